@@ -0,0 +1,747 @@
+/**
+ * @file fake_tracker.c
+ * @brief Fake tracker HTTP server implementation.
+ * @author Rafael Antoniello
+ */
+
+#include "fake_tracker.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+#include <pthread.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include <zlib.h>
+#include <libutils/check_utils.h>
+#include <libutils/mg_http.h>
+#include <libutils/interr_usleep.h>
+
+/* **** Definitions **** */
+
+/**
+ * Webcache buckets platform identifier (see 'tcdn_webcache' module).
+ */
+#define BUCKET_JSON_PLATFORM 8
+
+/**
+ * Synthesized buckets host-name format (the bucket identifier is appended).
+ */
+#define SYNTH_HOST_FMT "bkt%u.bench.tcdn"
+
+/**
+ * Synthesized origin-servers port range.
+ */
+#define SYNTH_ORIGIN_PORT_BASE 8000
+#define SYNTH_ORIGIN_PORT_RANGE 100
+
+/**
+ * Growable string buffer.
+ */
+typedef struct strbuf_s {
+	char *data;
+	size_t size;
+	size_t capacity;
+} strbuf_t;
+
+/**
+ * Synthesized webcache bucket.
+ */
+typedef struct bucket_s {
+	unsigned int id;
+	uint32_t origin_addr; //< IPv4 address in host byte order
+	unsigned int origin_port;
+	unsigned int default_ttl;
+	int enabled;
+	/**
+	 * Bucket set generation in which this bucket was last modified.
+	 */
+	uint64_t generation;
+} bucket_t;
+
+/**
+ * Rendered bucket set snapshot (reference counted; a snapshot is kept alive
+ * while being sent even if a newer one is published).
+ */
+typedef struct snapshot_s {
+	volatile int refcnt;
+	uint64_t generation;
+	char etag[32];
+	char *json;
+	size_t json_size;
+	unsigned char *gzip;
+	size_t gzip_size;
+} snapshot_t;
+
+/**
+ * Delta response body: keeps a reference to the snapshot whose ETag is
+ * sent along with the rendered delta.
+ */
+typedef struct delta_s {
+	snapshot_t *snapshot;
+	char *data;
+} delta_t;
+
+/**
+ * Fake tracker instance context structure.
+ */
+typedef struct fake_tracker_srv_ctx_s {
+	/**
+	 * Settings (strings are private copies).
+	 */
+	fake_tracker_srv_settings_t settings;
+	/**
+	 * Mutual-exclusion lock protecting all the fields below.
+	 */
+	pthread_mutex_t mutex;
+	/**
+	 * Synthesized buckets (NULL if serving a file).
+	 */
+	bucket_t *buckets;
+	unsigned int buckets_num;
+	/**
+	 * Current bucket set generation.
+	 */
+	uint64_t generation;
+	/**
+	 * Currently published snapshot.
+	 */
+	snapshot_t *snapshot;
+	/**
+	 * Statistics.
+	 */
+	fake_tracker_srv_stats_t stats;
+	/**
+	 * Pseudo-random generator state.
+	 */
+	unsigned int rand_state;
+	/**
+	 * Mutation thread.
+	 */
+	interr_usleep_ctx_t *interr_usleep_ctx;
+	pthread_t mutate_thread;
+	int flag_mutate_thread_running;
+	/**
+	 * HTTP server instance.
+	 */
+	mg_http_srv_ctx_t *mg_http_srv_ctx;
+} fake_tracker_srv_ctx_t;
+
+/* **** Prototypes **** */
+
+static int strbuf_printf(strbuf_t *strbuf, const char *fmt, ...)
+	__attribute__((format(printf, 2, 3)));
+
+static int buckets_synthesize(fake_tracker_srv_ctx_t *fake_tracker_srv_ctx);
+static void bucket_mutate(fake_tracker_srv_ctx_t *fake_tracker_srv_ctx,
+		bucket_t *bucket);
+static int buckets_render(fake_tracker_srv_ctx_t *fake_tracker_srv_ctx,
+		uint64_t since, strbuf_t *strbuf);
+
+static snapshot_t* snapshot_create(char *json, size_t json_size,
+		uint64_t generation);
+static void snapshot_release(void *arg);
+static int snapshot_publish(fake_tracker_srv_ctx_t *fake_tracker_srv_ctx);
+static void delta_release(void *arg);
+static char* file_read(const char *path, size_t *ref_size);
+
+static void srv_req_handler(void *opaque, const mg_http_srv_req_ctx_t *req,
+		mg_http_srv_rsp_ctx_t *rsp);
+static void* mutate_thr(void *t);
+
+/* **** Implementations **** */
+
+fake_tracker_srv_ctx_t* fake_tracker_srv_open(const char *listening_host,
+		const char *listening_port,
+		const fake_tracker_srv_settings_t *settings)
+{
+	int ret_code, end_code= -1; // error by default
+	fake_tracker_srv_ctx_t *fake_tracker_srv_ctx= NULL;
+
+	/* Check arguments */
+	CHECK_DO(listening_host!= NULL, return NULL);
+	CHECK_DO(listening_port!= NULL, return NULL);
+	CHECK_DO(settings!= NULL, return NULL);
+	CHECK_DO(settings->buckets_json_file!= NULL || settings->buckets_num> 0,
+			return NULL);
+	CHECK_DO(settings->mutate_ratio>= 0 && settings->mutate_ratio<= 1,
+			return NULL);
+
+	/* Allocate context structure */
+	fake_tracker_srv_ctx= (fake_tracker_srv_ctx_t*)calloc(1, sizeof(
+			fake_tracker_srv_ctx_t));
+	CHECK_DO(fake_tracker_srv_ctx!= NULL, goto end);
+
+	/* **** Initialize context structure **** */
+
+	fake_tracker_srv_ctx->settings= *settings;
+#define DUP_SETTING(NAME) \
+	fake_tracker_srv_ctx->settings.NAME= NULL;\
+	if(settings->NAME!= NULL) {\
+		fake_tracker_srv_ctx->settings.NAME= strdup(settings->NAME);\
+		CHECK_DO(fake_tracker_srv_ctx->settings.NAME!= NULL, goto end);\
+	}
+	DUP_SETTING(buckets_json_file);
+	DUP_SETTING(pinned_host);
+	DUP_SETTING(pinned_origin_host);
+	DUP_SETTING(push_host);
+	DUP_SETTING(push_port);
+	DUP_SETTING(push_location);
+#undef DUP_SETTING
+
+	ret_code= pthread_mutex_init(&fake_tracker_srv_ctx->mutex, NULL);
+	CHECK_DO(ret_code== 0, goto end);
+
+	fake_tracker_srv_ctx->rand_state= settings->seed;
+
+	fake_tracker_srv_ctx->interr_usleep_ctx= interr_usleep_open();
+	CHECK_DO(fake_tracker_srv_ctx->interr_usleep_ctx!= NULL, goto end);
+
+	/* Get the initial bucket set */
+	if(settings->buckets_json_file!= NULL) {
+		size_t json_size= 0;
+		char *json;
+
+		printf("Fake-tracker: reading buckets.json (%s)\n",
+				settings->buckets_json_file);
+		json= file_read(settings->buckets_json_file, &json_size);
+		CHECK_DO(json!= NULL, goto end);
+		fake_tracker_srv_ctx->snapshot= snapshot_create(json, json_size, 0);
+		CHECK_DO(fake_tracker_srv_ctx->snapshot!= NULL, free(json); goto end);
+	} else {
+		CHECK_DO(buckets_synthesize(fake_tracker_srv_ctx)== 0, goto end);
+		CHECK_DO(snapshot_publish(fake_tracker_srv_ctx)== 0, goto end);
+	}
+
+	/* Launch mutation thread if applicable */
+	if(fake_tracker_srv_ctx->buckets!= NULL &&
+			settings->mutate_period_secs> 0 && settings->mutate_ratio> 0) {
+		ret_code= pthread_create(&fake_tracker_srv_ctx->mutate_thread, NULL,
+				mutate_thr, fake_tracker_srv_ctx);
+		CHECK_DO(ret_code== 0, goto end);
+		fake_tracker_srv_ctx->flag_mutate_thread_running= 1;
+	}
+
+	/* Launch HTTP server */
+	fake_tracker_srv_ctx->mg_http_srv_ctx= mg_http_srv_open2(listening_host,
+			listening_port, srv_req_handler, fake_tracker_srv_ctx);
+	CHECK_DO(fake_tracker_srv_ctx->mg_http_srv_ctx!= NULL, goto end);
+
+	end_code= 0;
+end:
+	if(end_code!= 0)
+		fake_tracker_srv_close(&fake_tracker_srv_ctx);
+	return fake_tracker_srv_ctx;
+}
+
+void fake_tracker_srv_close(fake_tracker_srv_ctx_t **ref_fake_tracker_srv_ctx)
+{
+	fake_tracker_srv_ctx_t *fake_tracker_srv_ctx;
+
+	if(ref_fake_tracker_srv_ctx== NULL ||
+			(fake_tracker_srv_ctx= *ref_fake_tracker_srv_ctx)== NULL)
+		return;
+
+	/* Join HTTP server (no more requests will be processed) */
+	mg_http_srv_close(&fake_tracker_srv_ctx->mg_http_srv_ctx);
+
+	/* Join mutation thread */
+	if(fake_tracker_srv_ctx->flag_mutate_thread_running!= 0) {
+		interr_usleep_unblock(fake_tracker_srv_ctx->interr_usleep_ctx);
+		pthread_join(fake_tracker_srv_ctx->mutate_thread, NULL);
+	}
+	interr_usleep_close(&fake_tracker_srv_ctx->interr_usleep_ctx);
+
+	/* Release bucket set */
+	if(fake_tracker_srv_ctx->snapshot!= NULL)
+		snapshot_release(fake_tracker_srv_ctx->snapshot);
+	if(fake_tracker_srv_ctx->buckets!= NULL)
+		free(fake_tracker_srv_ctx->buckets);
+
+	pthread_mutex_destroy(&fake_tracker_srv_ctx->mutex);
+
+	/* Release settings copies */
+	free((void*)fake_tracker_srv_ctx->settings.buckets_json_file);
+	free((void*)fake_tracker_srv_ctx->settings.pinned_host);
+	free((void*)fake_tracker_srv_ctx->settings.pinned_origin_host);
+	free((void*)fake_tracker_srv_ctx->settings.push_host);
+	free((void*)fake_tracker_srv_ctx->settings.push_port);
+	free((void*)fake_tracker_srv_ctx->settings.push_location);
+
+	free(fake_tracker_srv_ctx);
+	*ref_fake_tracker_srv_ctx= NULL;
+}
+
+int fake_tracker_srv_get_stats(fake_tracker_srv_ctx_t *fake_tracker_srv_ctx,
+		fake_tracker_srv_stats_t *stats)
+{
+	/* Check arguments */
+	CHECK_DO(fake_tracker_srv_ctx!= NULL, return -1);
+	CHECK_DO(stats!= NULL, return -1);
+
+	pthread_mutex_lock(&fake_tracker_srv_ctx->mutex);
+	*stats= fake_tracker_srv_ctx->stats;
+	pthread_mutex_unlock(&fake_tracker_srv_ctx->mutex);
+	return 0;
+}
+
+/**
+ * Appends a formatted string to the given string buffer; the buffer grows
+ * geometrically as needed.
+ * @return 0 on success, -1 otherwise.
+ */
+static int strbuf_printf(strbuf_t *strbuf, const char *fmt, ...)
+{
+	va_list args;
+	int len;
+
+	for(;;) {
+		size_t avail= strbuf->capacity- strbuf->size;
+
+		va_start(args, fmt);
+		len= vsnprintf(strbuf->data!= NULL? strbuf->data+ strbuf->size: NULL,
+				avail, fmt, args);
+		va_end(args);
+		CHECK_DO(len>= 0, return -1);
+
+		if((size_t)len< avail) {
+			strbuf->size+= len;
+			return 0;
+		} else {
+			size_t capacity= strbuf->capacity> 0? strbuf->capacity* 2: 4096;
+			char *data;
+
+			while(capacity- strbuf->size<= (size_t)len)
+				capacity*= 2;
+			data= (char*)realloc(strbuf->data, capacity);
+			CHECK_DO(data!= NULL, return -1);
+			strbuf->data= data;
+			strbuf->capacity= capacity;
+		}
+	}
+	return -1; // never reached
+}
+
+/**
+ * Synthesizes the initial bucket set.
+ * @return 0 on success, -1 otherwise.
+ */
+static int buckets_synthesize(fake_tracker_srv_ctx_t *fake_tracker_srv_ctx)
+{
+	unsigned int i, buckets_num= fake_tracker_srv_ctx->settings.buckets_num;
+	bucket_t *buckets;
+
+	buckets= (bucket_t*)calloc(buckets_num, sizeof(bucket_t));
+	CHECK_DO(buckets!= NULL, return -1);
+
+	for(i= 0; i< buckets_num; i++) {
+		bucket_t *bucket= &buckets[i];
+
+		bucket->id= i+ 1;
+		bucket->enabled= 1;
+		bucket->generation= 0;
+		bucket->origin_addr= (10U<< 24)|
+				(rand_r(&fake_tracker_srv_ctx->rand_state)& 0x00FFFFFF);
+		bucket->origin_port= SYNTH_ORIGIN_PORT_BASE+
+				rand_r(&fake_tracker_srv_ctx->rand_state)%
+				SYNTH_ORIGIN_PORT_RANGE;
+		bucket->default_ttl= 1+ rand_r(&fake_tracker_srv_ctx->rand_state)% 300;
+	}
+
+	fake_tracker_srv_ctx->buckets= buckets;
+	fake_tracker_srv_ctx->buckets_num= buckets_num;
+	printf("Fake-tracker: synthesized %u webcache buckets\n", buckets_num);
+	return 0;
+}
+
+/**
+ * Mutates the given bucket (origin host, origin port, TTL or enabling);
+ * must be called with the instance lock acquired.
+ */
+static void bucket_mutate(fake_tracker_srv_ctx_t *fake_tracker_srv_ctx,
+		bucket_t *bucket)
+{
+	unsigned int *rand_state= &fake_tracker_srv_ctx->rand_state;
+
+	switch(rand_r(rand_state)% 4) {
+	case 0:
+		bucket->origin_addr= (10U<< 24)| (rand_r(rand_state)& 0x00FFFFFF);
+		break;
+	case 1:
+		bucket->origin_port= SYNTH_ORIGIN_PORT_BASE+ rand_r(rand_state)%
+				SYNTH_ORIGIN_PORT_RANGE;
+		break;
+	case 2:
+		bucket->default_ttl= 1+ rand_r(rand_state)% 300;
+		break;
+	default:
+		bucket->enabled= !bucket->enabled;
+		break;
+	}
+	bucket->generation= fake_tracker_srv_ctx->generation;
+}
+
+/**
+ * Renders the buckets modified after generation 'since' (all the buckets if
+ * 'since' is zero) as a JSON array; must be called with the instance lock
+ * acquired.
+ * @return 0 on success, -1 otherwise.
+ */
+static int buckets_render(fake_tracker_srv_ctx_t *fake_tracker_srv_ctx,
+		uint64_t since, strbuf_t *strbuf)
+{
+	unsigned int i;
+	int flag_first= 1;
+	const fake_tracker_srv_settings_t *settings=
+			&fake_tracker_srv_ctx->settings;
+
+	CHECK_DO(strbuf_printf(strbuf, "[")== 0, return -1);
+	for(i= 0; i< fake_tracker_srv_ctx->buckets_num; i++) {
+		const bucket_t *bucket= &fake_tracker_srv_ctx->buckets[i];
+		char host[64], origin_host[16];
+		const char *p_host= host, *p_origin_host= origin_host;
+		unsigned int origin_port= bucket->origin_port;
+		int enabled= bucket->enabled;
+
+		if(since> 0 && bucket->generation<= since)
+			continue;
+
+		/* The first bucket is the pinned one, if applicable */
+		if(i== 0 && settings->pinned_host!= NULL) {
+			p_host= settings->pinned_host;
+			p_origin_host= settings->pinned_origin_host;
+			origin_port= settings->pinned_origin_port;
+			enabled= 1;
+		} else {
+			snprintf(host, sizeof(host), SYNTH_HOST_FMT, bucket->id);
+			snprintf(origin_host, sizeof(origin_host), "%u.%u.%u.%u",
+					(bucket->origin_addr>> 24)& 0xFF,
+					(bucket->origin_addr>> 16)& 0xFF,
+					(bucket->origin_addr>> 8)& 0xFF,
+					bucket->origin_addr& 0xFF);
+		}
+
+		CHECK_DO(strbuf_printf(strbuf, "%s{\"id\": %u, \"platform\": %d, "
+				"\"host\": \"%s\", \"enabled\": %s, "
+				"\"https\": {\"enabled\": false}, "
+				"\"node_tag\": {\"tag_list\": []}, "
+				"\"awa_params\": {"
+				"\"state_machine\": {\"default_ttl\": %u}, "
+				"\"origins\": {\"policy\": \"BackUp\", \"origin_list\": "
+				"[{\"host\": \"%s\", \"port\": %u}]}}}",
+				flag_first? "": ", ", bucket->id, BUCKET_JSON_PLATFORM, p_host,
+				enabled? "true": "false", bucket->default_ttl,
+				p_origin_host!= NULL? p_origin_host: "", origin_port)== 0,
+				return -1);
+		flag_first= 0;
+	}
+	CHECK_DO(strbuf_printf(strbuf, "]")== 0, return -1);
+	return 0;
+}
+
+/**
+ * Creates a bucket set snapshot, including its gzip-compressed version.
+ * The 'json' buffer ownership is transferred to the snapshot on success.
+ * @return The new snapshot (reference count set to 1), or NULL on failure.
+ */
+static snapshot_t* snapshot_create(char *json, size_t json_size,
+		uint64_t generation)
+{
+	int ret_code, end_code= -1;
+	snapshot_t *snapshot= NULL;
+	z_stream strm;
+
+	snapshot= (snapshot_t*)calloc(1, sizeof(snapshot_t));
+	CHECK_DO(snapshot!= NULL, return NULL);
+	snapshot->refcnt= 1;
+	snapshot->generation= generation;
+	snapshot->json_size= json_size;
+	snprintf(snapshot->etag, sizeof(snapshot->etag), "\"g%"PRIu64"-%zx\"",
+			generation, json_size);
+
+	/* Compress (window-bits 15+ 16 selects the gzip format) */
+	memset(&strm, 0, sizeof(strm));
+	ret_code= deflateInit2(&strm, Z_BEST_SPEED, Z_DEFLATED, 15+ 16, 8,
+			Z_DEFAULT_STRATEGY);
+	CHECK_DO(ret_code== Z_OK, goto end);
+	snapshot->gzip= (unsigned char*)malloc(deflateBound(&strm, json_size));
+	CHECK_DO(snapshot->gzip!= NULL, deflateEnd(&strm); goto end);
+	strm.next_in= (Bytef*)json;
+	strm.avail_in= json_size;
+	strm.next_out= snapshot->gzip;
+	strm.avail_out= deflateBound(&strm, json_size);
+	ret_code= deflate(&strm, Z_FINISH);
+	snapshot->gzip_size= strm.total_out;
+	deflateEnd(&strm);
+	CHECK_DO(ret_code== Z_STREAM_END, goto end);
+
+	end_code= 0;
+end:
+	if(end_code!= 0) {
+		if(snapshot->gzip!= NULL)
+			free(snapshot->gzip);
+		free(snapshot);
+		return NULL;
+	}
+	snapshot->json= json;
+	return snapshot;
+}
+
+/**
+ * Decrements the snapshot reference count and releases it if it reaches
+ * zero. Also used as response body release callback.
+ */
+static void snapshot_release(void *arg)
+{
+	snapshot_t *snapshot= (snapshot_t*)arg;
+
+	if(snapshot== NULL || __sync_sub_and_fetch(&snapshot->refcnt, 1)> 0)
+		return;
+	if(snapshot->json!= NULL)
+		free(snapshot->json);
+	if(snapshot->gzip!= NULL)
+		free(snapshot->gzip);
+	free(snapshot);
+}
+
+/**
+ * Renders the current synthesized bucket set and publishes it.
+ * @return 0 on success, -1 otherwise.
+ */
+static int snapshot_publish(fake_tracker_srv_ctx_t *fake_tracker_srv_ctx)
+{
+	uint64_t generation;
+	strbuf_t strbuf= {0};
+	snapshot_t *snapshot, *snapshot_old;
+
+	pthread_mutex_lock(&fake_tracker_srv_ctx->mutex);
+	generation= fake_tracker_srv_ctx->generation;
+	if(buckets_render(fake_tracker_srv_ctx, 0, &strbuf)!= 0) {
+		pthread_mutex_unlock(&fake_tracker_srv_ctx->mutex);
+		free(strbuf.data);
+		return -1;
+	}
+	pthread_mutex_unlock(&fake_tracker_srv_ctx->mutex);
+
+	/* Compress out of the lock: this may be CPU-heavy */
+	snapshot= snapshot_create(strbuf.data, strbuf.size, generation);
+	CHECK_DO(snapshot!= NULL, free(strbuf.data); return -1);
+
+	pthread_mutex_lock(&fake_tracker_srv_ctx->mutex);
+	snapshot_old= fake_tracker_srv_ctx->snapshot;
+	fake_tracker_srv_ctx->snapshot= snapshot;
+	fake_tracker_srv_ctx->stats.generation= generation;
+	fake_tracker_srv_ctx->stats.json_size= snapshot->json_size;
+	fake_tracker_srv_ctx->stats.gzip_size= snapshot->gzip_size;
+	pthread_mutex_unlock(&fake_tracker_srv_ctx->mutex);
+
+	snapshot_release(snapshot_old);
+	return 0;
+}
+
+/**
+ * Releases a delta response body and its snapshot reference (response body
+ * release callback).
+ */
+static void delta_release(void *arg)
+{
+	delta_t *delta= (delta_t*)arg;
+
+	if(delta== NULL)
+		return;
+	snapshot_release(delta->snapshot);
+	free(delta->data);
+	free(delta);
+}
+
+/**
+ * Reads a whole file into a NULL-terminated heap-allocated buffer.
+ * @return The buffer, or NULL on failure.
+ */
+static char* file_read(const char *path, size_t *ref_size)
+{
+	int filedesc;
+	struct stat st;
+	size_t size= 0;
+	char *data= NULL;
+
+	filedesc= open(path, O_RDONLY);
+	CHECK_DO(filedesc>= 0, return NULL);
+	CHECK_DO(fstat(filedesc, &st)== 0, goto end);
+
+	data= (char*)malloc(st.st_size+ 1);
+	CHECK_DO(data!= NULL, goto end);
+	while(size< (size_t)st.st_size) {
+		ssize_t read_bytes= read(filedesc, data+ size, st.st_size- size);
+		if(read_bytes< 0 && errno== EINTR)
+			continue;
+		if(read_bytes<= 0)
+			break;
+		size+= read_bytes;
+	}
+	data[size]= 0;
+	*ref_size= size;
+end:
+	close(filedesc);
+	return data;
+}
+
+/**
+ * HTTP server request handler (see 'mg_http_srv_req_handler_t').
+ */
+static void srv_req_handler(void *opaque, const mg_http_srv_req_ctx_t *req,
+		mg_http_srv_rsp_ctx_t *rsp)
+{
+	const char *p_since;
+	uint64_t since= 0;
+	snapshot_t *snapshot;
+	fake_tracker_srv_ctx_t *fake_tracker_srv_ctx=
+			(fake_tracker_srv_ctx_t*)opaque;
+
+	if(strcmp(req->method, "GET")!= 0) {
+		rsp->status_code= 400;
+		return;
+	}
+
+	if(req->qstring!= NULL && (p_since= strstr(req->qstring, "since="))!=
+			NULL)
+		since= strtoull(p_since+ strlen("since="), NULL, 10);
+
+	/* Get a reference to the current snapshot */
+	pthread_mutex_lock(&fake_tracker_srv_ctx->mutex);
+	snapshot= fake_tracker_srv_ctx->snapshot;
+	__sync_add_and_fetch(&snapshot->refcnt, 1);
+	pthread_mutex_unlock(&fake_tracker_srv_ctx->mutex);
+
+	/* Conditional request: not modified */
+	if(req->if_none_match!= NULL &&
+			strstr(req->if_none_match, snapshot->etag)!= NULL) {
+		rsp->status_code= 304;
+		rsp->etag= snapshot->etag;
+		rsp->body_release= snapshot_release;
+		rsp->body_release_arg= snapshot;
+		pthread_mutex_lock(&fake_tracker_srv_ctx->mutex);
+		fake_tracker_srv_ctx->stats.requests_not_modified++;
+		pthread_mutex_unlock(&fake_tracker_srv_ctx->mutex);
+		return;
+	}
+
+	/* Delta request (only applies to synthesized bucket sets) */
+	if(since> 0 && fake_tracker_srv_ctx->buckets!= NULL) {
+		strbuf_t strbuf= {0};
+		delta_t *delta;
+		int ret_code;
+
+		pthread_mutex_lock(&fake_tracker_srv_ctx->mutex);
+		ret_code= buckets_render(fake_tracker_srv_ctx, since, &strbuf);
+		fake_tracker_srv_ctx->stats.requests_delta++;
+		pthread_mutex_unlock(&fake_tracker_srv_ctx->mutex);
+		delta= ret_code== 0? (delta_t*)malloc(sizeof(delta_t)): NULL;
+		if(delta== NULL) {
+			snapshot_release(snapshot);
+			free(strbuf.data);
+			rsp->status_code= 500;
+			return;
+		}
+		delta->snapshot= snapshot;
+		delta->data= strbuf.data;
+
+		/* The snapshot may be older than the rendered delta (it is published
+		 * after the mutation); at worst the client re-fetches once */
+		rsp->etag= snapshot->etag;
+		rsp->body= strbuf.data;
+		rsp->body_size= strbuf.size;
+		rsp->body_release= delta_release;
+		rsp->body_release_arg= delta;
+		return;
+	}
+
+	/* Full bucket set */
+	rsp->etag= snapshot->etag;
+	if(req->accept_encoding!= NULL &&
+			strstr(req->accept_encoding, "gzip")!= NULL) {
+		rsp->content_encoding= "gzip";
+		rsp->body= snapshot->gzip;
+		rsp->body_size= snapshot->gzip_size;
+	} else {
+		rsp->body= snapshot->json;
+		rsp->body_size= snapshot->json_size;
+	}
+	rsp->body_release= snapshot_release;
+	rsp->body_release_arg= snapshot;
+	pthread_mutex_lock(&fake_tracker_srv_ctx->mutex);
+	fake_tracker_srv_ctx->stats.requests_full++;
+	pthread_mutex_unlock(&fake_tracker_srv_ctx->mutex);
+}
+
+/**
+ * Mutation thread: every period, mutates the configured fraction of the
+ * bucket set, publishes the new set and pushes the delta if applicable.
+ */
+static void* mutate_thr(void *t)
+{
+	fake_tracker_srv_ctx_t *fake_tracker_srv_ctx= (fake_tracker_srv_ctx_t*)t;
+	const fake_tracker_srv_settings_t *settings=
+			&fake_tracker_srv_ctx->settings;
+	int interrupted= 0;
+
+	for(;;) {
+		unsigned int i, mutate_num, buckets_num;
+		uint64_t generation_prev;
+
+		/* Sleep in whole seconds: the period in usecs may not fit 32 bits */
+		for(i= 0; i< settings->mutate_period_secs && !interrupted; i++)
+			interrupted= interr_usleep(
+					fake_tracker_srv_ctx->interr_usleep_ctx, 1000* 1000)!= 0;
+		if(interrupted)
+			break;
+
+		/* Mutate */
+		pthread_mutex_lock(&fake_tracker_srv_ctx->mutex);
+		buckets_num= fake_tracker_srv_ctx->buckets_num;
+		mutate_num= (unsigned int)(settings->mutate_ratio* buckets_num);
+		generation_prev= fake_tracker_srv_ctx->generation++;
+		for(i= 0; i< mutate_num; i++) {
+			unsigned int idx= rand_r(&fake_tracker_srv_ctx->rand_state)%
+					buckets_num;
+			if(idx== 0 && settings->pinned_host!= NULL)
+				continue; // pinned bucket is never mutated
+			bucket_mutate(fake_tracker_srv_ctx,
+					&fake_tracker_srv_ctx->buckets[idx]);
+		}
+		pthread_mutex_unlock(&fake_tracker_srv_ctx->mutex);
+
+		/* Publish */
+		ASSERT(snapshot_publish(fake_tracker_srv_ctx)== 0);
+		printf("Fake-tracker: generation %"PRIu64" (%u buckets mutated)\n",
+				generation_prev+ 1, mutate_num);
+
+		/* Push delta if applicable */
+		if(settings->push_host!= NULL && settings->push_port!= NULL) {
+			strbuf_t strbuf= {0};
+			mg_http_cli_reqhdr_ctx_t mg_http_cli_reqhdr_ctx= {
+					settings->push_host
+			};
+			char *response= NULL;
+			int ret_code;
+
+			pthread_mutex_lock(&fake_tracker_srv_ctx->mutex);
+			ret_code= buckets_render(fake_tracker_srv_ctx,
+					generation_prev, &strbuf);
+			pthread_mutex_unlock(&fake_tracker_srv_ctx->mutex);
+			if(ret_code== 0)
+				response= mg_http_cli_request("POST", settings->push_host,
+						settings->push_port, settings->push_location!= NULL?
+						settings->push_location: "/", NULL,
+						&mg_http_cli_reqhdr_ctx, strbuf.data);
+			if(response!= NULL)
+				free(response);
+			free(strbuf.data);
+		}
+	}
+	return NULL;
+}
@@ -0,0 +1,127 @@
+/**
+ * @file fake_tracker.h
+ * @brief Fake tracker HTTP server public interface.
+ * The fake tracker stands in for the real tracker to feed the
+ * 'tcdn_webcache' module with buckets information. It either serves a given
+ * 'buckets.json' file or synthesizes a (possibly very large) set of webcache
+ * buckets, mutating a configurable fraction of them every period.
+ * Supported features:
+ * - 'ETag' and 'If-None-Match' (responds '304 Not Modified' if the bucket
+ * set did not change);
+ * - gzip 'Content-Encoding' if the client accepts it;
+ * - deltas: 'GET <uri>?since=<generation>' responds only the buckets
+ * modified after the given generation, and, optionally, each period delta is
+ * pushed (POST) to a given URL.
+ * @author Rafael Antoniello
+ */
+
+#ifndef EXAMPLES_FAKE_TRACKER_H_
+#define EXAMPLES_FAKE_TRACKER_H_
+
+#include <stddef.h>
+#include <inttypes.h>
+
+/* **** Definitions **** */
+
+/* Forward definitions */
+typedef struct fake_tracker_srv_ctx_s fake_tracker_srv_ctx_t;
+
+/**
+ * Fake tracker settings.
+ */
+typedef struct fake_tracker_srv_settings_s {
+	/**
+	 * Buckets JSON file to be served. If set, buckets are not synthesized
+	 * and the rest of the settings do not apply.
+	 */
+	const char *buckets_json_file;
+	/**
+	 * Number of webcache buckets to synthesize.
+	 */
+	unsigned int buckets_num;
+	/**
+	 * Fraction, in the range [0..1], of the buckets to be mutated each
+	 * period.
+	 */
+	double mutate_ratio;
+	/**
+	 * Mutation period in seconds (0 disables mutations).
+	 */
+	unsigned int mutate_period_secs;
+	/**
+	 * Pseudo-random generator seed (for reproducible bucket sets).
+	 */
+	unsigned int seed;
+	/**
+	 * Pinned bucket: host-name, origin host and port of a bucket that is
+	 * always included in the synthesized set and never mutated (e.g. to be
+	 * able to perform requests to a known origin). Optional (NULL).
+	 */
+	const char *pinned_host;
+	const char *pinned_origin_host;
+	unsigned int pinned_origin_port;
+	/**
+	 * Delta push destination (host, port and location). Optional (NULL).
+	 */
+	const char *push_host;
+	const char *push_port;
+	const char *push_location;
+} fake_tracker_srv_settings_t;
+
+/**
+ * Fake tracker statistics.
+ */
+typedef struct fake_tracker_srv_stats_s {
+	/**
+	 * Current bucket set generation (incremented on each mutation).
+	 */
+	uint64_t generation;
+	/**
+	 * Served bucket set size in bytes (not compressed).
+	 */
+	size_t json_size;
+	/**
+	 * Served bucket set size in bytes (gzip compressed).
+	 */
+	size_t gzip_size;
+	/**
+	 * Served requests counters.
+	 */
+	uint64_t requests_full;
+	uint64_t requests_delta;
+	uint64_t requests_not_modified;
+} fake_tracker_srv_stats_t;
+
+/* **** Prototypes **** */
+
+/**
+ * Instantiates the fake tracker HTTP server.
+ * @param listening_host Server host-name.
+ * @param listening_port Server listening port.
+ * @param settings Fake tracker settings.
+ * @return Pointer to the fake tracker context structure on success, NULL if
+ * fails.
+ */
+fake_tracker_srv_ctx_t* fake_tracker_srv_open(const char *listening_host,
+		const char *listening_port,
+		const fake_tracker_srv_settings_t *settings);
+
+/**
+ * Release fake tracker instance previously obtained in a call to
+ * 'fake_tracker_srv_open()'.
+ * @param ref_fake_tracker_srv_ctx Reference to the pointer to the fake
+ * tracker instance context structure to be released. Pointer is set to NULL
+ * on return.
+ */
+void fake_tracker_srv_close(fake_tracker_srv_ctx_t **ref_fake_tracker_srv_ctx);
+
+/**
+ * Get fake tracker statistics.
+ * @param fake_tracker_srv_ctx Fake tracker instance context structure.
+ * @param stats Statistics structure to be filled.
+ * @return 0 on success, -1 otherwise.
+ */
+int fake_tracker_srv_get_stats(fake_tracker_srv_ctx_t *fake_tracker_srv_ctx,
+		fake_tracker_srv_stats_t *stats);
+
+#endif /* EXAMPLES_FAKE_TRACKER_H_ */
@@ -22,6 +22,8 @@
 #include <libutils/mg_http.h>
 #include <libutils/interr_usleep.h>
 
+#include "fake_tracker.h"
+
 #define REPO_DIR "/home/ral/workspace/TID/cdn-webcache"
 
 /*
@@ -40,9 +42,10 @@
  */
 #define BUCKETS_JSON_FILE REPO_DIR"/src/rpm/SOURCES/modules/tcdn_webcache"\
 	"/ftests/buckets.json"
-#define BUCKETS_JSON_SIZE_MAX (1024* 10)
 #define HTTP_SERVER_FAKE_TRACKER_HOST "127.0.0.1"
 #define HTTP_SERVER_FAKE_TRACKER_PORT "8081"
+#define FAKE_TRACKER_MUTATE_RATIO_DEF 0.01
+#define FAKE_TRACKER_MUTATE_PERIOD_DEF 10
 
 /*
  * "Origin-1" server related definitions.
@@ -62,8 +65,13 @@ static nginx_wrapper_ctx_t* nginx_wrapper_open(char *const argv[],
 static void nginx_wrapper_close(nginx_wrapper_ctx_t **ref_nginx_wrapper_ctx,
 		const char *fullpath_pidfile);
 
-static mg_http_srv_ctx_t* fake_tracker_open();
-static void fake_tracker_close(mg_http_srv_ctx_t **ref_mg_http_srv_ctx);
+static fake_tracker_srv_ctx_t* fake_tracker_open(
+		fake_tracker_srv_settings_t *settings);
+static void fake_tracker_close(
+		fake_tracker_srv_ctx_t **ref_fake_tracker_srv_ctx);
+static int parse_push_url(char *push_url,
+		fake_tracker_srv_settings_t *settings);
+static void usage(const char *prog_name);
 
 static mg_http_srv_ctx_t* fake_origin_1_open();
 static void fake_origin_1_close(mg_http_srv_ctx_t **ref_mg_http_srv_ctx);
@@ -94,9 +102,48 @@ static interr_usleep_ctx_t* interr_usleep_ctx= NULL;
 int main(int argc, char* argv[])
 {
 	sigset_t set;
+	int opt;
+	unsigned int soak_secs= 0;
 	mg_http_srv_ctx_t *mg_http_srv_ctx_origin_1= NULL;
-	mg_http_srv_ctx_t *mg_http_srv_ctx_fake_tracker= NULL;
+	fake_tracker_srv_ctx_t *fake_tracker_srv_ctx= NULL;
 	nginx_wrapper_ctx_t *nginx_wrapper_ctx= NULL;
+	fake_tracker_srv_settings_t fake_tracker_settings= {
+			.buckets_json_file= BUCKETS_JSON_FILE,
+			.mutate_ratio= FAKE_TRACKER_MUTATE_RATIO_DEF,
+			.mutate_period_secs= FAKE_TRACKER_MUTATE_PERIOD_DEF,
+			.seed= 1,
+			/* Pinned bucket so that scripted requests below are served */
+			.pinned_host= HTTP_FINAL_CLIENT_HDRHOST,
+			.pinned_origin_host= HTTP_SERVER_ORIGIN1_HOST,
+			.pinned_origin_port= 8082
+	};
+
+	/* Parse options (by default, the fake-tracker serves 'buckets.json') */
+	while((opt= getopt(argc, argv, "n:r:p:s:u:h"))!= -1) {
+		switch(opt) {
+		case 'n':
+			fake_tracker_settings.buckets_json_file= NULL;
+			fake_tracker_settings.buckets_num= strtoul(optarg, NULL, 10);
+			break;
+		case 'r':
+			fake_tracker_settings.mutate_ratio= strtod(optarg, NULL);
+			break;
+		case 'p':
+			fake_tracker_settings.mutate_period_secs= strtoul(optarg, NULL,
+					10);
+			break;
+		case 's':
+			soak_secs= strtoul(optarg, NULL, 10);
+			break;
+		case 'u':
+			CHECK_DO(parse_push_url(optarg, &fake_tracker_settings)== 0,
+					usage(argv[0]); exit(-1));
+			break;
+		default:
+			usage(argv[0]);
+			exit(opt== 'h'? 0: -1);
+		}
+	}
 
 	/* Set SIGNAL handlers to this process */
 	sigfillset(&set);
@@ -113,8 +160,8 @@ int main(int argc, char* argv[])
 	CHECK_DO(nginx_wrapper_ctx!= NULL, exit(-1));
 
 	/* Launch "fake-tracker" */
-	mg_http_srv_ctx_fake_tracker= fake_tracker_open();
-	CHECK_DO(mg_http_srv_ctx_fake_tracker!= NULL, exit(-1));
+	fake_tracker_srv_ctx= fake_tracker_open(&fake_tracker_settings);
+	CHECK_DO(fake_tracker_srv_ctx!= NULL, exit(-1));
 
 	/* Launch MG HTTP-server "origin-1" */
 	mg_http_srv_ctx_origin_1= fake_origin_1_open();
@@ -154,6 +201,24 @@ int main(int argc, char* argv[])
 		goto end;
 	http_get_nginx("/any/path/media.mp4", "t0=0&res=720x480");
 
+	/* Soak: keep everything running (e.g. to benchmark nginx externally
+	 * while the fake-tracker mutates the bucket set) */
+	while(soak_secs> 0) {
+		fake_tracker_srv_stats_t stats= {0};
+		unsigned int wait_secs= soak_secs< 5? soak_secs: 5;
+
+		if(interr_usleep(interr_usleep_ctx, 1000* 1000* wait_secs)== EINTR)
+			goto end;
+		soak_secs-= wait_secs;
+		if(fake_tracker_srv_get_stats(fake_tracker_srv_ctx, &stats)== 0)
+			printf("Fake-tracker: generation %"PRIu64"; size %zu bytes "
+					"(gzip %zu); requests: %"PRIu64" full, %"PRIu64" delta, "
+					"%"PRIu64" not-modified\n", stats.generation,
+					stats.json_size, stats.gzip_size, stats.requests_full,
+					stats.requests_delta, stats.requests_not_modified);
+		http_get_nginx("/any/path/media.mp4", "t0=0&res=720x480");
+	}
+
 	/* Exit example */
 end:
 	printf("Shutting down example...!\n");
@@ -162,7 +227,7 @@ end:
 	fake_origin_1_close(&mg_http_srv_ctx_origin_1);
 
 	/* Joint fake tracker */
-	fake_tracker_close(&mg_http_srv_ctx_fake_tracker);
+	fake_tracker_close(&fake_tracker_srv_ctx);
 
 	/* Kill nginx */
 	nginx_wrapper_close(&nginx_wrapper_ctx, nginx_fdfile);
@@ -306,56 +371,69 @@ static void nginx_wrapper_close(nginx_wrapper_ctx_t **ref_nginx_wrapper_ctx,
 	ref_nginx_wrapper_ctx= NULL;
 }
 
-static mg_http_srv_ctx_t* fake_tracker_open()
+static fake_tracker_srv_ctx_t* fake_tracker_open(
+		fake_tracker_srv_settings_t *settings)
 {
-	int filedesc, json_buckets_len;
-	ssize_t read_bytes= -1;
-	char buckets_json_cstr[BODY_MAX]= {0};
-	mg_http_srv_ctx_t *mg_http_srv_ctx= NULL;
-	struct json_object *jobj_buckets= NULL;
-	mg_http_srv_reqhdr_ctx_t mg_http_srv_reqhdr_ctx= {
-			HTTP_SERVER_FAKE_TRACKER_HOST HTTP_SERVER_FAKE_TRACKER_PORT, //host
-			0 //max-age
-	};
+	fake_tracker_srv_ctx_t *fake_tracker_srv_ctx= NULL;
 
 	/* Check arguments */
-	// Reserved for future use...
+	CHECK_DO(settings!= NULL, exit(-1));
 
 	printf("\nLaunching HTTP-server \"fake-tracker\"... \n");
+	if(settings->buckets_json_file== NULL)
+		printf("Tracker: synthesizing %u buckets (mutating %.2f%% every %u "
+				"seconds)...\n", settings->buckets_num,
+				settings->mutate_ratio* 100, settings->mutate_period_secs);
 
-	/* Get buckets JSON */
-	printf("Getting buckets.json (%s)\n", BUCKETS_JSON_FILE);
-	filedesc= open(BUCKETS_JSON_FILE, O_RDONLY);
-	CHECK_DO(filedesc>= 0, exit(-1));
-	read_bytes= read(filedesc, buckets_json_cstr, BODY_MAX);
-	if(read_bytes< 0 || !(read_bytes< BODY_MAX)) {
-		printf("Sample JSON size not supported [has to be 0..%d]\n", BODY_MAX);
-		CHECK_DO(0, exit(-1));
-	}
-	close(filedesc);
-
-	/* Parse the JSON -this may be CPU-heavy- */
-	printf("Tracker: parsing buckets.json...\n");
-	jobj_buckets= json_tokener_parse(buckets_json_cstr);
-	json_buckets_len= json_object_array_length(jobj_buckets);
-	printf("Tracker: buckets.json has %d buckets...\n", json_buckets_len);
+	fake_tracker_srv_ctx= fake_tracker_srv_open(HTTP_SERVER_FAKE_TRACKER_HOST,
+			HTTP_SERVER_FAKE_TRACKER_PORT, settings);
+	CHECK_DO(fake_tracker_srv_ctx!= NULL, exit(-1));
 
-	/* Launch MG HTTP-server for our fake tracker */
-	mg_http_srv_ctx= mg_http_srv_open(HTTP_SERVER_FAKE_TRACKER_HOST,
-			HTTP_SERVER_FAKE_TRACKER_PORT, &mg_http_srv_reqhdr_ctx,
-			buckets_json_cstr);
-	CHECK_DO(mg_http_srv_ctx!= NULL, exit(-1));
+	return fake_tracker_srv_ctx;
+}
 
-	/* Decrement the reference count of json_object -free if it reaches zero- */
-	json_object_put(jobj_buckets);
+static void fake_tracker_close(
+		fake_tracker_srv_ctx_t **ref_fake_tracker_srv_ctx)
+{
+	printf("\nClosing HTTP-server \"fake-tracker\"... \n");
+	fake_tracker_srv_close(ref_fake_tracker_srv_ctx);
+}
 
-	return mg_http_srv_ctx;
+/**
+ * Parses delta push URL of the form '<host>:<port>[/location]'.
+ * The given string is modified (split in place).
+ */
+static int parse_push_url(char *push_url,
+		fake_tracker_srv_settings_t *settings)
+{
+	char *p_port, *p_location;
+
+	if((p_port= strchr(push_url, ':'))== NULL)
+		return -1;
+	*p_port++= 0;
+	if((p_location= strchr(p_port, '/'))!= NULL) {
+		settings->push_location= strdup(p_location); // static along 'main()'
+		*p_location= 0;
+	}
+	settings->push_host= push_url;
+	settings->push_port= p_port;
+	return 0;
 }
 
-static void fake_tracker_close(mg_http_srv_ctx_t **ref_mg_http_srv_ctx)
+static void usage(const char *prog_name)
 {
-	printf("\nClosing HTTP-server \"fake-tracker\"... \n");
-	mg_http_srv_close(ref_mg_http_srv_ctx);
+	printf("usage: %s [-n buckets_num] [-r mutate_ratio] [-p mutate_period] "
+			"[-s soak_secs] [-u push_host:push_port/location]\n"
+			"  -n: synthesize the given number of webcache buckets (by "
+			"default, '%s' is served)\n"
+			"  -r: fraction [0..1] of buckets mutated each period "
+			"(default %.2f)\n"
+			"  -p: mutation period in seconds (default %d)\n"
+			"  -s: keep running the given seconds after the scripted "
+			"requests\n"
+			"  -u: push each period buckets delta to the given URL\n",
+			prog_name, BUCKETS_JSON_FILE, FAKE_TRACKER_MUTATE_RATIO_DEF,
+			FAKE_TRACKER_MUTATE_PERIOD_DEF);
 }
 
 static mg_http_srv_ctx_t* fake_origin_1_open()
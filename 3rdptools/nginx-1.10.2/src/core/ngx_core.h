@@ -90,6 +90,7 @@ typedef void (*ngx_connection_handler_pt)(ngx_connection_t *c);
 #include <ngx_connection.h>
 #include <ngx_syslog.h>
 #include <ngx_proxy_protocol.h>
+#include <ngx_probe.h>
 
 
 #define LF     (u_char) '\n'
@@ -0,0 +1,33 @@
+
+/*
+ * Statically defined tracing (USDT) probe points.
+ *
+ * Probes compile to a single nop when SystemTap's <sys/sdt.h> is available
+ * and to nothing otherwise; they can be attached to with perf, bpftrace or
+ * stap, e.g.: bpftrace -e 'usdt:./objs/nginx:nginx:upstream__connect__done
+ * { @us = hist(arg1 * 1000); }'.
+ */
+
+
+#ifndef _NGX_PROBE_H_INCLUDED_
+#define _NGX_PROBE_H_INCLUDED_
+
+
+#include <ngx_config.h>
+
+
+#if (NGX_HAVE_SDT)
+
+#include <sys/sdt.h>
+
+#define ngx_probe(provider, name, ...)                                        \
+    STAP_PROBEV(provider, name, __VA_ARGS__)
+
+#else
+
+#define ngx_probe(provider, name, ...)
+
+#endif
+
+
+#endif /* _NGX_PROBE_H_INCLUDED_ */
@@ -541,6 +541,35 @@ static ngx_command_t  ngx_http_proxy_commands[] = {
       offsetof(ngx_http_proxy_loc_conf_t, upstream.cache_convert_head),
       NULL },
 
+    { ngx_string("proxy_cache_stale_while_revalidate"),
+      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_TAKE1,
+      ngx_http_set_complex_value_slot,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      offsetof(ngx_http_proxy_loc_conf_t,
+               upstream.cache_stale_while_revalidate),
+      NULL },
+
+    { ngx_string("proxy_cache_stale_if_error"),
+      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_TAKE1,
+      ngx_http_set_complex_value_slot,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      offsetof(ngx_http_proxy_loc_conf_t, upstream.cache_stale_if_error),
+      NULL },
+
+    { ngx_string("proxy_cache_partition"),
+      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_TAKE1,
+      ngx_http_set_complex_value_slot,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      offsetof(ngx_http_proxy_loc_conf_t, upstream.cache_partition),
+      NULL },
+
+    { ngx_string("proxy_cache_partition_max_size"),
+      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_TAKE1,
+      ngx_http_set_complex_value_slot,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      offsetof(ngx_http_proxy_loc_conf_t, upstream.cache_partition_max_size),
+      NULL },
+
 #endif
 
     { ngx_string("proxy_temp_path"),
@@ -1266,6 +1295,10 @@ ngx_http_proxy_create_request(ngx_http_request_t *r)
                 i = 0;
             }
 
+            if (header[i].hash == 0) {
+                continue;
+            }
+
             if (ngx_hash_find(&headers->hash, header[i].hash,
                               header[i].lowcase_key, header[i].key.len))
             {
@@ -1391,6 +1424,10 @@ ngx_http_proxy_create_request(ngx_http_request_t *r)
                 i = 0;
             }
 
+            if (header[i].hash == 0) {
+                continue;
+            }
+
             if (ngx_hash_find(&headers->hash, header[i].hash,
                               header[i].lowcase_key, header[i].key.len))
             {
@@ -2789,6 +2826,10 @@ ngx_http_proxy_create_loc_conf(ngx_conf_t *cf)
      *     conf->upstream.cache_zone = NULL;
      *     conf->upstream.cache_use_stale = 0;
      *     conf->upstream.cache_methods = 0;
+     *     conf->upstream.cache_stale_while_revalidate = NULL;
+     *     conf->upstream.cache_stale_if_error = NULL;
+     *     conf->upstream.cache_partition = NULL;
+     *     conf->upstream.cache_partition_max_size = NULL;
      *     conf->upstream.temp_path = NULL;
      *     conf->upstream.hide_headers_hash = { NULL, 0 };
      *     conf->upstream.uri = { 0, NULL };
@@ -3156,6 +3197,25 @@ ngx_http_proxy_merge_loc_conf(ngx_conf_t *cf, void *parent, void *child)
     ngx_conf_merge_value(conf->upstream.cache_convert_head,
                               prev->upstream.cache_convert_head, 1);
 
+    if (conf->upstream.cache_stale_while_revalidate == NULL) {
+        conf->upstream.cache_stale_while_revalidate =
+                                   prev->upstream.cache_stale_while_revalidate;
+    }
+
+    if (conf->upstream.cache_stale_if_error == NULL) {
+        conf->upstream.cache_stale_if_error =
+                                   prev->upstream.cache_stale_if_error;
+    }
+
+    if (conf->upstream.cache_partition == NULL) {
+        conf->upstream.cache_partition = prev->upstream.cache_partition;
+    }
+
+    if (conf->upstream.cache_partition_max_size == NULL) {
+        conf->upstream.cache_partition_max_size =
+                                   prev->upstream.cache_partition_max_size;
+    }
+
 #endif
 
     ngx_conf_merge_str_value(conf->method, prev->method, "");
@@ -4306,6 +4366,13 @@ ngx_http_proxy_set_ssl(ngx_conf_t *cf, ngx_http_proxy_loc_conf_t *plcf)
     cln->handler = ngx_ssl_cleanup_ctx;
     cln->data = plcf->upstream.ssl;
 
+    if (ngx_ssl_client_session_cache(cf, plcf->upstream.ssl,
+                                     plcf->upstream.ssl_session_reuse)
+        != NGX_OK)
+    {
+        return NGX_ERROR;
+    }
+
     if (plcf->ssl_certificate.len) {
 
         if (plcf->ssl_certificate_key.len == 0) {
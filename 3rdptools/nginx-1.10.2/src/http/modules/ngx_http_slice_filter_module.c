@@ -11,13 +11,15 @@
 
 
 typedef struct {
-    size_t      size;
+    size_t                     size;
+    ngx_http_complex_value_t  *size_value;
 } ngx_http_slice_loc_conf_t;
 
 
 typedef struct {
     off_t       start;
     off_t       end;
+    off_t       size;
     ngx_str_t   range;
     ngx_str_t   etag;
     ngx_uint_t  last;  /* unsigned  last:1; */
@@ -39,6 +41,9 @@ static ngx_int_t ngx_http_slice_parse_content_range(ngx_http_request_t *r,
 static ngx_int_t ngx_http_slice_range_variable(ngx_http_request_t *r,
     ngx_http_variable_value_t *v, uintptr_t data);
 static off_t ngx_http_slice_get_start(ngx_http_request_t *r);
+static size_t ngx_http_slice_get_size(ngx_http_request_t *r,
+    ngx_http_slice_loc_conf_t *slcf);
+static char *ngx_http_slice(ngx_conf_t *cf, ngx_command_t *cmd, void *conf);
 static void *ngx_http_slice_create_loc_conf(ngx_conf_t *cf);
 static char *ngx_http_slice_merge_loc_conf(ngx_conf_t *cf, void *parent,
     void *child);
@@ -50,9 +55,9 @@ static ngx_command_t  ngx_http_slice_filter_commands[] = {
 
     { ngx_string("slice"),
       NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_TAKE1,
-      ngx_conf_set_size_slot,
+      ngx_http_slice,
       NGX_HTTP_LOC_CONF_OFFSET,
-      offsetof(ngx_http_slice_loc_conf_t, size),
+      0,
       NULL },
 
       ngx_null_command
@@ -103,7 +108,6 @@ ngx_http_slice_header_filter(ngx_http_request_t *r)
     ngx_int_t                        rc;
     ngx_table_elt_t                 *h;
     ngx_http_slice_ctx_t            *ctx;
-    ngx_http_slice_loc_conf_t       *slcf;
     ngx_http_slice_content_range_t   cr;
 
     ctx = ngx_http_get_module_ctx(r, ngx_http_slice_filter_module);
@@ -157,9 +161,7 @@ ngx_http_slice_header_filter(ngx_http_request_t *r)
                    "http slice response range: %O-%O/%O",
                    cr.start, cr.end, cr.complete_length);
 
-    slcf = ngx_http_get_module_loc_conf(r, ngx_http_slice_filter_module);
-
-    end = ngx_min(cr.start + (off_t) slcf->size, cr.complete_length);
+    end = ngx_min(cr.start + ctx->size, cr.complete_length);
 
     if (cr.start != ctx->start || cr.end != end) {
         ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
@@ -188,9 +190,9 @@ ngx_http_slice_header_filter(ngx_http_request_t *r)
     }
 
     if (r->headers_out.status == NGX_HTTP_PARTIAL_CONTENT) {
-        if (ctx->start + (off_t) slcf->size <= r->headers_out.content_offset) {
-            ctx->start = slcf->size
-                         * (r->headers_out.content_offset / slcf->size);
+        if (ctx->start + ctx->size <= r->headers_out.content_offset) {
+            ctx->start = ctx->size
+                         * (r->headers_out.content_offset / ctx->size);
         }
 
         ctx->end = r->headers_out.content_offset
@@ -207,11 +209,10 @@ ngx_http_slice_header_filter(ngx_http_request_t *r)
 static ngx_int_t
 ngx_http_slice_body_filter(ngx_http_request_t *r, ngx_chain_t *in)
 {
-    ngx_int_t                   rc;
-    ngx_chain_t                *cl;
-    ngx_http_request_t         *sr;
-    ngx_http_slice_ctx_t       *ctx;
-    ngx_http_slice_loc_conf_t  *slcf;
+    ngx_int_t              rc;
+    ngx_chain_t           *cl;
+    ngx_http_request_t    *sr;
+    ngx_http_slice_ctx_t  *ctx;
 
     ctx = ngx_http_get_module_ctx(r, ngx_http_slice_filter_module);
 
@@ -250,10 +251,8 @@ ngx_http_slice_body_filter(ngx_http_request_t *r, ngx_chain_t *in)
 
     ngx_http_set_ctx(sr, ctx, ngx_http_slice_filter_module);
 
-    slcf = ngx_http_get_module_loc_conf(r, ngx_http_slice_filter_module);
-
     ctx->range.len = ngx_sprintf(ctx->range.data, "bytes=%O-%O", ctx->start,
-                                 ctx->start + (off_t) slcf->size - 1)
+                                 ctx->start + ctx->size - 1)
                      - ctx->range.data;
 
     ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
@@ -372,6 +371,7 @@ ngx_http_slice_range_variable(ngx_http_request_t *r,
     ngx_http_variable_value_t *v, uintptr_t data)
 {
     u_char                     *p;
+    size_t                      size;
     ngx_http_slice_ctx_t       *ctx;
     ngx_http_slice_loc_conf_t  *slcf;
 
@@ -385,7 +385,9 @@ ngx_http_slice_range_variable(ngx_http_request_t *r,
 
         slcf = ngx_http_get_module_loc_conf(r, ngx_http_slice_filter_module);
 
-        if (slcf->size == 0) {
+        size = ngx_http_slice_get_size(r, slcf);
+
+        if (size == 0) {
             v->not_found = 1;
             return NGX_OK;
         }
@@ -402,11 +404,12 @@ ngx_http_slice_range_variable(ngx_http_request_t *r,
             return NGX_ERROR;
         }
 
-        ctx->start = slcf->size * (ngx_http_slice_get_start(r) / slcf->size);
+        ctx->size = size;
+        ctx->start = ctx->size * (ngx_http_slice_get_start(r) / ctx->size);
 
         ctx->range.data = p;
         ctx->range.len = ngx_sprintf(p, "bytes=%O-%O", ctx->start,
-                                     ctx->start + (off_t) slcf->size - 1)
+                                     ctx->start + ctx->size - 1)
                          - p;
     }
 
@@ -469,6 +472,81 @@ ngx_http_slice_get_start(ngx_http_request_t *r)
 }
 
 
+static size_t
+ngx_http_slice_get_size(ngx_http_request_t *r, ngx_http_slice_loc_conf_t *slcf)
+{
+    ssize_t    size;
+    ngx_str_t  value;
+
+    if (slcf->size_value == NULL) {
+        return slcf->size;
+    }
+
+    if (ngx_http_complex_value(r, slcf->size_value, &value) != NGX_OK) {
+        return 0;
+    }
+
+    if (value.len == 0) {
+        return 0;
+    }
+
+    size = ngx_parse_size(&value);
+
+    if (size == NGX_ERROR) {
+        ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
+                      "invalid slice size \"%V\"", &value);
+        return 0;
+    }
+
+    return (size_t) size;
+}
+
+
+static char *
+ngx_http_slice(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+    ngx_http_slice_loc_conf_t *slcf = conf;
+
+    ssize_t                            size;
+    ngx_str_t                         *value;
+    ngx_http_compile_complex_value_t   ccv;
+
+    if (slcf->size != NGX_CONF_UNSET_SIZE || slcf->size_value) {
+        return "is duplicate";
+    }
+
+    value = cf->args->elts;
+
+    if (ngx_http_script_variables_count(&value[1]) == 0) {
+        size = ngx_parse_size(&value[1]);
+        if (size == NGX_ERROR) {
+            return "invalid value";
+        }
+
+        slcf->size = (size_t) size;
+
+        return NGX_CONF_OK;
+    }
+
+    slcf->size_value = ngx_palloc(cf->pool, sizeof(ngx_http_complex_value_t));
+    if (slcf->size_value == NULL) {
+        return NGX_CONF_ERROR;
+    }
+
+    ngx_memzero(&ccv, sizeof(ngx_http_compile_complex_value_t));
+
+    ccv.cf = cf;
+    ccv.value = &value[1];
+    ccv.complex_value = slcf->size_value;
+
+    if (ngx_http_compile_complex_value(&ccv) != NGX_OK) {
+        return NGX_CONF_ERROR;
+    }
+
+    return NGX_CONF_OK;
+}
+
+
 static void *
 ngx_http_slice_create_loc_conf(ngx_conf_t *cf)
 {
@@ -480,6 +558,7 @@ ngx_http_slice_create_loc_conf(ngx_conf_t *cf)
     }
 
     slcf->size = NGX_CONF_UNSET_SIZE;
+    slcf->size_value = NULL;
 
     return slcf;
 }
@@ -491,6 +570,10 @@ ngx_http_slice_merge_loc_conf(ngx_conf_t *cf, void *parent, void *child)
     ngx_http_slice_loc_conf_t *prev = parent;
     ngx_http_slice_loc_conf_t *conf = child;
 
+    if (conf->size == NGX_CONF_UNSET_SIZE && conf->size_value == NULL) {
+        conf->size_value = prev->size_value;
+    }
+
     ngx_conf_merge_size_value(conf->size, prev->size, 0);
 
     return NGX_CONF_OK;
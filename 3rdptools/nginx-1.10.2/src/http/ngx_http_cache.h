@@ -27,6 +27,19 @@
 #define NGX_HTTP_CACHE_ETAG_LEN      42
 #define NGX_HTTP_CACHE_VARY_LEN      42
 
+#define NGX_HTTP_CACHE_PARTITION_LEN   32
+#define NGX_HTTP_CACHE_PARTITIONS_MAX  1023
+
+#define NGX_HTTP_CACHE_POLICY_LRU      0
+#define NGX_HTTP_CACHE_POLICY_SLRU     1
+#define NGX_HTTP_CACHE_POLICY_TINYLFU  2
+
+#define NGX_HTTP_CACHE_SKETCH_DEPTH    4
+#define NGX_HTTP_CACHE_SKETCH_MAX      15
+
+#define NGX_HTTP_CACHE_WALK_BATCH      4096
+#define NGX_HTTP_CACHE_SNAPSHOT_SLACK  60
+
 #define NGX_HTTP_CACHE_VERSION       3
 
 
@@ -36,6 +49,15 @@ typedef struct {
 } ngx_http_cache_valid_t;
 
 
+/* temporary file being written by the cache lock owner */
+
+typedef struct {
+    off_t                            size;
+    size_t                           body_start;
+    ngx_str_t                        name;
+} ngx_http_file_cache_fill_t;
+
+
 typedef struct {
     ngx_rbtree_node_t                node;
     ngx_queue_t                      queue;
@@ -50,7 +72,9 @@ typedef struct {
     unsigned                         exists:1;
     unsigned                         updating:1;
     unsigned                         deleting:1;
-                                     /* 11 unused bits */
+    unsigned                         waiting:1;
+    unsigned                         partition:10;
+    unsigned                         protected:1;
 
     ngx_file_uniq_t                  uniq;
     time_t                           expire;
@@ -58,6 +82,7 @@ typedef struct {
     size_t                           body_start;
     off_t                            fs_size;
     ngx_msec_t                       lock_time;
+    ngx_http_file_cache_fill_t      *fill;
 } ngx_http_file_cache_node_t;
 
 
@@ -82,11 +107,18 @@ struct ngx_http_cache_s {
     off_t                            length;
     off_t                            fs_size;
 
+    ngx_str_t                        partition;
+    off_t                            partition_max_size;
+
     ngx_uint_t                       min_uses;
     ngx_uint_t                       error;
     ngx_uint_t                       valid_msec;
 
+    time_t                           updating_sec;
+    time_t                           error_sec;
+
     ngx_buf_t                       *buf;
+    ngx_buf_t                       *fill_buf;
 
     ngx_http_file_cache_t           *file_cache;
     ngx_http_file_cache_node_t      *node;
@@ -101,6 +133,7 @@ struct ngx_http_cache_s {
     ngx_msec_t                       wait_time;
 
     ngx_event_t                      wait_event;
+    ngx_queue_t                      wait_queue;
 
     unsigned                         lock:1;
     unsigned                         waiting:1;
@@ -111,6 +144,11 @@ struct ngx_http_cache_s {
     unsigned                         temp_file:1;
     unsigned                         reading:1;
     unsigned                         secondary:1;
+    unsigned                         filling:1;
+
+    unsigned                         stale_updating:1;
+    unsigned                         stale_error:1;
+    unsigned                         background:1;
 };
 
 
@@ -131,18 +169,51 @@ typedef struct {
 } ngx_http_file_cache_header_t;
 
 
+/*
+ * cache partition: the nodes of a partition key (e.g. a bucket) have their
+ * own inactive queue and size, so that eviction can be partitioned;
+ * the partition 0 holds the nodes without key and those loaded from disk;
+ * with the "slru" and "tinylfu" policies, nodes hit while cached move from
+ * the probation queue to the protected one
+ */
+
+typedef struct {
+    ngx_queue_t                      queue;
+    ngx_queue_t                      protected;
+    off_t                            size;
+    off_t                            max_size;
+    ngx_uint_t                       count;
+    ngx_uint_t                       nprotected;
+    uint32_t                         hash;
+    size_t                           len;
+    u_char                           name[NGX_HTTP_CACHE_PARTITION_LEN];
+} ngx_http_file_cache_partition_t;
+
+
 typedef struct {
     ngx_rbtree_t                     rbtree;
     ngx_rbtree_node_t                sentinel;
-    ngx_queue_t                      queue;
+    ngx_http_file_cache_partition_t *partition;
     ngx_atomic_t                     cold;
     ngx_atomic_t                     loading;
     off_t                            size;
     ngx_uint_t                       count;
     ngx_uint_t                       watermark;
+    u_char                          *sketch;
+    ngx_uint_t                       sketch_mask;
+    ngx_uint_t                       sketch_adds;
+    time_t                           snapshot_time;
 } ngx_http_file_cache_sh_t;
 
 
+/* a cache node ranked by ngx_http_file_cache_hot() */
+
+typedef struct {
+    u_char                           key[NGX_HTTP_CACHE_KEY_LEN];
+    ngx_uint_t                       uses;
+} ngx_http_file_cache_hot_t;
+
+
 struct ngx_http_file_cache_s {
     ngx_http_file_cache_sh_t        *sh;
     ngx_slab_pool_t                 *shpool;
@@ -153,6 +224,9 @@ struct ngx_http_file_cache_s {
     off_t                            max_size;
     size_t                           bsize;
 
+    ngx_uint_t                       partitions;
+    ngx_uint_t                       policy;
+
     time_t                           inactive;
 
     time_t                           fail_time;
@@ -163,6 +237,11 @@ struct ngx_http_file_cache_s {
     ngx_msec_t                       loader_sleep;
     ngx_msec_t                       loader_threshold;
 
+    ngx_str_t                        snapshot;
+    ngx_str_t                        snapshot_temp;
+    time_t                           snapshot_interval;
+    time_t                           snapshot_next;
+
     ngx_shm_zone_t                  *shm_zone;
 };
 
@@ -172,11 +251,19 @@ ngx_int_t ngx_http_file_cache_create(ngx_http_request_t *r);
 void ngx_http_file_cache_create_key(ngx_http_request_t *r);
 ngx_int_t ngx_http_file_cache_open(ngx_http_request_t *r);
 ngx_int_t ngx_http_file_cache_set_header(ngx_http_request_t *r, u_char *buf);
+void ngx_http_file_cache_fill(ngx_http_request_t *r, ngx_temp_file_t *tf);
 void ngx_http_file_cache_update(ngx_http_request_t *r, ngx_temp_file_t *tf);
 void ngx_http_file_cache_update_header(ngx_http_request_t *r);
 ngx_int_t ngx_http_cache_send(ngx_http_request_t *);
 void ngx_http_file_cache_free(ngx_http_cache_t *c, ngx_temp_file_t *tf);
 time_t ngx_http_file_cache_valid(ngx_array_t *cache_valid, ngx_uint_t status);
+ngx_uint_t ngx_http_file_cache_hot(ngx_http_file_cache_t *cache,
+    ngx_str_t *partition, ngx_http_file_cache_hot_t *hot, ngx_uint_t n);
+ngx_int_t ngx_http_file_cache_file_name(ngx_http_file_cache_t *cache,
+    u_char *key, ngx_str_t *name, ngx_pool_t *pool);
+ngx_int_t ngx_http_file_cache_import(ngx_http_file_cache_t *cache,
+    u_char *key, ngx_uint_t uses, ngx_str_t *name, ngx_pool_t *pool,
+    ngx_log_t *log);
 
 char *ngx_http_file_cache_set_slot(ngx_conf_t *cf, ngx_command_t *cmd,
     void *conf);
@@ -16,6 +16,21 @@ static ngx_int_t ngx_http_file_cache_lock(ngx_http_request_t *r,
 static void ngx_http_file_cache_lock_wait_handler(ngx_event_t *ev);
 static void ngx_http_file_cache_lock_wait(ngx_http_request_t *r,
     ngx_http_cache_t *c);
+static void ngx_http_file_cache_wait_add(ngx_http_cache_t *c);
+static void ngx_http_file_cache_wait_delete(ngx_http_cache_t *c);
+static void ngx_http_file_cache_wakeup(ngx_http_file_cache_node_t *fcn);
+static void ngx_http_file_cache_wakeup_handler(ngx_event_t *ev);
+static ngx_int_t ngx_http_file_cache_fill_open(ngx_http_request_t *r,
+    ngx_http_cache_t *c);
+static ngx_int_t ngx_http_file_cache_fill_read(ngx_http_request_t *r,
+    ngx_http_cache_t *c);
+static ngx_int_t ngx_http_file_cache_fill_send(ngx_http_request_t *r);
+static ngx_int_t ngx_http_file_cache_fill_tail(ngx_http_request_t *r,
+    ngx_http_cache_t *c);
+static void ngx_http_file_cache_fill_handler(ngx_event_t *ev);
+static void ngx_http_file_cache_fill_writer(ngx_http_request_t *r);
+static void ngx_http_file_cache_fill_free_locked(ngx_http_file_cache_t *cache,
+    ngx_http_file_cache_node_t *fcn, ngx_str_t *name);
 static ngx_int_t ngx_http_file_cache_read(ngx_http_request_t *r,
     ngx_http_cache_t *c);
 static ssize_t ngx_http_file_cache_aio_read(ngx_http_request_t *r,
@@ -45,8 +60,24 @@ static ngx_int_t ngx_http_file_cache_reopen(ngx_http_request_t *r,
 static ngx_int_t ngx_http_file_cache_update_variant(ngx_http_request_t *r,
     ngx_http_cache_t *c);
 static void ngx_http_file_cache_cleanup(void *data);
+static ngx_uint_t ngx_http_file_cache_partition(ngx_http_file_cache_t *cache,
+    ngx_http_cache_t *c);
+static ngx_http_file_cache_partition_t *ngx_http_file_cache_victim(
+    ngx_http_file_cache_t *cache, ngx_uint_t over);
+static void ngx_http_file_cache_enqueue(ngx_http_file_cache_t *cache,
+    ngx_http_file_cache_node_t *fcn, ngx_uint_t protect);
+static void ngx_http_file_cache_dequeue(ngx_http_file_cache_t *cache,
+    ngx_http_file_cache_node_t *fcn);
+static void ngx_http_file_cache_remove(ngx_http_file_cache_t *cache,
+    ngx_http_file_cache_node_t *fcn);
+static ngx_uint_t ngx_http_file_cache_sketch(ngx_http_file_cache_t *cache,
+    u_char *key, ngx_uint_t add);
+static ngx_uint_t ngx_http_file_cache_admit(ngx_http_file_cache_t *cache,
+    ngx_http_cache_t *c, ngx_uint_t n);
 static time_t ngx_http_file_cache_forced_expire(ngx_http_file_cache_t *cache);
 static time_t ngx_http_file_cache_expire(ngx_http_file_cache_t *cache);
+static time_t ngx_http_file_cache_expire_queue(ngx_http_file_cache_t *cache,
+    ngx_queue_t *queue, u_char *name, time_t now);
 static void ngx_http_file_cache_delete(ngx_http_file_cache_t *cache,
     ngx_queue_t *q, u_char *name);
 static void ngx_http_file_cache_loader_sleep(ngx_http_file_cache_t *cache);
@@ -59,10 +90,23 @@ static ngx_int_t ngx_http_file_cache_manage_directory(ngx_tree_ctx_t *ctx,
 static ngx_int_t ngx_http_file_cache_add_file(ngx_tree_ctx_t *ctx,
     ngx_str_t *path);
 static ngx_int_t ngx_http_file_cache_add(ngx_http_file_cache_t *cache,
-    ngx_http_cache_t *c);
+    ngx_http_cache_t *c, ngx_uint_t uses);
 static ngx_int_t ngx_http_file_cache_delete_file(ngx_tree_ctx_t *ctx,
     ngx_str_t *path);
 static void ngx_http_file_cache_set_watermark(ngx_http_file_cache_t *cache);
+static void ngx_http_file_cache_snapshot(ngx_http_file_cache_t *cache);
+static ngx_rbtree_node_t *ngx_http_file_cache_next(
+    ngx_http_file_cache_t *cache, u_char *key);
+static ngx_rbtree_node_t *ngx_http_file_cache_successor(
+    ngx_rbtree_node_t *node, ngx_rbtree_node_t *sentinel);
+static void ngx_http_file_cache_node_key(ngx_http_file_cache_node_t *fcn,
+    u_char *key);
+static void ngx_http_file_cache_snapshot_load(ngx_http_file_cache_t *cache,
+    ngx_log_t *log);
+static void ngx_http_file_cache_hot_add(ngx_http_file_cache_hot_t *hot,
+    ngx_uint_t n, ngx_uint_t *nhot, ngx_http_file_cache_node_t *fcn);
+static int ngx_libc_cdecl ngx_http_file_cache_hot_cmp(const void *one,
+    const void *two);
 
 
 ngx_str_t  ngx_http_cache_status[] = {
@@ -79,6 +123,47 @@ ngx_str_t  ngx_http_cache_status[] = {
 static u_char  ngx_http_file_cache_key[] = { LF, 'K', 'E', 'Y', ':', ' ' };
 
 
+/*
+ * requests of this worker waiting for a cache lock; they are woken up
+ * as soon as the lock is released, either by this worker or by another
+ * one (ngx_wakeup_event), instead of polling the cache node every 500ms
+ */
+
+static ngx_queue_t  ngx_http_file_cache_waiters;
+static ngx_event_t  ngx_http_file_cache_wakeup_event;
+
+
+/*
+ * cache index snapshot: the header is followed by a node per cached file;
+ * the CRC32 covers the nodes and then the header fields after it
+ */
+
+typedef struct {
+    u_char                           NGXSNP[6];
+    u_char                           version;
+    u_char                           ptr_size;
+    uint32_t                         endianness;
+    uint32_t                         crc32;
+    time_t                           time;
+    ngx_uint_t                       count;
+    size_t                           bsize;
+    size_t                           level[3];
+} ngx_http_file_cache_snapshot_t;
+
+
+typedef struct {
+    u_char                           key[NGX_HTTP_CACHE_KEY_LEN];
+    off_t                            fs_size;
+    ngx_uint_t                       uses;
+} ngx_http_file_cache_snapshot_node_t;
+
+
+static ngx_http_file_cache_snapshot_t  ngx_http_file_cache_snapshot_header = {
+    { 'N', 'G', 'X', 'S', 'N', 'P' }, 1, sizeof(void *), 0x12345678, 0,
+    0, 0, 0, { 0, 0, 0 }
+};
+
+
 static ngx_int_t
 ngx_http_file_cache_init(ngx_shm_zone_t *shm_zone, void *data)
 {
@@ -110,6 +195,16 @@ ngx_http_file_cache_init(ngx_shm_zone_t *shm_zone, void *data)
             }
         }
 
+        if (cache->partitions != ocache->partitions
+            || cache->policy != ocache->policy)
+        {
+            ngx_log_error(NGX_LOG_EMERG, shm_zone->shm.log, 0,
+                          "cache \"%V\" had previously different "
+                          "partitions or policy",
+                          &shm_zone->shm.name);
+            return NGX_ERROR;
+        }
+
         cache->sh = ocache->sh;
 
         cache->shpool = ocache->shpool;
@@ -143,7 +238,35 @@ ngx_http_file_cache_init(ngx_shm_zone_t *shm_zone, void *data)
     ngx_rbtree_init(&cache->sh->rbtree, &cache->sh->sentinel,
                     ngx_http_file_cache_rbtree_insert_value);
 
-    ngx_queue_init(&cache->sh->queue);
+    cache->sh->partition = ngx_slab_calloc(cache->shpool,
+                               (cache->partitions + 1)
+                               * sizeof(ngx_http_file_cache_partition_t));
+    if (cache->sh->partition == NULL) {
+        return NGX_ERROR;
+    }
+
+    for (n = 0; n <= cache->partitions; n++) {
+        ngx_queue_init(&cache->sh->partition[n].queue);
+        ngx_queue_init(&cache->sh->partition[n].protected);
+    }
+
+    if (cache->policy == NGX_HTTP_CACHE_POLICY_TINYLFU) {
+
+        /* a counter per node the keys zone can hold, in each row */
+
+        len = shm_zone->shm.size / sizeof(ngx_http_file_cache_node_t);
+
+        for (n = 256; n < len; n <<= 1) { /* void */ }
+
+        cache->sh->sketch = ngx_slab_calloc(cache->shpool,
+                                            NGX_HTTP_CACHE_SKETCH_DEPTH * n);
+        if (cache->sh->sketch == NULL) {
+            return NGX_ERROR;
+        }
+
+        cache->sh->sketch_mask = n - 1;
+        cache->sh->sketch_adds = 0;
+    }
 
     cache->sh->cold = 1;
     cache->sh->loading = 0;
@@ -167,6 +290,12 @@ ngx_http_file_cache_init(ngx_shm_zone_t *shm_zone, void *data)
 
     cache->shpool->log_nomem = 0;
 
+    cache->sh->snapshot_time = 0;
+
+    if (cache->snapshot.len) {
+        ngx_http_file_cache_snapshot_load(cache, shm_zone->shm.log);
+    }
+
     return NGX_OK;
 }
 
@@ -273,12 +402,15 @@ ngx_http_file_cache_open(ngx_http_request_t *r)
 
     c = r->cache;
 
+    ngx_probe(nginx, cache__open__start, r, (ngx_uint_t) c->waiting,
+              (ngx_uint_t) c->reading);
+
     if (c->waiting) {
         return NGX_AGAIN;
     }
 
     if (c->reading) {
-        return ngx_http_file_cache_read(r, c);
+        return ngx_http_file_cache_fill_read(r, c);
     }
 
     cache = c->file_cache;
@@ -401,8 +533,10 @@ done:
 static ngx_int_t
 ngx_http_file_cache_lock(ngx_http_request_t *r, ngx_http_cache_t *c)
 {
-    ngx_msec_t                 now, timer;
-    ngx_http_file_cache_t     *cache;
+    u_char                       *name;
+    ngx_msec_t                    now, timer;
+    ngx_http_file_cache_t        *cache;
+    ngx_http_file_cache_fill_t   *fill;
 
     if (!c->lock) {
         return NGX_DECLINED;
@@ -411,20 +545,49 @@ ngx_http_file_cache_lock(ngx_http_request_t *r, ngx_http_cache_t *c)
     now = ngx_current_msec;
 
     cache = c->file_cache;
+    name = NULL;
 
     ngx_shmtx_lock(&cache->shpool->mutex);
 
     timer = c->node->lock_time - now;
+    fill = c->node->fill;
 
     if (!c->node->updating || (ngx_msec_int_t) timer <= 0) {
         c->node->updating = 1;
         c->node->lock_time = now + c->lock_age;
         c->updating = 1;
         c->lock_time = c->node->lock_time;
+
+    } else if (fill && r == r->main) {
+
+        /* the response is being cached, read it while it is written */
+
+        name = ngx_pnalloc(r->pool, fill->name.len + 1);
+        if (name) {
+            ngx_memcpy(name, fill->name.data, fill->name.len + 1);
+
+            c->file.name.len = fill->name.len;
+            c->body_start = fill->body_start;
+            c->length = fill->body_start;
+        }
+
+    } else if (c->lock_timeout) {
+        c->node->waiting = 1;
     }
 
     ngx_shmtx_unlock(&cache->shpool->mutex);
 
+    if (fill && r == r->main && !c->updating) {
+        if (name == NULL) {
+            return NGX_ERROR;
+        }
+
+        c->file.name.data = name;
+        c->filling = 1;
+
+        return ngx_http_file_cache_fill_open(r, c);
+    }
+
     ngx_log_debug2(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
                    "http file cache lock u:%d wt:%M",
                    c->updating, c->wait_time);
@@ -437,7 +600,10 @@ ngx_http_file_cache_lock(ngx_http_request_t *r, ngx_http_cache_t *c)
         return NGX_HTTP_CACHE_SCARCE;
     }
 
-    c->waiting = 1;
+    if (!c->waiting) {
+        c->waiting = 1;
+        ngx_http_file_cache_wait_add(c);
+    }
 
     if (c->wait_time == 0) {
         c->wait_time = now + c->lock_timeout;
@@ -502,7 +668,10 @@ ngx_http_file_cache_lock_wait(ngx_http_request_t *r, ngx_http_cache_t *c)
 
     timer = c->node->lock_time - now;
 
-    if (c->node->updating && (ngx_msec_int_t) timer > 0) {
+    if (c->node->updating && (ngx_msec_int_t) timer > 0
+        && (c->node->fill == NULL || r != r->main))
+    {
+        c->node->waiting = 1;
         wait = 1;
     }
 
@@ -515,280 +684,397 @@ ngx_http_file_cache_lock_wait(ngx_http_request_t *r, ngx_http_cache_t *c)
 
 wakeup:
 
+    if (c->wait_event.timer_set) {
+        ngx_del_timer(&c->wait_event);
+    }
+
+    ngx_http_file_cache_wait_delete(c);
+
     c->waiting = 0;
     r->main->blocked--;
     r->write_event_handler(r);
 }
 
 
-static ngx_int_t
-ngx_http_file_cache_read(ngx_http_request_t *r, ngx_http_cache_t *c)
+static void
+ngx_http_file_cache_wait_add(ngx_http_cache_t *c)
 {
-    u_char                        *p;
-    time_t                         now;
-    ssize_t                        n;
-    ngx_str_t                     *key;
-    ngx_int_t                      rc;
-    ngx_uint_t                     i;
-    ngx_http_file_cache_t         *cache;
-    ngx_http_file_cache_header_t  *h;
+    if (ngx_http_file_cache_waiters.prev == NULL) {
+        ngx_queue_init(&ngx_http_file_cache_waiters);
 
-    n = ngx_http_file_cache_aio_read(r, c);
+        ngx_http_file_cache_wakeup_event.handler =
+                                            ngx_http_file_cache_wakeup_handler;
+        ngx_http_file_cache_wakeup_event.log = ngx_cycle->log;
 
-    if (n < 0) {
-        return n;
+#if !(NGX_WIN32)
+        ngx_wakeup_event = &ngx_http_file_cache_wakeup_event;
+#endif
     }
 
-    if ((size_t) n < c->header_start) {
-        ngx_log_error(NGX_LOG_CRIT, r->connection->log, 0,
-                      "cache file \"%s\" is too small", c->file.name.data);
-        return NGX_DECLINED;
-    }
+    ngx_queue_insert_tail(&ngx_http_file_cache_waiters, &c->wait_queue);
+}
 
-    h = (ngx_http_file_cache_header_t *) c->buf->pos;
 
-    if (h->version != NGX_HTTP_CACHE_VERSION) {
-        ngx_log_error(NGX_LOG_INFO, r->connection->log, 0,
-                      "cache file \"%s\" version mismatch", c->file.name.data);
-        return NGX_DECLINED;
+static void
+ngx_http_file_cache_wait_delete(ngx_http_cache_t *c)
+{
+    if (c->wait_event.posted) {
+        ngx_delete_posted_event(&c->wait_event);
     }
 
-    if (h->crc32 != c->crc32 || h->header_start != c->header_start) {
-        ngx_log_error(NGX_LOG_CRIT, r->connection->log, 0,
-                      "cache file \"%s\" has md5 collision", c->file.name.data);
-        return NGX_DECLINED;
-    }
+    ngx_queue_remove(&c->wait_queue);
+}
 
-    p = c->buf->pos + sizeof(ngx_http_file_cache_header_t)
-        + sizeof(ngx_http_file_cache_key);
 
-    key = c->keys.elts;
-    for (i = 0; i < c->keys.nelts; i++) {
-        if (ngx_memcmp(p, key[i].data, key[i].len) != 0) {
-            ngx_log_error(NGX_LOG_CRIT, r->connection->log, 0,
-                          "cache file \"%s\" has md5 collision",
-                          c->file.name.data);
-            return NGX_DECLINED;
-        }
+/*
+ * fcn is the cache node just unlocked by this worker, or NULL if
+ * another worker has unlocked some cache node
+ */
 
-        p += key[i].len;
-    }
+static void
+ngx_http_file_cache_wakeup(ngx_http_file_cache_node_t *fcn)
+{
+    ngx_queue_t       *q;
+    ngx_http_cache_t  *c;
 
-    if ((size_t) h->body_start > c->body_start) {
-        ngx_log_error(NGX_LOG_CRIT, r->connection->log, 0,
-                      "cache file \"%s\" has too long header",
-                      c->file.name.data);
-        return NGX_DECLINED;
-    }
+    if (ngx_http_file_cache_waiters.prev) {
 
-    if (h->vary_len > NGX_HTTP_CACHE_VARY_LEN) {
-        ngx_log_error(NGX_LOG_CRIT, r->connection->log, 0,
-                      "cache file \"%s\" has incorrect vary length",
-                      c->file.name.data);
-        return NGX_DECLINED;
-    }
+        for (q = ngx_queue_head(&ngx_http_file_cache_waiters);
+             q != ngx_queue_sentinel(&ngx_http_file_cache_waiters);
+             q = ngx_queue_next(q))
+        {
+            c = ngx_queue_data(q, ngx_http_cache_t, wait_queue);
 
-    if (h->vary_len) {
-        ngx_http_file_cache_vary(r, h->vary, h->vary_len, c->variant);
+            if (fcn && c->node != fcn) {
+                continue;
+            }
 
-        if (ngx_memcmp(c->variant, h->variant, NGX_HTTP_CACHE_KEY_LEN) != 0) {
-            ngx_log_debug0(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
-                           "http file cache vary mismatch");
-            return ngx_http_file_cache_reopen(r, c);
+            if (!c->wait_event.posted) {
+                ngx_post_event(&c->wait_event, &ngx_posted_events);
+            }
         }
     }
 
-    c->buf->last += n;
-
-    c->valid_sec = h->valid_sec;
-    c->last_modified = h->last_modified;
-    c->date = h->date;
-    c->valid_msec = h->valid_msec;
-    c->body_start = h->body_start;
-    c->etag.len = h->etag_len;
-    c->etag.data = h->etag;
+#if !(NGX_WIN32)
+    if (fcn) {
+        ngx_wakeup_worker_processes((ngx_cycle_t *) ngx_cycle);
+    }
+#endif
+}
 
-    r->cached = 1;
 
-    cache = c->file_cache;
+static void
+ngx_http_file_cache_wakeup_handler(ngx_event_t *ev)
+{
+    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, ev->log, 0,
+                   "http file cache wakeup");
 
-    if (cache->sh->cold) {
+    ngx_http_file_cache_wakeup(NULL);
+}
 
-        ngx_shmtx_lock(&cache->shpool->mutex);
 
-        if (!c->node->exists) {
-            c->node->uses = 1;
-            c->node->body_start = c->body_start;
-            c->node->exists = 1;
-            c->node->uniq = c->uniq;
-            c->node->fs_size = c->fs_size;
+static ngx_int_t
+ngx_http_file_cache_fill_open(ngx_http_request_t *r, ngx_http_cache_t *c)
+{
+    ngx_fd_t                  fd;
+    ngx_file_info_t           fi;
+    ngx_pool_cleanup_t       *cln;
+    ngx_pool_cleanup_file_t  *clnf;
 
-            cache->sh->size += c->fs_size;
-        }
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                   "http file cache fill open: \"%s\"", c->file.name.data);
 
-        ngx_shmtx_unlock(&cache->shpool->mutex);
+    cln = ngx_pool_cleanup_add(r->pool, sizeof(ngx_pool_cleanup_file_t));
+    if (cln == NULL) {
+        return NGX_ERROR;
     }
 
-    now = ngx_time();
+    fd = ngx_open_file(c->file.name.data, NGX_FILE_RDONLY|NGX_FILE_NONBLOCK,
+                       NGX_FILE_OPEN, 0);
 
-    if (c->valid_sec < now) {
+    if (fd == NGX_INVALID_FILE) {
 
-        ngx_shmtx_lock(&cache->shpool->mutex);
+        if (ngx_errno != NGX_ENOENT) {
+            ngx_log_error(NGX_LOG_CRIT, r->connection->log, ngx_errno,
+                          ngx_open_file_n " \"%s\" failed", c->file.name.data);
+            return NGX_ERROR;
+        }
 
-        if (c->node->updating) {
-            rc = NGX_HTTP_CACHE_UPDATING;
+        /* the file has been just completed or abandoned */
 
-        } else {
-            c->node->updating = 1;
-            c->updating = 1;
-            c->lock_time = c->node->lock_time;
-            rc = NGX_HTTP_CACHE_STALE;
+        c->filling = 0;
+        c->file.name.len = 0;
+
+        if (ngx_http_file_cache_name(r, c->file_cache->path) != NGX_OK) {
+            return NGX_ERROR;
         }
 
-        ngx_shmtx_unlock(&cache->shpool->mutex);
+        return ngx_http_file_cache_open(r);
+    }
 
-        ngx_log_debug3(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
-                       "http file cache expired: %i %T %T",
-                       rc, c->valid_sec, now);
+    cln->handler = ngx_pool_cleanup_file;
+    clnf = cln->data;
 
-        return rc;
+    clnf->fd = fd;
+    clnf->name = c->file.name.data;
+    clnf->log = r->pool->log;
+
+    if (ngx_fd_info(fd, &fi) == NGX_FILE_ERROR) {
+        ngx_log_error(NGX_LOG_CRIT, r->connection->log, ngx_errno,
+                      ngx_fd_info_n " \"%s\" failed", c->file.name.data);
+        return NGX_ERROR;
     }
 
-    return NGX_OK;
+    c->file.fd = fd;
+    c->file.log = r->connection->log;
+    c->uniq = ngx_file_uniq(&fi);
+
+    c->buf = ngx_create_temp_buf(r->pool, c->body_start);
+    if (c->buf == NULL) {
+        return NGX_ERROR;
+    }
+
+    return ngx_http_file_cache_fill_read(r, c);
 }
 
 
-static ssize_t
-ngx_http_file_cache_aio_read(ngx_http_request_t *r, ngx_http_cache_t *c)
+static ngx_int_t
+ngx_http_file_cache_fill_read(ngx_http_request_t *r, ngx_http_cache_t *c)
 {
-#if (NGX_HAVE_FILE_AIO || NGX_THREADS)
-    ssize_t                    n;
-    ngx_http_core_loc_conf_t  *clcf;
+    ngx_int_t  rc;
 
-    clcf = ngx_http_get_module_loc_conf(r, ngx_http_core_module);
-#endif
+    rc = ngx_http_file_cache_read(r, c);
 
-#if (NGX_HAVE_FILE_AIO)
+    if (!c->filling || rc == NGX_OK || rc == NGX_AGAIN) {
+        return rc;
+    }
 
-    if (clcf->aio == NGX_HTTP_AIO_ON && ngx_file_aio) {
-        n = ngx_file_aio_read(&c->file, c->buf->pos, c->body_start, 0, r->pool);
+    /* an incomplete file must never be sent as a stale response */
 
-        if (n != NGX_AGAIN) {
-            c->reading = 0;
-            return n;
-        }
+    ngx_pool_run_cleanup_file(r->pool, c->file.fd);
 
-        c->reading = 1;
+    c->file.fd = NGX_INVALID_FILE;
+    c->filling = 0;
+    c->file.name.len = 0;
 
-        c->file.aio->data = r;
-        c->file.aio->handler = ngx_http_cache_aio_event_handler;
+    if (ngx_http_file_cache_name(r, c->file_cache->path) != NGX_OK) {
+        return NGX_ERROR;
+    }
 
-        r->main->blocked++;
-        r->aio = 1;
+    return NGX_HTTP_CACHE_SCARCE;
+}
 
-        return NGX_AGAIN;
-    }
 
-#endif
+static ngx_int_t
+ngx_http_file_cache_fill_send(ngx_http_request_t *r)
+{
+    ngx_int_t          rc;
+    ngx_http_cache_t  *c;
 
-#if (NGX_THREADS)
+    c = r->cache;
 
-    if (clcf->aio == NGX_HTTP_AIO_THREADS) {
-        c->file.thread_task = c->thread_task;
-        c->file.thread_handler = ngx_http_cache_thread_handler;
-        c->file.thread_ctx = r;
+    c->fill_buf = ngx_calloc_buf(r->pool);
+    if (c->fill_buf == NULL) {
+        return NGX_HTTP_INTERNAL_SERVER_ERROR;
+    }
 
-        n = ngx_thread_read(&c->file, c->buf->pos, c->body_start, 0, r->pool);
+    c->fill_buf->file = ngx_pcalloc(r->pool, sizeof(ngx_file_t));
+    if (c->fill_buf->file == NULL) {
+        return NGX_HTTP_INTERNAL_SERVER_ERROR;
+    }
 
-        c->thread_task = c->file.thread_task;
-        c->reading = (n == NGX_AGAIN);
+    /* the file length is not known yet */
 
-        return n;
+    r->allow_ranges = 0;
+
+    rc = ngx_http_send_header(r);
+
+    if (rc == NGX_ERROR || rc > NGX_OK || r->header_only) {
+        return rc;
     }
 
-#endif
+    c->wait_event.handler = ngx_http_file_cache_fill_handler;
+    c->wait_event.data = r;
+    c->wait_event.log = r->connection->log;
 
-    return ngx_read_file(&c->file, c->buf->pos, c->body_start, 0);
-}
+    r->write_event_handler = ngx_http_file_cache_fill_writer;
 
+    return ngx_http_file_cache_fill_tail(r, c);
+}
 
-#if (NGX_HAVE_FILE_AIO)
 
-static void
-ngx_http_cache_aio_event_handler(ngx_event_t *ev)
+/*
+ * sends the part of the file written since the last call; returns NGX_DONE
+ * if the request is suspended until the file grows or the client accepts
+ * more data, and the final result otherwise
+ */
+
+static ngx_int_t
+ngx_http_file_cache_fill_tail(ngx_http_request_t *r, ngx_http_cache_t *c)
 {
-    ngx_event_aio_t     *aio;
-    ngx_connection_t    *c;
-    ngx_http_request_t  *r;
+    off_t                        size;
+    ngx_int_t                    rc;
+    ngx_buf_t                   *b;
+    ngx_uint_t                   done, complete;
+    ngx_chain_t                  out;
+    ngx_event_t                 *wev;
+    ngx_file_info_t              fi;
+    ngx_http_file_cache_t       *cache;
+    ngx_http_file_cache_fill_t  *fill;
+    ngx_http_core_loc_conf_t    *clcf;
 
-    aio = ev->data;
-    r = aio->data;
-    c = r->connection;
+    cache = c->file_cache;
+    wev = r->connection->write;
 
-    ngx_http_set_log_request(c->log, r);
+    if (c->waiting) {
+        if (c->wait_event.timer_set) {
+            ngx_del_timer(&c->wait_event);
+        }
 
-    ngx_log_debug2(NGX_LOG_DEBUG_HTTP, c->log, 0,
-                   "http file cache aio: \"%V?%V\"", &r->uri, &r->args);
+        ngx_http_file_cache_wait_delete(c);
+        c->waiting = 0;
+    }
 
-    r->main->blocked--;
-    r->aio = 0;
+    for ( ;; ) {
 
-    r->write_event_handler(r);
+        if (r->buffered || r->postponed || r->connection->buffered) {
 
-    ngx_http_run_posted_requests(c);
-}
+            rc = ngx_http_output_filter(r, NULL);
 
-#endif
+            if (rc == NGX_ERROR) {
+                return NGX_ERROR;
+            }
 
+            if (r->buffered || r->postponed || r->connection->buffered) {
+                clcf = ngx_http_get_module_loc_conf(r, ngx_http_core_module);
 
-#if (NGX_THREADS)
+                if (!wev->delayed) {
+                    ngx_add_timer(wev, clcf->send_timeout);
+                }
 
-static ngx_int_t
-ngx_http_cache_thread_handler(ngx_thread_task_t *task, ngx_file_t *file)
-{
-    ngx_str_t                  name;
-    ngx_thread_pool_t         *tp;
-    ngx_http_request_t        *r;
-    ngx_http_core_loc_conf_t  *clcf;
+                if (ngx_handle_write_event(wev, clcf->send_lowat) != NGX_OK) {
+                    return NGX_ERROR;
+                }
 
-    r = file->thread_ctx;
+                return NGX_DONE;
+            }
+        }
 
-    clcf = ngx_http_get_module_loc_conf(r, ngx_http_core_module);
-    tp = clcf->thread_pool;
+        /* keep the timer of a delayed (rate limited) connection */
 
-    if (tp == NULL) {
-        if (ngx_http_complex_value(r, clcf->thread_pool_value, &name)
-            != NGX_OK)
+        if (wev->timer_set && !wev->delayed) {
+            ngx_del_timer(wev);
+        }
+
+        done = 0;
+        complete = 0;
+
+        ngx_shmtx_lock(&cache->shpool->mutex);
+
+        fill = c->node->fill;
+
+        if (fill
+            && fill->name.len == c->file.name.len
+            && ngx_strncmp(fill->name.data, c->file.name.data,
+                           fill->name.len)
+               == 0)
         {
-            return NGX_ERROR;
+            size = fill->size;
+
+            if (size == c->length) {
+                c->node->waiting = 1;
+            }
+
+        } else {
+            size = c->length;
+            done = 1;
+            complete = (c->node->exists && c->node->uniq == c->uniq);
         }
 
-        tp = ngx_thread_pool_get((ngx_cycle_t *) ngx_cycle, &name);
+        ngx_shmtx_unlock(&cache->shpool->mutex);
 
-        if (tp == NULL) {
-            ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
-                          "thread pool \"%V\" not found", &name);
-            return NGX_ERROR;
+        if (!done && size == c->length) {
+
+            /* a file abandoned without its fill being freed */
+
+            if (ngx_fd_info(c->file.fd, &fi) == NGX_FILE_ERROR) {
+                ngx_log_error(NGX_LOG_CRIT, r->connection->log, ngx_errno,
+                              ngx_fd_info_n " \"%s\" failed",
+                              c->file.name.data);
+                return NGX_ERROR;
+            }
+
+            if (ngx_file_nlink(&fi) == 0) {
+                ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
+                              "cache file \"%s\" was not completed",
+                              c->file.name.data);
+                return NGX_ERROR;
+            }
+
+            c->waiting = 1;
+            ngx_http_file_cache_wait_add(c);
+
+            ngx_add_timer(&c->wait_event, 500);
+
+            return NGX_DONE;
         }
-    }
 
-    task->event.data = r;
-    task->event.handler = ngx_http_cache_thread_event_handler;
+        if (done) {
+            if (!complete) {
+                ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
+                              "cache file \"%s\" was not completed",
+                              c->file.name.data);
+                return NGX_ERROR;
+            }
 
-    if (ngx_thread_task_post(tp, task) != NGX_OK) {
-        return NGX_ERROR;
-    }
+            if (ngx_fd_info(c->file.fd, &fi) == NGX_FILE_ERROR) {
+                ngx_log_error(NGX_LOG_CRIT, r->connection->log, ngx_errno,
+                              ngx_fd_info_n " \"%s\" failed",
+                              c->file.name.data);
+                return NGX_ERROR;
+            }
 
-    r->main->blocked++;
-    r->aio = 1;
+            size = ngx_file_size(&fi);
+        }
 
-    return NGX_OK;
+        ngx_log_debug3(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                       "http file cache fill send: %O-%O d:%ui",
+                       c->length, size, done);
+
+        /* the previous part has been completely sent, reuse its buffer */
+
+        b = c->fill_buf;
+
+        b->file_pos = c->length;
+        b->file_last = size;
+
+        b->in_file = (size > c->length) ? 1 : 0;
+        b->last_buf = done;
+        b->last_in_chain = 1;
+        b->flush = done ? 0 : 1;
+
+        b->file->fd = c->file.fd;
+        b->file->name = c->file.name;
+        b->file->log = r->connection->log;
+
+        c->length = size;
+
+        out.buf = b;
+        out.next = NULL;
+
+        rc = ngx_http_output_filter(r, &out);
+
+        if (done || rc == NGX_ERROR) {
+            return rc;
+        }
+    }
 }
 
 
 static void
-ngx_http_cache_thread_event_handler(ngx_event_t *ev)
+ngx_http_file_cache_fill_handler(ngx_event_t *ev)
 {
+    ngx_int_t            rc;
     ngx_connection_t    *c;
     ngx_http_request_t  *r;
 
@@ -798,1378 +1084,3024 @@ ngx_http_cache_thread_event_handler(ngx_event_t *ev)
     ngx_http_set_log_request(c->log, r);
 
     ngx_log_debug2(NGX_LOG_DEBUG_HTTP, c->log, 0,
-                   "http file cache thread: \"%V?%V\"", &r->uri, &r->args);
+                   "http file cache fill: \"%V?%V\"", &r->uri, &r->args);
 
-    r->main->blocked--;
-    r->aio = 0;
+    rc = ngx_http_file_cache_fill_tail(r, r->cache);
 
-    r->write_event_handler(r);
+    if (rc != NGX_DONE) {
+        r->write_event_handler = ngx_http_request_empty_handler;
+        ngx_http_finalize_request(r, rc);
+    }
 
     ngx_http_run_posted_requests(c);
 }
 
-#endif
-
 
-static ngx_int_t
-ngx_http_file_cache_exists(ngx_http_file_cache_t *cache, ngx_http_cache_t *c)
+static void
+ngx_http_file_cache_fill_writer(ngx_http_request_t *r)
 {
-    ngx_int_t                    rc;
-    ngx_http_file_cache_node_t  *fcn;
+    ngx_int_t                  rc;
+    ngx_event_t               *wev;
+    ngx_http_core_loc_conf_t  *clcf;
 
-    ngx_shmtx_lock(&cache->shpool->mutex);
+    wev = r->connection->write;
 
-    fcn = c->node;
+    ngx_log_debug2(NGX_LOG_DEBUG_HTTP, wev->log, 0,
+                   "http file cache fill writer: \"%V?%V\"",
+                   &r->uri, &r->args);
 
-    if (fcn == NULL) {
-        fcn = ngx_http_file_cache_lookup(cache, c->key);
+    if (wev->timedout) {
+        if (!wev->delayed) {
+            ngx_log_error(NGX_LOG_INFO, r->connection->log, NGX_ETIMEDOUT,
+                          "client timed out");
+            r->connection->timedout = 1;
+
+            ngx_http_finalize_request(r, NGX_HTTP_REQUEST_TIME_OUT);
+            return;
+        }
+
+        wev->timedout = 0;
+        wev->delayed = 0;
     }
 
-    if (fcn) {
-        ngx_queue_remove(&fcn->queue);
+    if (wev->delayed || r->aio) {
+        clcf = ngx_http_get_module_loc_conf(r, ngx_http_core_module);
 
-        if (c->node == NULL) {
-            fcn->uses++;
-            fcn->count++;
+        if (ngx_handle_write_event(wev, clcf->send_lowat) != NGX_OK) {
+            ngx_http_finalize_request(r, NGX_ERROR);
         }
 
-        if (fcn->error) {
+        return;
+    }
 
-            if (fcn->valid_sec < ngx_time()) {
-                goto renew;
-            }
+    rc = ngx_http_file_cache_fill_tail(r, r->cache);
 
-            rc = NGX_OK;
+    if (rc != NGX_DONE) {
+        r->write_event_handler = ngx_http_request_empty_handler;
+        ngx_http_finalize_request(r, rc);
+    }
+}
 
-            goto done;
-        }
 
-        if (fcn->exists || fcn->uses >= c->min_uses) {
+void
+ngx_http_file_cache_fill(ngx_http_request_t *r, ngx_temp_file_t *tf)
+{
+    ngx_uint_t                   waiting;
+    ngx_http_cache_t            *c;
+    ngx_http_file_cache_t       *cache;
+    ngx_http_file_cache_fill_t  *fill;
+    ngx_http_file_cache_node_t  *fcn;
 
-            c->exists = fcn->exists;
-            if (fcn->body_start) {
-                c->body_start = fcn->body_start;
-            }
+    c = r->cache;
 
-            rc = NGX_OK;
+    if (!c->lock || !c->updating || c->updated
+        || tf->file.fd == NGX_INVALID_FILE
+        || tf->offset < (off_t) c->body_start)
+    {
+        return;
+    }
 
-            goto done;
-        }
+    cache = c->file_cache;
+    waiting = 0;
 
-        rc = NGX_AGAIN;
+    ngx_shmtx_lock(&cache->shpool->mutex);
 
+    fcn = c->node;
+
+    if (fcn->lock_time != c->lock_time) {
+        /* the lock has expired and has been taken by another request */
         goto done;
     }
 
-    fcn = ngx_slab_calloc_locked(cache->shpool,
-                                 sizeof(ngx_http_file_cache_node_t));
-    if (fcn == NULL) {
-        ngx_http_file_cache_set_watermark(cache);
-
-        ngx_shmtx_unlock(&cache->shpool->mutex);
-
-        (void) ngx_http_file_cache_forced_expire(cache);
+    fill = fcn->fill;
 
-        ngx_shmtx_lock(&cache->shpool->mutex);
+    if (fill
+        && (fill->name.len != tf->file.name.len
+            || ngx_strncmp(fill->name.data, tf->file.name.data,
+                           tf->file.name.len)
+               != 0))
+    {
+        /* left by a request whose lock has expired */
 
-        fcn = ngx_slab_calloc_locked(cache->shpool,
-                                     sizeof(ngx_http_file_cache_node_t));
-        if (fcn == NULL) {
-            ngx_log_error(NGX_LOG_ALERT, ngx_cycle->log, 0,
-                          "could not allocate node%s", cache->shpool->log_ctx);
-            rc = NGX_ERROR;
-            goto failed;
-        }
+        ngx_http_file_cache_fill_free_locked(cache, fcn, NULL);
+        fill = NULL;
     }
 
-    cache->sh->count++;
+    if (fill == NULL) {
+        fill = ngx_slab_alloc_locked(cache->shpool,
+                                     sizeof(ngx_http_file_cache_fill_t)
+                                     + tf->file.name.len + 1);
+        if (fill == NULL) {
+            goto done;
+        }
 
-    ngx_memcpy((u_char *) &fcn->node.key, c->key, sizeof(ngx_rbtree_key_t));
+        fill->size = 0;
+        fill->body_start = c->body_start;
+        fill->name.len = tf->file.name.len;
+        fill->name.data = (u_char *) fill + sizeof(ngx_http_file_cache_fill_t);
 
-    ngx_memcpy(fcn->key, &c->key[sizeof(ngx_rbtree_key_t)],
-               NGX_HTTP_CACHE_KEY_LEN - sizeof(ngx_rbtree_key_t));
+        ngx_memcpy(fill->name.data, tf->file.name.data, tf->file.name.len + 1);
 
-    ngx_rbtree_insert(&cache->sh->rbtree, &fcn->node);
+        fcn->fill = fill;
+    }
 
-    fcn->uses = 1;
-    fcn->count = 1;
+    if (fill->size != tf->offset) {
+        fill->size = tf->offset;
 
-renew:
+        waiting = fcn->waiting;
+        fcn->waiting = 0;
+    }
 
-    rc = NGX_DECLINED;
+done:
 
-    fcn->valid_msec = 0;
-    fcn->error = 0;
-    fcn->exists = 0;
-    fcn->valid_sec = 0;
-    fcn->uniq = 0;
-    fcn->body_start = 0;
-    fcn->fs_size = 0;
+    ngx_shmtx_unlock(&cache->shpool->mutex);
 
-done:
+    if (waiting) {
+        ngx_http_file_cache_wakeup(fcn);
+    }
+}
 
-    fcn->expire = ngx_time() + cache->inactive;
 
-    ngx_queue_insert_head(&cache->sh->queue, &fcn->queue);
+static void
+ngx_http_file_cache_fill_free_locked(ngx_http_file_cache_t *cache,
+    ngx_http_file_cache_node_t *fcn, ngx_str_t *name)
+{
+    ngx_http_file_cache_fill_t  *fill;
 
-    c->uniq = fcn->uniq;
-    c->error = fcn->error;
-    c->node = fcn;
+    fill = fcn->fill;
 
-failed:
+    if (fill == NULL) {
+        return;
+    }
 
-    ngx_shmtx_unlock(&cache->shpool->mutex);
+    if (name
+        && (fill->name.len != name->len
+            || ngx_strncmp(fill->name.data, name->data, name->len) != 0))
+    {
+        return;
+    }
 
-    return rc;
+    ngx_slab_free_locked(cache->shpool, fill);
+    fcn->fill = NULL;
 }
 
 
 static ngx_int_t
-ngx_http_file_cache_name(ngx_http_request_t *r, ngx_path_t *path)
+ngx_http_file_cache_read(ngx_http_request_t *r, ngx_http_cache_t *c)
 {
-    u_char            *p;
-    ngx_http_cache_t  *c;
+    u_char                        *p;
+    time_t                         now;
+    ssize_t                        n;
+    ngx_str_t                     *key;
+    ngx_int_t                      rc;
+    ngx_uint_t                     i;
+    ngx_http_file_cache_t         *cache;
+    ngx_http_file_cache_header_t  *h;
 
-    c = r->cache;
+    n = ngx_http_file_cache_aio_read(r, c);
 
-    if (c->file.name.len) {
-        return NGX_OK;
+    if (n < 0) {
+        return n;
     }
 
-    c->file.name.len = path->name.len + 1 + path->len
-                       + 2 * NGX_HTTP_CACHE_KEY_LEN;
-
-    c->file.name.data = ngx_pnalloc(r->pool, c->file.name.len + 1);
-    if (c->file.name.data == NULL) {
-        return NGX_ERROR;
+    if ((size_t) n < c->header_start) {
+        ngx_log_error(NGX_LOG_CRIT, r->connection->log, 0,
+                      "cache file \"%s\" is too small", c->file.name.data);
+        return NGX_DECLINED;
     }
 
-    ngx_memcpy(c->file.name.data, path->name.data, path->name.len);
-
-    p = c->file.name.data + path->name.len + 1 + path->len;
-    p = ngx_hex_dump(p, c->key, NGX_HTTP_CACHE_KEY_LEN);
-    *p = '\0';
+    h = (ngx_http_file_cache_header_t *) c->buf->pos;
 
-    ngx_create_hashed_filename(path, c->file.name.data, c->file.name.len);
+    if (h->version != NGX_HTTP_CACHE_VERSION) {
+        ngx_log_error(NGX_LOG_INFO, r->connection->log, 0,
+                      "cache file \"%s\" version mismatch", c->file.name.data);
+        return NGX_DECLINED;
+    }
 
-    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
-                   "cache file: \"%s\"", c->file.name.data);
+    if (h->crc32 != c->crc32 || h->header_start != c->header_start) {
+        ngx_log_error(NGX_LOG_CRIT, r->connection->log, 0,
+                      "cache file \"%s\" has md5 collision", c->file.name.data);
+        return NGX_DECLINED;
+    }
+
+    p = c->buf->pos + sizeof(ngx_http_file_cache_header_t)
+        + sizeof(ngx_http_file_cache_key);
+
+    key = c->keys.elts;
+    for (i = 0; i < c->keys.nelts; i++) {
+        if (ngx_memcmp(p, key[i].data, key[i].len) != 0) {
+            ngx_log_error(NGX_LOG_CRIT, r->connection->log, 0,
+                          "cache file \"%s\" has md5 collision",
+                          c->file.name.data);
+            return NGX_DECLINED;
+        }
+
+        p += key[i].len;
+    }
+
+    if ((size_t) h->body_start > c->body_start) {
+        ngx_log_error(NGX_LOG_CRIT, r->connection->log, 0,
+                      "cache file \"%s\" has too long header",
+                      c->file.name.data);
+        return NGX_DECLINED;
+    }
+
+    if (h->vary_len > NGX_HTTP_CACHE_VARY_LEN) {
+        ngx_log_error(NGX_LOG_CRIT, r->connection->log, 0,
+                      "cache file \"%s\" has incorrect vary length",
+                      c->file.name.data);
+        return NGX_DECLINED;
+    }
+
+    if (h->vary_len) {
+        ngx_http_file_cache_vary(r, h->vary, h->vary_len, c->variant);
+
+        if (ngx_memcmp(c->variant, h->variant, NGX_HTTP_CACHE_KEY_LEN) != 0) {
+            ngx_log_debug0(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                           "http file cache vary mismatch");
+            return ngx_http_file_cache_reopen(r, c);
+        }
+    }
+
+    c->buf->last += n;
+
+    c->valid_sec = h->valid_sec;
+    c->last_modified = h->last_modified;
+    c->date = h->date;
+    c->valid_msec = h->valid_msec;
+    c->body_start = h->body_start;
+    c->etag.len = h->etag_len;
+    c->etag.data = h->etag;
+
+    r->cached = 1;
+
+    cache = c->file_cache;
+
+    if (cache->sh->cold && !c->filling) {
+
+        ngx_shmtx_lock(&cache->shpool->mutex);
+
+        if (!c->node->exists) {
+            c->node->uses = 1;
+            c->node->body_start = c->body_start;
+            c->node->exists = 1;
+            c->node->uniq = c->uniq;
+            c->node->fs_size = c->fs_size;
+
+            cache->sh->size += c->fs_size;
+            cache->sh->partition[c->node->partition].size += c->fs_size;
+        }
+
+        ngx_shmtx_unlock(&cache->shpool->mutex);
+    }
+
+    now = ngx_time();
+
+    if (c->valid_sec < now) {
+        c->stale_updating = c->valid_sec + c->updating_sec >= now;
+        c->stale_error = c->valid_sec + c->error_sec >= now;
+
+        ngx_shmtx_lock(&cache->shpool->mutex);
+
+        if (c->node->updating) {
+            rc = NGX_HTTP_CACHE_UPDATING;
+
+        } else {
+            c->node->updating = 1;
+            c->updating = 1;
+            c->lock_time = c->node->lock_time;
+            rc = NGX_HTTP_CACHE_STALE;
+        }
+
+        ngx_shmtx_unlock(&cache->shpool->mutex);
+
+        ngx_log_debug3(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                       "http file cache expired: %i %T %T",
+                       rc, c->valid_sec, now);
+
+        return rc;
+    }
 
     return NGX_OK;
 }
 
 
-static ngx_http_file_cache_node_t *
-ngx_http_file_cache_lookup(ngx_http_file_cache_t *cache, u_char *key)
+static ssize_t
+ngx_http_file_cache_aio_read(ngx_http_request_t *r, ngx_http_cache_t *c)
 {
-    ngx_int_t                    rc;
-    ngx_rbtree_key_t             node_key;
-    ngx_rbtree_node_t           *node, *sentinel;
-    ngx_http_file_cache_node_t  *fcn;
+#if (NGX_HAVE_FILE_AIO || NGX_THREADS)
+    ssize_t                    n;
+    ngx_http_core_loc_conf_t  *clcf;
 
-    ngx_memcpy((u_char *) &node_key, key, sizeof(ngx_rbtree_key_t));
+    clcf = ngx_http_get_module_loc_conf(r, ngx_http_core_module);
+#endif
 
-    node = cache->sh->rbtree.root;
-    sentinel = cache->sh->rbtree.sentinel;
+#if (NGX_HAVE_FILE_AIO)
 
-    while (node != sentinel) {
+    if (clcf->aio == NGX_HTTP_AIO_ON && ngx_file_aio) {
+        n = ngx_file_aio_read(&c->file, c->buf->pos, c->body_start, 0, r->pool);
 
-        if (node_key < node->key) {
-            node = node->left;
-            continue;
+        if (n != NGX_AGAIN) {
+            c->reading = 0;
+            return n;
         }
 
-        if (node_key > node->key) {
-            node = node->right;
-            continue;
+        c->reading = 1;
+
+        c->file.aio->data = r;
+        c->file.aio->handler = ngx_http_cache_aio_event_handler;
+
+        r->main->blocked++;
+        r->aio = 1;
+
+        return NGX_AGAIN;
+    }
+
+#endif
+
+#if (NGX_THREADS)
+
+    if (clcf->aio == NGX_HTTP_AIO_THREADS) {
+        c->file.thread_task = c->thread_task;
+        c->file.thread_handler = ngx_http_cache_thread_handler;
+        c->file.thread_ctx = r;
+
+        n = ngx_thread_read(&c->file, c->buf->pos, c->body_start, 0, r->pool);
+
+        c->thread_task = c->file.thread_task;
+        c->reading = (n == NGX_AGAIN);
+
+        return n;
+    }
+
+#endif
+
+    return ngx_read_file(&c->file, c->buf->pos, c->body_start, 0);
+}
+
+
+#if (NGX_HAVE_FILE_AIO)
+
+static void
+ngx_http_cache_aio_event_handler(ngx_event_t *ev)
+{
+    ngx_event_aio_t     *aio;
+    ngx_connection_t    *c;
+    ngx_http_request_t  *r;
+
+    aio = ev->data;
+    r = aio->data;
+    c = r->connection;
+
+    ngx_http_set_log_request(c->log, r);
+
+    ngx_log_debug2(NGX_LOG_DEBUG_HTTP, c->log, 0,
+                   "http file cache aio: \"%V?%V\"", &r->uri, &r->args);
+
+    r->main->blocked--;
+    r->aio = 0;
+
+    r->write_event_handler(r);
+
+    ngx_http_run_posted_requests(c);
+}
+
+#endif
+
+
+#if (NGX_THREADS)
+
+static ngx_int_t
+ngx_http_cache_thread_handler(ngx_thread_task_t *task, ngx_file_t *file)
+{
+    ngx_str_t                  name;
+    ngx_thread_pool_t         *tp;
+    ngx_http_request_t        *r;
+    ngx_http_core_loc_conf_t  *clcf;
+
+    r = file->thread_ctx;
+
+    clcf = ngx_http_get_module_loc_conf(r, ngx_http_core_module);
+    tp = clcf->thread_pool;
+
+    if (tp == NULL) {
+        if (ngx_http_complex_value(r, clcf->thread_pool_value, &name)
+            != NGX_OK)
+        {
+            return NGX_ERROR;
         }
 
-        /* node_key == node->key */
+        tp = ngx_thread_pool_get((ngx_cycle_t *) ngx_cycle, &name);
 
-        fcn = (ngx_http_file_cache_node_t *) node;
+        if (tp == NULL) {
+            ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
+                          "thread pool \"%V\" not found", &name);
+            return NGX_ERROR;
+        }
+    }
+
+    task->event.data = r;
+    task->event.handler = ngx_http_cache_thread_event_handler;
+
+    if (ngx_thread_task_post(tp, task) != NGX_OK) {
+        return NGX_ERROR;
+    }
+
+    r->main->blocked++;
+    r->aio = 1;
+
+    return NGX_OK;
+}
+
+
+static void
+ngx_http_cache_thread_event_handler(ngx_event_t *ev)
+{
+    ngx_connection_t    *c;
+    ngx_http_request_t  *r;
+
+    r = ev->data;
+    c = r->connection;
+
+    ngx_http_set_log_request(c->log, r);
+
+    ngx_log_debug2(NGX_LOG_DEBUG_HTTP, c->log, 0,
+                   "http file cache thread: \"%V?%V\"", &r->uri, &r->args);
+
+    r->main->blocked--;
+    r->aio = 0;
+
+    r->write_event_handler(r);
+
+    ngx_http_run_posted_requests(c);
+}
+
+#endif
+
+
+static ngx_int_t
+ngx_http_file_cache_exists(ngx_http_file_cache_t *cache, ngx_http_cache_t *c)
+{
+    ngx_int_t                         rc;
+    ngx_uint_t                        n, hit;
+    ngx_http_file_cache_node_t       *fcn;
+    ngx_http_file_cache_partition_t  *part;
+
+    ngx_shmtx_lock(&cache->shpool->mutex);
+
+    n = ngx_http_file_cache_partition(cache, c);
+
+    hit = 0;
+    fcn = c->node;
+
+    if (fcn == NULL) {
+        fcn = ngx_http_file_cache_lookup(cache, c->key);
+
+        if (cache->sh->sketch) {
+            (void) ngx_http_file_cache_sketch(cache, c->key, 1);
+        }
+    }
+
+    if (fcn) {
+        ngx_http_file_cache_dequeue(cache, fcn);
+
+        if (c->partition.len && fcn->partition != n) {
+            part = cache->sh->partition;
+
+            if (fcn->exists) {
+                part[fcn->partition].size -= fcn->fs_size;
+                part[n].size += fcn->fs_size;
+            }
+
+            part[fcn->partition].count--;
+            part[n].count++;
+
+            fcn->partition = n;
+        }
+
+        hit = (c->node == NULL && fcn->exists);
+
+        if (c->node == NULL) {
+            fcn->uses++;
+            fcn->count++;
+        }
+
+        if (fcn->error) {
+
+            if (fcn->valid_sec < ngx_time()) {
+                goto renew;
+            }
+
+            rc = NGX_OK;
+
+            goto done;
+        }
+
+        if (fcn->exists
+            || (fcn->uses >= c->min_uses
+                && ngx_http_file_cache_admit(cache, c, fcn->partition)))
+        {
+
+            c->exists = fcn->exists;
+            if (fcn->body_start) {
+                c->body_start = fcn->body_start;
+            }
+
+            rc = NGX_OK;
+
+            goto done;
+        }
+
+        rc = NGX_AGAIN;
+
+        goto done;
+    }
+
+    fcn = ngx_slab_calloc_locked(cache->shpool,
+                                 sizeof(ngx_http_file_cache_node_t));
+    if (fcn == NULL) {
+        ngx_http_file_cache_set_watermark(cache);
+
+        ngx_shmtx_unlock(&cache->shpool->mutex);
+
+        (void) ngx_http_file_cache_forced_expire(cache);
+
+        ngx_shmtx_lock(&cache->shpool->mutex);
+
+        fcn = ngx_slab_calloc_locked(cache->shpool,
+                                     sizeof(ngx_http_file_cache_node_t));
+        if (fcn == NULL) {
+            ngx_log_error(NGX_LOG_ALERT, ngx_cycle->log, 0,
+                          "could not allocate node%s", cache->shpool->log_ctx);
+            rc = NGX_ERROR;
+            goto failed;
+        }
+    }
+
+    cache->sh->count++;
+    cache->sh->partition[n].count++;
+
+    ngx_memcpy((u_char *) &fcn->node.key, c->key, sizeof(ngx_rbtree_key_t));
+
+    ngx_memcpy(fcn->key, &c->key[sizeof(ngx_rbtree_key_t)],
+               NGX_HTTP_CACHE_KEY_LEN - sizeof(ngx_rbtree_key_t));
+
+    ngx_rbtree_insert(&cache->sh->rbtree, &fcn->node);
+
+    fcn->uses = 1;
+    fcn->count = 1;
+    fcn->partition = n;
+
+renew:
+
+    rc = NGX_DECLINED;
+
+    fcn->valid_msec = 0;
+    fcn->error = 0;
+    fcn->exists = 0;
+    fcn->valid_sec = 0;
+    fcn->uniq = 0;
+    fcn->body_start = 0;
+    fcn->fs_size = 0;
+
+    if (!ngx_http_file_cache_admit(cache, c, fcn->partition)) {
+        rc = NGX_AGAIN;
+    }
+
+done:
+
+    fcn->expire = ngx_time() + cache->inactive;
+
+    ngx_http_file_cache_enqueue(cache, fcn,
+                                hit
+                                && cache->policy != NGX_HTTP_CACHE_POLICY_LRU);
+
+    c->uniq = fcn->uniq;
+    c->error = fcn->error;
+    c->node = fcn;
+
+failed:
+
+    ngx_shmtx_unlock(&cache->shpool->mutex);
+
+    return rc;
+}
+
+
+static ngx_int_t
+ngx_http_file_cache_name(ngx_http_request_t *r, ngx_path_t *path)
+{
+    u_char            *p;
+    ngx_http_cache_t  *c;
+
+    c = r->cache;
+
+    if (c->file.name.len) {
+        return NGX_OK;
+    }
+
+    c->file.name.len = path->name.len + 1 + path->len
+                       + 2 * NGX_HTTP_CACHE_KEY_LEN;
+
+    c->file.name.data = ngx_pnalloc(r->pool, c->file.name.len + 1);
+    if (c->file.name.data == NULL) {
+        return NGX_ERROR;
+    }
+
+    ngx_memcpy(c->file.name.data, path->name.data, path->name.len);
+
+    p = c->file.name.data + path->name.len + 1 + path->len;
+    p = ngx_hex_dump(p, c->key, NGX_HTTP_CACHE_KEY_LEN);
+    *p = '\0';
+
+    ngx_create_hashed_filename(path, c->file.name.data, c->file.name.len);
+
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                   "cache file: \"%s\"", c->file.name.data);
+
+    return NGX_OK;
+}
+
+
+static ngx_http_file_cache_node_t *
+ngx_http_file_cache_lookup(ngx_http_file_cache_t *cache, u_char *key)
+{
+    ngx_int_t                    rc;
+    ngx_rbtree_key_t             node_key;
+    ngx_rbtree_node_t           *node, *sentinel;
+    ngx_http_file_cache_node_t  *fcn;
+
+    ngx_memcpy((u_char *) &node_key, key, sizeof(ngx_rbtree_key_t));
+
+    node = cache->sh->rbtree.root;
+    sentinel = cache->sh->rbtree.sentinel;
+
+    while (node != sentinel) {
+
+        if (node_key < node->key) {
+            node = node->left;
+            continue;
+        }
+
+        if (node_key > node->key) {
+            node = node->right;
+            continue;
+        }
+
+        /* node_key == node->key */
+
+        fcn = (ngx_http_file_cache_node_t *) node;
+
+        rc = ngx_memcmp(&key[sizeof(ngx_rbtree_key_t)], fcn->key,
+                        NGX_HTTP_CACHE_KEY_LEN - sizeof(ngx_rbtree_key_t));
+
+        if (rc == 0) {
+            return fcn;
+        }
+
+        node = (rc < 0) ? node->left : node->right;
+    }
+
+    /* not found */
+
+    return NULL;
+}
+
+
+static void
+ngx_http_file_cache_rbtree_insert_value(ngx_rbtree_node_t *temp,
+    ngx_rbtree_node_t *node, ngx_rbtree_node_t *sentinel)
+{
+    ngx_rbtree_node_t           **p;
+    ngx_http_file_cache_node_t   *cn, *cnt;
+
+    for ( ;; ) {
+
+        if (node->key < temp->key) {
+
+            p = &temp->left;
+
+        } else if (node->key > temp->key) {
+
+            p = &temp->right;
+
+        } else { /* node->key == temp->key */
+
+            cn = (ngx_http_file_cache_node_t *) node;
+            cnt = (ngx_http_file_cache_node_t *) temp;
+
+            p = (ngx_memcmp(cn->key, cnt->key,
+                            NGX_HTTP_CACHE_KEY_LEN - sizeof(ngx_rbtree_key_t))
+                 < 0)
+                    ? &temp->left : &temp->right;
+        }
+
+        if (*p == sentinel) {
+            break;
+        }
+
+        temp = *p;
+    }
+
+    *p = node;
+    node->parent = temp;
+    node->left = sentinel;
+    node->right = sentinel;
+    ngx_rbt_red(node);
+}
+
+
+static void
+ngx_http_file_cache_vary(ngx_http_request_t *r, u_char *vary, size_t len,
+    u_char *hash)
+{
+    u_char     *p, *last;
+    ngx_str_t   name;
+    ngx_md5_t   md5;
+    u_char      buf[NGX_HTTP_CACHE_VARY_LEN];
+
+    ngx_log_debug2(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                   "http file cache vary: \"%*s\"", len, vary);
+
+    ngx_md5_init(&md5);
+    ngx_md5_update(&md5, r->cache->main, NGX_HTTP_CACHE_KEY_LEN);
+
+    ngx_strlow(buf, vary, len);
+
+    p = buf;
+    last = buf + len;
+
+    while (p < last) {
+
+        while (p < last && (*p == ' ' || *p == ',')) { p++; }
+
+        name.data = p;
+
+        while (p < last && *p != ',' && *p != ' ') { p++; }
+
+        name.len = p - name.data;
+
+        if (name.len == 0) {
+            break;
+        }
+
+        ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                       "http file cache vary: %V", &name);
+
+        ngx_md5_update(&md5, name.data, name.len);
+        ngx_md5_update(&md5, (u_char *) ":", sizeof(":") - 1);
+
+        ngx_http_file_cache_vary_header(r, &md5, &name);
+
+        ngx_md5_update(&md5, (u_char *) CRLF, sizeof(CRLF) - 1);
+    }
+
+    ngx_md5_final(hash, &md5);
+}
+
+
+static void
+ngx_http_file_cache_vary_header(ngx_http_request_t *r, ngx_md5_t *md5,
+    ngx_str_t *name)
+{
+    size_t            len;
+    u_char           *p, *start, *last;
+    ngx_uint_t        i, multiple, normalize;
+    ngx_list_part_t  *part;
+    ngx_table_elt_t  *header;
+
+    multiple = 0;
+    normalize = 0;
+
+    if (name->len == sizeof("Accept-Charset") - 1
+        && ngx_strncasecmp(name->data, (u_char *) "Accept-Charset",
+                           sizeof("Accept-Charset") - 1) == 0)
+    {
+        normalize = 1;
+
+    } else if (name->len == sizeof("Accept-Encoding") - 1
+        && ngx_strncasecmp(name->data, (u_char *) "Accept-Encoding",
+                           sizeof("Accept-Encoding") - 1) == 0)
+    {
+        normalize = 1;
+
+    } else if (name->len == sizeof("Accept-Language") - 1
+        && ngx_strncasecmp(name->data, (u_char *) "Accept-Language",
+                           sizeof("Accept-Language") - 1) == 0)
+    {
+        normalize = 1;
+    }
+
+    part = &r->headers_in.headers.part;
+    header = part->elts;
+
+    for (i = 0; /* void */ ; i++) {
+
+        if (i >= part->nelts) {
+            if (part->next == NULL) {
+                break;
+            }
+
+            part = part->next;
+            header = part->elts;
+            i = 0;
+        }
+
+        if (header[i].hash == 0) {
+            continue;
+        }
+
+        if (header[i].key.len != name->len) {
+            continue;
+        }
+
+        if (ngx_strncasecmp(header[i].key.data, name->data, name->len) != 0) {
+            continue;
+        }
+
+        if (!normalize) {
+
+            if (multiple) {
+                ngx_md5_update(md5, (u_char *) ",", sizeof(",") - 1);
+            }
+
+            ngx_md5_update(md5, header[i].value.data, header[i].value.len);
+
+            multiple = 1;
+
+            continue;
+        }
+
+        /* normalize spaces */
+
+        p = header[i].value.data;
+        last = p + header[i].value.len;
+
+        while (p < last) {
+
+            while (p < last && (*p == ' ' || *p == ',')) { p++; }
+
+            start = p;
+
+            while (p < last && *p != ',' && *p != ' ') { p++; }
+
+            len = p - start;
+
+            if (len == 0) {
+                break;
+            }
+
+            if (multiple) {
+                ngx_md5_update(md5, (u_char *) ",", sizeof(",") - 1);
+            }
+
+            ngx_md5_update(md5, start, len);
+
+            multiple = 1;
+        }
+    }
+}
+
+
+static ngx_int_t
+ngx_http_file_cache_reopen(ngx_http_request_t *r, ngx_http_cache_t *c)
+{
+    ngx_http_file_cache_t  *cache;
+
+    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, c->file.log, 0,
+                   "http file cache reopen");
+
+    if (c->secondary) {
+        ngx_log_error(NGX_LOG_CRIT, r->connection->log, 0,
+                      "cache file \"%s\" has incorrect vary hash",
+                      c->file.name.data);
+        return NGX_DECLINED;
+    }
+
+    cache = c->file_cache;
+
+    ngx_shmtx_lock(&cache->shpool->mutex);
+
+    c->node->count--;
+    c->node = NULL;
+
+    ngx_shmtx_unlock(&cache->shpool->mutex);
+
+    c->secondary = 1;
+    c->filling = 0;
+    c->file.name.len = 0;
+    c->body_start = c->buf->end - c->buf->start;
+
+    ngx_memcpy(c->key, c->variant, NGX_HTTP_CACHE_KEY_LEN);
+
+    return ngx_http_file_cache_open(r);
+}
+
+
+ngx_int_t
+ngx_http_file_cache_set_header(ngx_http_request_t *r, u_char *buf)
+{
+    ngx_http_file_cache_header_t  *h = (ngx_http_file_cache_header_t *) buf;
+
+    u_char            *p;
+    ngx_str_t         *key;
+    ngx_uint_t         i;
+    ngx_http_cache_t  *c;
+
+    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                   "http file cache set header");
+
+    c = r->cache;
+
+    ngx_memzero(h, sizeof(ngx_http_file_cache_header_t));
+
+    h->version = NGX_HTTP_CACHE_VERSION;
+    h->valid_sec = c->valid_sec;
+    h->last_modified = c->last_modified;
+    h->date = c->date;
+    h->crc32 = c->crc32;
+    h->valid_msec = (u_short) c->valid_msec;
+    h->header_start = (u_short) c->header_start;
+    h->body_start = (u_short) c->body_start;
+
+    if (c->etag.len <= NGX_HTTP_CACHE_ETAG_LEN) {
+        h->etag_len = (u_char) c->etag.len;
+        ngx_memcpy(h->etag, c->etag.data, c->etag.len);
+    }
+
+    if (c->vary.len) {
+        if (c->vary.len > NGX_HTTP_CACHE_VARY_LEN) {
+            /* should not happen */
+            c->vary.len = NGX_HTTP_CACHE_VARY_LEN;
+        }
+
+        h->vary_len = (u_char) c->vary.len;
+        ngx_memcpy(h->vary, c->vary.data, c->vary.len);
+
+        ngx_http_file_cache_vary(r, c->vary.data, c->vary.len, c->variant);
+        ngx_memcpy(h->variant, c->variant, NGX_HTTP_CACHE_KEY_LEN);
+    }
+
+    if (ngx_http_file_cache_update_variant(r, c) != NGX_OK) {
+        return NGX_ERROR;
+    }
+
+    p = buf + sizeof(ngx_http_file_cache_header_t);
+
+    p = ngx_cpymem(p, ngx_http_file_cache_key, sizeof(ngx_http_file_cache_key));
+
+    key = c->keys.elts;
+    for (i = 0; i < c->keys.nelts; i++) {
+        p = ngx_copy(p, key[i].data, key[i].len);
+    }
+
+    *p = LF;
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_http_file_cache_update_variant(ngx_http_request_t *r, ngx_http_cache_t *c)
+{
+    ngx_uint_t                   waiting;
+    ngx_http_file_cache_t       *cache;
+    ngx_http_file_cache_node_t  *fcn;
+
+    if (!c->secondary) {
+        return NGX_OK;
+    }
+
+    if (c->vary.len
+        && ngx_memcmp(c->variant, c->key, NGX_HTTP_CACHE_KEY_LEN) == 0)
+    {
+        return NGX_OK;
+    }
+
+    /*
+     * if the variant hash doesn't match one we used as a secondary
+     * cache key, switch back to the original key
+     */
+
+    cache = c->file_cache;
+
+    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                   "http file cache main key");
+
+    ngx_shmtx_lock(&cache->shpool->mutex);
+
+    fcn = c->node;
+    fcn->count--;
+    fcn->updating = 0;
+
+    waiting = fcn->waiting;
+    fcn->waiting = 0;
+
+    c->node = NULL;
+
+    ngx_shmtx_unlock(&cache->shpool->mutex);
+
+    if (waiting) {
+        ngx_http_file_cache_wakeup(fcn);
+    }
+
+    c->file.name.len = 0;
+
+    ngx_memcpy(c->key, c->main, NGX_HTTP_CACHE_KEY_LEN);
+
+    if (ngx_http_file_cache_exists(cache, c) == NGX_ERROR) {
+        return NGX_ERROR;
+    }
+
+    if (ngx_http_file_cache_name(r, cache->path) != NGX_OK) {
+        return NGX_ERROR;
+    }
+
+    return NGX_OK;
+}
+
+
+void
+ngx_http_file_cache_update(ngx_http_request_t *r, ngx_temp_file_t *tf)
+{
+    off_t                   fs_size;
+    ngx_int_t               rc;
+    ngx_uint_t              waiting;
+    ngx_file_uniq_t         uniq;
+    ngx_file_info_t         fi;
+    ngx_http_cache_t        *c;
+    ngx_ext_rename_file_t   ext;
+    ngx_http_file_cache_t  *cache;
+
+    c = r->cache;
+
+    if (c->updated) {
+        return;
+    }
+
+    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                   "http file cache update");
+
+    cache = c->file_cache;
+
+    c->updated = 1;
+    c->updating = 0;
+
+    uniq = 0;
+    fs_size = 0;
+
+    ngx_log_debug2(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                   "http file cache rename: \"%s\" to \"%s\"",
+                   tf->file.name.data, c->file.name.data);
+
+    ext.access = NGX_FILE_OWNER_ACCESS;
+    ext.path_access = NGX_FILE_OWNER_ACCESS;
+    ext.time = -1;
+    ext.create_path = 1;
+    ext.delete_file = 1;
+    ext.log = r->connection->log;
+
+    rc = ngx_ext_rename_file(&tf->file.name, &c->file.name, &ext);
+
+    if (rc == NGX_OK) {
+
+        if (ngx_fd_info(tf->file.fd, &fi) == NGX_FILE_ERROR) {
+            ngx_log_error(NGX_LOG_CRIT, r->connection->log, ngx_errno,
+                          ngx_fd_info_n " \"%s\" failed", tf->file.name.data);
+
+            rc = NGX_ERROR;
+
+        } else {
+            uniq = ngx_file_uniq(&fi);
+            fs_size = (ngx_file_fs_size(&fi) + cache->bsize - 1) / cache->bsize;
+        }
+    }
+
+    ngx_shmtx_lock(&cache->shpool->mutex);
+
+    c->node->count--;
+    c->node->uniq = uniq;
+    c->node->body_start = c->body_start;
+
+    cache->sh->size += fs_size - c->node->fs_size;
+    cache->sh->partition[c->node->partition].size += fs_size
+                                                     - c->node->fs_size;
+    c->node->fs_size = fs_size;
+
+    if (rc == NGX_OK) {
+        c->node->exists = 1;
+    }
+
+    ngx_http_file_cache_fill_free_locked(cache, c->node, &tf->file.name);
+
+    c->node->updating = 0;
+
+    waiting = c->node->waiting;
+    c->node->waiting = 0;
+
+    ngx_shmtx_unlock(&cache->shpool->mutex);
+
+    if (waiting) {
+        ngx_http_file_cache_wakeup(c->node);
+    }
+}
+
+
+void
+ngx_http_file_cache_update_header(ngx_http_request_t *r)
+{
+    ssize_t                        n;
+    ngx_err_t                      err;
+    ngx_file_t                     file;
+    ngx_file_info_t                fi;
+    ngx_http_cache_t              *c;
+    ngx_http_file_cache_header_t   h;
+
+    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                   "http file cache update header");
+
+    c = r->cache;
+
+    ngx_memzero(&file, sizeof(ngx_file_t));
+
+    file.name = c->file.name;
+    file.log = r->connection->log;
+    file.fd = ngx_open_file(file.name.data, NGX_FILE_RDWR, NGX_FILE_OPEN, 0);
+
+    if (file.fd == NGX_INVALID_FILE) {
+        err = ngx_errno;
+
+        /* cache file may have been deleted */
+
+        if (err == NGX_ENOENT) {
+            ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                           "http file cache \"%s\" not found",
+                           file.name.data);
+            return;
+        }
+
+        ngx_log_error(NGX_LOG_CRIT, r->connection->log, err,
+                      ngx_open_file_n " \"%s\" failed", file.name.data);
+        return;
+    }
+
+    /*
+     * make sure cache file wasn't replaced;
+     * if it was, do nothing
+     */
+
+    if (ngx_fd_info(file.fd, &fi) == NGX_FILE_ERROR) {
+        ngx_log_error(NGX_LOG_CRIT, r->connection->log, ngx_errno,
+                      ngx_fd_info_n " \"%s\" failed", file.name.data);
+        goto done;
+    }
+
+    if (c->uniq != ngx_file_uniq(&fi)
+        || c->length != ngx_file_size(&fi))
+    {
+        ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                       "http file cache \"%s\" changed",
+                       file.name.data);
+        goto done;
+    }
+
+    n = ngx_read_file(&file, (u_char *) &h,
+                      sizeof(ngx_http_file_cache_header_t), 0);
+
+    if (n == NGX_ERROR) {
+        goto done;
+    }
+
+    if ((size_t) n != sizeof(ngx_http_file_cache_header_t)) {
+        ngx_log_error(NGX_LOG_CRIT, r->connection->log, 0,
+                      ngx_read_file_n " read only %z of %z from \"%s\"",
+                      n, sizeof(ngx_http_file_cache_header_t), file.name.data);
+        goto done;
+    }
+
+    if (h.version != NGX_HTTP_CACHE_VERSION
+        || h.last_modified != c->last_modified
+        || h.crc32 != c->crc32
+        || h.header_start != c->header_start
+        || h.body_start != c->body_start)
+    {
+        ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                       "http file cache \"%s\" content changed",
+                       file.name.data);
+        goto done;
+    }
+
+    /*
+     * update cache file header with new data,
+     * notably h.valid_sec and h.date
+     */
+
+    ngx_memzero(&h, sizeof(ngx_http_file_cache_header_t));
+
+    h.version = NGX_HTTP_CACHE_VERSION;
+    h.valid_sec = c->valid_sec;
+    h.last_modified = c->last_modified;
+    h.date = c->date;
+    h.crc32 = c->crc32;
+    h.valid_msec = (u_short) c->valid_msec;
+    h.header_start = (u_short) c->header_start;
+    h.body_start = (u_short) c->body_start;
+
+    if (c->etag.len <= NGX_HTTP_CACHE_ETAG_LEN) {
+        h.etag_len = (u_char) c->etag.len;
+        ngx_memcpy(h.etag, c->etag.data, c->etag.len);
+    }
+
+    if (c->vary.len) {
+        if (c->vary.len > NGX_HTTP_CACHE_VARY_LEN) {
+            /* should not happen */
+            c->vary.len = NGX_HTTP_CACHE_VARY_LEN;
+        }
+
+        h.vary_len = (u_char) c->vary.len;
+        ngx_memcpy(h.vary, c->vary.data, c->vary.len);
+
+        ngx_http_file_cache_vary(r, c->vary.data, c->vary.len, c->variant);
+        ngx_memcpy(h.variant, c->variant, NGX_HTTP_CACHE_KEY_LEN);
+    }
+
+    (void) ngx_write_file(&file, (u_char *) &h,
+                          sizeof(ngx_http_file_cache_header_t), 0);
+
+done:
+
+    if (ngx_close_file(file.fd) == NGX_FILE_ERROR) {
+        ngx_log_error(NGX_LOG_ALERT, r->connection->log, ngx_errno,
+                      ngx_close_file_n " \"%s\" failed", file.name.data);
+    }
+}
+
+
+ngx_int_t
+ngx_http_cache_send(ngx_http_request_t *r)
+{
+    ngx_int_t          rc;
+    ngx_buf_t         *b;
+    ngx_chain_t        out;
+    ngx_http_cache_t  *c;
+
+    c = r->cache;
+
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                   "http file cache send: %s", c->file.name.data);
+
+    if (c->filling) {
+        return ngx_http_file_cache_fill_send(r);
+    }
+
+    if (r != r->main && c->length - c->body_start == 0) {
+        return ngx_http_send_header(r);
+    }
+
+    /* we need to allocate all before the header would be sent */
+
+    b = ngx_pcalloc(r->pool, sizeof(ngx_buf_t));
+    if (b == NULL) {
+        return NGX_HTTP_INTERNAL_SERVER_ERROR;
+    }
+
+    b->file = ngx_pcalloc(r->pool, sizeof(ngx_file_t));
+    if (b->file == NULL) {
+        return NGX_HTTP_INTERNAL_SERVER_ERROR;
+    }
+
+    rc = ngx_http_send_header(r);
+
+    if (rc == NGX_ERROR || rc > NGX_OK || r->header_only) {
+        return rc;
+    }
+
+    b->file_pos = c->body_start;
+    b->file_last = c->length;
+
+    b->in_file = (c->length - c->body_start) ? 1: 0;
+    b->last_buf = (r == r->main) ? 1: 0;
+    b->last_in_chain = 1;
+
+    b->file->fd = c->file.fd;
+    b->file->name = c->file.name;
+    b->file->log = r->connection->log;
+
+    out.buf = b;
+    out.next = NULL;
+
+    return ngx_http_output_filter(r, &out);
+}
+
+
+void
+ngx_http_file_cache_free(ngx_http_cache_t *c, ngx_temp_file_t *tf)
+{
+    ngx_uint_t                   waiting;
+    ngx_http_file_cache_t       *cache;
+    ngx_http_file_cache_node_t  *fcn;
+
+    if (c->updated || c->node == NULL) {
+        return;
+    }
+
+    cache = c->file_cache;
+
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, c->file.log, 0,
+                   "http file cache free, fd: %d", c->file.fd);
+
+    ngx_shmtx_lock(&cache->shpool->mutex);
+
+    fcn = c->node;
+    fcn->count--;
+
+    waiting = 0;
+
+    if (c->updating && fcn->lock_time == c->lock_time) {
+        fcn->updating = 0;
+
+        ngx_http_file_cache_fill_free_locked(cache, fcn, NULL);
+
+        waiting = fcn->waiting;
+        fcn->waiting = 0;
+
+    } else if (tf && fcn->fill) {
+
+        /* the lock has expired, but the fill may still be of this file */
+
+        ngx_http_file_cache_fill_free_locked(cache, fcn, &tf->file.name);
+
+        if (fcn->fill == NULL) {
+            waiting = fcn->waiting;
+            fcn->waiting = 0;
+        }
+    }
+
+    if (c->error) {
+        fcn->error = c->error;
+
+        if (c->valid_sec) {
+            fcn->valid_sec = c->valid_sec;
+            fcn->valid_msec = c->valid_msec;
+        }
+
+    } else if (!fcn->exists && fcn->count == 0 && c->min_uses == 1) {
+        ngx_http_file_cache_remove(cache, fcn);
+        c->node = NULL;
+    }
+
+    ngx_shmtx_unlock(&cache->shpool->mutex);
+
+    c->updated = 1;
+    c->updating = 0;
+
+    if (waiting) {
+        ngx_http_file_cache_wakeup(fcn);
+    }
+
+    if (c->temp_file) {
+        if (tf && tf->file.fd != NGX_INVALID_FILE) {
+            ngx_log_debug1(NGX_LOG_DEBUG_HTTP, c->file.log, 0,
+                           "http file cache incomplete: \"%s\"",
+                           tf->file.name.data);
+
+            if (ngx_delete_file(tf->file.name.data) == NGX_FILE_ERROR) {
+                ngx_log_error(NGX_LOG_CRIT, c->file.log, ngx_errno,
+                              ngx_delete_file_n " \"%s\" failed",
+                              tf->file.name.data);
+            }
+        }
+    }
+
+    if (c->wait_event.timer_set) {
+        ngx_del_timer(&c->wait_event);
+    }
+
+    if (c->waiting) {
+        c->waiting = 0;
+        ngx_http_file_cache_wait_delete(c);
+    }
+}
+
+
+static void
+ngx_http_file_cache_cleanup(void *data)
+{
+    ngx_http_cache_t  *c = data;
+
+    if (c->updated) {
+        return;
+    }
+
+    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, c->file.log, 0,
+                   "http file cache cleanup");
+
+    if (c->updating) {
+        ngx_log_error(NGX_LOG_ALERT, c->file.log, 0,
+                      "stalled cache updating, error:%ui", c->error);
+    }
+
+    ngx_http_file_cache_free(c, NULL);
+}
+
+
+/*
+ * gets the partition of a request, taking a free one (or an empty one)
+ * if its key has none; requests without key, or whose key does not fit,
+ * go to the partition 0
+ */
+
+static ngx_uint_t
+ngx_http_file_cache_partition(ngx_http_file_cache_t *cache,
+    ngx_http_cache_t *c)
+{
+    size_t                            len;
+    uint32_t                          hash;
+    ngx_uint_t                        i, n, free;
+    ngx_http_file_cache_partition_t  *part;
+
+    if (cache->partitions == 0 || c->partition.len == 0) {
+        return 0;
+    }
+
+    hash = ngx_crc32_short(c->partition.data, c->partition.len);
+    len = ngx_min(c->partition.len, NGX_HTTP_CACHE_PARTITION_LEN);
+    free = 0;
+
+    for (i = 0; i < cache->partitions; i++) {
+        n = 1 + (hash + i) % cache->partitions;
+        part = &cache->sh->partition[n];
+
+        if (part->len == 0) {
+            if (free == 0) {
+                free = n;
+            }
+
+            break;
+        }
+
+        if (part->hash == hash && part->len == c->partition.len
+            && ngx_memcmp(part->name, c->partition.data, len) == 0)
+        {
+            goto found;
+        }
+
+        if (free == 0 && part->count == 0) {
+            free = n;
+        }
+    }
+
+    if (free == 0) {
+        return 0;
+    }
+
+    n = free;
+    part = &cache->sh->partition[n];
+
+    part->size = 0;
+    part->hash = hash;
+    part->len = c->partition.len;
+    ngx_memcpy(part->name, c->partition.data, len);
+
+found:
+
+    part->max_size = c->partition_max_size / cache->bsize;
+
+    return n;
+}
+
+
+/*
+ * the partition to evict from: the one most over its max_size, or,
+ * unless only those are asked, the largest one
+ */
+
+static ngx_http_file_cache_partition_t *
+ngx_http_file_cache_victim(ngx_http_file_cache_t *cache, ngx_uint_t over)
+{
+    off_t                             excess, size;
+    ngx_uint_t                        n;
+    ngx_http_file_cache_partition_t  *part, *victim;
+
+    victim = NULL;
+    excess = 0;
+
+    for (n = 0; n <= cache->partitions; n++) {
+        part = &cache->sh->partition[n];
+
+        if (part->max_size && part->size - part->max_size > excess
+            && part->count)
+        {
+            excess = part->size - part->max_size;
+            victim = part;
+        }
+    }
+
+    if (victim || over) {
+        return victim;
+    }
+
+    size = -1;
+
+    for (n = 0; n <= cache->partitions; n++) {
+        part = &cache->sh->partition[n];
+
+        if (part->size > size && part->count) {
+            size = part->size;
+            victim = part;
+        }
+    }
+
+    return victim;
+}
+
+
+static void
+ngx_http_file_cache_enqueue(ngx_http_file_cache_t *cache,
+    ngx_http_file_cache_node_t *fcn, ngx_uint_t protect)
+{
+    ngx_queue_t                      *q;
+    ngx_http_file_cache_node_t       *last;
+    ngx_http_file_cache_partition_t  *part;
+
+    part = &cache->sh->partition[fcn->partition];
+
+    if (!protect) {
+        ngx_queue_insert_head(&part->queue, &fcn->queue);
+        return;
+    }
+
+    fcn->protected = 1;
+    part->nprotected++;
+    ngx_queue_insert_head(&part->protected, &fcn->queue);
+
+    /* the protected queue holds up to 80% of the nodes of the partition */
+
+    while (part->nprotected > part->count - part->count / 5) {
+        q = ngx_queue_last(&part->protected);
+        last = ngx_queue_data(q, ngx_http_file_cache_node_t, queue);
+
+        ngx_queue_remove(q);
+        last->protected = 0;
+        part->nprotected--;
+
+        ngx_queue_insert_head(&part->queue, q);
+    }
+}
+
+
+static void
+ngx_http_file_cache_dequeue(ngx_http_file_cache_t *cache,
+    ngx_http_file_cache_node_t *fcn)
+{
+    ngx_queue_remove(&fcn->queue);
+
+    if (fcn->protected) {
+        fcn->protected = 0;
+        cache->sh->partition[fcn->partition].nprotected--;
+    }
+}
+
+
+/* frees a node, with the zone mutex held */
+
+static void
+ngx_http_file_cache_remove(ngx_http_file_cache_t *cache,
+    ngx_http_file_cache_node_t *fcn)
+{
+    ngx_http_file_cache_partition_t  *part;
+
+    part = &cache->sh->partition[fcn->partition];
+    part->count--;
+
+    ngx_http_file_cache_dequeue(cache, fcn);
+    ngx_rbtree_delete(&cache->sh->rbtree, &fcn->node);
+    ngx_slab_free_locked(cache->shpool, fcn);
+    cache->sh->count--;
+}
+
+
+/*
+ * count-min sketch of the keys requested: NGX_HTTP_CACHE_SKETCH_DEPTH rows
+ * of 4-bit saturating counters, each row indexed by its own 32 bits of the
+ * md5 key; the counters are halved every 10 increments per column, so the
+ * sketch estimates the recent frequency of a key
+ */
+
+static ngx_uint_t
+ngx_http_file_cache_sketch(ngx_http_file_cache_t *cache, u_char *key,
+    ngx_uint_t add)
+{
+    u_char      *counter;
+    uint32_t     hash;
+    ngx_uint_t   i, min, width;
+
+    width = cache->sh->sketch_mask + 1;
+    min = NGX_HTTP_CACHE_SKETCH_MAX;
+
+    for (i = 0; i < NGX_HTTP_CACHE_SKETCH_DEPTH; i++) {
+        ngx_memcpy(&hash, &key[i * sizeof(uint32_t)], sizeof(uint32_t));
+
+        counter = &cache->sh->sketch[i * width
+                                     + (hash & cache->sh->sketch_mask)];
+
+        if (add && *counter < NGX_HTTP_CACHE_SKETCH_MAX) {
+            (*counter)++;
+        }
+
+        if (*counter < min) {
+            min = *counter;
+        }
+    }
+
+    if (add && ++cache->sh->sketch_adds >= 10 * width) {
+
+        for (i = 0; i < NGX_HTTP_CACHE_SKETCH_DEPTH * width; i++) {
+            cache->sh->sketch[i] >>= 1;
+        }
+
+        cache->sh->sketch_adds /= 2;
+    }
+
+    return min;
+}
+
+
+/*
+ * TinyLFU admission: once the cache (or the partition of the request)
+ * is about to evict, a new object is only cached if its key is requested
+ * more often than the one of the node that would be evicted for it
+ */
+
+static ngx_uint_t
+ngx_http_file_cache_admit(ngx_http_file_cache_t *cache, ngx_http_cache_t *c,
+    ngx_uint_t n)
+{
+    ngx_queue_t                      *queue;
+    ngx_http_file_cache_node_t       *fcn;
+    ngx_http_file_cache_partition_t  *part;
+    u_char                            key[NGX_HTTP_CACHE_KEY_LEN];
+
+    if (cache->sh->sketch == NULL || cache->sh->cold) {
+        return 1;
+    }
+
+    part = &cache->sh->partition[n];
+
+    if (part->max_size == 0 || part->size < part->max_size) {
+
+        if (cache->sh->size < cache->max_size - cache->max_size / 16
+            && cache->sh->count < cache->sh->watermark)
+        {
+            return 1;
+        }
+
+        part = ngx_http_file_cache_victim(cache, 0);
+
+        if (part == NULL) {
+            return 1;
+        }
+    }
+
+    queue = ngx_queue_empty(&part->queue) ? &part->protected : &part->queue;
+
+    if (ngx_queue_empty(queue)) {
+        return 1;
+    }
+
+    fcn = ngx_queue_data(ngx_queue_last(queue), ngx_http_file_cache_node_t,
+                         queue);
+
+    ngx_memcpy(key, &fcn->node.key, sizeof(ngx_rbtree_key_t));
+    ngx_memcpy(&key[sizeof(ngx_rbtree_key_t)], fcn->key,
+               NGX_HTTP_CACHE_KEY_LEN - sizeof(ngx_rbtree_key_t));
+
+    return ngx_http_file_cache_sketch(cache, c->key, 0)
+           > ngx_http_file_cache_sketch(cache, key, 0);
+}
+
+
+static time_t
+ngx_http_file_cache_forced_expire(ngx_http_file_cache_t *cache)
+{
+    u_char                           *name;
+    size_t                            len;
+    time_t                            wait;
+    ngx_uint_t                        tries;
+    ngx_path_t                       *path;
+    ngx_queue_t                      *q, *queue;
+    ngx_http_file_cache_node_t       *fcn;
+    ngx_http_file_cache_partition_t  *part;
+
+    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, ngx_cycle->log, 0,
+                   "http file cache forced expire");
+
+    path = cache->path;
+    len = path->name.len + 1 + path->len + 2 * NGX_HTTP_CACHE_KEY_LEN;
+
+    name = ngx_alloc(len + 1, ngx_cycle->log);
+    if (name == NULL) {
+        return 10;
+    }
+
+    ngx_memcpy(name, path->name.data, path->name.len);
+
+    wait = 10;
+    tries = 20;
+
+    ngx_shmtx_lock(&cache->shpool->mutex);
+
+    part = ngx_http_file_cache_victim(cache, 0);
+    queue = NULL;
+
+    if (part) {
+        queue = ngx_queue_empty(&part->queue) ? &part->protected
+                                              : &part->queue;
+    }
+
+    for (q = queue ? ngx_queue_last(queue) : NULL;
+         q && q != ngx_queue_sentinel(queue);
+         q = ngx_queue_prev(q))
+    {
+        fcn = ngx_queue_data(q, ngx_http_file_cache_node_t, queue);
+
+        ngx_log_debug6(NGX_LOG_DEBUG_HTTP, ngx_cycle->log, 0,
+                  "http file cache forced expire: #%d %d %02xd%02xd%02xd%02xd",
+                  fcn->count, fcn->exists,
+                  fcn->key[0], fcn->key[1], fcn->key[2], fcn->key[3]);
+
+        if (fcn->count == 0) {
+            ngx_http_file_cache_delete(cache, q, name);
+            wait = 0;
 
-        rc = ngx_memcmp(&key[sizeof(ngx_rbtree_key_t)], fcn->key,
-                        NGX_HTTP_CACHE_KEY_LEN - sizeof(ngx_rbtree_key_t));
+        } else {
+            if (--tries) {
+                continue;
+            }
 
-        if (rc == 0) {
-            return fcn;
+            wait = 1;
         }
 
-        node = (rc < 0) ? node->left : node->right;
+        break;
     }
 
-    /* not found */
+    ngx_shmtx_unlock(&cache->shpool->mutex);
 
-    return NULL;
+    ngx_free(name);
+
+    return wait;
 }
 
 
-static void
-ngx_http_file_cache_rbtree_insert_value(ngx_rbtree_node_t *temp,
-    ngx_rbtree_node_t *node, ngx_rbtree_node_t *sentinel)
+static time_t
+ngx_http_file_cache_expire(ngx_http_file_cache_t *cache)
 {
-    ngx_rbtree_node_t           **p;
-    ngx_http_file_cache_node_t   *cn, *cnt;
+    u_char      *name;
+    size_t       len;
+    time_t       now, wait, w;
+    ngx_uint_t   n;
+    ngx_path_t  *path;
 
-    for ( ;; ) {
+    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, ngx_cycle->log, 0,
+                   "http file cache expire");
 
-        if (node->key < temp->key) {
+    path = cache->path;
+    len = path->name.len + 1 + path->len + 2 * NGX_HTTP_CACHE_KEY_LEN;
 
-            p = &temp->left;
+    name = ngx_alloc(len + 1, ngx_cycle->log);
+    if (name == NULL) {
+        return 10;
+    }
 
-        } else if (node->key > temp->key) {
+    ngx_memcpy(name, path->name.data, path->name.len);
 
-            p = &temp->right;
+    now = ngx_time();
+    wait = 10;
 
-        } else { /* node->key == temp->key */
+    ngx_shmtx_lock(&cache->shpool->mutex);
 
-            cn = (ngx_http_file_cache_node_t *) node;
-            cnt = (ngx_http_file_cache_node_t *) temp;
+    for (n = 0; n <= cache->partitions; n++) {
+        w = ngx_http_file_cache_expire_queue(cache,
+                                             &cache->sh->partition[n].queue,
+                                             name, now);
+        if (w < wait) {
+            wait = w;
+        }
 
-            p = (ngx_memcmp(cn->key, cnt->key,
-                            NGX_HTTP_CACHE_KEY_LEN - sizeof(ngx_rbtree_key_t))
-                 < 0)
-                    ? &temp->left : &temp->right;
+        w = ngx_http_file_cache_expire_queue(cache,
+                                         &cache->sh->partition[n].protected,
+                                         name, now);
+        if (w < wait) {
+            wait = w;
         }
 
-        if (*p == sentinel) {
+        if (ngx_quit || ngx_terminate) {
             break;
         }
-
-        temp = *p;
     }
 
-    *p = node;
-    node->parent = temp;
-    node->left = sentinel;
-    node->right = sentinel;
-    ngx_rbt_red(node);
+    ngx_shmtx_unlock(&cache->shpool->mutex);
+
+    ngx_free(name);
+
+    return wait;
 }
 
 
-static void
-ngx_http_file_cache_vary(ngx_http_request_t *r, u_char *vary, size_t len,
-    u_char *hash)
+static time_t
+ngx_http_file_cache_expire_queue(ngx_http_file_cache_t *cache,
+    ngx_queue_t *queue, u_char *name, time_t now)
 {
-    u_char     *p, *last;
-    ngx_str_t   name;
-    ngx_md5_t   md5;
-    u_char      buf[NGX_HTTP_CACHE_VARY_LEN];
+    u_char                      *p;
+    size_t                       len;
+    time_t                       wait;
+    ngx_queue_t                 *q;
+    ngx_http_file_cache_node_t  *fcn;
+    u_char                       key[2 * NGX_HTTP_CACHE_KEY_LEN];
 
-    ngx_log_debug2(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
-                   "http file cache vary: \"%*s\"", len, vary);
+    for ( ;; ) {
 
-    ngx_md5_init(&md5);
-    ngx_md5_update(&md5, r->cache->main, NGX_HTTP_CACHE_KEY_LEN);
+        if (ngx_quit || ngx_terminate) {
+            wait = 1;
+            break;
+        }
 
-    ngx_strlow(buf, vary, len);
+        if (ngx_queue_empty(queue)) {
+            wait = 10;
+            break;
+        }
 
-    p = buf;
-    last = buf + len;
+        q = ngx_queue_last(queue);
 
-    while (p < last) {
+        fcn = ngx_queue_data(q, ngx_http_file_cache_node_t, queue);
 
-        while (p < last && (*p == ' ' || *p == ',')) { p++; }
+        wait = fcn->expire - now;
 
-        name.data = p;
+        if (wait > 0) {
+            wait = wait > 10 ? 10 : wait;
+            break;
+        }
 
-        while (p < last && *p != ',' && *p != ' ') { p++; }
+        ngx_log_debug6(NGX_LOG_DEBUG_HTTP, ngx_cycle->log, 0,
+                       "http file cache expire: #%d %d %02xd%02xd%02xd%02xd",
+                       fcn->count, fcn->exists,
+                       fcn->key[0], fcn->key[1], fcn->key[2], fcn->key[3]);
 
-        name.len = p - name.data;
+        if (fcn->count == 0) {
+            ngx_http_file_cache_delete(cache, q, name);
+            continue;
+        }
 
-        if (name.len == 0) {
+        if (fcn->deleting) {
+            wait = 1;
             break;
         }
 
-        ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
-                       "http file cache vary: %V", &name);
+        p = ngx_hex_dump(key, (u_char *) &fcn->node.key,
+                         sizeof(ngx_rbtree_key_t));
+        len = NGX_HTTP_CACHE_KEY_LEN - sizeof(ngx_rbtree_key_t);
+        (void) ngx_hex_dump(p, fcn->key, len);
 
-        ngx_md5_update(&md5, name.data, name.len);
-        ngx_md5_update(&md5, (u_char *) ":", sizeof(":") - 1);
+        /*
+         * abnormally exited workers may leave locked cache entries,
+         * and although it may be safe to remove them completely,
+         * we prefer to just move them to the top of the inactive queue
+         */
 
-        ngx_http_file_cache_vary_header(r, &md5, &name);
+        ngx_queue_remove(q);
+        fcn->expire = ngx_time() + cache->inactive;
+        ngx_queue_insert_head(queue, &fcn->queue);
 
-        ngx_md5_update(&md5, (u_char *) CRLF, sizeof(CRLF) - 1);
+        ngx_log_error(NGX_LOG_ALERT, ngx_cycle->log, 0,
+                      "ignore long locked inactive cache entry %*s, count:%d",
+                      (size_t) 2 * NGX_HTTP_CACHE_KEY_LEN, key, fcn->count);
     }
 
-    ngx_md5_final(hash, &md5);
+    return wait;
 }
 
 
 static void
-ngx_http_file_cache_vary_header(ngx_http_request_t *r, ngx_md5_t *md5,
-    ngx_str_t *name)
+ngx_http_file_cache_delete(ngx_http_file_cache_t *cache, ngx_queue_t *q,
+    u_char *name)
 {
-    size_t            len;
-    u_char           *p, *start, *last;
-    ngx_uint_t        i, multiple, normalize;
-    ngx_list_part_t  *part;
-    ngx_table_elt_t  *header;
-
-    multiple = 0;
-    normalize = 0;
-
-    if (name->len == sizeof("Accept-Charset") - 1
-        && ngx_strncasecmp(name->data, (u_char *) "Accept-Charset",
-                           sizeof("Accept-Charset") - 1) == 0)
-    {
-        normalize = 1;
-
-    } else if (name->len == sizeof("Accept-Encoding") - 1
-        && ngx_strncasecmp(name->data, (u_char *) "Accept-Encoding",
-                           sizeof("Accept-Encoding") - 1) == 0)
-    {
-        normalize = 1;
+    u_char                      *p;
+    size_t                       len;
+    ngx_path_t                  *path;
+    ngx_http_file_cache_node_t  *fcn;
 
-    } else if (name->len == sizeof("Accept-Language") - 1
-        && ngx_strncasecmp(name->data, (u_char *) "Accept-Language",
-                           sizeof("Accept-Language") - 1) == 0)
-    {
-        normalize = 1;
-    }
+    fcn = ngx_queue_data(q, ngx_http_file_cache_node_t, queue);
 
-    part = &r->headers_in.headers.part;
-    header = part->elts;
+    if (fcn->exists) {
+        cache->sh->size -= fcn->fs_size;
+        cache->sh->partition[fcn->partition].size -= fcn->fs_size;
 
-    for (i = 0; /* void */ ; i++) {
+        path = cache->path;
+        p = name + path->name.len + 1 + path->len;
+        p = ngx_hex_dump(p, (u_char *) &fcn->node.key,
+                         sizeof(ngx_rbtree_key_t));
+        len = NGX_HTTP_CACHE_KEY_LEN - sizeof(ngx_rbtree_key_t);
+        p = ngx_hex_dump(p, fcn->key, len);
+        *p = '\0';
 
-        if (i >= part->nelts) {
-            if (part->next == NULL) {
-                break;
-            }
+        fcn->count++;
+        fcn->deleting = 1;
+        ngx_shmtx_unlock(&cache->shpool->mutex);
 
-            part = part->next;
-            header = part->elts;
-            i = 0;
-        }
+        len = path->name.len + 1 + path->len + 2 * NGX_HTTP_CACHE_KEY_LEN;
+        ngx_create_hashed_filename(path, name, len);
 
-        if (header[i].hash == 0) {
-            continue;
-        }
+        ngx_log_debug1(NGX_LOG_DEBUG_HTTP, ngx_cycle->log, 0,
+                       "http file cache expire: \"%s\"", name);
 
-        if (header[i].key.len != name->len) {
-            continue;
-        }
+        /* a node loaded from a snapshot may have outlived its file */
 
-        if (ngx_strncasecmp(header[i].key.data, name->data, name->len) != 0) {
-            continue;
+        if (ngx_delete_file(name) == NGX_FILE_ERROR
+            && ngx_errno != NGX_ENOENT)
+        {
+            ngx_log_error(NGX_LOG_CRIT, ngx_cycle->log, ngx_errno,
+                          ngx_delete_file_n " \"%s\" failed", name);
         }
 
-        if (!normalize) {
-
-            if (multiple) {
-                ngx_md5_update(md5, (u_char *) ",", sizeof(",") - 1);
-            }
-
-            ngx_md5_update(md5, header[i].value.data, header[i].value.len);
+        ngx_shmtx_lock(&cache->shpool->mutex);
+        fcn->count--;
+        fcn->deleting = 0;
+    }
 
-            multiple = 1;
+    if (fcn->count == 0) {
+        ngx_http_file_cache_remove(cache, fcn);
+    }
+}
 
-            continue;
-        }
 
-        /* normalize spaces */
+static time_t
+ngx_http_file_cache_manager(void *data)
+{
+    ngx_http_file_cache_t  *cache = data;
 
-        p = header[i].value.data;
-        last = p + header[i].value.len;
+    off_t       size;
+    time_t      next, wait;
+    ngx_uint_t  count, watermark, over;
 
-        while (p < last) {
+    next = ngx_http_file_cache_expire(cache);
 
-            while (p < last && (*p == ' ' || *p == ',')) { p++; }
+    if (cache->snapshot.len) {
+        ngx_http_file_cache_snapshot(cache);
+    }
 
-            start = p;
+    cache->last = ngx_current_msec;
+    cache->files = 0;
 
-            while (p < last && *p != ',' && *p != ' ') { p++; }
+    for ( ;; ) {
+        ngx_shmtx_lock(&cache->shpool->mutex);
 
-            len = p - start;
+        size = cache->sh->size;
+        count = cache->sh->count;
+        watermark = cache->sh->watermark;
+        over = (ngx_http_file_cache_victim(cache, 1) != NULL);
 
-            if (len == 0) {
-                break;
-            }
+        ngx_shmtx_unlock(&cache->shpool->mutex);
 
-            if (multiple) {
-                ngx_md5_update(md5, (u_char *) ",", sizeof(",") - 1);
-            }
+        ngx_log_debug4(NGX_LOG_DEBUG_HTTP, ngx_cycle->log, 0,
+                       "http file cache size: %O c:%ui w:%i o:%ui",
+                       size, count, (ngx_int_t) watermark, over);
 
-            ngx_md5_update(md5, start, len);
+        if (size < cache->max_size && count < watermark && !over) {
+            return next;
+        }
 
-            multiple = 1;
+        wait = ngx_http_file_cache_forced_expire(cache);
+
+        if (wait > 0) {
+            return wait;
+        }
+
+        if (ngx_quit || ngx_terminate) {
+            return next;
         }
     }
 }
 
 
-static ngx_int_t
-ngx_http_file_cache_reopen(ngx_http_request_t *r, ngx_http_cache_t *c)
+static void
+ngx_http_file_cache_loader(void *data)
 {
-    ngx_http_file_cache_t  *cache;
+    ngx_http_file_cache_t  *cache = data;
 
-    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, c->file.log, 0,
-                   "http file cache reopen");
+    ngx_tree_ctx_t  tree;
 
-    if (c->secondary) {
-        ngx_log_error(NGX_LOG_CRIT, r->connection->log, 0,
-                      "cache file \"%s\" has incorrect vary hash",
-                      c->file.name.data);
-        return NGX_DECLINED;
+    if (!cache->sh->cold || cache->sh->loading) {
+        return;
     }
 
-    cache = c->file_cache;
+    if (!ngx_atomic_cmp_set(&cache->sh->loading, 0, ngx_pid)) {
+        return;
+    }
 
-    ngx_shmtx_lock(&cache->shpool->mutex);
+    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, ngx_cycle->log, 0,
+                   "http file cache loader");
 
-    c->node->count--;
-    c->node = NULL;
+    tree.init_handler = NULL;
+    tree.file_handler = ngx_http_file_cache_manage_file;
+    tree.pre_tree_handler = ngx_http_file_cache_manage_directory;
+    tree.post_tree_handler = ngx_http_file_cache_noop;
+    tree.spec_handler = ngx_http_file_cache_delete_file;
+    tree.data = cache;
+    tree.alloc = 0;
+    tree.log = ngx_cycle->log;
 
-    ngx_shmtx_unlock(&cache->shpool->mutex);
+    cache->last = ngx_current_msec;
+    cache->files = 0;
 
-    c->secondary = 1;
-    c->file.name.len = 0;
-    c->body_start = c->buf->end - c->buf->start;
+    if (ngx_walk_tree(&tree, &cache->path->name) == NGX_ABORT) {
+        cache->sh->loading = 0;
+        return;
+    }
 
-    ngx_memcpy(c->key, c->variant, NGX_HTTP_CACHE_KEY_LEN);
+    cache->sh->cold = 0;
+    cache->sh->loading = 0;
 
-    return ngx_http_file_cache_open(r);
+    ngx_log_error(NGX_LOG_NOTICE, ngx_cycle->log, 0,
+                  "http file cache: %V %.3fM, bsize: %uz",
+                  &cache->path->name,
+                  ((double) cache->sh->size * cache->bsize) / (1024 * 1024),
+                  cache->bsize);
 }
 
 
-ngx_int_t
-ngx_http_file_cache_set_header(ngx_http_request_t *r, u_char *buf)
+static ngx_int_t
+ngx_http_file_cache_noop(ngx_tree_ctx_t *ctx, ngx_str_t *path)
 {
-    ngx_http_file_cache_header_t  *h = (ngx_http_file_cache_header_t *) buf;
-
-    u_char            *p;
-    ngx_str_t         *key;
-    ngx_uint_t         i;
-    ngx_http_cache_t  *c;
+    return NGX_OK;
+}
 
-    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
-                   "http file cache set header");
 
-    c = r->cache;
+static ngx_int_t
+ngx_http_file_cache_manage_file(ngx_tree_ctx_t *ctx, ngx_str_t *path)
+{
+    ngx_msec_t              elapsed;
+    ngx_http_file_cache_t  *cache;
 
-    ngx_memzero(h, sizeof(ngx_http_file_cache_header_t));
+    cache = ctx->data;
 
-    h->version = NGX_HTTP_CACHE_VERSION;
-    h->valid_sec = c->valid_sec;
-    h->last_modified = c->last_modified;
-    h->date = c->date;
-    h->crc32 = c->crc32;
-    h->valid_msec = (u_short) c->valid_msec;
-    h->header_start = (u_short) c->header_start;
-    h->body_start = (u_short) c->body_start;
+    /* the files older than the snapshot loaded are indexed already */
 
-    if (c->etag.len <= NGX_HTTP_CACHE_ETAG_LEN) {
-        h->etag_len = (u_char) c->etag.len;
-        ngx_memcpy(h->etag, c->etag.data, c->etag.len);
+    if (cache->sh->snapshot_time
+        && ctx->mtime
+           < cache->sh->snapshot_time - NGX_HTTP_CACHE_SNAPSHOT_SLACK)
+    {
+        return (ngx_quit || ngx_terminate) ? NGX_ABORT : NGX_OK;
     }
 
-    if (c->vary.len) {
-        if (c->vary.len > NGX_HTTP_CACHE_VARY_LEN) {
-            /* should not happen */
-            c->vary.len = NGX_HTTP_CACHE_VARY_LEN;
-        }
-
-        h->vary_len = (u_char) c->vary.len;
-        ngx_memcpy(h->vary, c->vary.data, c->vary.len);
-
-        ngx_http_file_cache_vary(r, c->vary.data, c->vary.len, c->variant);
-        ngx_memcpy(h->variant, c->variant, NGX_HTTP_CACHE_KEY_LEN);
+    if (ngx_http_file_cache_add_file(ctx, path) != NGX_OK) {
+        (void) ngx_http_file_cache_delete_file(ctx, path);
     }
 
-    if (ngx_http_file_cache_update_variant(r, c) != NGX_OK) {
-        return NGX_ERROR;
-    }
+    if (++cache->files >= cache->loader_files) {
+        ngx_http_file_cache_loader_sleep(cache);
 
-    p = buf + sizeof(ngx_http_file_cache_header_t);
+    } else {
+        ngx_time_update();
 
-    p = ngx_cpymem(p, ngx_http_file_cache_key, sizeof(ngx_http_file_cache_key));
+        elapsed = ngx_abs((ngx_msec_int_t) (ngx_current_msec - cache->last));
 
-    key = c->keys.elts;
-    for (i = 0; i < c->keys.nelts; i++) {
-        p = ngx_copy(p, key[i].data, key[i].len);
-    }
+        ngx_log_debug1(NGX_LOG_DEBUG_HTTP, ngx_cycle->log, 0,
+                       "http file cache loader time elapsed: %M", elapsed);
 
-    *p = LF;
+        if (elapsed >= cache->loader_threshold) {
+            ngx_http_file_cache_loader_sleep(cache);
+        }
+    }
 
-    return NGX_OK;
+    return (ngx_quit || ngx_terminate) ? NGX_ABORT : NGX_OK;
 }
 
 
 static ngx_int_t
-ngx_http_file_cache_update_variant(ngx_http_request_t *r, ngx_http_cache_t *c)
+ngx_http_file_cache_manage_directory(ngx_tree_ctx_t *ctx, ngx_str_t *path)
 {
     ngx_http_file_cache_t  *cache;
 
-    if (!c->secondary) {
-        return NGX_OK;
-    }
-
-    if (c->vary.len
-        && ngx_memcmp(c->variant, c->key, NGX_HTTP_CACHE_KEY_LEN) == 0)
+    if (path->len >= 5
+        && ngx_strncmp(path->data + path->len - 5, "/temp", 5) == 0)
     {
-        return NGX_OK;
+        return NGX_DECLINED;
     }
 
+    cache = ctx->data;
+
     /*
-     * if the variant hash doesn't match one we used as a secondary
-     * cache key, switch back to the original key
+     * a last level directory not modified since the snapshot loaded
+     * holds no file to index: the snapshot has them all
      */
 
-    cache = c->file_cache;
-
-    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
-                   "http file cache main key");
-
-    ngx_shmtx_lock(&cache->shpool->mutex);
-
-    c->node->count--;
-    c->node->updating = 0;
-    c->node = NULL;
-
-    ngx_shmtx_unlock(&cache->shpool->mutex);
-
-    c->file.name.len = 0;
-
-    ngx_memcpy(c->key, c->main, NGX_HTTP_CACHE_KEY_LEN);
-
-    if (ngx_http_file_cache_exists(cache, c) == NGX_ERROR) {
-        return NGX_ERROR;
-    }
-
-    if (ngx_http_file_cache_name(r, cache->path) != NGX_OK) {
-        return NGX_ERROR;
+    if (cache->sh->snapshot_time
+        && path->len == cache->path->name.len + cache->path->len
+        && ctx->mtime
+           < cache->sh->snapshot_time - NGX_HTTP_CACHE_SNAPSHOT_SLACK)
+    {
+        return NGX_DECLINED;
     }
 
     return NGX_OK;
 }
 
 
-void
-ngx_http_file_cache_update(ngx_http_request_t *r, ngx_temp_file_t *tf)
+static void
+ngx_http_file_cache_loader_sleep(ngx_http_file_cache_t *cache)
 {
-    off_t                   fs_size;
-    ngx_int_t               rc;
-    ngx_file_uniq_t         uniq;
-    ngx_file_info_t         fi;
-    ngx_http_cache_t        *c;
-    ngx_ext_rename_file_t   ext;
-    ngx_http_file_cache_t  *cache;
-
-    c = r->cache;
-
-    if (c->updated) {
-        return;
-    }
-
-    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
-                   "http file cache update");
-
-    cache = c->file_cache;
+    ngx_msleep(cache->loader_sleep);
 
-    c->updated = 1;
-    c->updating = 0;
+    ngx_time_update();
 
-    uniq = 0;
-    fs_size = 0;
+    cache->last = ngx_current_msec;
+    cache->files = 0;
+}
 
-    ngx_log_debug2(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
-                   "http file cache rename: \"%s\" to \"%s\"",
-                   tf->file.name.data, c->file.name.data);
 
-    ext.access = NGX_FILE_OWNER_ACCESS;
-    ext.path_access = NGX_FILE_OWNER_ACCESS;
-    ext.time = -1;
-    ext.create_path = 1;
-    ext.delete_file = 1;
-    ext.log = r->connection->log;
+static ngx_int_t
+ngx_http_file_cache_add_file(ngx_tree_ctx_t *ctx, ngx_str_t *name)
+{
+    u_char                 *p;
+    ngx_int_t               n;
+    ngx_uint_t              i;
+    ngx_http_cache_t        c;
+    ngx_http_file_cache_t  *cache;
 
-    rc = ngx_ext_rename_file(&tf->file.name, &c->file.name, &ext);
+    if (name->len < 2 * NGX_HTTP_CACHE_KEY_LEN) {
+        return NGX_ERROR;
+    }
 
-    if (rc == NGX_OK) {
+    if (ctx->size < (off_t) sizeof(ngx_http_file_cache_header_t)) {
+        ngx_log_error(NGX_LOG_CRIT, ctx->log, 0,
+                      "cache file \"%s\" is too small", name->data);
+        return NGX_ERROR;
+    }
 
-        if (ngx_fd_info(tf->file.fd, &fi) == NGX_FILE_ERROR) {
-            ngx_log_error(NGX_LOG_CRIT, r->connection->log, ngx_errno,
-                          ngx_fd_info_n " \"%s\" failed", tf->file.name.data);
+    ngx_memzero(&c, sizeof(ngx_http_cache_t));
+    cache = ctx->data;
 
-            rc = NGX_ERROR;
+    c.length = ctx->size;
+    c.fs_size = (ctx->fs_size + cache->bsize - 1) / cache->bsize;
 
-        } else {
-            uniq = ngx_file_uniq(&fi);
-            fs_size = (ngx_file_fs_size(&fi) + cache->bsize - 1) / cache->bsize;
-        }
-    }
+    p = &name->data[name->len - 2 * NGX_HTTP_CACHE_KEY_LEN];
 
-    ngx_shmtx_lock(&cache->shpool->mutex);
+    for (i = 0; i < NGX_HTTP_CACHE_KEY_LEN; i++) {
+        n = ngx_hextoi(p, 2);
 
-    c->node->count--;
-    c->node->uniq = uniq;
-    c->node->body_start = c->body_start;
+        if (n == NGX_ERROR) {
+            return NGX_ERROR;
+        }
 
-    cache->sh->size += fs_size - c->node->fs_size;
-    c->node->fs_size = fs_size;
+        p += 2;
 
-    if (rc == NGX_OK) {
-        c->node->exists = 1;
+        c.key[i] = (u_char) n;
     }
 
-    c->node->updating = 0;
-
-    ngx_shmtx_unlock(&cache->shpool->mutex);
+    return ngx_http_file_cache_add(cache, &c, 1);
 }
 
 
-void
-ngx_http_file_cache_update_header(ngx_http_request_t *r)
+static ngx_int_t
+ngx_http_file_cache_add(ngx_http_file_cache_t *cache, ngx_http_cache_t *c,
+    ngx_uint_t uses)
 {
-    ssize_t                        n;
-    ngx_err_t                      err;
-    ngx_file_t                     file;
-    ngx_file_info_t                fi;
-    ngx_http_cache_t              *c;
-    ngx_http_file_cache_header_t   h;
-
-    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
-                   "http file cache update header");
+    ngx_http_file_cache_node_t  *fcn;
 
-    c = r->cache;
+    ngx_shmtx_lock(&cache->shpool->mutex);
 
-    ngx_memzero(&file, sizeof(ngx_file_t));
+    fcn = ngx_http_file_cache_lookup(cache, c->key);
 
-    file.name = c->file.name;
-    file.log = r->connection->log;
-    file.fd = ngx_open_file(file.name.data, NGX_FILE_RDWR, NGX_FILE_OPEN, 0);
+    if (fcn == NULL) {
 
-    if (file.fd == NGX_INVALID_FILE) {
-        err = ngx_errno;
+        fcn = ngx_slab_calloc_locked(cache->shpool,
+                                     sizeof(ngx_http_file_cache_node_t));
+        if (fcn == NULL) {
+            ngx_http_file_cache_set_watermark(cache);
 
-        /* cache file may have been deleted */
+            if (cache->fail_time != ngx_time()) {
+                cache->fail_time = ngx_time();
+                ngx_log_error(NGX_LOG_ALERT, ngx_cycle->log, 0,
+                           "could not allocate node%s", cache->shpool->log_ctx);
+            }
 
-        if (err == NGX_ENOENT) {
-            ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
-                           "http file cache \"%s\" not found",
-                           file.name.data);
-            return;
+            ngx_shmtx_unlock(&cache->shpool->mutex);
+            return NGX_ERROR;
         }
 
-        ngx_log_error(NGX_LOG_CRIT, r->connection->log, err,
-                      ngx_open_file_n " \"%s\" failed", file.name.data);
-        return;
-    }
+        cache->sh->count++;
 
-    /*
-     * make sure cache file wasn't replaced;
-     * if it was, do nothing
-     */
+        ngx_memcpy((u_char *) &fcn->node.key, c->key, sizeof(ngx_rbtree_key_t));
 
-    if (ngx_fd_info(file.fd, &fi) == NGX_FILE_ERROR) {
-        ngx_log_error(NGX_LOG_CRIT, r->connection->log, ngx_errno,
-                      ngx_fd_info_n " \"%s\" failed", file.name.data);
-        goto done;
-    }
+        ngx_memcpy(fcn->key, &c->key[sizeof(ngx_rbtree_key_t)],
+                   NGX_HTTP_CACHE_KEY_LEN - sizeof(ngx_rbtree_key_t));
 
-    if (c->uniq != ngx_file_uniq(&fi)
-        || c->length != ngx_file_size(&fi))
-    {
-        ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
-                       "http file cache \"%s\" changed",
-                       file.name.data);
-        goto done;
-    }
+        ngx_rbtree_insert(&cache->sh->rbtree, &fcn->node);
 
-    n = ngx_read_file(&file, (u_char *) &h,
-                      sizeof(ngx_http_file_cache_header_t), 0);
+        fcn->uses = ngx_min(uses, 1023);
+        fcn->exists = 1;
+        fcn->fs_size = c->fs_size;
 
-    if (n == NGX_ERROR) {
-        goto done;
-    }
+        cache->sh->size += c->fs_size;
+        cache->sh->partition[0].size += c->fs_size;
+        cache->sh->partition[0].count++;
 
-    if ((size_t) n != sizeof(ngx_http_file_cache_header_t)) {
-        ngx_log_error(NGX_LOG_CRIT, r->connection->log, 0,
-                      ngx_read_file_n " read only %z of %z from \"%s\"",
-                      n, sizeof(ngx_http_file_cache_header_t), file.name.data);
-        goto done;
-    }
+    } else {
+        ngx_http_file_cache_dequeue(cache, fcn);
 
-    if (h.version != NGX_HTTP_CACHE_VERSION
-        || h.last_modified != c->last_modified
-        || h.crc32 != c->crc32
-        || h.header_start != c->header_start
-        || h.body_start != c->body_start)
-    {
-        ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
-                       "http file cache \"%s\" content changed",
-                       file.name.data);
-        goto done;
+        /*
+         * e.g. a node loaded from the snapshot whose file was walked
+         * again: the size of the file on disk is the up to date one
+         */
+
+        if (fcn->exists) {
+            cache->sh->size += c->fs_size - fcn->fs_size;
+            cache->sh->partition[fcn->partition].size += c->fs_size
+                                                         - fcn->fs_size;
+            fcn->fs_size = c->fs_size;
+        }
     }
 
-    /*
-     * update cache file header with new data,
-     * notably h.valid_sec and h.date
-     */
+    fcn->expire = ngx_time() + cache->inactive;
 
-    ngx_memzero(&h, sizeof(ngx_http_file_cache_header_t));
+    ngx_http_file_cache_enqueue(cache, fcn, 0);
 
-    h.version = NGX_HTTP_CACHE_VERSION;
-    h.valid_sec = c->valid_sec;
-    h.last_modified = c->last_modified;
-    h.date = c->date;
-    h.crc32 = c->crc32;
-    h.valid_msec = (u_short) c->valid_msec;
-    h.header_start = (u_short) c->header_start;
-    h.body_start = (u_short) c->body_start;
+    ngx_shmtx_unlock(&cache->shpool->mutex);
 
-    if (c->etag.len <= NGX_HTTP_CACHE_ETAG_LEN) {
-        h.etag_len = (u_char) c->etag.len;
-        ngx_memcpy(h.etag, c->etag.data, c->etag.len);
-    }
+    return NGX_OK;
+}
 
-    if (c->vary.len) {
-        if (c->vary.len > NGX_HTTP_CACHE_VARY_LEN) {
-            /* should not happen */
-            c->vary.len = NGX_HTTP_CACHE_VARY_LEN;
-        }
 
-        h.vary_len = (u_char) c->vary.len;
-        ngx_memcpy(h.vary, c->vary.data, c->vary.len);
+static ngx_int_t
+ngx_http_file_cache_delete_file(ngx_tree_ctx_t *ctx, ngx_str_t *path)
+{
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, ctx->log, 0,
+                   "http file cache delete: \"%s\"", path->data);
 
-        ngx_http_file_cache_vary(r, c->vary.data, c->vary.len, c->variant);
-        ngx_memcpy(h.variant, c->variant, NGX_HTTP_CACHE_KEY_LEN);
+    if (ngx_delete_file(path->data) == NGX_FILE_ERROR) {
+        ngx_log_error(NGX_LOG_CRIT, ctx->log, ngx_errno,
+                      ngx_delete_file_n " \"%s\" failed", path->data);
     }
 
-    (void) ngx_write_file(&file, (u_char *) &h,
-                          sizeof(ngx_http_file_cache_header_t), 0);
-
-done:
-
-    if (ngx_close_file(file.fd) == NGX_FILE_ERROR) {
-        ngx_log_error(NGX_LOG_ALERT, r->connection->log, ngx_errno,
-                      ngx_close_file_n " \"%s\" failed", file.name.data);
-    }
+    return NGX_OK;
 }
 
 
-ngx_int_t
-ngx_http_cache_send(ngx_http_request_t *r)
+static void
+ngx_http_file_cache_set_watermark(ngx_http_file_cache_t *cache)
 {
-    ngx_int_t          rc;
-    ngx_buf_t         *b;
-    ngx_chain_t        out;
-    ngx_http_cache_t  *c;
+    cache->sh->watermark = cache->sh->count - cache->sh->count / 8;
 
-    c = r->cache;
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, ngx_cycle->log, 0,
+                   "http file cache watermark: %ui", cache->sh->watermark);
+}
 
-    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
-                   "http file cache send: %s", c->file.name.data);
 
-    if (r != r->main && c->length - c->body_start == 0) {
-        return ngx_http_send_header(r);
-    }
+/*
+ * the cache manager persists the index every snapshot_interval: the
+ * nodes are copied in key order, a batch at a time so as not to hold
+ * the zone mutex long, to a temporary file then renamed over the snapshot
+ */
 
-    /* we need to allocate all before the header would be sent */
+static void
+ngx_http_file_cache_snapshot(ngx_http_file_cache_t *cache)
+{
+    off_t                                 offset;
+    size_t                                len;
+    time_t                                now;
+    uint32_t                              crc32;
+    ngx_uint_t                            i, n, count;
+    ngx_file_t                            file;
+    ngx_rbtree_node_t                    *node;
+    ngx_http_file_cache_node_t           *fcn;
+    ngx_http_file_cache_snapshot_t        header;
+    ngx_http_file_cache_snapshot_node_t  *sn;
+    u_char                                key[NGX_HTTP_CACHE_KEY_LEN];
 
-    b = ngx_pcalloc(r->pool, sizeof(ngx_buf_t));
-    if (b == NULL) {
-        return NGX_HTTP_INTERNAL_SERVER_ERROR;
-    }
+    now = ngx_time();
 
-    b->file = ngx_pcalloc(r->pool, sizeof(ngx_file_t));
-    if (b->file == NULL) {
-        return NGX_HTTP_INTERNAL_SERVER_ERROR;
+    if (cache->sh->cold || now < cache->snapshot_next) {
+        return;
     }
 
-    rc = ngx_http_send_header(r);
+    cache->snapshot_next = now + cache->snapshot_interval;
 
-    if (rc == NGX_ERROR || rc > NGX_OK || r->header_only) {
-        return rc;
+    sn = ngx_calloc(NGX_HTTP_CACHE_WALK_BATCH
+                    * sizeof(ngx_http_file_cache_snapshot_node_t),
+                    ngx_cycle->log);
+    if (sn == NULL) {
+        return;
     }
 
-    b->file_pos = c->body_start;
-    b->file_last = c->length;
-
-    b->in_file = (c->length - c->body_start) ? 1: 0;
-    b->last_buf = (r == r->main) ? 1: 0;
-    b->last_in_chain = 1;
-
-    b->file->fd = c->file.fd;
-    b->file->name = c->file.name;
-    b->file->log = r->connection->log;
-
-    out.buf = b;
-    out.next = NULL;
-
-    return ngx_http_output_filter(r, &out);
-}
-
+    ngx_memzero(&file, sizeof(ngx_file_t));
 
-void
-ngx_http_file_cache_free(ngx_http_cache_t *c, ngx_temp_file_t *tf)
-{
-    ngx_http_file_cache_t       *cache;
-    ngx_http_file_cache_node_t  *fcn;
+    file.name = cache->snapshot_temp;
+    file.log = ngx_cycle->log;
 
-    if (c->updated || c->node == NULL) {
+    file.fd = ngx_open_file(file.name.data, NGX_FILE_WRONLY,
+                            NGX_FILE_TRUNCATE, NGX_FILE_DEFAULT_ACCESS);
+    if (file.fd == NGX_INVALID_FILE) {
+        ngx_log_error(NGX_LOG_CRIT, ngx_cycle->log, ngx_errno,
+                      ngx_open_file_n " \"%s\" failed", file.name.data);
+        ngx_free(sn);
         return;
     }
 
-    cache = c->file_cache;
+    offset = sizeof(ngx_http_file_cache_snapshot_t);
+    count = 0;
+    node = NULL;
 
-    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, c->file.log, 0,
-                   "http file cache free, fd: %d", c->file.fd);
+    ngx_crc32_init(crc32);
 
-    ngx_shmtx_lock(&cache->shpool->mutex);
+    for ( ;; ) {
+        ngx_shmtx_lock(&cache->shpool->mutex);
 
-    fcn = c->node;
-    fcn->count--;
+        node = ngx_http_file_cache_next(cache, node ? key : NULL);
 
-    if (c->updating && fcn->lock_time == c->lock_time) {
-        fcn->updating = 0;
-    }
+        for (i = 0, n = 0; node && i < NGX_HTTP_CACHE_WALK_BATCH; i++) {
+            fcn = (ngx_http_file_cache_node_t *) node;
 
-    if (c->error) {
-        fcn->error = c->error;
+            ngx_http_file_cache_node_key(fcn, key);
 
-        if (c->valid_sec) {
-            fcn->valid_sec = c->valid_sec;
-            fcn->valid_msec = c->valid_msec;
+            if (fcn->exists && !fcn->deleting) {
+                ngx_memcpy(sn[n].key, key, NGX_HTTP_CACHE_KEY_LEN);
+                sn[n].fs_size = fcn->fs_size;
+                sn[n].uses = fcn->uses;
+                n++;
+            }
+
+            node = ngx_http_file_cache_successor(node,
+                                                 cache->sh->rbtree.sentinel);
         }
 
-    } else if (!fcn->exists && fcn->count == 0 && c->min_uses == 1) {
-        ngx_queue_remove(&fcn->queue);
-        ngx_rbtree_delete(&cache->sh->rbtree, &fcn->node);
-        ngx_slab_free_locked(cache->shpool, fcn);
-        cache->sh->count--;
-        c->node = NULL;
-    }
+        ngx_shmtx_unlock(&cache->shpool->mutex);
 
-    ngx_shmtx_unlock(&cache->shpool->mutex);
+        if (n) {
+            len = n * sizeof(ngx_http_file_cache_snapshot_node_t);
 
-    c->updated = 1;
-    c->updating = 0;
+            if (ngx_write_file(&file, (u_char *) sn, len, offset)
+                == NGX_ERROR)
+            {
+                goto failed;
+            }
 
-    if (c->temp_file) {
-        if (tf && tf->file.fd != NGX_INVALID_FILE) {
-            ngx_log_debug1(NGX_LOG_DEBUG_HTTP, c->file.log, 0,
-                           "http file cache incomplete: \"%s\"",
-                           tf->file.name.data);
+            ngx_crc32_update(&crc32, (u_char *) sn, len);
 
-            if (ngx_delete_file(tf->file.name.data) == NGX_FILE_ERROR) {
-                ngx_log_error(NGX_LOG_CRIT, c->file.log, ngx_errno,
-                              ngx_delete_file_n " \"%s\" failed",
-                              tf->file.name.data);
-            }
+            offset += len;
+            count += n;
+        }
+
+        if (node == NULL) {
+            break;
+        }
+
+        if (ngx_quit || ngx_terminate) {
+            goto failed;
         }
     }
 
-    if (c->wait_event.timer_set) {
-        ngx_del_timer(&c->wait_event);
+    header = ngx_http_file_cache_snapshot_header;
+    header.time = now;
+    header.count = count;
+    header.bsize = cache->bsize;
+    ngx_memcpy(header.level, cache->path->level, 3 * sizeof(size_t));
+
+    ngx_crc32_update(&crc32, (u_char *) &header.time,
+                     sizeof(ngx_http_file_cache_snapshot_t)
+                     - offsetof(ngx_http_file_cache_snapshot_t, time));
+    ngx_crc32_final(crc32);
+
+    header.crc32 = crc32;
+
+    if (ngx_write_file(&file, (u_char *) &header,
+                       sizeof(ngx_http_file_cache_snapshot_t), 0)
+        == NGX_ERROR)
+    {
+        goto failed;
     }
-}
 
+    if (ngx_close_file(file.fd) == NGX_FILE_ERROR) {
+        ngx_log_error(NGX_LOG_ALERT, ngx_cycle->log, ngx_errno,
+                      ngx_close_file_n " \"%s\" failed", file.name.data);
+        goto delete;
+    }
 
-static void
-ngx_http_file_cache_cleanup(void *data)
-{
-    ngx_http_cache_t  *c = data;
+    if (ngx_rename_file(file.name.data, cache->snapshot.data)
+        == NGX_FILE_ERROR)
+    {
+        ngx_log_error(NGX_LOG_CRIT, ngx_cycle->log, ngx_errno,
+                      ngx_rename_file_n " \"%s\" to \"%s\" failed",
+                      file.name.data, cache->snapshot.data);
+        goto delete;
+    }
 
-    if (c->updated) {
-        return;
+    ngx_log_debug2(NGX_LOG_DEBUG_HTTP, ngx_cycle->log, 0,
+                   "http file cache snapshot: \"%V\" %ui nodes",
+                   &cache->snapshot, count);
+
+    ngx_free(sn);
+
+    return;
+
+failed:
+
+    if (ngx_close_file(file.fd) == NGX_FILE_ERROR) {
+        ngx_log_error(NGX_LOG_ALERT, ngx_cycle->log, ngx_errno,
+                      ngx_close_file_n " \"%s\" failed", file.name.data);
     }
 
-    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, c->file.log, 0,
-                   "http file cache cleanup");
+delete:
 
-    if (c->updating) {
-        ngx_log_error(NGX_LOG_ALERT, c->file.log, 0,
-                      "stalled cache updating, error:%ui", c->error);
+    if (ngx_delete_file(file.name.data) == NGX_FILE_ERROR) {
+        ngx_log_error(NGX_LOG_CRIT, ngx_cycle->log, ngx_errno,
+                      ngx_delete_file_n " \"%s\" failed", file.name.data);
     }
 
-    ngx_http_file_cache_free(c, NULL);
+    ngx_free(sn);
 }
 
 
-static time_t
-ngx_http_file_cache_forced_expire(ngx_http_file_cache_t *cache)
+/* the first node with a key greater than the given one, or the first one */
+
+static ngx_rbtree_node_t *
+ngx_http_file_cache_next(ngx_http_file_cache_t *cache, u_char *key)
 {
-    u_char                      *name;
-    size_t                       len;
-    time_t                       wait;
-    ngx_uint_t                   tries;
-    ngx_path_t                  *path;
-    ngx_queue_t                 *q;
+    ngx_int_t                    rc;
+    ngx_rbtree_key_t             node_key;
+    ngx_rbtree_node_t           *node, *next, *sentinel;
     ngx_http_file_cache_node_t  *fcn;
 
-    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, ngx_cycle->log, 0,
-                   "http file cache forced expire");
+    node = cache->sh->rbtree.root;
+    sentinel = cache->sh->rbtree.sentinel;
 
-    path = cache->path;
-    len = path->name.len + 1 + path->len + 2 * NGX_HTTP_CACHE_KEY_LEN;
+    if (node == sentinel) {
+        return NULL;
+    }
 
-    name = ngx_alloc(len + 1, ngx_cycle->log);
-    if (name == NULL) {
-        return 10;
+    if (key == NULL) {
+        return ngx_rbtree_min(node, sentinel);
     }
 
-    ngx_memcpy(name, path->name.data, path->name.len);
+    ngx_memcpy((u_char *) &node_key, key, sizeof(ngx_rbtree_key_t));
 
-    wait = 10;
-    tries = 20;
+    next = NULL;
 
-    ngx_shmtx_lock(&cache->shpool->mutex);
+    while (node != sentinel) {
 
-    for (q = ngx_queue_last(&cache->sh->queue);
-         q != ngx_queue_sentinel(&cache->sh->queue);
-         q = ngx_queue_prev(q))
-    {
-        fcn = ngx_queue_data(q, ngx_http_file_cache_node_t, queue);
+        if (node->key != node_key) {
+            rc = (node->key > node_key) ? 1 : -1;
 
-        ngx_log_debug6(NGX_LOG_DEBUG_HTTP, ngx_cycle->log, 0,
-                  "http file cache forced expire: #%d %d %02xd%02xd%02xd%02xd",
-                  fcn->count, fcn->exists,
-                  fcn->key[0], fcn->key[1], fcn->key[2], fcn->key[3]);
+        } else {
+            fcn = (ngx_http_file_cache_node_t *) node;
 
-        if (fcn->count == 0) {
-            ngx_http_file_cache_delete(cache, q, name);
-            wait = 0;
+            rc = ngx_memcmp(fcn->key, &key[sizeof(ngx_rbtree_key_t)],
+                            NGX_HTTP_CACHE_KEY_LEN - sizeof(ngx_rbtree_key_t));
+        }
 
-        } else {
-            if (--tries) {
-                continue;
-            }
+        if (rc > 0) {
+            next = node;
+            node = node->left;
 
-            wait = 1;
+        } else {
+            node = node->right;
         }
+    }
 
-        break;
+    return next;
+}
+
+
+/* the next node in key order */
+
+static ngx_rbtree_node_t *
+ngx_http_file_cache_successor(ngx_rbtree_node_t *node,
+    ngx_rbtree_node_t *sentinel)
+{
+    ngx_rbtree_node_t  *parent;
+
+    if (node->right != sentinel) {
+        return ngx_rbtree_min(node->right, sentinel);
     }
 
-    ngx_shmtx_unlock(&cache->shpool->mutex);
+    for (parent = node->parent;
+         parent && node == parent->right;
+         parent = parent->parent)
+    {
+        node = parent;
+    }
 
-    ngx_free(name);
+    return parent;
+}
 
-    return wait;
+
+static void
+ngx_http_file_cache_node_key(ngx_http_file_cache_node_t *fcn, u_char *key)
+{
+    ngx_memcpy(key, &fcn->node.key, sizeof(ngx_rbtree_key_t));
+    ngx_memcpy(&key[sizeof(ngx_rbtree_key_t)], fcn->key,
+               NGX_HTTP_CACHE_KEY_LEN - sizeof(ngx_rbtree_key_t));
 }
 
 
-static time_t
-ngx_http_file_cache_expire(ngx_http_file_cache_t *cache)
+/*
+ * a new keys zone is filled from the snapshot, if any; the cache loader
+ * then walks only the directories modified since the snapshot was taken
+ */
+
+static void
+ngx_http_file_cache_snapshot_load(ngx_http_file_cache_t *cache,
+    ngx_log_t *log)
 {
-    u_char                      *name, *p;
-    size_t                       len;
-    time_t                       now, wait;
-    ngx_path_t                  *path;
-    ngx_queue_t                 *q;
-    ngx_http_file_cache_node_t  *fcn;
-    u_char                       key[2 * NGX_HTTP_CACHE_KEY_LEN];
+    u_char                               *base;
+    size_t                                size;
+    ssize_t                               n;
+    uint32_t                              crc32;
+    ngx_uint_t                            i;
+    ngx_file_t                            file;
+    ngx_file_info_t                       fi;
+    ngx_http_cache_t                      c;
+    ngx_http_file_cache_snapshot_t       *header;
+    ngx_http_file_cache_snapshot_node_t  *sn;
 
-    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, ngx_cycle->log, 0,
-                   "http file cache expire");
+    ngx_memzero(&file, sizeof(ngx_file_t));
 
-    path = cache->path;
-    len = path->name.len + 1 + path->len + 2 * NGX_HTTP_CACHE_KEY_LEN;
+    file.name = cache->snapshot;
+    file.log = log;
 
-    name = ngx_alloc(len + 1, ngx_cycle->log);
-    if (name == NULL) {
-        return 10;
+    file.fd = ngx_open_file(cache->snapshot.data, NGX_FILE_RDONLY,
+                            NGX_FILE_OPEN, 0);
+    if (file.fd == NGX_INVALID_FILE) {
+        if (ngx_errno != NGX_ENOENT) {
+            ngx_log_error(NGX_LOG_CRIT, log, ngx_errno,
+                          ngx_open_file_n " \"%s\" failed",
+                          cache->snapshot.data);
+        }
+
+        return;
     }
 
-    ngx_memcpy(name, path->name.data, path->name.len);
+    if (ngx_fd_info(file.fd, &fi) == NGX_FILE_ERROR) {
+        ngx_log_error(NGX_LOG_CRIT, log, ngx_errno,
+                      ngx_fd_info_n " \"%s\" failed", cache->snapshot.data);
+        goto close;
+    }
 
-    now = ngx_time();
+    size = (size_t) ngx_file_size(&fi);
 
-    ngx_shmtx_lock(&cache->shpool->mutex);
+    if (size < sizeof(ngx_http_file_cache_snapshot_t)) {
+        goto invalid;
+    }
 
-    for ( ;; ) {
+    base = ngx_alloc(size, log);
+    if (base == NULL) {
+        goto close;
+    }
 
-        if (ngx_quit || ngx_terminate) {
-            wait = 1;
-            break;
-        }
+    n = ngx_read_file(&file, base, size, 0);
 
-        if (ngx_queue_empty(&cache->sh->queue)) {
-            wait = 10;
-            break;
-        }
+    if (n == NGX_ERROR) {
+        goto free;
+    }
 
-        q = ngx_queue_last(&cache->sh->queue);
+    if ((size_t) n != size) {
+        ngx_log_error(NGX_LOG_CRIT, log, 0,
+                      ngx_read_file_n " read only %z of %uz from \"%s\"",
+                      n, size, cache->snapshot.data);
+        goto free;
+    }
 
-        fcn = ngx_queue_data(q, ngx_http_file_cache_node_t, queue);
+    header = (ngx_http_file_cache_snapshot_t *) base;
+    sn = (ngx_http_file_cache_snapshot_node_t *)
+             (base + sizeof(ngx_http_file_cache_snapshot_t));
 
-        wait = fcn->expire - now;
+    size -= sizeof(ngx_http_file_cache_snapshot_t);
 
-        if (wait > 0) {
-            wait = wait > 10 ? 10 : wait;
-            break;
-        }
+    if (ngx_memcmp(header, &ngx_http_file_cache_snapshot_header, 12) != 0
+        || header->count != size / sizeof(ngx_http_file_cache_snapshot_node_t)
+        || size % sizeof(ngx_http_file_cache_snapshot_node_t)
+        || header->bsize != cache->bsize
+        || ngx_memcmp(header->level, cache->path->level, 3 * sizeof(size_t))
+        || header->time > ngx_time())
+    {
+        ngx_log_error(NGX_LOG_WARN, log, 0,
+                      "incompatible cache snapshot \"%s\"",
+                      cache->snapshot.data);
+        goto free;
+    }
 
-        ngx_log_debug6(NGX_LOG_DEBUG_HTTP, ngx_cycle->log, 0,
-                       "http file cache expire: #%d %d %02xd%02xd%02xd%02xd",
-                       fcn->count, fcn->exists,
-                       fcn->key[0], fcn->key[1], fcn->key[2], fcn->key[3]);
+    ngx_crc32_init(crc32);
+    ngx_crc32_update(&crc32, (u_char *) sn, size);
+    ngx_crc32_update(&crc32, (u_char *) &header->time,
+                     sizeof(ngx_http_file_cache_snapshot_t)
+                     - offsetof(ngx_http_file_cache_snapshot_t, time));
+    ngx_crc32_final(crc32);
+
+    if (crc32 != header->crc32) {
+        ngx_log_error(NGX_LOG_ALERT, log, 0,
+                      "CRC32 mismatch in cache snapshot \"%s\"",
+                      cache->snapshot.data);
+        goto free;
+    }
 
-        if (fcn->count == 0) {
-            ngx_http_file_cache_delete(cache, q, name);
-            continue;
-        }
+    ngx_memzero(&c, sizeof(ngx_http_cache_t));
 
-        if (fcn->deleting) {
-            wait = 1;
+    for (i = 0; i < header->count; i++) {
+        ngx_memcpy(c.key, sn[i].key, NGX_HTTP_CACHE_KEY_LEN);
+        c.fs_size = sn[i].fs_size;
+
+        if (ngx_http_file_cache_add(cache, &c, sn[i].uses) != NGX_OK) {
             break;
         }
+    }
 
-        p = ngx_hex_dump(key, (u_char *) &fcn->node.key,
-                         sizeof(ngx_rbtree_key_t));
-        len = NGX_HTTP_CACHE_KEY_LEN - sizeof(ngx_rbtree_key_t);
-        (void) ngx_hex_dump(p, fcn->key, len);
-
-        /*
-         * abnormally exited workers may leave locked cache entries,
-         * and although it may be safe to remove them completely,
-         * we prefer to just move them to the top of the inactive queue
-         */
-
-        ngx_queue_remove(q);
-        fcn->expire = ngx_time() + cache->inactive;
-        ngx_queue_insert_head(&cache->sh->queue, &fcn->queue);
+    /* unless all the nodes were added, the whole cache is to be walked */
 
-        ngx_log_error(NGX_LOG_ALERT, ngx_cycle->log, 0,
-                      "ignore long locked inactive cache entry %*s, count:%d",
-                      (size_t) 2 * NGX_HTTP_CACHE_KEY_LEN, key, fcn->count);
+    if (i == header->count) {
+        cache->sh->snapshot_time = header->time;
     }
 
-    ngx_shmtx_unlock(&cache->shpool->mutex);
+    ngx_log_error(NGX_LOG_NOTICE, log, 0,
+                  "http file cache snapshot: \"%s\" %ui of %ui nodes",
+                  cache->snapshot.data, i, header->count);
 
-    ngx_free(name);
+free:
 
-    return wait;
-}
+    ngx_free(base);
 
+    goto close;
 
-static void
-ngx_http_file_cache_delete(ngx_http_file_cache_t *cache, ngx_queue_t *q,
-    u_char *name)
-{
-    u_char                      *p;
-    size_t                       len;
-    ngx_path_t                  *path;
-    ngx_http_file_cache_node_t  *fcn;
+invalid:
 
-    fcn = ngx_queue_data(q, ngx_http_file_cache_node_t, queue);
+    ngx_log_error(NGX_LOG_WARN, log, 0,
+                  "incompatible cache snapshot \"%s\"", cache->snapshot.data);
 
-    if (fcn->exists) {
-        cache->sh->size -= fcn->fs_size;
+close:
 
-        path = cache->path;
-        p = name + path->name.len + 1 + path->len;
-        p = ngx_hex_dump(p, (u_char *) &fcn->node.key,
-                         sizeof(ngx_rbtree_key_t));
-        len = NGX_HTTP_CACHE_KEY_LEN - sizeof(ngx_rbtree_key_t);
-        p = ngx_hex_dump(p, fcn->key, len);
-        *p = '\0';
+    if (ngx_close_file(file.fd) == NGX_FILE_ERROR) {
+        ngx_log_error(NGX_LOG_ALERT, log, ngx_errno,
+                      ngx_close_file_n " \"%s\" failed", cache->snapshot.data);
+    }
+}
 
-        fcn->count++;
-        fcn->deleting = 1;
-        ngx_shmtx_unlock(&cache->shpool->mutex);
 
-        len = path->name.len + 1 + path->len + 2 * NGX_HTTP_CACHE_KEY_LEN;
-        ngx_create_hashed_filename(path, name, len);
+/*
+ * the up to n most used nodes of a partition (of all of them if
+ * partition is NULL or empty), most used first, to hand a hot set over
+ * to another cache (see ngx_http_file_cache_import()); the nodes are
+ * walked in key order, a batch at a time so as not to hold the zone
+ * mutex long
+ */
 
-        ngx_log_debug1(NGX_LOG_DEBUG_HTTP, ngx_cycle->log, 0,
-                       "http file cache expire: \"%s\"", name);
+ngx_uint_t
+ngx_http_file_cache_hot(ngx_http_file_cache_t *cache, ngx_str_t *partition,
+    ngx_http_file_cache_hot_t *hot, ngx_uint_t n)
+{
+    size_t                            len;
+    uint32_t                          hash;
+    ngx_uint_t                        i, p, nhot;
+    ngx_rbtree_node_t                *node;
+    ngx_http_file_cache_node_t       *fcn;
+    ngx_http_file_cache_partition_t  *part;
+    u_char                            key[NGX_HTTP_CACHE_KEY_LEN];
+
+    if (n == 0) {
+        return 0;
+    }
 
-        if (ngx_delete_file(name) == NGX_FILE_ERROR) {
-            ngx_log_error(NGX_LOG_CRIT, ngx_cycle->log, ngx_errno,
-                          ngx_delete_file_n " \"%s\" failed", name);
+    nhot = 0;
+    p = NGX_HTTP_CACHE_PARTITIONS_MAX + 1;
+
+    if (partition && partition->len) {
+        if (cache->partitions == 0) {
+            return 0;
         }
 
+        hash = ngx_crc32_short(partition->data, partition->len);
+        len = ngx_min(partition->len, NGX_HTTP_CACHE_PARTITION_LEN);
+
         ngx_shmtx_lock(&cache->shpool->mutex);
-        fcn->count--;
-        fcn->deleting = 0;
-    }
 
-    if (fcn->count == 0) {
-        ngx_queue_remove(q);
-        ngx_rbtree_delete(&cache->sh->rbtree, &fcn->node);
-        ngx_slab_free_locked(cache->shpool, fcn);
-        cache->sh->count--;
-    }
-}
+        for (i = 0; i < cache->partitions; i++) {
+            p = 1 + (hash + i) % cache->partitions;
+            part = &cache->sh->partition[p];
 
+            if (part->len == 0) {
+                i = cache->partitions;
+                break;
+            }
 
-static time_t
-ngx_http_file_cache_manager(void *data)
-{
-    ngx_http_file_cache_t  *cache = data;
+            if (part->hash == hash && part->len == partition->len
+                && ngx_memcmp(part->name, partition->data, len) == 0)
+            {
+                break;
+            }
+        }
 
-    off_t       size;
-    time_t      next, wait;
-    ngx_uint_t  count, watermark;
+        ngx_shmtx_unlock(&cache->shpool->mutex);
 
-    next = ngx_http_file_cache_expire(cache);
+        if (i == cache->partitions) {
+            return 0;
+        }
+    }
 
-    cache->last = ngx_current_msec;
-    cache->files = 0;
+    node = NULL;
 
-    for ( ;; ) {
+    do {
         ngx_shmtx_lock(&cache->shpool->mutex);
 
-        size = cache->sh->size;
-        count = cache->sh->count;
-        watermark = cache->sh->watermark;
+        node = ngx_http_file_cache_next(cache, node ? key : NULL);
 
-        ngx_shmtx_unlock(&cache->shpool->mutex);
+        for (i = 0; node && i < NGX_HTTP_CACHE_WALK_BATCH; i++) {
+            fcn = (ngx_http_file_cache_node_t *) node;
 
-        ngx_log_debug3(NGX_LOG_DEBUG_HTTP, ngx_cycle->log, 0,
-                       "http file cache size: %O c:%ui w:%i",
-                       size, count, (ngx_int_t) watermark);
+            ngx_http_file_cache_node_key(fcn, key);
 
-        if (size < cache->max_size && count < watermark) {
-            return next;
+            if (fcn->exists && !fcn->deleting
+                && (p > NGX_HTTP_CACHE_PARTITIONS_MAX || fcn->partition == p))
+            {
+                ngx_http_file_cache_hot_add(hot, n, &nhot, fcn);
+            }
+
+            node = ngx_http_file_cache_successor(node,
+                                                 cache->sh->rbtree.sentinel);
         }
 
-        wait = ngx_http_file_cache_forced_expire(cache);
+        ngx_shmtx_unlock(&cache->shpool->mutex);
 
-        if (wait > 0) {
-            return wait;
-        }
+    } while (node);
+
+    ngx_qsort(hot, nhot, sizeof(ngx_http_file_cache_hot_t),
+              ngx_http_file_cache_hot_cmp);
 
-        if (ngx_quit || ngx_terminate) {
-            return next;
-        }
-    }
+    return nhot;
 }
 
 
+/* the hot nodes are kept in a min-heap of uses while they are collected */
+
 static void
-ngx_http_file_cache_loader(void *data)
+ngx_http_file_cache_hot_add(ngx_http_file_cache_hot_t *hot, ngx_uint_t n,
+    ngx_uint_t *nhot, ngx_http_file_cache_node_t *fcn)
 {
-    ngx_http_file_cache_t  *cache = data;
-
-    ngx_tree_ctx_t  tree;
+    ngx_uint_t                 i, child;
+    ngx_http_file_cache_hot_t  node;
 
-    if (!cache->sh->cold || cache->sh->loading) {
+    if (*nhot == n && fcn->uses <= hot[0].uses) {
         return;
     }
 
-    if (!ngx_atomic_cmp_set(&cache->sh->loading, 0, ngx_pid)) {
-        return;
-    }
+    ngx_http_file_cache_node_key(fcn, node.key);
+    node.uses = fcn->uses;
 
-    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, ngx_cycle->log, 0,
-                   "http file cache loader");
+    if (*nhot < n) {
 
-    tree.init_handler = NULL;
-    tree.file_handler = ngx_http_file_cache_manage_file;
-    tree.pre_tree_handler = ngx_http_file_cache_manage_directory;
-    tree.post_tree_handler = ngx_http_file_cache_noop;
-    tree.spec_handler = ngx_http_file_cache_delete_file;
-    tree.data = cache;
-    tree.alloc = 0;
-    tree.log = ngx_cycle->log;
+        /* sift up */
 
-    cache->last = ngx_current_msec;
-    cache->files = 0;
+        for (i = (*nhot)++; i > 0 && hot[(i - 1) / 2].uses > node.uses;
+             i = (i - 1) / 2)
+        {
+            hot[i] = hot[(i - 1) / 2];
+        }
 
-    if (ngx_walk_tree(&tree, &cache->path->name) == NGX_ABORT) {
-        cache->sh->loading = 0;
+        hot[i] = node;
         return;
     }
 
-    cache->sh->cold = 0;
-    cache->sh->loading = 0;
+    /* replace the least used one and sift down */
 
-    ngx_log_error(NGX_LOG_NOTICE, ngx_cycle->log, 0,
-                  "http file cache: %V %.3fM, bsize: %uz",
-                  &cache->path->name,
-                  ((double) cache->sh->size * cache->bsize) / (1024 * 1024),
-                  cache->bsize);
-}
+    for (i = 0; (child = 2 * i + 1) < n; i = child) {
 
+        if (child + 1 < n && hot[child + 1].uses < hot[child].uses) {
+            child++;
+        }
 
-static ngx_int_t
-ngx_http_file_cache_noop(ngx_tree_ctx_t *ctx, ngx_str_t *path)
-{
-    return NGX_OK;
+        if (hot[child].uses >= node.uses) {
+            break;
+        }
+
+        hot[i] = hot[child];
+    }
+
+    hot[i] = node;
 }
 
 
-static ngx_int_t
-ngx_http_file_cache_manage_file(ngx_tree_ctx_t *ctx, ngx_str_t *path)
+static int ngx_libc_cdecl
+ngx_http_file_cache_hot_cmp(const void *one, const void *two)
 {
-    ngx_msec_t              elapsed;
-    ngx_http_file_cache_t  *cache;
-
-    cache = ctx->data;
+    const ngx_http_file_cache_hot_t  *first = one;
+    const ngx_http_file_cache_hot_t  *second = two;
 
-    if (ngx_http_file_cache_add_file(ctx, path) != NGX_OK) {
-        (void) ngx_http_file_cache_delete_file(ctx, path);
+    if (first->uses == second->uses) {
+        return 0;
     }
 
-    if (++cache->files >= cache->loader_files) {
-        ngx_http_file_cache_loader_sleep(cache);
+    return (first->uses < second->uses) ? 1 : -1;
+}
 
-    } else {
-        ngx_time_update();
 
-        elapsed = ngx_abs((ngx_msec_int_t) (ngx_current_msec - cache->last));
+ngx_int_t
+ngx_http_file_cache_file_name(ngx_http_file_cache_t *cache, u_char *key,
+    ngx_str_t *name, ngx_pool_t *pool)
+{
+    u_char      *p;
+    ngx_path_t  *path;
 
-        ngx_log_debug1(NGX_LOG_DEBUG_HTTP, ngx_cycle->log, 0,
-                       "http file cache loader time elapsed: %M", elapsed);
+    path = cache->path;
 
-        if (elapsed >= cache->loader_threshold) {
-            ngx_http_file_cache_loader_sleep(cache);
-        }
+    name->len = path->name.len + 1 + path->len + 2 * NGX_HTTP_CACHE_KEY_LEN;
+
+    name->data = ngx_pnalloc(pool, name->len + 1);
+    if (name->data == NULL) {
+        return NGX_ERROR;
     }
 
-    return (ngx_quit || ngx_terminate) ? NGX_ABORT : NGX_OK;
-}
+    ngx_memcpy(name->data, path->name.data, path->name.len);
 
+    p = name->data + path->name.len + 1 + path->len;
+    p = ngx_hex_dump(p, key, NGX_HTTP_CACHE_KEY_LEN);
+    *p = '\0';
 
-static ngx_int_t
-ngx_http_file_cache_manage_directory(ngx_tree_ctx_t *ctx, ngx_str_t *path)
-{
-    if (path->len >= 5
-        && ngx_strncmp(path->data + path->len - 5, "/temp", 5) == 0)
-    {
-        return NGX_DECLINED;
-    }
+    ngx_create_hashed_filename(path, name->data, name->len);
 
     return NGX_OK;
 }
 
 
-static void
-ngx_http_file_cache_loader_sleep(ngx_http_file_cache_t *cache)
-{
-    ngx_msleep(cache->loader_sleep);
+/*
+ * moves a cache file received from another cache (e.g. the node being
+ * replaced) into the cache and adds it to the index, as the loader does;
+ * the file is checked to be a cache file of the key, and is not imported
+ * if the key is already cached;
+ * may be called from a thread, as the index is only accessed locked
+ */
 
-    ngx_time_update();
+ngx_int_t
+ngx_http_file_cache_import(ngx_http_file_cache_t *cache, u_char *key,
+    ngx_uint_t uses, ngx_str_t *name, ngx_pool_t *pool, ngx_log_t *log)
+{
+    u_char                        *buf, *p;
+    size_t                         len;
+    ssize_t                        n;
+    ngx_fd_t                       fd;
+    ngx_int_t                      rc;
+    ngx_str_t                      to;
+    ngx_md5_t                      md5;
+    ngx_file_t                     file;
+    ngx_file_info_t                fi;
+    ngx_http_cache_t               c;
+    ngx_ext_rename_file_t          ext;
+    ngx_http_file_cache_node_t    *fcn;
+    ngx_http_file_cache_header_t  *h;
+    u_char                         md5_key[NGX_HTTP_CACHE_KEY_LEN];
 
-    cache->last = ngx_current_msec;
-    cache->files = 0;
-}
+    ngx_shmtx_lock(&cache->shpool->mutex);
 
+    fcn = ngx_http_file_cache_lookup(cache, key);
+    rc = (fcn && (fcn->exists || fcn->updating)) ? NGX_DECLINED : NGX_OK;
 
-static ngx_int_t
-ngx_http_file_cache_add_file(ngx_tree_ctx_t *ctx, ngx_str_t *name)
-{
-    u_char                 *p;
-    ngx_int_t               n;
-    ngx_uint_t              i;
-    ngx_http_cache_t        c;
-    ngx_http_file_cache_t  *cache;
+    ngx_shmtx_unlock(&cache->shpool->mutex);
 
-    if (name->len < 2 * NGX_HTTP_CACHE_KEY_LEN) {
-        return NGX_ERROR;
+    if (rc != NGX_OK) {
+        goto failed;
     }
 
-    if (ctx->size < (off_t) sizeof(ngx_http_file_cache_header_t)) {
-        ngx_log_error(NGX_LOG_CRIT, ctx->log, 0,
-                      "cache file \"%s\" is too small", name->data);
-        return NGX_ERROR;
-    }
+    rc = NGX_ERROR;
 
-    ngx_memzero(&c, sizeof(ngx_http_cache_t));
-    cache = ctx->data;
+    fd = ngx_open_file(name->data, NGX_FILE_RDONLY, NGX_FILE_OPEN, 0);
 
-    c.length = ctx->size;
-    c.fs_size = (ctx->fs_size + cache->bsize - 1) / cache->bsize;
+    if (fd == NGX_INVALID_FILE) {
+        ngx_log_error(NGX_LOG_CRIT, log, ngx_errno,
+                      ngx_open_file_n " \"%s\" failed", name->data);
+        goto failed;
+    }
 
-    p = &name->data[name->len - 2 * NGX_HTTP_CACHE_KEY_LEN];
+    ngx_memzero(&file, sizeof(ngx_file_t));
 
-    for (i = 0; i < NGX_HTTP_CACHE_KEY_LEN; i++) {
-        n = ngx_hextoi(p, 2);
+    file.fd = fd;
+    file.name = *name;
+    file.log = log;
 
-        if (n == NGX_ERROR) {
-            return NGX_ERROR;
-        }
+    if (ngx_fd_info(fd, &fi) == NGX_FILE_ERROR) {
+        ngx_log_error(NGX_LOG_CRIT, log, ngx_errno,
+                      ngx_fd_info_n " \"%s\" failed", name->data);
+        goto close;
+    }
 
-        p += 2;
+    len = ngx_min(ngx_file_size(&fi), 65535);
 
-        c.key[i] = (u_char) n;
+    if (len < sizeof(ngx_http_file_cache_header_t)
+              + sizeof(ngx_http_file_cache_key) + 1)
+    {
+        goto invalid;
     }
 
-    return ngx_http_file_cache_add(cache, &c);
-}
+    buf = ngx_pnalloc(pool, len);
+    if (buf == NULL) {
+        goto close;
+    }
 
+    n = ngx_read_file(&file, buf, len, 0);
 
-static ngx_int_t
-ngx_http_file_cache_add(ngx_http_file_cache_t *cache, ngx_http_cache_t *c)
-{
-    ngx_http_file_cache_node_t  *fcn;
+    if (n != (ssize_t) len) {
+        goto close;
+    }
 
-    ngx_shmtx_lock(&cache->shpool->mutex);
+    h = (ngx_http_file_cache_header_t *) buf;
 
-    fcn = ngx_http_file_cache_lookup(cache, c->key);
+    if (h->version != NGX_HTTP_CACHE_VERSION
+        || h->header_start < sizeof(ngx_http_file_cache_header_t)
+                             + sizeof(ngx_http_file_cache_key) + 1
+        || h->header_start > len
+        || h->body_start < h->header_start
+        || h->body_start > ngx_file_size(&fi)
+        || h->vary_len > NGX_HTTP_CACHE_VARY_LEN)
+    {
+        goto invalid;
+    }
 
-    if (fcn == NULL) {
+    p = buf + sizeof(ngx_http_file_cache_header_t);
 
-        fcn = ngx_slab_calloc_locked(cache->shpool,
-                                     sizeof(ngx_http_file_cache_node_t));
-        if (fcn == NULL) {
-            ngx_http_file_cache_set_watermark(cache);
+    if (ngx_memcmp(p, ngx_http_file_cache_key,
+                   sizeof(ngx_http_file_cache_key))
+        != 0)
+    {
+        goto invalid;
+    }
 
-            if (cache->fail_time != ngx_time()) {
-                cache->fail_time = ngx_time();
-                ngx_log_error(NGX_LOG_ALERT, ngx_cycle->log, 0,
-                           "could not allocate node%s", cache->shpool->log_ctx);
-            }
+    /* the key, as in the file, must be the one of the file name */
 
-            ngx_shmtx_unlock(&cache->shpool->mutex);
-            return NGX_ERROR;
-        }
+    p += sizeof(ngx_http_file_cache_key);
+    len = buf + h->header_start - 1 - p;
 
-        cache->sh->count++;
+    ngx_crc32_init(c.crc32);
+    ngx_crc32_update(&c.crc32, p, len);
+    ngx_crc32_final(c.crc32);
 
-        ngx_memcpy((u_char *) &fcn->node.key, c->key, sizeof(ngx_rbtree_key_t));
+    ngx_md5_init(&md5);
+    ngx_md5_update(&md5, p, len);
+    ngx_md5_final(md5_key, &md5);
 
-        ngx_memcpy(fcn->key, &c->key[sizeof(ngx_rbtree_key_t)],
-                   NGX_HTTP_CACHE_KEY_LEN - sizeof(ngx_rbtree_key_t));
+    if (h->crc32 != c.crc32
+        || (ngx_memcmp(md5_key, key, NGX_HTTP_CACHE_KEY_LEN) != 0
+            && (h->vary_len == 0
+                || ngx_memcmp(h->variant, key, NGX_HTTP_CACHE_KEY_LEN) != 0)))
+    {
+        goto invalid;
+    }
 
-        ngx_rbtree_insert(&cache->sh->rbtree, &fcn->node);
+    if (ngx_close_file(fd) == NGX_FILE_ERROR) {
+        ngx_log_error(NGX_LOG_ALERT, log, ngx_errno,
+                      ngx_close_file_n " \"%s\" failed", name->data);
+    }
 
-        fcn->uses = 1;
-        fcn->exists = 1;
-        fcn->fs_size = c->fs_size;
+    if (ngx_http_file_cache_file_name(cache, key, &to, pool) != NGX_OK) {
+        goto failed;
+    }
 
-        cache->sh->size += c->fs_size;
+    ext.access = NGX_FILE_OWNER_ACCESS;
+    ext.path_access = NGX_FILE_OWNER_ACCESS;
+    ext.time = -1;
+    ext.create_path = 1;
+    ext.delete_file = 1;
+    ext.log = log;
 
-    } else {
-        ngx_queue_remove(&fcn->queue);
+    if (ngx_ext_rename_file(name, &to, &ext) != NGX_OK) {
+        return NGX_ERROR;
     }
 
-    fcn->expire = ngx_time() + cache->inactive;
+    ngx_memzero(&c, sizeof(ngx_http_cache_t));
 
-    ngx_queue_insert_head(&cache->sh->queue, &fcn->queue);
+    ngx_memcpy(c.key, key, NGX_HTTP_CACHE_KEY_LEN);
+    c.length = ngx_file_size(&fi);
+    c.fs_size = (ngx_file_fs_size(&fi) + cache->bsize - 1) / cache->bsize;
 
-    ngx_shmtx_unlock(&cache->shpool->mutex);
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, log, 0,
+                   "http file cache import: \"%s\"", to.data);
 
-    return NGX_OK;
-}
+    return ngx_http_file_cache_add(cache, &c, uses);
 
+invalid:
 
-static ngx_int_t
-ngx_http_file_cache_delete_file(ngx_tree_ctx_t *ctx, ngx_str_t *path)
-{
-    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, ctx->log, 0,
-                   "http file cache delete: \"%s\"", path->data);
+    ngx_log_error(NGX_LOG_ERR, log, 0,
+                  "cache file \"%s\" is not a valid cache file of its key",
+                  name->data);
 
-    if (ngx_delete_file(path->data) == NGX_FILE_ERROR) {
-        ngx_log_error(NGX_LOG_CRIT, ctx->log, ngx_errno,
-                      ngx_delete_file_n " \"%s\" failed", path->data);
-    }
+close:
 
-    return NGX_OK;
-}
+    if (ngx_close_file(fd) == NGX_FILE_ERROR) {
+        ngx_log_error(NGX_LOG_ALERT, log, ngx_errno,
+                      ngx_close_file_n " \"%s\" failed", name->data);
+    }
 
+failed:
 
-static void
-ngx_http_file_cache_set_watermark(ngx_http_file_cache_t *cache)
-{
-    cache->sh->watermark = cache->sh->count - cache->sh->count / 8;
+    if (ngx_delete_file(name->data) == NGX_FILE_ERROR) {
+        ngx_log_error(NGX_LOG_CRIT, log, ngx_errno,
+                      ngx_delete_file_n " \"%s\" failed", name->data);
+    }
 
-    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, ngx_cycle->log, 0,
-                   "http file cache watermark: %ui", cache->sh->watermark);
+    return rc;
 }
 
 
@@ -2206,11 +4138,12 @@ ngx_http_file_cache_set_slot(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
 
     off_t                   max_size;
     u_char                 *last, *p;
-    time_t                  inactive;
+    time_t                  inactive, snapshot_interval;
     size_t                  len;
     ssize_t                 size;
-    ngx_str_t               s, name, *value;
-    ngx_int_t               loader_files;
+    ngx_str_t               s, name, snapshot, *value;
+    ngx_int_t               loader_files, partitions;
+    ngx_uint_t              policy;
     ngx_msec_t              loader_sleep, loader_threshold;
     ngx_uint_t              i, n, use_temp_path;
     ngx_array_t            *caches;
@@ -2232,8 +4165,12 @@ ngx_http_file_cache_set_slot(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
     loader_files = 100;
     loader_sleep = 50;
     loader_threshold = 200;
+    partitions = 0;
+    policy = NGX_HTTP_CACHE_POLICY_LRU;
+    snapshot_interval = 300;
 
     name.len = 0;
+    ngx_str_null(&snapshot);
     size = 0;
     max_size = NGX_MAX_OFF_T_VALUE;
 
@@ -2404,6 +4341,70 @@ ngx_http_file_cache_set_slot(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
             continue;
         }
 
+        if (ngx_strncmp(value[i].data, "partitions=", 11) == 0) {
+
+            partitions = ngx_atoi(value[i].data + 11, value[i].len - 11);
+            if (partitions == NGX_ERROR
+                || partitions > NGX_HTTP_CACHE_PARTITIONS_MAX)
+            {
+                ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "invalid partitions value \"%V\"", &value[i]);
+                return NGX_CONF_ERROR;
+            }
+
+            continue;
+        }
+
+        if (ngx_strcmp(value[i].data, "policy=lru") == 0) {
+            policy = NGX_HTTP_CACHE_POLICY_LRU;
+            continue;
+        }
+
+        if (ngx_strcmp(value[i].data, "policy=slru") == 0) {
+            policy = NGX_HTTP_CACHE_POLICY_SLRU;
+            continue;
+        }
+
+        if (ngx_strcmp(value[i].data, "policy=tinylfu") == 0) {
+            policy = NGX_HTTP_CACHE_POLICY_TINYLFU;
+            continue;
+        }
+
+        if (ngx_strncmp(value[i].data, "snapshot=", 9) == 0) {
+
+            snapshot.len = value[i].len - 9;
+            snapshot.data = value[i].data + 9;
+
+            if (snapshot.len == 0) {
+                ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                                   "invalid snapshot value \"%V\"", &value[i]);
+                return NGX_CONF_ERROR;
+            }
+
+            if (ngx_conf_full_name(cf->cycle, &snapshot, 0) != NGX_OK) {
+                return NGX_CONF_ERROR;
+            }
+
+            continue;
+        }
+
+        if (ngx_strncmp(value[i].data, "snapshot_interval=", 18) == 0) {
+
+            s.len = value[i].len - 18;
+            s.data = value[i].data + 18;
+
+            snapshot_interval = ngx_parse_time(&s, 1);
+            if (snapshot_interval == (time_t) NGX_ERROR
+                || snapshot_interval == 0)
+            {
+                ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "invalid snapshot_interval value \"%V\"", &value[i]);
+                return NGX_CONF_ERROR;
+            }
+
+            continue;
+        }
+
         ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
                            "invalid parameter \"%V\"", &value[i]);
         return NGX_CONF_ERROR;
@@ -2424,6 +4425,37 @@ ngx_http_file_cache_set_slot(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
     cache->loader_files = loader_files;
     cache->loader_sleep = loader_sleep;
     cache->loader_threshold = loader_threshold;
+    cache->partitions = partitions;
+    cache->policy = policy;
+
+    if (snapshot.len) {
+
+        /* the cache loader would delete it as an invalid cache file */
+
+        if (snapshot.len > cache->path->name.len
+            && snapshot.data[cache->path->name.len] == '/'
+            && ngx_strncmp(snapshot.data, cache->path->name.data,
+                           cache->path->name.len)
+               == 0)
+        {
+            ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                               "snapshot \"%V\" must not be in the cache "
+                               "directory", &snapshot);
+            return NGX_CONF_ERROR;
+        }
+
+        cache->snapshot = snapshot;
+        cache->snapshot_interval = snapshot_interval;
+
+        cache->snapshot_temp.len = snapshot.len + sizeof(".tmp") - 1;
+        cache->snapshot_temp.data = ngx_pnalloc(cf->pool,
+                                                cache->snapshot_temp.len + 1);
+        if (cache->snapshot_temp.data == NULL) {
+            return NGX_CONF_ERROR;
+        }
+
+        ngx_sprintf(cache->snapshot_temp.data, "%V.tmp%Z", &snapshot);
+    }
 
     if (ngx_add_path(cf, &cache->path) != NGX_OK) {
         return NGX_CONF_ERROR;
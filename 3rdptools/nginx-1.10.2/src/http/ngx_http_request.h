@@ -62,6 +62,7 @@
 /* unused                                  1 */
 #define NGX_HTTP_SUBREQUEST_IN_MEMORY      2
 #define NGX_HTTP_SUBREQUEST_WAITED         4
+#define NGX_HTTP_SUBREQUEST_BACKGROUND     8
 #define NGX_HTTP_LOG_UNSAFE                8
 
 
@@ -362,6 +363,25 @@ typedef ngx_int_t (*ngx_http_handler_pt)(ngx_http_request_t *r);
 typedef void (*ngx_http_event_handler_pt)(ngx_http_request_t *r);
 
 
+/*
+ * an output shaper paces the response sending in the write filter, in
+ * addition to limit_rate: "acquire" may lower the send limit (0 means
+ * no limit) or return the delay before sending, and "release" is told how
+ * many bytes out of the granted limit were actually sent
+ */
+
+typedef ngx_msec_t (*ngx_http_shaper_acquire_pt)(ngx_http_request_t *r,
+    off_t *limit);
+typedef void (*ngx_http_shaper_release_pt)(ngx_http_request_t *r,
+    off_t limit, off_t sent);
+
+typedef struct {
+    ngx_http_shaper_acquire_pt        acquire;
+    ngx_http_shaper_release_pt        release;
+    void                             *data;
+} ngx_http_shaper_t;
+
+
 struct ngx_http_request_s {
     uint32_t                          signature;         /* "HTTP" */
 
@@ -428,6 +448,7 @@ struct ngx_http_request_s {
 
     size_t                            limit_rate;
     size_t                            limit_rate_after;
+    ngx_http_shaper_t                *shaper;
 
     /* used to learn the Apache compatible response length without a header */
     size_t                            header_size;
@@ -483,6 +504,7 @@ struct ngx_http_request_s {
 
     unsigned                          subrequest_in_memory:1;
     unsigned                          waited:1;
+    unsigned                          background:1;
 
 #if (NGX_HTTP_CACHE)
     unsigned                          cached:1;
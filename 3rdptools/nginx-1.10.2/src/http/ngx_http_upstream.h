@@ -199,6 +199,11 @@ typedef struct {
     ngx_array_t                     *cache_valid;
     ngx_array_t                     *cache_bypass;
     ngx_array_t                     *no_cache;
+
+    ngx_http_complex_value_t        *cache_stale_while_revalidate;
+    ngx_http_complex_value_t        *cache_stale_if_error;
+    ngx_http_complex_value_t        *cache_partition;
+    ngx_http_complex_value_t        *cache_partition_max_size;
 #endif
 
     ngx_array_t                     *store_lengths;
@@ -19,10 +19,35 @@ static ngx_http_upstream_rr_peer_t *ngx_http_upstream_get_peer(
 
 #if (NGX_HTTP_SSL)
 
-static ngx_int_t ngx_http_upstream_empty_set_session(ngx_peer_connection_t *pc,
-    void *data);
-static void ngx_http_upstream_empty_save_session(ngx_peer_connection_t *pc,
-    void *data);
+/*
+ * SSL sessions of the peers created at run time (proxied URLs with
+ * variables): such peers only live for a request, so their sessions are
+ * kept in a per worker direct-mapped cache, keyed by the peer address and
+ * the SSL server name, to be reused by the next connections to the peer
+ */
+
+#define NGX_HTTP_UPSTREAM_RR_SESSIONS     256
+#define NGX_HTTP_UPSTREAM_RR_SESSION_KEY  (NGX_SOCKADDR_STRLEN + 256)
+
+
+typedef struct {
+    u_char                         *key;
+    size_t                          len;
+    ngx_ssl_session_t              *session;
+} ngx_http_upstream_rr_session_t;
+
+
+static ngx_int_t ngx_http_upstream_set_created_peer_session(
+    ngx_peer_connection_t *pc, void *data);
+static void ngx_http_upstream_save_created_peer_session(
+    ngx_peer_connection_t *pc, void *data);
+static ngx_http_upstream_rr_session_t *ngx_http_upstream_created_peer_slot(
+    ngx_peer_connection_t *pc, ngx_http_upstream_rr_peer_data_t *rrp,
+    u_char *key, size_t *len);
+
+
+static ngx_http_upstream_rr_session_t
+    ngx_http_upstream_rr_sessions[NGX_HTTP_UPSTREAM_RR_SESSIONS];
 
 #endif
 
@@ -407,8 +432,9 @@ ngx_http_upstream_create_round_robin_peer(ngx_http_request_t *r,
     r->upstream->peer.free = ngx_http_upstream_free_round_robin_peer;
     r->upstream->peer.tries = ngx_http_upstream_tries(rrp->peers);
 #if (NGX_HTTP_SSL)
-    r->upstream->peer.set_session = ngx_http_upstream_empty_set_session;
-    r->upstream->peer.save_session = ngx_http_upstream_empty_save_session;
+    r->upstream->peer.set_session = ngx_http_upstream_set_created_peer_session;
+    r->upstream->peer.save_session =
+                               ngx_http_upstream_save_created_peer_session;
 #endif
 
     return NGX_OK;
@@ -828,16 +854,135 @@ ngx_http_upstream_save_round_robin_peer_session(ngx_peer_connection_t *pc,
 
 
 static ngx_int_t
-ngx_http_upstream_empty_set_session(ngx_peer_connection_t *pc, void *data)
+ngx_http_upstream_set_created_peer_session(ngx_peer_connection_t *pc,
+    void *data)
 {
-    return NGX_OK;
+    ngx_http_upstream_rr_peer_data_t  *rrp = data;
+
+    size_t                           len;
+    ngx_int_t                        rc;
+    ngx_http_upstream_rr_session_t  *slot;
+    u_char                           key[NGX_HTTP_UPSTREAM_RR_SESSION_KEY];
+
+    slot = ngx_http_upstream_created_peer_slot(pc, rrp, key, &len);
+
+    if (slot == NULL
+        || slot->session == NULL
+        || slot->len != len
+        || ngx_memcmp(slot->key, key, len) != 0)
+    {
+        return NGX_OK;
+    }
+
+    rc = ngx_ssl_set_session(pc->connection, slot->session);
+
+    ngx_log_debug3(NGX_LOG_DEBUG_HTTP, pc->log, 0,
+                   "set session: %p \"%*s\"", slot->session, len, key);
+
+    return rc;
 }
 
 
 static void
-ngx_http_upstream_empty_save_session(ngx_peer_connection_t *pc, void *data)
+ngx_http_upstream_save_created_peer_session(ngx_peer_connection_t *pc,
+    void *data)
+{
+    ngx_http_upstream_rr_peer_data_t  *rrp = data;
+
+    u_char                          *p;
+    size_t                           len;
+    ngx_ssl_session_t               *ssl_session;
+    ngx_http_upstream_rr_session_t  *slot;
+    u_char                           key[NGX_HTTP_UPSTREAM_RR_SESSION_KEY];
+
+    slot = ngx_http_upstream_created_peer_slot(pc, rrp, key, &len);
+
+    if (slot == NULL) {
+        return;
+    }
+
+    ssl_session = ngx_ssl_get_session(pc->connection);
+
+    if (ssl_session == NULL) {
+        return;
+    }
+
+    ngx_log_debug3(NGX_LOG_DEBUG_HTTP, pc->log, 0,
+                   "save session: %p \"%*s\"", ssl_session, len, key);
+
+    if (slot->len == len && ngx_memcmp(slot->key, key, len) == 0) {
+        p = slot->key;
+
+    } else {
+        p = ngx_alloc(len, pc->log);
+        if (p == NULL) {
+            ngx_ssl_free_session(ssl_session);
+            return;
+        }
+
+        ngx_memcpy(p, key, len);
+
+        if (slot->key) {
+            ngx_free(slot->key);
+        }
+
+        slot->key = p;
+        slot->len = len;
+    }
+
+    if (slot->session) {
+
+        ngx_log_debug1(NGX_LOG_DEBUG_HTTP, pc->log, 0,
+                       "old session: %p", slot->session);
+
+        /* TODO: may block */
+
+        ngx_ssl_free_session(slot->session);
+    }
+
+    slot->session = ssl_session;
+}
+
+
+static ngx_http_upstream_rr_session_t *
+ngx_http_upstream_created_peer_slot(ngx_peer_connection_t *pc,
+    ngx_http_upstream_rr_peer_data_t *rrp, u_char *key, size_t *len)
 {
-    return;
+    u_char                       *p;
+    size_t                        n;
+    const char                   *name;
+    ngx_http_upstream_rr_peer_t  *peer;
+
+    peer = rrp->current;
+
+    if (peer == NULL) {
+        return NULL;
+    }
+
+    name = NULL;
+
+#ifdef SSL_CTRL_SET_TLSEXT_HOSTNAME
+    name = SSL_get_servername(pc->connection->ssl->connection,
+                              TLSEXT_NAMETYPE_host_name);
+#endif
+
+    n = name ? ngx_strlen(name) : 0;
+
+    if (peer->name.len + 1 + n > NGX_HTTP_UPSTREAM_RR_SESSION_KEY) {
+        return NULL;
+    }
+
+    p = ngx_cpymem(key, peer->name.data, peer->name.len);
+    *p++ = ' ';
+
+    if (n) {
+        p = ngx_cpymem(p, name, n);
+    }
+
+    *len = p - key;
+
+    return &ngx_http_upstream_rr_sessions[ngx_crc32_short(key, *len)
+                                          % NGX_HTTP_UPSTREAM_RR_SESSIONS];
 }
 
 #endif
@@ -246,6 +246,19 @@ ngx_http_write_filter(ngx_http_request_t *r, ngx_chain_t *in)
         limit = clcf->sendfile_max_chunk;
     }
 
+    if (r->shaper) {
+        delay = r->shaper->acquire(r, &limit);
+
+        if (delay) {
+            c->write->delayed = 1;
+            ngx_add_timer(c->write, delay);
+
+            c->buffered |= NGX_HTTP_WRITE_BUFFERED;
+
+            return NGX_AGAIN;
+        }
+    }
+
     sent = c->sent;
 
     ngx_log_debug1(NGX_LOG_DEBUG_HTTP, c->log, 0,
@@ -256,6 +269,10 @@ ngx_http_write_filter(ngx_http_request_t *r, ngx_chain_t *in)
     ngx_log_debug1(NGX_LOG_DEBUG_HTTP, c->log, 0,
                    "http write filter %p", chain);
 
+    if (r->shaper) {
+        r->shaper->release(r, limit, c->sent - sent);
+    }
+
     if (chain == NGX_CHAIN_ERROR) {
         c->error = 1;
         return NGX_ERROR;
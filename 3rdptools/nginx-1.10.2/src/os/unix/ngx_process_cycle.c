@@ -51,6 +51,9 @@ sig_atomic_t  ngx_noaccept;
 ngx_uint_t    ngx_noaccepting;
 ngx_uint_t    ngx_restart;
 
+/* posted on NGX_CMD_WAKEUP, see ngx_wakeup_worker_processes() */
+ngx_event_t  *ngx_wakeup_event;
+
 
 static u_char  master_process[] = "master process";
 
@@ -451,6 +454,47 @@ ngx_pass_open_channel(ngx_cycle_t *cycle, ngx_channel_t *ch)
 }
 
 
+/*
+ * Notifies the rest of worker processes (through the channels passed by
+ * the master process) so they post their ngx_wakeup_event.  This is a hint:
+ * a full channel or a worker spawned later just miss the notification.
+ */
+
+void
+ngx_wakeup_worker_processes(ngx_cycle_t *cycle)
+{
+    ngx_int_t      i;
+    ngx_channel_t  ch;
+
+    if (ngx_process != NGX_PROCESS_WORKER) {
+        return;
+    }
+
+    ngx_memzero(&ch, sizeof(ngx_channel_t));
+
+    ch.command = NGX_CMD_WAKEUP;
+    ch.pid = ngx_pid;
+    ch.slot = ngx_process_slot;
+    ch.fd = -1;
+
+    for (i = 0; i < ngx_last_process; i++) {
+
+        if (i == ngx_process_slot
+            || ngx_processes[i].pid == -1
+            || ngx_processes[i].channel[0] == -1)
+        {
+            continue;
+        }
+
+        ngx_log_debug2(NGX_LOG_DEBUG_CORE, cycle->log, 0,
+                       "wakeup s:%i pid:%P", i, ngx_processes[i].pid);
+
+        (void) ngx_write_channel(ngx_processes[i].channel[0],
+                                 &ch, sizeof(ngx_channel_t), cycle->log);
+    }
+}
+
+
 static void
 ngx_signal_worker_processes(ngx_cycle_t *cycle, int signo)
 {
@@ -1063,6 +1107,12 @@ ngx_channel_handler(ngx_event_t *ev)
             ngx_reopen = 1;
             break;
 
+        case NGX_CMD_WAKEUP:
+            if (ngx_wakeup_event && !ngx_wakeup_event->posted) {
+                ngx_post_event(ngx_wakeup_event, &ngx_posted_events);
+            }
+            break;
+
         case NGX_CMD_OPEN_CHANNEL:
 
             ngx_log_debug3(NGX_LOG_DEBUG_CORE, ev->log, 0,
@@ -1071,6 +1121,13 @@ ngx_channel_handler(ngx_event_t *ev)
 
             ngx_processes[ch.slot].pid = ch.pid;
             ngx_processes[ch.slot].channel[0] = ch.fd;
+
+            /* a process spawned later, see ngx_wakeup_worker_processes() */
+
+            if (ch.slot >= ngx_last_process) {
+                ngx_last_process = ch.slot + 1;
+            }
+
             break;
 
         case NGX_CMD_CLOSE_CHANNEL:
@@ -159,6 +159,7 @@ ngx_int_t ngx_file_info(u_char *filename, ngx_file_info_t *fi);
 #define ngx_file_fs_size(fi)        ngx_file_size(fi)
 
 #define ngx_file_uniq(fi)   (*(ngx_file_uniq_t *) &(fi)->nFileIndexHigh)
+#define ngx_file_nlink(fi)  (fi)->nNumberOfLinks
 
 
 /* 116444736000000000 is commented in src/os/win32/ngx_time.c */
@@ -50,6 +50,15 @@ typedef struct mg_http_srv_ctx_s {
 	 * Server fixed "fake" response body.
 	 */
 	char fake_response[BODY_MAX];
+	/**
+	 * Dynamic request handler; if set, 'fake_response' is not used
+	 * (see 'mg_http_srv_open2()').
+	 */
+	mg_http_srv_req_handler_t mg_http_srv_req_handler;
+	/**
+	 * Request handler private user data pointer.
+	 */
+	void *mg_http_srv_req_handler_opaque;
 
 	//Reserved for future use: add new fields in this structure...
 } mg_http_srv_ctx_t;
@@ -67,7 +76,13 @@ typedef struct mg_http_cli_ctx_s {
 
 /* **** Prototypes **** */
 
+static mg_http_srv_ctx_t* srv_open(const char *listening_host,
+		const char *listening_port);
 static void srv_event_handler(struct mg_connection *c, int ev, void *p);
+static void srv_event_handler_dyn(struct mg_connection *c,
+		struct http_message *hm, mg_http_srv_ctx_t *mg_http_srv_ctx);
+static char* mg_str_dup(const struct mg_str *mg_str);
+static const char* status_reason(int status_code);
 static void* srv_thr(void *t);
 
 static void cli_event_handler(struct mg_connection *nc, int ev, void *p);
@@ -90,18 +105,10 @@ mg_http_srv_ctx_t* mg_http_srv_open(const char *listening_host,
 			(fake_response_body_len= strlen(fake_response_body))< BODY_MAX,
 			return NULL);
 
-	/* Allocate module's context structure */
-	mg_http_srv_ctx= (mg_http_srv_ctx_t*)calloc(1, sizeof(mg_http_srv_ctx_t));
+	/* Allocate and initialize module's context structure */
+	mg_http_srv_ctx= srv_open(listening_host, listening_port);
 	CHECK_DO(mg_http_srv_ctx!= NULL, goto end);
 
-	/* Initialize context structure */
-
-	mg_http_srv_ctx->listening_host= strdup(listening_host);
-	CHECK_DO(mg_http_srv_ctx->listening_host!= NULL, goto end);
-
-	mg_http_srv_ctx->listening_port= strdup(listening_port);
-	CHECK_DO(mg_http_srv_ctx->listening_port!= NULL, goto end);
-
 	if(mg_http_srv_reqhdr_ctx!= NULL) {
 		if(mg_http_srv_reqhdr_ctx->host!= NULL &&
 				strlen(mg_http_srv_reqhdr_ctx->host)> 0)
@@ -128,6 +135,37 @@ end:
 	return mg_http_srv_ctx;
 }
 
+mg_http_srv_ctx_t* mg_http_srv_open2(const char *listening_host,
+		const char *listening_port,
+		mg_http_srv_req_handler_t mg_http_srv_req_handler, void *opaque)
+{
+	int ret_code, end_code= -1; // error by default
+	mg_http_srv_ctx_t *mg_http_srv_ctx= NULL;
+
+	/* Check arguments */
+	CHECK_DO(listening_host!= NULL, return NULL);
+	CHECK_DO(listening_port!= NULL, return NULL);
+	CHECK_DO(mg_http_srv_req_handler!= NULL, return NULL);
+
+	/* Allocate and initialize module's context structure */
+	mg_http_srv_ctx= srv_open(listening_host, listening_port);
+	CHECK_DO(mg_http_srv_ctx!= NULL, goto end);
+
+	mg_http_srv_ctx->mg_http_srv_req_handler= mg_http_srv_req_handler;
+	mg_http_srv_ctx->mg_http_srv_req_handler_opaque= opaque;
+
+	/* Launch HTTP server thread */
+	ret_code= pthread_create(&mg_http_srv_ctx->http_srv_thread, NULL, srv_thr,
+			mg_http_srv_ctx);
+	CHECK_DO(ret_code== 0, goto end);
+
+	end_code= 0;
+end:
+	if(end_code!= 0)
+		mg_http_srv_close(&mg_http_srv_ctx);
+	return mg_http_srv_ctx;
+}
+
 void mg_http_srv_close(mg_http_srv_ctx_t **ref_mg_http_srv_ctx)
 {
 	mg_http_srv_ctx_t *mg_http_srv_ctx;
@@ -164,6 +202,12 @@ void mg_http_srv_close(mg_http_srv_ctx_t **ref_mg_http_srv_ctx)
 		mg_http_srv_ctx->listening_port= NULL;
 	}
 
+	/* Release response headers */
+	if(mg_http_srv_ctx->mg_http_srv_reqhdr_ctx.host!= NULL) {
+		free((void*)mg_http_srv_ctx->mg_http_srv_reqhdr_ctx.host);
+		mg_http_srv_ctx->mg_http_srv_reqhdr_ctx.host= NULL;
+	}
+
 	// Reserved for future use: release other new variables here...
 
 	/* Release context structure */
@@ -230,15 +274,59 @@ end:
 		return NULL;
 }
 
+/**
+ * Allocates and initializes the server context structure (common to
+ * 'mg_http_srv_open()' and 'mg_http_srv_open2()').
+ * Server thread is not launched.
+ */
+static mg_http_srv_ctx_t* srv_open(const char *listening_host,
+		const char *listening_port)
+{
+	int end_code= -1; // error by default
+	mg_http_srv_ctx_t *mg_http_srv_ctx= NULL;
+
+	/* Allocate module's context structure */
+	mg_http_srv_ctx= (mg_http_srv_ctx_t*)calloc(1, sizeof(mg_http_srv_ctx_t));
+	CHECK_DO(mg_http_srv_ctx!= NULL, goto end);
+
+	/* Initialize context structure */
+
+	mg_http_srv_ctx->listening_host= strdup(listening_host);
+	CHECK_DO(mg_http_srv_ctx->listening_host!= NULL, goto end);
+
+	mg_http_srv_ctx->listening_port= strdup(listening_port);
+	CHECK_DO(mg_http_srv_ctx->listening_port!= NULL, goto end);
+
+	end_code= 0;
+end:
+	if(end_code!= 0 && mg_http_srv_ctx!= NULL) {
+		if(mg_http_srv_ctx->listening_host!= NULL)
+			free(mg_http_srv_ctx->listening_host);
+		free(mg_http_srv_ctx);
+		mg_http_srv_ctx= NULL;
+	}
+	return mg_http_srv_ctx;
+}
+
 static void srv_event_handler(struct mg_connection *c, int ev, void *p)
 {
+	mg_http_srv_ctx_t *mg_http_srv_ctx= (mg_http_srv_ctx_t*)c->user_data;
+
+	/* Dynamic request handler: only HTTP requests are processed */
+	if(mg_http_srv_ctx!= NULL &&
+			mg_http_srv_ctx->mg_http_srv_req_handler!= NULL) {
+		if(ev== MG_EV_HTTP_REQUEST)
+			srv_event_handler_dyn(c, (struct http_message*)p,
+					mg_http_srv_ctx);
+		return;
+	}
+
 	if(ev== MG_EV_HTTP_REQUEST) {
 		register size_t uri_len= 0, method_len= 0, qs_len= 0, body_len= 0;
 		const char *uri_p, *method_p, *qs_p, *body_p;
 		struct http_message *hm= (struct http_message*)p;
 		char *url_str= NULL, *method_str= NULL, *str_response= NULL,
 				*qstring_str= NULL, *body_str= NULL;
-		mg_http_srv_ctx_t *mg_http_srv_ctx= (mg_http_srv_ctx_t*)c->user_data;
 
 		if((uri_p= hm->uri.p)!= NULL && (uri_len= hm->uri.len)> 0 &&
 				uri_len< URI_MAX) {
@@ -331,6 +419,109 @@ static void srv_event_handler(struct mg_connection *c, int ev, void *p)
 	}
 }
 
+/**
+ * Processes a request by means of the dynamic request handler
+ * (see 'mg_http_srv_open2()').
+ */
+static void srv_event_handler_dyn(struct mg_connection *c,
+		struct http_message *hm, mg_http_srv_ctx_t *mg_http_srv_ctx)
+{
+	mg_http_srv_req_ctx_t req= {0};
+	mg_http_srv_rsp_ctx_t rsp= {0};
+	char *method_str= NULL, *url_str= NULL, *qstring_str= NULL,
+			*body_str= NULL, *if_none_match_str= NULL,
+			*accept_encoding_str= NULL;
+
+	/* Compose request context (strings are NULL-terminated copies) */
+	method_str= mg_str_dup(&hm->method);
+	url_str= mg_str_dup(&hm->uri);
+	qstring_str= mg_str_dup(&hm->query_string);
+	body_str= mg_str_dup(&hm->body);
+	if_none_match_str= mg_str_dup(mg_get_http_header(hm, "If-None-Match"));
+	accept_encoding_str= mg_str_dup(mg_get_http_header(hm,
+			"Accept-Encoding"));
+	if(method_str== NULL || url_str== NULL) {
+		mg_printf(c, "%s", "HTTP/1.1 400 Bad Request\r\n"
+				"Content-Length: 0\r\n\r\n");
+		goto end;
+	}
+	req.method= method_str;
+	req.uri= url_str;
+	req.qstring= qstring_str;
+	req.body= body_str;
+	req.if_none_match= if_none_match_str;
+	req.accept_encoding= accept_encoding_str;
+
+	/* Execute handler */
+	rsp.status_code= 200;
+	mg_http_srv_ctx->mg_http_srv_req_handler(
+			mg_http_srv_ctx->mg_http_srv_req_handler_opaque, &req, &rsp);
+
+	/* Send response */
+	mg_printf(c, "HTTP/1.1 %d %s\r\n", rsp.status_code,
+			status_reason(rsp.status_code));
+	if(rsp.etag!= NULL)
+		mg_printf(c, "ETag: %s\r\n", rsp.etag);
+	if(rsp.content_encoding!= NULL)
+		mg_printf(c, "Content-Encoding: %s\r\n", rsp.content_encoding);
+	if(rsp.max_age> 0)
+		mg_printf(c, "Cache-Control: public, max-age=%u\r\n", rsp.max_age);
+	mg_printf(c, "Content-Length: %zu\r\n\r\n",
+			rsp.body!= NULL? rsp.body_size: 0);
+	if(rsp.body!= NULL && rsp.body_size> 0)
+		mg_send(c, rsp.body, (int)rsp.body_size);
+	if(rsp.body_release!= NULL)
+		rsp.body_release(rsp.body_release_arg);
+
+end:
+	if(method_str!= NULL)
+		free(method_str);
+	if(url_str!= NULL)
+		free(url_str);
+	if(qstring_str!= NULL)
+		free(qstring_str);
+	if(body_str!= NULL)
+		free(body_str);
+	if(if_none_match_str!= NULL)
+		free(if_none_match_str);
+	if(accept_encoding_str!= NULL)
+		free(accept_encoding_str);
+}
+
+/**
+ * Duplicates a mongoose string as a NULL-terminated heap-allocated string.
+ * @return The new string, or NULL if the input is NULL or empty.
+ */
+static char* mg_str_dup(const struct mg_str *mg_str)
+{
+	char *str;
+
+	if(mg_str== NULL || mg_str->p== NULL || mg_str->len== 0)
+		return NULL;
+	str= (char*)calloc(1, mg_str->len+ 1);
+	if(str!= NULL)
+		memcpy(str, mg_str->p, mg_str->len);
+	return str;
+}
+
+/**
+ * Returns the reason phrase for the (commonly used) HTTP status codes.
+ */
+static const char* status_reason(int status_code)
+{
+	switch(status_code) {
+	case 200: return "OK";
+	case 202: return "Accepted";
+	case 204: return "No Content";
+	case 304: return "Not Modified";
+	case 400: return "Bad Request";
+	case 404: return "Not Found";
+	case 500: return "Internal Server Error";
+	case 503: return "Service Unavailable";
+	default: return "Unknown";
+	}
+}
+
 /**
  * Runs HTTP server thread, listening to the given port.
  */
@@ -7,6 +7,8 @@
 #ifndef UTILS_SRC_MG_HTTP_H_
 #define UTILS_SRC_MG_HTTP_H_
 
+#include <stddef.h>
+
 /* **** Definitions **** */
 
 /* Forward definitions */
@@ -35,6 +37,85 @@ typedef struct mg_http_srv_reqhdr_ctx_s {
 	// Reserved for future use: add other header-fields here
 } mg_http_srv_reqhdr_ctx_t;
 
+/**
+ * Server's HTTP-request context structure passed to the request handler
+ * (see 'mg_http_srv_req_handler_t').
+ * All the strings are NULL-terminated and only valid during the handler call.
+ */
+typedef struct mg_http_srv_req_ctx_s {
+	const char *method;
+	const char *uri;
+	/**
+	 * Query-string; NULL if not present.
+	 */
+	const char *qstring;
+	/**
+	 * Request body; NULL if not present.
+	 */
+	const char *body;
+	/**
+	 * 'If-None-Match' header-field value; NULL if not present.
+	 */
+	const char *if_none_match;
+	/**
+	 * 'Accept-Encoding' header-field value; NULL if not present.
+	 */
+	const char *accept_encoding;
+	// Reserved for future use: add other header-fields here
+} mg_http_srv_req_ctx_t;
+
+/**
+ * Server's HTTP-response context structure to be filled by the request
+ * handler (see 'mg_http_srv_req_handler_t').
+ */
+typedef struct mg_http_srv_rsp_ctx_s {
+	/**
+	 * HTTP status code (e.g. 200, 304, 404).
+	 */
+	int status_code;
+	/**
+	 * 'ETag' header-field value (quoted); NULL to omit the header.
+	 */
+	const char *etag;
+	/**
+	 * 'Content-Encoding' header-field value; NULL to omit the header.
+	 */
+	const char *content_encoding;
+	/**
+	 * 'Cache-Control' max-age value in seconds; zero to omit the header.
+	 */
+	unsigned int max_age;
+	/**
+	 * Response body (may be binary data); NULL if no body is sent.
+	 * Body memory is owned by the handler and is kept valid until
+	 * 'body_release()' is called by the server (if defined).
+	 */
+	const void *body;
+	/**
+	 * Response body size in bytes.
+	 */
+	size_t body_size;
+	/**
+	 * Optional callback used by the server to release the body once sent.
+	 */
+	void (*body_release)(void *body_release_arg);
+	/**
+	 * Opaque argument passed to 'body_release()'.
+	 */
+	void *body_release_arg;
+} mg_http_srv_rsp_ctx_t;
+
+/**
+ * Server's request handler callback prototype.
+ * It is executed in the server thread for every received request.
+ * @param opaque Private user data pointer passed to 'mg_http_srv_open2()'.
+ * @param req Request context structure.
+ * @param rsp Response context structure to be filled by the handler; it is
+ * initialized to an empty 200 response before calling the handler.
+ */
+typedef void (*mg_http_srv_req_handler_t)(void *opaque,
+		const mg_http_srv_req_ctx_t *req, mg_http_srv_rsp_ctx_t *rsp);
+
 /* **** Prototypes **** */
 
 /**
@@ -52,6 +133,22 @@ mg_http_srv_ctx_t* mg_http_srv_open(const char *listening_host,
 		mg_http_srv_reqhdr_ctx_t *mg_http_srv_reqhdr_ctx,
 		const char *fake_response_body);
 
+/**
+ * Instantiates HTTP server with a dynamic request handler.
+ * As opposed to 'mg_http_srv_open()', the response to each request is
+ * generated by the given handler; the response body size is not limited by
+ * 'BODY_MAX'.
+ * @param listening_host Server host-name.
+ * @param listening_port Server listening port.
+ * @param mg_http_srv_req_handler Request handler callback.
+ * @param opaque Private user data pointer passed to the request handler.
+ * @return Pointer to the server's context structure on success, NULL if
+ * fails. Release with 'mg_http_srv_close()'.
+ */
+mg_http_srv_ctx_t* mg_http_srv_open2(const char *listening_host,
+		const char *listening_port,
+		mg_http_srv_req_handler_t mg_http_srv_req_handler, void *opaque);
+
 /**
  * Release HTTP server instance previously obtained in a call to
  * 'mg_http_srv_open'.
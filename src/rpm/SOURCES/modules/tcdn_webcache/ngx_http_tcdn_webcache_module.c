@@ -15,11 +15,34 @@
 #include <ngx_config.h>
 #include <ngx_core.h>
 #include <ngx_http.h>
+#include <inttypes.h>
 #include <curl/curl.h>
-#include <json-c/json.h>
+#if (NGX_OPENSSL)
+#include <openssl/crypto.h>
+#include <openssl/md5.h>
+#include <openssl/sha.h>
+#endif
+
+#include "tcdn_routing_table.h"
 
 /* **** Definitions **** */
 
+/**
+ * USDT probe points (provider 'tcdn_webcache'); see 'ngx_probe.h'.
+ * Probes are no-ops if Nginx was built without SystemTap's <sys/sdt.h>
+ * (or if the Nginx sources do not provide 'ngx_probe()' at all).
+ * Available probes:
+ * - lookup__start(r), lookup__done(r, rc): bucket (origin) lookup;
+ * - redirect__start(r), redirect__done(r, rc): internal redirection;
+ * - tracker__fetch__start(url), tracker__fetch__done(curl_code, http_code,
+ * body_size): tracker buckets information request;
+ * - table__swap(routing_table_idx, routing_table_size): new buckets
+ * information set (routing table) in use.
+ */
+#ifndef ngx_probe
+#define ngx_probe(provider, name, ...)
+#endif
+
 /**
  * Internal redirection prefix path for all requests to be proxied.
  * The incoming request's HTTP host-header will be parsed and used to
@@ -38,42 +61,278 @@
  *     ...
  * }
  * @endcode
+ * If the origin-servers host-names are resolved in the background (see
+ * 'tcdn_webcache_resolve_valid' directive), the request is redirected to
+ * the origin-server numeric address, so no 'resolver' is needed; the
+ * origin-server host-name is then to be sent as host-header, and used in
+ * the cache key (so that it does not depend on the address):
+ * @code
+ *     location ~ /proxy/([^/]*)(.*) {
+ *         proxy_pass http://$1$2;
+ *         proxy_set_header Host $tcdn_origin_host;
+ *         proxy_cache_key http://$tcdn_origin_host$2;
+ *     }
+ * @endcode
+ * Buckets whose origin-server is fetched over TLS ('https.enabled') are
+ * proxied with the scheme given by '$tcdn_origin_scheme'; the origin
+ * host-name is then to be sent as TLS server name, and the SSL sessions are
+ * reused (they are cached per origin peer address and server name, also if
+ * the proxied URL has variables):
+ * @code
+ *     location ~ /proxy/([^/]*)(.*) {
+ *         proxy_pass $tcdn_origin_scheme://$1$2;
+ *         proxy_set_header Host $tcdn_origin_host;
+ *         proxy_ssl_server_name on;
+ *         proxy_ssl_name $tcdn_origin_host;
+ *         proxy_ssl_session_reuse on;
+ *         proxy_cache_key http://$tcdn_origin_host$2;
+ *     }
+ * @endcode
  */
 #define INT_REDIR_PATH "/proxy/"
 
 /**
- * Maximum URI path length in bytes.
- * The URI is conformed by the path and query-string concatenated to the
- * upstream <host:port> pair. For most cases, URI length will be less than this
- * value, and stack memory will be used internally to manage the request.
- * If a specific request exceeds this length, this module will use the heap
- * memory to manage it. Nevertheless, if the URI specified exceeds the
- * defined 'URI_MAX_LEN_GUARD', it will be declined and an error trace
- * logged.
+ * Internal redirection prefix path for the requests to be forwarded to the
+ * cluster peer owning the requested content (see 'tcdn_webcache_peer'
+ * directive). The peer receives the original host-header and the hop-count
+ * header-field (so it serves the request from its cache or from the origin,
+ * never forwarding it again). If the peer is not reachable, the request falls
+ * back to the origin-server:
+ * @code
+ *     location ~ /peer/(.*) {
+ *         proxy_pass http://$1;
+ *         proxy_set_header Host $host;
+ *         proxy_set_header X-TCDN-Hop $tcdn_hop_next;
+ *         proxy_connect_timeout 1s;
+ *         error_page 502 504 = @tcdn_origin;
+ *     }
+ *     location @tcdn_origin {
+ *         proxy_pass $tcdn_origin_scheme://$tcdn_origin$request_uri;
+ *         proxy_set_header Host $tcdn_origin_host;
+ *     }
+ * @endcode
+ * Content is not cached in this location: it is cached by its owner.
+ */
+#define INT_REDIR_PEER_PATH "/peer/"
+
+/**
+ * Internal redirection prefix path for the requests to be forwarded to the
+ * bucket's shield (parent webcache, running this module too) instead of the
+ * origin-server, so that the misses of all the edge nodes are collapsed into
+ * a single origin request. Content is cached in this location; if the shield
+ * is not reachable, the request falls back to the origin-server:
+ * @code
+ *     location ~ /shield/(.*) {
+ *         proxy_pass http://$1;
+ *         proxy_set_header Host $host;
+ *         proxy_set_header X-TCDN-Hop $tcdn_hop_next;
+ *         proxy_connect_timeout 1s;
+ *         error_page 502 504 = @tcdn_origin;
+ *     }
+ * @endcode
+ * The shield node identifies itself (so it requests the origin-server) by
+ * its 'self' peer address (see 'tcdn_webcache_peer'), which must match the
+ * bucket's shield "host:port".
+ */
+#define INT_REDIR_SHIELD_PATH "/shield/"
+
+/**
+ * Hop-count HTTP header-field name. Requests forwarded by another webcache
+ * node carry this header-field (value: number of hops); requests forwarded
+ * by a cluster peer are never forwarded to a peer again, to avoid
+ * forwarding loops.
+ * The header-field is only trusted from the cluster peers and the
+ * 'tcdn_webcache_trusted' addresses (e.g. the edge nodes of a shield); for
+ * any other client the hop-count is zero and the header-field is dropped
+ * (it is not proxied).
  */
-#define URI_MAX_LEN 1024
+#define HOP_HEADER_NAME "X-TCDN-Hop"
 
 /**
- * Maximum URI path length guard in bytes.
- * This guard is for sanity check; we will assume no URI can exceed this
- * length. See 'URI_MAX_LEN' for details.
+ * Maximum hop-count. Requests reaching this hop-count are considered to be
+ * in a forwarding loop (e.g. misconfigured shields) and are responded
+ * '502 Bad Gateway'.
  */
-#define URI_MAX_LEN_GUARD 16384
+#define HOPS_MAX 4
+
+/**
+ * Default maximum number of media segment prefetch subrequests in progress
+ * per worker process (see 'tcdn_webcache_prefetch_concurrency' directive).
+ */
+#define PREFETCH_CONCURRENCY_DEFAULT 16
 
 /**
- * Maximum internal redirection full-path length.
- * This value is supposed to cope with almost all common requests.
- * Nevertheless, some requests may exceed this value; in that case heap
- * memory may be used. See 'URI_MAX_LEN' and 'URI_MAX_LEN_GUARD'.
+ * Maximum number of digits of a media segment number (see
+ * 'segment_number_find()').
  */
-#define INT_REDIR_PATH_MAX_LEN \
-	(sizeof(INT_REDIR_PATH)+ sizeof("255.255.255.255:65535")+ URI_MAX_LEN)
+#define SEGMENT_NUMBER_DIGITS_MAX 9
+
+/**
+ * Number of points per weight unit of each peer in the cluster
+ * consistent-hashing ring (as in 'ngx_http_upstream_hash_module.c').
+ */
+#define PEERS_RING_POINTS_PER_WEIGHT 160
+
+/**
+ * Maximum URI path length guard in bytes.
+ * The internal redirection URI is conformed by the path and query-string
+ * concatenated to the upstream <host:port> pair. This guard is for sanity
+ * check; we will assume no URI can exceed this length (the request is
+ * declined and an error trace logged).
+ */
+#define URI_MAX_LEN_GUARD 16384
 
 /**
  * Bucket Identifier for web-caching.
  */
 #define BUCKET_JSON_PLATFORM 8
 
+/**
+ * Maximum length of the tracker's buckets information entity-tag
+ * (HTTP 'ETag' header-field value), including the terminating character.
+ * Longer entity-tags are ignored (conditional requests are not performed).
+ */
+#define TRACKER_ETAG_MAX_LEN 256
+
+/**
+ * Initial size in bytes of the buffer used to receive the tracker response
+ * body; the buffer grows geometrically as needed.
+ */
+#define TRACKER_BODY_SIZE_INI (64* 1024)
+
+/**
+ * Metrics shared memory zone name and size (see
+ * 'ngx_http_tcdn_webcache_metrics_t').
+ */
+#define METRICS_ZONE_NAME "tcdn_webcache_metrics"
+#define METRICS_ZONE_SIZE (8* ngx_pagesize)
+
+/**
+ * Buckets shared state memory zone name and size (see
+ * 'ngx_http_tcdn_webcache_buckets_state_t').
+ */
+#define BUCKETS_ZONE_NAME "tcdn_webcache_buckets"
+#define BUCKETS_ZONE_SIZE \
+	(sizeof(ngx_http_tcdn_webcache_buckets_state_t)+ 8* ngx_pagesize)
+
+/**
+ * Maximum number of limited buckets (number of buckets shared states; idle
+ * ones are reused, least recently used first).
+ */
+#define BUCKETS_STATE_MAX 1024
+
+/**
+ * Maximum length of the bucket key (bucket identifier, or host-name if the
+ * bucket has none) kept in its shared state (longer ones are compared by
+ * their hash and length too).
+ */
+#define BUCKET_KEY_LEN_MAX 256
+
+/**
+ * 'Retry-After' seconds of the requests rejected by their bucket's
+ * admission control (a connection or a request token is available within a
+ * second).
+ */
+#define ADMISSION_RETRY_AFTER "1"
+
+/**
+ * Bucket shaper burst, in milliseconds of the bucket's bandwidth: tokens
+ * not spent are accumulated up to this amount.
+ */
+#define SHAPER_BURST_MSEC 250
+
+/**
+ * Maximum number of purge rules in effect (see 'tcdn_webcache_purge'),
+ * common to all the worker processes.
+ */
+#define PURGES_MAX 256
+
+/**
+ * Maximum length of a purge rule URI prefix or regular expression,
+ * including the terminating character.
+ */
+#define PURGE_PATTERN_LEN_MAX 512
+
+/**
+ * Default purge rules time-to-live, in seconds (see
+ * 'tcdn_webcache_purge_ttl' directive).
+ */
+#define PURGE_TTL_DEFAULT 3600
+
+/**
+ * Maximum number of cache warm-up jobs kept in the buckets shared memory
+ * zone (see 'tcdn_webcache_warmup'): the progress of finished jobs is
+ * reported until their slot is reused, oldest first.
+ */
+#define WARMUPS_MAX 16
+
+/**
+ * Maximum number of URLs of a cache warm-up job.
+ */
+#define WARMUP_URLS_MAX 10000
+
+/**
+ * Default and maximum number of cache warm-up subrequests in progress per
+ * job ('concurrency' argument).
+ */
+#define WARMUP_CONCURRENCY_DEFAULT 4
+#define WARMUP_CONCURRENCY_MAX 64
+
+/**
+ * Default and maximum cache warm-up subrequests rate per job, in
+ * subrequests per second ('rate' argument; zero means not limited).
+ */
+#define WARMUP_RATE_DEFAULT 20
+#define WARMUP_RATE_MAX 1000
+
+/**
+ * Cache warm-up job states (see 'ngx_http_tcdn_webcache_warmup_t').
+ */
+#define WARMUP_RUNNING 1
+#define WARMUP_DONE 2
+#define WARMUP_CANCELED 3
+#define WARMUP_ABORTED 4
+
+/**
+ * Default and maximum number of keys of a cache handoff (see
+ * 'tcdn_webcache_handoff'; 'limit' argument).
+ */
+#define HANDOFF_KEYS_DEFAULT 1000
+#define HANDOFF_KEYS_MAX 100000
+
+/**
+ * Maximum length of a cache handoff peer URL (see
+ * 'ngx_http_tcdn_webcache_handoff_t').
+ */
+#define HANDOFF_URL_LEN_MAX 512
+
+/**
+ * Default time, in seconds, the origin-servers and shields resolved
+ * addresses are used (see 'tcdn_webcache_resolve_valid' directive); zero
+ * means host-names are not resolved in the background.
+ */
+#define RESOLVE_VALID_DEFAULT 0
+
+/**
+ * Maximum buckets activation window transition timer delay, in
+ * milliseconds: farther transitions are waited for in several steps (see
+ * 'transition_timer_handler()').
+ */
+#define TRANSITION_DELAY_MAX (24* 60* 60* 1000)
+
+/**
+ * Signed URLs query-string arguments (see 'bucket_signature_check()'):
+ * token expiration time, in seconds since the Epoch, and token (hexadecimal
+ * HMAC of the expiration time digits followed by the URI path).
+ */
+#define REDIR_ARG_EXPIRES "expires"
+#define REDIR_ARG_TOKEN "token"
+
+/**
+ * Signed URLs HMAC block size in bytes (both MD5 and SHA-256).
+ */
+#define REDIR_HMAC_BLOCK_SIZE 64
+
 /** Source code file-name without path */
 #define __FILENAME__ strrchr("/" __FILE__, '/') + 1
 
@@ -126,6 +385,379 @@
 			"%s:%d: Assertion failed.\n", __FILE__, __LINE__);\
 	}
 
+/**
+ * Increments a module's metrics counter (see
+ * 'ngx_http_tcdn_webcache_metrics_t'). Safe to be used from any worker
+ * process or thread.
+ */
+#define METRICS_INC(MAIN_CONF, FIELD) \
+	if((MAIN_CONF)->metrics!= NULL) {\
+		(void)ngx_atomic_fetch_add(&(MAIN_CONF)->metrics->FIELD, 1);\
+	}
+
+/**
+ * TCDN-webcache module's metrics.
+ * Counters are shared by all the worker processes (allocated in the
+ * 'METRICS_ZONE_NAME' shared memory zone, so they survive configuration
+ * reloads) and exposed through the 'tcdn_webcache_status' handler.
+ * Request failures are counted by the HTTP status responded.
+ */
+typedef struct ngx_http_tcdn_webcache_metrics_s {
+	/**
+	 * Requests successfully routed to an origin-server.
+	 */
+	ngx_atomic_t requests_routed;
+	/**
+	 * Requests routed to the cluster peer owning the requested content
+	 * (also counted in 'requests_routed').
+	 */
+	ngx_atomic_t requests_peer;
+	/**
+	 * Requests routed to the bucket's shield (also counted in
+	 * 'requests_routed').
+	 */
+	ngx_atomic_t requests_shield;
+	/**
+	 * Requests detected to be in a forwarding loop (hop-count reached
+	 * 'HOPS_MAX'; responded '502 Bad Gateway').
+	 */
+	ngx_atomic_t requests_loop;
+	/**
+	 * Requests without HTTP host-header (responded '400 Bad Request').
+	 */
+	ngx_atomic_t requests_no_host;
+	/**
+	 * Requests received before any buckets information was available
+	 * (responded '503 Service Unavailable').
+	 */
+	ngx_atomic_t requests_no_table;
+	/**
+	 * Requests whose host-header does not match any bucket (responded
+	 * '502 Bad Gateway').
+	 */
+	ngx_atomic_t requests_unknown_host;
+	/**
+	 * Requests failed because of internal errors, e.g. memory allocation
+	 * (responded '500 Internal Server Error').
+	 */
+	ngx_atomic_t requests_internal_error;
+	/**
+	 * Tracker synchronizations that put a new buckets information set in use.
+	 */
+	ngx_atomic_t tracker_sync_updated;
+	/**
+	 * Tracker synchronizations responded '304 Not Modified'.
+	 */
+	ngx_atomic_t tracker_sync_not_modified;
+	/**
+	 * Tracker synchronizations failed (e.g. connection error, unexpected
+	 * response status or malformed buckets information); the last good
+	 * buckets information is kept in use.
+	 */
+	ngx_atomic_t tracker_sync_failed;
+	/**
+	 * Malformed buckets information sets received from the tracker (thus
+	 * discarded; the last good buckets information is kept in use).
+	 */
+	ngx_atomic_t tracker_sync_malformed;
+	/**
+	 * Buckets discarded when compiling the routing table (malformed or
+	 * duplicated; see 'tcdn_routing_table_discarded()').
+	 */
+	ngx_atomic_t buckets_discarded;
+	/**
+	 * Media segment prefetch subrequests issued (see 'segments_prefetch()').
+	 */
+	ngx_atomic_t prefetch_issued;
+	/**
+	 * Media segment prefetches skipped because the prefetch concurrency
+	 * budget was exhausted (see 'tcdn_webcache_prefetch_concurrency').
+	 */
+	ngx_atomic_t prefetch_skipped;
+	/**
+	 * Requests paced by their bucket's aggregate bandwidth limit (see
+	 * 'bucket_limits_apply()').
+	 */
+	ngx_atomic_t requests_shaped;
+	/**
+	 * Requests rejected because their bucket reached its maximum number of
+	 * connections (responded '503 Service Unavailable').
+	 */
+	ngx_atomic_t requests_over_connections;
+	/**
+	 * Requests rejected because their bucket exceeded its maximum request
+	 * rate (responded '503 Service Unavailable').
+	 */
+	ngx_atomic_t requests_over_rate;
+	/**
+	 * Requests denied by their bucket's access policy (responded '403
+	 * Forbidden'), by client address ('whitelist' or 'blacklist'), by
+	 * referer ('referer') or by country ('geoloc-allow' or 'geoloc-deny').
+	 */
+	ngx_atomic_t requests_denied_address;
+	ngx_atomic_t requests_denied_referer;
+	ngx_atomic_t requests_denied_geoloc;
+	/**
+	 * Purge rules added (see 'tcdn_webcache_purge').
+	 */
+	ngx_atomic_t purges;
+	/**
+	 * Requests not limited by their bucket because all the buckets shared
+	 * states were in use (see 'BUCKETS_STATE_MAX').
+	 */
+	ngx_atomic_t buckets_state_exhausted;
+	/**
+	 * Origin-servers and shields host-names that could not be resolved (see
+	 * 'tcdn_webcache_resolve_valid'); their requests are proxied to the
+	 * host-name.
+	 */
+	ngx_atomic_t resolve_failed;
+	/**
+	 * Requests to buckets out of their activation window, or disabled
+	 * ('enabled', 'startdate' and 'enddate'; responded '503 Service
+	 * Unavailable').
+	 */
+	ngx_atomic_t requests_inactive_bucket;
+	/**
+	 * Routing tables put in use at a buckets activation window transition
+	 * (see 'transition_timer_handler()').
+	 */
+	ngx_atomic_t buckets_transitions;
+	/**
+	 * Requests to buckets with signed URLs ('redir') missing their token,
+	 * with an expired or invalid one (responded '403 Forbidden').
+	 */
+	ngx_atomic_t requests_denied_signature;
+	/**
+	 * Cache warm-up jobs started (see 'tcdn_webcache_warmup').
+	 */
+	ngx_atomic_t warmups;
+	/**
+	 * Cache warm-up subrequests issued.
+	 */
+	ngx_atomic_t warmup_requests;
+	/**
+	 * Cache files sent to (exported) and received from (imported) other
+	 * nodes, and that failed to be received (see 'tcdn_webcache_handoff').
+	 */
+	ngx_atomic_t handoff_exported;
+	ngx_atomic_t handoff_imported;
+	ngx_atomic_t handoff_failed;
+	// Reserved for future use: add new counters here (and to
+	// 'ngx_http_tcdn_webcache_metrics_names[]')
+} ngx_http_tcdn_webcache_metrics_t;
+
+/**
+ * Webcache cluster peer (see 'tcdn_webcache_peer' directive).
+ */
+typedef struct ngx_http_tcdn_webcache_peer_s {
+	/**
+	 * Peer address, as "host:port".
+	 */
+	ngx_str_t name;
+	/**
+	 * Peer node tag; buckets declaring node tags are only served by the
+	 * peers with one of these tags. Defaults to the peer address.
+	 */
+	ngx_str_t tag;
+	/**
+	 * Peer weight (share of the content owned by the peer).
+	 */
+	ngx_uint_t weight;
+	/**
+	 * Set if the peer is this webcache node.
+	 */
+	ngx_flag_t self;
+} ngx_http_tcdn_webcache_peer_t;
+
+/**
+ * Cluster consistent-hashing ring point.
+ */
+typedef struct ngx_http_tcdn_webcache_ring_point_s {
+	uint32_t hash;
+	ngx_http_tcdn_webcache_peer_t *peer;
+} ngx_http_tcdn_webcache_ring_point_t;
+
+/**
+ * Cluster consistent-hashing ("ketama") ring: points sorted by hash.
+ */
+typedef struct ngx_http_tcdn_webcache_ring_s {
+	ngx_uint_t number;
+	ngx_http_tcdn_webcache_ring_point_t point[1];
+} ngx_http_tcdn_webcache_ring_t;
+
+/**
+ * Bucket shared state: the bucket's limits accounting, common to all the
+ * worker processes (see 'bucket_limits_apply()'):
+ * - admission control: number of the bucket's requests in progress (as in
+ * 'ngx_http_limit_conn_module.c'), checked against 'max_connections', and
+ * request tokens (as in 'ngx_http_limit_req_module.c', but rejecting at
+ * once instead of delaying), earned at the 'max_request_rate' rate up to a
+ * second worth of it;
+ * - bandwidth shaper: token bucket limiting the aggregate bandwidth of all
+ * the bucket's responses. Tokens are bytes, earned at the bucket's
+ * 'max_bandwidth' rate, up to 'SHAPER_BURST_MSEC' worth of it. Each
+ * response is granted at most its fair share of the burst (the burst
+ * divided by the number of the bucket's requests in progress) per write,
+ * and then waits for its fair share of the rate to send it, so that no
+ * connection starves the others.
+ * Should be accessed with the zone's slab pool mutex locked.
+ */
+typedef struct ngx_http_tcdn_webcache_bucket_state_s {
+	/**
+	 * Bucket key hash and length; the length is zero if the state is free.
+	 */
+	uint32_t hash;
+	size_t key_len;
+	/**
+	 * Bucket key (truncated to 'BUCKET_KEY_LEN_MAX').
+	 */
+	u_char key[BUCKET_KEY_LEN_MAX];
+	/**
+	 * Number of the bucket's requests in progress.
+	 */
+	ngx_uint_t active;
+	/**
+	 * Time-stamp of the last use of the state, in milliseconds.
+	 */
+	ngx_msec_t used;
+	/**
+	 * Available request tokens, in thousandths of a request, and time-stamp
+	 * of their last refill, in milliseconds.
+	 */
+	ngx_int_t requests;
+	ngx_msec_t requests_last;
+	/**
+	 * Available bandwidth tokens (bytes; may be negative after a write
+	 * overrun), and time-stamp of their last refill, in milliseconds.
+	 */
+	off_t tokens;
+	ngx_msec_t last;
+} ngx_http_tcdn_webcache_bucket_state_t;
+
+/**
+ * Purge rule (see 'tcdn_webcache_purge'): the cached objects of a bucket
+ * host-name whose URI matches the rule are invalidated by moving them to
+ * the rule's cache key generation (see '$tcdn_cache_generation'), until
+ * the rule expires.
+ * Should be accessed with the buckets zone slab pool mutex locked.
+ */
+typedef struct ngx_http_tcdn_webcache_purge_s {
+	/**
+	 * Rule serial number (cache key generation); zero if the rule is free.
+	 */
+	ngx_uint_t serial;
+	/**
+	 * Expiration time, in seconds since the Epoch.
+	 */
+	time_t expires;
+	/**
+	 * Bucket host-name (lower-case, without port), its hash and length.
+	 */
+	uint32_t hash;
+	size_t host_len;
+	u_char host[BUCKET_KEY_LEN_MAX];
+	/**
+	 * URI prefix, or regular expression if 'regex' is set (NULL-terminated).
+	 */
+	ngx_flag_t regex;
+	size_t pattern_len;
+	u_char pattern[PURGE_PATTERN_LEN_MAX];
+} ngx_http_tcdn_webcache_purge_t;
+
+/**
+ * Cache warm-up job progress (see 'tcdn_webcache_warmup'), so that it is
+ * reported by any worker process. It is only updated by the worker process
+ * running the job (counters are read without locking).
+ */
+typedef struct ngx_http_tcdn_webcache_warmup_s {
+	/**
+	 * Job identifier; zero if the slot is free.
+	 */
+	ngx_uint_t id;
+	/**
+	 * Job state (e.g. WARMUP_RUNNING).
+	 */
+	ngx_uint_t state;
+	/**
+	 * Set to cancel the job (see 'warmup_cancel()').
+	 */
+	volatile ngx_flag_t cancel;
+	/**
+	 * Worker process running the job.
+	 */
+	ngx_pid_t pid;
+	/**
+	 * Number of URLs, of URLs warmed up (responded successfully), failed,
+	 * skipped (owned by another cluster peer, or of another host-name), and
+	 * subrequests in progress.
+	 */
+	ngx_uint_t urls;
+	ngx_uint_t warmed;
+	ngx_uint_t failed;
+	ngx_uint_t skipped;
+	ngx_uint_t inflight;
+	size_t host_len;
+	u_char host[BUCKET_KEY_LEN_MAX];
+} ngx_http_tcdn_webcache_warmup_t;
+
+/**
+ * Buckets shared states (allocated in the 'BUCKETS_ZONE_NAME' shared memory
+ * zone), as an open-addressing hash table keyed by bucket identifier.
+ * States are never freed (only reused), so look-ups end at the first free
+ * one.
+ * The zone also holds the purge rules in effect and the cache warm-up jobs
+ * progress.
+ */
+typedef struct ngx_http_tcdn_webcache_buckets_state_s {
+	ngx_http_tcdn_webcache_bucket_state_t state[BUCKETS_STATE_MAX];
+	/**
+	 * Last purge rule serial number. It starts at the zone creation time, in
+	 * seconds since the Epoch, and is kept not lower than the current time,
+	 * so that the serial numbers of a restarted node never reuse the cache
+	 * key generations of a previous run.
+	 */
+	ngx_uint_t purge_serial;
+	/**
+	 * Number of purge rules in effect (read without locking as a hint: the
+	 * rules are not checked if there is none).
+	 */
+	volatile ngx_uint_t purges_num;
+	ngx_http_tcdn_webcache_purge_t purge[PURGES_MAX];
+	/**
+	 * Last cache warm-up job identifier.
+	 */
+	ngx_uint_t warmup_serial;
+	ngx_http_tcdn_webcache_warmup_t warmup[WARMUPS_MAX];
+} ngx_http_tcdn_webcache_buckets_state_t;
+
+#if (NGX_PCRE)
+/**
+ * Purge rule regular expression compiled by a worker process, in its own
+ * memory pool (released when the rule is replaced).
+ */
+typedef struct ngx_http_tcdn_webcache_purge_regex_s {
+	ngx_uint_t serial;
+	ngx_regex_t *regex;
+	ngx_pool_t *ngx_pool;
+} ngx_http_tcdn_webcache_purge_regex_t;
+#endif
+
+#if (NGX_OPENSSL)
+/**
+ * Bucket's signed URLs key (see 'tcdn_routing_table_keys()'): HMAC inner and
+ * outer hash states once the padded secret is digested. It is computed by
+ * the tracker synchronization thread, so that requests only digest their
+ * own message (see 'bucket_signature_check()').
+ */
+typedef struct ngx_http_tcdn_webcache_redir_key_s {
+	union {
+		MD5_CTX md5;
+		SHA256_CTX sha256;
+	} inner, outer;
+} ngx_http_tcdn_webcache_redir_key_t;
+#endif
+
 /**
  * TCDN-webcache module's main configuration context structure.
  * The fields in this structure are thought to be initially configured through
@@ -152,6 +784,38 @@ typedef struct ngx_http_tcdn_webcache_main_conf_s {
 	 * Specifies the refresh period, in seconds, for the buckets information.
 	 */
 	ngx_uint_t bucket_update_period;
+	/**
+	 * Webcache cluster peers (see 'ngx_http_tcdn_webcache_peer_t'); NULL if
+	 * no cluster is configured.
+	 */
+	ngx_array_t *peers;
+	/**
+	 * Addresses ('ngx_cidr_t') the hop-count header-field is trusted from
+	 * besides the cluster peers (see 'HOP_HEADER_NAME'); NULL if none.
+	 */
+	ngx_array_t *trusted;
+	/**
+	 * Maximum number of media segment prefetch subrequests in progress per
+	 * worker process (zero disables prefetch).
+	 */
+	ngx_uint_t prefetch_concurrency;
+	/**
+	 * Client country code (ISO 3166 two-letter code; e.g.
+	 * '$geoip_country_code') the buckets' 'geoloc-allow' and 'geoloc-deny'
+	 * lists are checked against; NULL if not configured (then they are not
+	 * enforced).
+	 */
+	ngx_http_complex_value_t *country;
+	/**
+	 * Purge rules time-to-live, in seconds (see 'tcdn_webcache_purge').
+	 */
+	time_t purge_ttl;
+	/**
+	 * Time, in seconds, the origin-servers and shields resolved addresses
+	 * are used before resolving the host-names again (zero if they are not
+	 * resolved in the background).
+	 */
+	time_t resolve_valid;
 
 	/* **** Other variables **** */
 	/**
@@ -173,21 +837,63 @@ typedef struct ngx_http_tcdn_webcache_main_conf_s {
 	 */
 	volatile int flag_sync_tracker_locked;
 	/*
-	 * Web-caching buckets register.
+	 * Web-caching buckets routing tables (compiled from the buckets
+	 * information; see 'tcdn_routing_table.h').
 	 * We work with two copies to be able to perform "ping-pong" buffering
 	 * strategy to optimize parallel buckets access.
 	 */
-#define JOBJ_BUCKETS_CACHE_NUM 2
-	struct json_object *jobj_buckets_cache[JOBJ_BUCKETS_CACHE_NUM];
+#define ROUTING_TABLE_NUM 2
+	tcdn_routing_table_t *routing_table[ROUTING_TABLE_NUM];
 	/**
-	 * Web-caching buckets register current index.
+	 * Web-caching buckets routing table current index.
 	 */
-	volatile int buckets_cache_idx;
-	/*
+	volatile int routing_table_idx;
+	/**
+	 * Buckets information set generation: incremented each time a new set is
+	 * put in use. Should be accessed with 'routing_table_mutex' locked.
+	 */
+	volatile ngx_uint_t buckets_generation;
+	/**
+	 * Next buckets activation window transition of the routing table in use
+	 * (in seconds since the Epoch; zero if none), and the routing table
+	 * compiled for that time (NULL if not compiled yet), to be put in use by
+	 * the transition timer at that very moment. Should be accessed with
+	 * 'routing_table_mutex' locked.
+	 */
+	volatile time_t routing_table_next_ts;
+	tcdn_routing_table_t *routing_table_next;
+	/**
+	 * Buckets activation window transition timer (see
+	 * 'transition_timer_handler()'). Only accessed by the worker's event
+	 * loop.
+	 */
+	ngx_event_t transition_timer;
+	/**
+	 * Entity-tag of the buckets information set currently in use, as
+	 * received from the tracker ('ETag' header-field). It is used to perform
+	 * conditional requests ('If-None-Match'); empty string if unknown.
+	 * Only accessed by the tracker synchronization thread.
+	 */
+	char tracker_etag[TRACKER_ETAG_MAX_LEN];
+	/**
+	 * Buckets information set currently in use, as received from the tracker
+	 * (heap allocated), kept to compile it again when the host-names are to
+	 * be resolved again or for the next buckets activation window
+	 * transition; NULL if none was received yet. Only accessed by the tracker
+	 * synchronization thread.
+	 */
+	char *tracker_body;
+	size_t tracker_body_size;
+	/**
+	 * Monotonic time-stamp, in seconds, of the last host-names resolution.
+	 * Only accessed by the tracker synchronization thread.
+	 */
+	uint64_t resolve_monot_ts_secs;
+	/*
 	 * Web-caching buckets mutual-exclusion lock.
-	 * This lock should be acquired to access 'jobj_buckets_cache[]'.
+	 * This lock should be acquired to access 'routing_table[]'.
 	 */
-	ngx_thread_mutex_t jobj_buckets_cache_mutex;
+	ngx_thread_mutex_t routing_table_mutex;
 	/**
 	 * Pointer to module's main context memory pool.
 	 */
@@ -206,8 +912,190 @@ typedef struct ngx_http_tcdn_webcache_main_conf_s {
 	 * This structure holds the thread function (handler), etc.
 	 */
 	ngx_thread_task_t *ngx_sync_tracker_thread_task;
+	/**
+	 * Cache handoff import thread task; its context is the import job (see
+	 * 'ngx_http_tcdn_webcache_handoff_t').
+	 */
+	ngx_thread_task_t *ngx_handoff_thread_task;
+	/**
+	 * Measure buckets lookup time flag. Set on configuration only if the
+	 * '$tcdn_lookup_time' variable is used (e.g. in a 'log_format'), to avoid
+	 * taking time-stamps otherwise.
+	 */
+	ngx_flag_t flag_lookup_time;
+	/**
+	 * Module's metrics (in shared memory; see
+	 * 'ngx_http_tcdn_webcache_metrics_t'). Set when the shared memory zone
+	 * is initialized.
+	 */
+	ngx_http_tcdn_webcache_metrics_t *metrics;
+	/**
+	 * Buckets shared states and their shared memory zone slab pool (see
+	 * 'ngx_http_tcdn_webcache_buckets_state_t'). Set when the shared memory
+	 * zone is initialized.
+	 */
+	ngx_http_tcdn_webcache_buckets_state_t *buckets_state;
+	ngx_slab_pool_t *buckets_shpool;
+	/**
+	 * Cluster consistent-hashing ring, built on configuration from 'peers';
+	 * NULL if no cluster is configured.
+	 */
+	ngx_http_tcdn_webcache_ring_t *peers_ring;
+	/**
+	 * This node's peer (the 'self' one); NULL if not declared.
+	 */
+	ngx_http_tcdn_webcache_peer_t *peer_self;
+	/**
+	 * Cluster peers addresses ('ngx_cidr_t', resolved on configuration from
+	 * 'peers', the 'self' one excluded); NULL if no cluster is configured.
+	 */
+	ngx_array_t *peers_addrs;
+	/**
+	 * Number of media segment prefetch subrequests in progress in this
+	 * worker process.
+	 */
+	ngx_uint_t prefetch_inflight;
+#if (NGX_PCRE)
+	/**
+	 * Purge rules regular expressions compiled by this worker process,
+	 * indexed as the rules; NULL until a regular expression rule is checked.
+	 */
+	ngx_http_tcdn_webcache_purge_regex_t *purge_regex;
+#endif
 } ngx_http_tcdn_webcache_main_conf_t;
 
+/**
+ * Media segment prefetch subrequest context (see 'segments_prefetch()').
+ * It is released (accounted out of 'prefetch_inflight') either when the
+ * subrequest is finalized or, if it never is (e.g. the connection is
+ * terminated), when the request memory pool is destroyed.
+ */
+typedef struct ngx_http_tcdn_webcache_prefetch_s {
+	ngx_http_tcdn_webcache_main_conf_t *main_conf;
+	ngx_flag_t released;
+} ngx_http_tcdn_webcache_prefetch_t;
+
+/**
+ * Cache warm-up URL (see 'tcdn_webcache_warmup'): URI path (decoded, as the
+ * requests' one) and query-string.
+ */
+typedef struct ngx_http_tcdn_webcache_warmup_uri_s {
+	ngx_str_t uri;
+	ngx_str_t args;
+} ngx_http_tcdn_webcache_warmup_uri_t;
+
+/**
+ * Cache warm-up job, run by the worker process that received it (see
+ * 'warmup_start()'). Its subrequests are background subrequests of the
+ * warm-up request, which holds a reference to keep it (and the job memory,
+ * allocated in its pool) until the job ends.
+ */
+typedef struct ngx_http_tcdn_webcache_warmup_job_s {
+	ngx_http_tcdn_webcache_main_conf_t *main_conf;
+	ngx_http_request_t *r;
+	/**
+	 * Job progress (shared memory; see 'ngx_http_tcdn_webcache_warmup_t').
+	 */
+	ngx_http_tcdn_webcache_warmup_t *warmup;
+	ngx_uint_t id;
+	/**
+	 * Server the subrequests are run in (first server routing the buckets
+	 * requests), and bucket host-name, as the subrequests host-header.
+	 */
+	ngx_http_core_srv_conf_t *server;
+	ngx_table_elt_t host;
+	ngx_http_tcdn_webcache_warmup_uri_t *uris;
+	ngx_uint_t uris_num;
+	/**
+	 * Next URL to be requested, and number of subrequests in progress.
+	 */
+	ngx_uint_t next;
+	ngx_uint_t inflight;
+	ngx_uint_t concurrency;
+	/**
+	 * Rate limit: interval between subrequests, in milliseconds (zero if
+	 * not limited), and time the next one may be issued at; the timer is
+	 * armed while it is waited for.
+	 */
+	ngx_msec_t interval;
+	ngx_msec_t next_msec;
+	ngx_event_t timer;
+	ngx_flag_t finished;
+} ngx_http_tcdn_webcache_warmup_job_t;
+
+/**
+ * Cache warm-up subrequest context (see 'warmup_done()').
+ */
+typedef struct ngx_http_tcdn_webcache_warmup_sr_s {
+	ngx_http_tcdn_webcache_warmup_job_t *job;
+	ngx_flag_t done;
+} ngx_http_tcdn_webcache_warmup_sr_t;
+
+/**
+ * Cache handoff import job (see 'tcdn_webcache_handoff'): the context of the
+ * import off-load thread task ('ngx_handoff_thread_task'). One job at a time
+ * is run per worker process.
+ */
+typedef struct ngx_http_tcdn_webcache_handoff_s {
+	ngx_http_tcdn_webcache_main_conf_t *main_conf;
+#if (NGX_HTTP_CACHE)
+	ngx_http_file_cache_t *cache;
+#endif
+	/**
+	 * Peer's handoff URL with the cache zone argument (e.g.
+	 * "http://10.0.0.1:8089/tcdn_handoff?zone=one"), and the keys list
+	 * request arguments (e.g. "&limit=1000&bucket=86").
+	 */
+	char url[HANDOFF_URL_LEN_MAX];
+	char list_args[HANDOFF_URL_LEN_MAX];
+	/**
+	 * Number of files imported, already cached, and failed. Only accessed by
+	 * the thread (and by the completion handler once it finished).
+	 */
+	ngx_uint_t imported;
+	ngx_uint_t cached;
+	ngx_uint_t failed;
+	/**
+	 * Job in progress flag. Only accessed by the worker's event loop.
+	 */
+	ngx_flag_t running;
+} ngx_http_tcdn_webcache_handoff_t;
+
+/**
+ * Request bucket limits context (see 'bucket_limits_apply()'). It is the
+ * data of a request pool clean-up handler that accounts the request out of
+ * its bucket's requests in progress, and of the request's output shaper
+ * (see 'ngx_http_shaper_t'), if the bucket's bandwidth is limited.
+ */
+typedef struct ngx_http_tcdn_webcache_bucket_req_s {
+	ngx_http_shaper_t shaper;
+	ngx_slab_pool_t *shpool;
+	ngx_http_tcdn_webcache_bucket_state_t *bucket_state;
+	/**
+	 * Bucket's aggregate bandwidth, in bytes per second, and burst, in
+	 * bytes.
+	 */
+	off_t rate;
+	off_t burst;
+	/**
+	 * Time, in milliseconds, the response may send again at its fair share
+	 * of the bucket's bandwidth.
+	 */
+	ngx_msec_t next;
+} ngx_http_tcdn_webcache_bucket_req_t;
+
+/**
+ * TCDN-webcache module's server configuration context structure.
+ */
+typedef struct ngx_http_tcdn_webcache_srv_conf_s {
+	/**
+	 * Route the requests received by this server to the buckets
+	 * origin-servers (enabled by default). It is disabled, for example, for
+	 * servers dedicated to monitoring (see 'tcdn_webcache_status').
+	 */
+	ngx_flag_t routing;
+} ngx_http_tcdn_webcache_srv_conf_t;
+
 /**
  * Curl memory context structure.
  * This type will be used as the private data passed to the read callback
@@ -217,11 +1105,116 @@ typedef struct ngx_http_tcdn_webcache_main_conf_s {
 typedef struct curl_mem_ctx_s {
   char *data;
   size_t size;
+  size_t capacity;
+  /**
+   * Entity-tag received in the response headers (empty string if none).
+   */
+  char etag[TRACKER_ETAG_MAX_LEN];
   ngx_log_t *ngx_log;
 } curl_mem_ctx_t;
 
+/**
+ * TCDN-webcache module's request context structure.
+ * Holds how the request was routed, to be exposed through the module's
+ * variables (see 'ngx_http_tcdn_webcache_vars').
+ * Note that Nginx clears the request modules' contexts on internal
+ * redirection (see 'ngx_http_internal_redirect()'); thus, this structure is
+ * allocated as the data of a request's pool clean-up handler, so it can be
+ * recovered after the redirection (see 'ngx_http_tcdn_webcache_req_ctx_get()').
+ */
+typedef struct ngx_http_tcdn_webcache_req_ctx_s {
+	/**
+	 * Request the context was created for (subrequests share the pool of
+	 * their main request).
+	 */
+	ngx_http_request_t *request;
+	/**
+	 * Cache warm-up subrequest (see 'tcdn_webcache_warmup'): routed as a
+	 * client request, but the bucket's access policy, signed URLs, limits
+	 * and activation window are not applied.
+	 */
+	ngx_flag_t warmup;
+	/**
+	 * Buckets lookup time in microseconds; -1 if not measured.
+	 */
+	ngx_int_t lookup_time_usecs;
+	/**
+	 * Generation of the buckets information set used to route the request.
+	 */
+	ngx_uint_t table_generation;
+	/**
+	 * Bucket identifier (bucket's 'id' field); empty if no bucket matched.
+	 */
+	ngx_str_t bucket_id;
+	/**
+	 * Origin-server "host:port" (or "address:port", if resolved); empty if
+	 * no origin was selected.
+	 */
+	ngx_str_t origin;
+	/**
+	 * Origin-server host-header value: "host", or "host:port" if the port is
+	 * not the default one; empty if no origin was selected.
+	 */
+	ngx_str_t origin_host;
+	/**
+	 * Origin-server URL scheme: "https" if the bucket's origin-server is
+	 * fetched over TLS, "http" otherwise; empty if no origin was selected.
+	 */
+	ngx_str_t origin_scheme;
+	/**
+	 * Cluster peer "host:port" the request is forwarded to; empty if the
+	 * request is served by this node.
+	 */
+	ngx_str_t peer;
+	/**
+	 * Shield "host:port" the request is forwarded to; empty if the request
+	 * is not shielded.
+	 */
+	ngx_str_t shield;
+	/**
+	 * Request hop-count (value of the 'HOP_HEADER_NAME' header-field); zero
+	 * if the request comes directly from a client (or from any source not
+	 * trusted to forward requests).
+	 */
+	ngx_uint_t hop;
+	/**
+	 * Non-zero if the request was forwarded by a cluster peer (see
+	 * 'request_hop_count()'), so it is served by this node.
+	 */
+	ngx_flag_t from_peer;
+	/**
+	 * Bucket's stale-while-revalidate window in seconds (zero if disabled).
+	 */
+	ngx_uint_t stale_while_revalidate;
+	/**
+	 * Bucket's stale-if-error window in seconds (zero if disabled).
+	 */
+	ngx_uint_t stale_if_error;
+	/**
+	 * Number of next media segments to be prefetched (zero if disabled, or
+	 * if the content is not cached by this node).
+	 */
+	ngx_uint_t prefetch;
+	/**
+	 * Next media segments owned by another cluster peer, thus not
+	 * prefetched by this node (bit 'i- 1' set for the i-th next segment).
+	 */
+	ngx_uint_t prefetch_foreign;
+	/**
+	 * Bucket's byte-range slice size in bytes (zero if objects are cached
+	 * whole).
+	 */
+	ngx_uint_t slice;
+	/**
+	 * Cache key generation of the requested content (see
+	 * '$tcdn_cache_generation'); empty if never invalidated.
+	 */
+	ngx_str_t cache_generation;
+} ngx_http_tcdn_webcache_req_ctx_t;
+
 /* **** Prototypes **** */
 
+static ngx_int_t ngx_http_tcdn_webcache_add_variables(ngx_conf_t *ngx_conf);
 static ngx_int_t ngx_http_tcdn_webcache_init(ngx_conf_t *ngx_conf);
 
 static void* ngx_http_tcdn_webcache_main_conf_create(ngx_conf_t *ngx_conf);
@@ -230,19 +1223,144 @@ static void ngx_http_tcdn_webcache_main_conf_release(
 		ngx_pool_t *ngx_pool, ngx_log_t *ngx_log);
 static char* ngx_http_tcdn_webcache_set_main(ngx_conf_t *ngx_conf,
 		ngx_command_t *ngx_command, void *opaque_main_conf);
+static void* ngx_http_tcdn_webcache_srv_conf_create(ngx_conf_t *ngx_conf);
+static char* ngx_http_tcdn_webcache_srv_conf_merge(ngx_conf_t *ngx_conf,
+		void *parent, void *child);
+static char* ngx_http_tcdn_webcache_set_status(ngx_conf_t *ngx_conf,
+		ngx_command_t *ngx_command, void *opaque_conf);
+static char* ngx_http_tcdn_webcache_set_peer(ngx_conf_t *ngx_conf,
+		ngx_command_t *ngx_command, void *opaque_main_conf);
+static char* ngx_http_tcdn_webcache_set_trusted(ngx_conf_t *ngx_conf,
+		ngx_command_t *ngx_command, void *opaque_main_conf);
+static char* ngx_http_tcdn_webcache_set_purge(ngx_conf_t *ngx_conf,
+		ngx_command_t *ngx_command, void *opaque_conf);
+static char* ngx_http_tcdn_webcache_set_warmup(ngx_conf_t *ngx_conf,
+		ngx_command_t *ngx_command, void *opaque_conf);
+#if (NGX_HTTP_CACHE)
+static char* ngx_http_tcdn_webcache_set_handoff(ngx_conf_t *ngx_conf,
+		ngx_command_t *ngx_command, void *opaque_conf);
+#endif
+static ngx_int_t ngx_http_tcdn_webcache_metrics_zone_init(
+		ngx_shm_zone_t *shm_zone, void *data);
+static ngx_int_t ngx_http_tcdn_webcache_buckets_zone_init(
+		ngx_shm_zone_t *shm_zone, void *data);
 static void exit_process(ngx_cycle_t *cycle);
 static void exit_master(ngx_cycle_t *cycle);
 
 static ngx_int_t ngx_http_tcdn_webcache_handler_phase0(ngx_http_request_t *r);
+static ngx_int_t ngx_http_tcdn_webcache_status_handler(ngx_http_request_t *r);
+static ngx_int_t ngx_http_tcdn_webcache_purge_handler(ngx_http_request_t *r);
+static ngx_int_t ngx_http_tcdn_webcache_warmup_handler(ngx_http_request_t *r);
+#if (NGX_HTTP_CACHE)
+static ngx_int_t ngx_http_tcdn_webcache_handoff_handler(ngx_http_request_t *r);
+#endif
+static ngx_int_t host_arg_parse(ngx_http_request_t *r, ngx_str_t *arg,
+		ngx_str_t *host);
+static ngx_int_t text_response_send(ngx_http_request_t *r, ngx_uint_t status,
+		ngx_buf_t *b);
+static ngx_http_tcdn_webcache_req_ctx_t* ngx_http_tcdn_webcache_req_ctx_get(
+		ngx_http_request_t *r);
+static ngx_http_tcdn_webcache_req_ctx_t* ngx_http_tcdn_webcache_req_ctx_create(
+		ngx_http_request_t *r);
+static void ngx_http_tcdn_webcache_req_ctx_cleanup(void *data);
 static ngx_int_t buckets_information_fetch_host_origin(
+		ngx_http_tcdn_webcache_main_conf_t *main_conf, ngx_http_request_t *r,
+		ngx_log_t *ngx_log, ngx_http_tcdn_webcache_req_ctx_t *ctx);
+static ngx_uint_t request_hop_count(
+		ngx_http_tcdn_webcache_main_conf_t *main_conf, ngx_http_request_t *r);
+static ngx_flag_t cidrs_match(ngx_array_t *cidrs, struct sockaddr *sockaddr);
+static ngx_int_t bucket_access_check(
+		ngx_http_tcdn_webcache_main_conf_t *main_conf, ngx_http_request_t *r,
+		ngx_log_t *ngx_log, const tcdn_routing_entry_t *entry);
+static ngx_int_t bucket_signature_check(
+		ngx_http_tcdn_webcache_main_conf_t *main_conf, ngx_http_request_t *r,
+		ngx_log_t *ngx_log, const tcdn_routing_entry_t *entry);
+static ngx_int_t bucket_limits_apply(
+		ngx_http_tcdn_webcache_main_conf_t *main_conf, ngx_http_request_t *r,
+		ngx_log_t *ngx_log, const tcdn_routing_entry_t *entry);
+static ngx_int_t bucket_limits_reject(ngx_http_request_t *r,
+		ngx_log_t *ngx_log);
+static ngx_http_tcdn_webcache_bucket_state_t* bucket_state_get(
+		ngx_http_tcdn_webcache_buckets_state_t *buckets_state,
+		const char *key, size_t key_len);
+static ngx_msec_t bucket_shaper_acquire(ngx_http_request_t *r, off_t *limit);
+static void bucket_shaper_release(ngx_http_request_t *r, off_t limit,
+		off_t sent);
+static void bucket_limits_cleanup(void *data);
+static ngx_uint_t purges_match(ngx_http_tcdn_webcache_main_conf_t *main_conf,
+		ngx_log_t *ngx_log, const char *host, size_t host_len,
+		ngx_str_t *uri);
+#if (NGX_PCRE)
+static ngx_int_t purge_regex_match(
+		ngx_http_tcdn_webcache_main_conf_t *main_conf, ngx_log_t *ngx_log,
+		ngx_uint_t slot, ngx_http_tcdn_webcache_purge_t *purge, ngx_str_t *uri);
+#endif
+static ngx_http_tcdn_webcache_ring_t* peers_ring_create(ngx_conf_t *ngx_conf,
+		ngx_array_t *peers, ngx_http_tcdn_webcache_peer_t **ref_peer_self);
+static ngx_array_t* peers_addrs_create(ngx_conf_t *ngx_conf,
+		ngx_array_t *peers);
+static int peers_ring_cmp_points(const void *one, const void *two);
+static ngx_http_tcdn_webcache_peer_t* peers_ring_find(
+		ngx_http_tcdn_webcache_ring_t *ring, uint32_t hash,
+		const char *node_tags, size_t node_tags_len);
+static ngx_http_tcdn_webcache_peer_t* peers_select(
 		ngx_http_tcdn_webcache_main_conf_t *main_conf,
-		ngx_http_headers_in_t *headers_in, ngx_log_t *ngx_log,
-		char **ref_orig_host, char **ref_orig_port);
-static ngx_int_t buckets_information_fetch_host_origin2(
-		struct json_object *jobj_buckets_cache, ngx_str_t *hdr_host,
-		ngx_log_t *ngx_log, char **ref_orig_host, char **ref_orig_port);
+		const tcdn_routing_entry_t *entry, const ngx_str_t *uri,
+		const ngx_str_t *args);
 static ngx_int_t perform_http_internal_redirect(ngx_http_request_t *r,
-		ngx_log_t *ngx_log, char *orig_host, char *orig_port);
+		ngx_log_t *ngx_log, const char *path, ngx_str_t *upstream);
+static ngx_int_t segment_number_find(const ngx_str_t *uri, size_t *ref_pos,
+		size_t *ref_len);
+static u_char* segment_uri_print(u_char *p, const ngx_str_t *uri,
+		size_t number_pos, size_t number_len, ngx_uint_t number);
+static ngx_uint_t segments_prefetch_foreign(
+		ngx_http_tcdn_webcache_main_conf_t *main_conf, ngx_http_request_t *r,
+		ngx_log_t *ngx_log, const tcdn_routing_entry_t *entry,
+		ngx_uint_t prefetch);
+static void segments_prefetch(ngx_http_tcdn_webcache_main_conf_t *main_conf,
+		ngx_http_request_t *r, ngx_log_t *ngx_log, ngx_uint_t prefetch,
+		ngx_uint_t foreign, const char *path, const ngx_str_t *upstream,
+		const ngx_str_t *uri, const ngx_str_t *args);
+static ngx_int_t segments_prefetch_done(ngx_http_request_t *r, void *data,
+		ngx_int_t rc);
+static void segments_prefetch_cleanup(void *data);
+static void warmup_body_handler(ngx_http_request_t *r);
+static ngx_int_t warmup_start(ngx_http_request_t *r,
+		ngx_http_tcdn_webcache_main_conf_t *main_conf);
+static ngx_int_t warmup_bucket_host(
+		ngx_http_tcdn_webcache_main_conf_t *main_conf, ngx_http_request_t *r,
+		const ngx_str_t *bucket_id, ngx_str_t *host);
+static ngx_int_t warmup_url_parse(ngx_http_request_t *r, ngx_str_t *host,
+		const ngx_str_t *base, u_char *p, u_char *last,
+		ngx_http_tcdn_webcache_warmup_uri_t *warmup_uri);
+static ngx_int_t warmup_report(ngx_http_request_t *r,
+		ngx_http_tcdn_webcache_main_conf_t *main_conf);
+static ngx_int_t warmup_cancel(ngx_http_request_t *r,
+		ngx_http_tcdn_webcache_main_conf_t *main_conf);
+static void warmup_issue(ngx_http_tcdn_webcache_warmup_job_t *job);
+static void warmup_subrequest(ngx_http_tcdn_webcache_warmup_job_t *job,
+		ngx_http_tcdn_webcache_warmup_uri_t *warmup_uri);
+static ngx_int_t warmup_done(ngx_http_request_t *r, void *data,
+		ngx_int_t rc);
+static void warmup_timer_handler(ngx_event_t *ev);
+static void warmup_finish(ngx_http_tcdn_webcache_warmup_job_t *job);
+static void warmup_cleanup(void *data);
+#if (NGX_HTTP_CACHE)
+static ngx_http_file_cache_t* handoff_cache_get(const ngx_str_t *zone);
+static ngx_int_t handoff_keys_send(ngx_http_request_t *r,
+		ngx_http_file_cache_t *cache);
+static ngx_int_t handoff_file_send(ngx_http_request_t *r,
+		ngx_http_tcdn_webcache_main_conf_t *main_conf,
+		ngx_http_file_cache_t *cache, ngx_str_t *key_hex);
+static ngx_int_t handoff_start(ngx_http_request_t *r,
+		ngx_http_tcdn_webcache_main_conf_t *main_conf,
+		ngx_http_file_cache_t *cache, ngx_str_t *zone);
+static void handoff_thr(void *data, ngx_log_t *ngx_log);
+static void handoff_thr_completion(ngx_event_t *ev);
+static ngx_int_t handoff_file_fetch(ngx_http_tcdn_webcache_handoff_t *handoff,
+		CURL *curl_handle, const char *key_hex, const char *file_name,
+		ngx_log_t *ngx_log);
+#endif
 
 static ngx_int_t synchronize_buckets_information(
 		ngx_http_tcdn_webcache_main_conf_t *main_conf, ngx_log_t *ngx_log);
@@ -252,10 +1370,42 @@ static ngx_int_t synchronize_buckets_information_launch_thread(
 static void sync_tracker_thr(void *data, ngx_log_t *ngx_log_arg);
 static size_t curl_write_body_callback(void *contents, size_t size,
 		size_t nmemb, void *userp);
+static size_t curl_header_callback(char *buffer, size_t size, size_t nitems,
+		void *userp);
 static void sync_tracker_thr_completion(ngx_event_t *ev);
+static ngx_int_t routing_table_prepare(
+		ngx_http_tcdn_webcache_main_conf_t *main_conf,
+		tcdn_routing_table_t *routing_table, ngx_log_t *ngx_log);
+static void transition_timer_arm(ngx_http_tcdn_webcache_main_conf_t *main_conf,
+		ngx_log_t *ngx_log);
+static void transition_timer_handler(ngx_event_t *ev);
+static int host_resolve(const char *host, char *addr, void *opaque);
+#if (NGX_OPENSSL)
+static int redir_key_compute(const char *secret, size_t secret_len,
+		unsigned int hash_type, void *key, void *opaque);
+#endif
+
+static ngx_int_t ngx_http_tcdn_webcache_lookup_time_variable(
+		ngx_http_request_t *r, ngx_http_variable_value_t *v, uintptr_t data);
+static ngx_int_t ngx_http_tcdn_webcache_table_generation_variable(
+		ngx_http_request_t *r, ngx_http_variable_value_t *v, uintptr_t data);
+static ngx_int_t ngx_http_tcdn_webcache_str_variable(ngx_http_request_t *r,
+		ngx_http_variable_value_t *v, uintptr_t data);
+static ngx_int_t ngx_http_tcdn_webcache_hop_next_variable(
+		ngx_http_request_t *r, ngx_http_variable_value_t *v, uintptr_t data);
+static ngx_int_t ngx_http_tcdn_webcache_uint_variable(ngx_http_request_t *r,
+		ngx_http_variable_value_t *v, uintptr_t data);
 
 /* **** Nginx module-specific definitions **** */
 
+#if (NGX_HTTP_CACHE)
+/**
+ * Proxy module: tags the proxy caches shared memory zones (see
+ * 'handoff_cache_get()').
+ */
+extern ngx_module_t ngx_http_proxy_module;
+#endif
+
 /**
  * TCDN-webcache module's directives:<br>
  * Define a set of "commands" this module will be able to handle.
@@ -336,9 +1486,326 @@ static ngx_command_t ngx_http_tcdn_webcache_commands[]= {
 				offsetof(ngx_http_tcdn_webcache_main_conf_t, bucket_uri),
 				NULL
 		},
+		{
+				ngx_string("tcdn_webcache_peer"),
+				NGX_HTTP_MAIN_CONF|NGX_CONF_1MORE,
+				ngx_http_tcdn_webcache_set_peer,
+				NGX_HTTP_MAIN_CONF_OFFSET,
+				0,
+				NULL
+		},
+		{
+				ngx_string("tcdn_webcache_trusted"),
+				NGX_HTTP_MAIN_CONF|NGX_CONF_TAKE1,
+				ngx_http_tcdn_webcache_set_trusted,
+				NGX_HTTP_MAIN_CONF_OFFSET,
+				0,
+				NULL
+		},
+		{
+				ngx_string("tcdn_webcache_routing"),
+				NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_CONF_FLAG,
+				ngx_conf_set_flag_slot,
+				NGX_HTTP_SRV_CONF_OFFSET,
+				offsetof(ngx_http_tcdn_webcache_srv_conf_t, routing),
+				NULL
+		},
+		{
+				ngx_string("tcdn_webcache_prefetch_concurrency"),
+				NGX_HTTP_MAIN_CONF|NGX_CONF_TAKE1,
+				ngx_conf_set_num_slot,
+				NGX_HTTP_MAIN_CONF_OFFSET,
+				offsetof(ngx_http_tcdn_webcache_main_conf_t,
+						prefetch_concurrency),
+				NULL
+		},
+		{
+				ngx_string("tcdn_webcache_country"),
+				NGX_HTTP_MAIN_CONF|NGX_CONF_TAKE1,
+				ngx_http_set_complex_value_slot,
+				NGX_HTTP_MAIN_CONF_OFFSET,
+				offsetof(ngx_http_tcdn_webcache_main_conf_t, country),
+				NULL
+		},
+		{
+				ngx_string("tcdn_webcache_status"),
+				NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_NOARGS,
+				ngx_http_tcdn_webcache_set_status,
+				0,
+				0,
+				NULL
+		},
+		{
+				ngx_string("tcdn_webcache_purge"),
+				NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_NOARGS,
+				ngx_http_tcdn_webcache_set_purge,
+				0,
+				0,
+				NULL
+		},
+		{
+				ngx_string("tcdn_webcache_warmup"),
+				NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_NOARGS,
+				ngx_http_tcdn_webcache_set_warmup,
+				0,
+				0,
+				NULL
+		},
+#if (NGX_HTTP_CACHE)
+		{
+				ngx_string("tcdn_webcache_handoff"),
+				NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_NOARGS,
+				ngx_http_tcdn_webcache_set_handoff,
+				0,
+				0,
+				NULL
+		},
+#endif
+		{
+				ngx_string("tcdn_webcache_purge_ttl"),
+				NGX_HTTP_MAIN_CONF|NGX_CONF_TAKE1,
+				ngx_conf_set_sec_slot,
+				NGX_HTTP_MAIN_CONF_OFFSET,
+				offsetof(ngx_http_tcdn_webcache_main_conf_t, purge_ttl),
+				NULL
+		},
+		{
+				ngx_string("tcdn_webcache_resolve_valid"),
+				NGX_HTTP_MAIN_CONF|NGX_CONF_TAKE1,
+				ngx_conf_set_sec_slot,
+				NGX_HTTP_MAIN_CONF_OFFSET,
+				offsetof(ngx_http_tcdn_webcache_main_conf_t, resolve_valid),
+				NULL
+		},
 		ngx_null_command
 };
 
+/**
+ * TCDN-webcache module's variables.
+ * They expose how each request was routed, to be used for example in access
+ * logs 'log_format' (all of them are evaluated lazily, on demand):
+ * <ul>
+ * <li>$tcdn_lookup_time: bucket lookup time in seconds, with microseconds
+ * resolution (e.g. "0.000012");</li>
+ * <li>$tcdn_table_generation: generation of the buckets information set used
+ * to route the request;</li>
+ * <li>$tcdn_bucket_id: identifier of the matching bucket;</li>
+ * <li>$tcdn_origin: selected origin-server, as "host:port" (or
+ * "address:port" if resolved; see 'tcdn_webcache_resolve_valid');</li>
+ * <li>$tcdn_origin_host: selected origin-server host-header value, as
+ * "host" (or "host:port" if the port is not 80, or 443 for TLS);</li>
+ * <li>$tcdn_origin_scheme: selected origin-server URL scheme, "https" if
+ * the bucket's origin-server is fetched over TLS ('https.enabled') or
+ * "http";</li>
+ * <li>$tcdn_peer: cluster peer the request is forwarded to, as "host:port"
+ * (not found if served by this node);</li>
+ * <li>$tcdn_shield: bucket's shield the request is forwarded to, as
+ * "host:port" (not found if not shielded);</li>
+ * <li>$tcdn_hop_next: hop-count to be sent when forwarding the request to
+ * another webcache node (see 'HOP_HEADER_NAME');</li>
+ * <li>$tcdn_stale_while_revalidate, $tcdn_stale_if_error: bucket's stale
+ * windows in seconds (not found if disabled), to be used in the
+ * 'proxy_cache_stale_while_revalidate' and 'proxy_cache_stale_if_error'
+ * directives of the caching location:
+ * @code
+ *     location ~ /proxy/(.*) {
+ *         proxy_pass http://$1;
+ *         proxy_cache_stale_while_revalidate $tcdn_stale_while_revalidate;
+ *         proxy_cache_stale_if_error $tcdn_stale_if_error;
+ *     }
+ * @endcode
+ * An expired object is then served at once while a single background
+ * subrequest refreshes it, or served if the origin-server fails.</li>
+ * <li>$tcdn_slice: bucket's byte-range slice size in bytes (not found if
+ * objects are cached whole), to be used in the 'slice' directive of the
+ * caching location, with the slice range in the cache key:
+ * @code
+ *     location ~ /proxy/(.*) {
+ *         proxy_pass http://$1;
+ *         slice $tcdn_slice;
+ *         proxy_cache_key http://$1$slice_range;
+ *         proxy_set_header Range $slice_range;
+ *         proxy_cache_valid 200 206 1h;
+ *     }
+ * @endcode
+ * Slice subrequests are issued to the redirected URI, so they reach the
+ * caching location directly, without a new bucket lookup, and share the
+ * request context. Cache keys of buckets without slices are unchanged (the
+ * slice range is empty).</li>
+ * <li>$tcdn_cache_generation: cache key generation of the requested content,
+ * as "#L" or "#L.P", where L is the bucket's last invalidation time
+ * ('lastinvalidated') and P the serial number of the latest purge rule
+ * matching the request (see 'tcdn_webcache_purge'); not found if the
+ * content was never invalidated. To be appended to the cache key of the
+ * caching location:
+ * @code
+ *     location ~ /proxy/(.*) {
+ *         proxy_pass http://$1;
+ *         proxy_cache_key http://$1$slice_range$tcdn_cache_generation;
+ *     }
+ * @endcode
+ * Invalidated objects are thus never hit again (the check is the cache key
+ * computation), and are deleted by the cache manager once inactive (see
+ * 'proxy_cache_path' 'inactive' parameter), with no cache walk.</li>
+ * </ul>
+ * Variables are not found (empty) for requests not routed by this module.
+ */
+static ngx_http_variable_t ngx_http_tcdn_webcache_vars[]= {
+		{
+				ngx_string("tcdn_lookup_time"),
+				NULL,
+				ngx_http_tcdn_webcache_lookup_time_variable,
+				0,
+				NGX_HTTP_VAR_NOCACHEABLE,
+				0
+		},
+		{
+				ngx_string("tcdn_table_generation"),
+				NULL,
+				ngx_http_tcdn_webcache_table_generation_variable,
+				0,
+				NGX_HTTP_VAR_NOCACHEABLE,
+				0
+		},
+		{
+				ngx_string("tcdn_bucket_id"),
+				NULL,
+				ngx_http_tcdn_webcache_str_variable,
+				offsetof(ngx_http_tcdn_webcache_req_ctx_t, bucket_id),
+				NGX_HTTP_VAR_NOCACHEABLE,
+				0
+		},
+		{
+				ngx_string("tcdn_origin"),
+				NULL,
+				ngx_http_tcdn_webcache_str_variable,
+				offsetof(ngx_http_tcdn_webcache_req_ctx_t, origin),
+				NGX_HTTP_VAR_NOCACHEABLE,
+				0
+		},
+		{
+				ngx_string("tcdn_origin_host"),
+				NULL,
+				ngx_http_tcdn_webcache_str_variable,
+				offsetof(ngx_http_tcdn_webcache_req_ctx_t, origin_host),
+				NGX_HTTP_VAR_NOCACHEABLE,
+				0
+		},
+		{
+				ngx_string("tcdn_origin_scheme"),
+				NULL,
+				ngx_http_tcdn_webcache_str_variable,
+				offsetof(ngx_http_tcdn_webcache_req_ctx_t, origin_scheme),
+				NGX_HTTP_VAR_NOCACHEABLE,
+				0
+		},
+		{
+				ngx_string("tcdn_peer"),
+				NULL,
+				ngx_http_tcdn_webcache_str_variable,
+				offsetof(ngx_http_tcdn_webcache_req_ctx_t, peer),
+				NGX_HTTP_VAR_NOCACHEABLE,
+				0
+		},
+		{
+				ngx_string("tcdn_shield"),
+				NULL,
+				ngx_http_tcdn_webcache_str_variable,
+				offsetof(ngx_http_tcdn_webcache_req_ctx_t, shield),
+				NGX_HTTP_VAR_NOCACHEABLE,
+				0
+		},
+		{
+				ngx_string("tcdn_hop_next"),
+				NULL,
+				ngx_http_tcdn_webcache_hop_next_variable,
+				0,
+				NGX_HTTP_VAR_NOCACHEABLE,
+				0
+		},
+		{
+				ngx_string("tcdn_stale_while_revalidate"),
+				NULL,
+				ngx_http_tcdn_webcache_uint_variable,
+				offsetof(ngx_http_tcdn_webcache_req_ctx_t,
+						stale_while_revalidate),
+				NGX_HTTP_VAR_NOCACHEABLE,
+				0
+		},
+		{
+				ngx_string("tcdn_stale_if_error"),
+				NULL,
+				ngx_http_tcdn_webcache_uint_variable,
+				offsetof(ngx_http_tcdn_webcache_req_ctx_t, stale_if_error),
+				NGX_HTTP_VAR_NOCACHEABLE,
+				0
+		},
+		{
+				ngx_string("tcdn_slice"),
+				NULL,
+				ngx_http_tcdn_webcache_uint_variable,
+				offsetof(ngx_http_tcdn_webcache_req_ctx_t, slice),
+				NGX_HTTP_VAR_NOCACHEABLE,
+				0
+		},
+		{
+				ngx_string("tcdn_cache_generation"),
+				NULL,
+				ngx_http_tcdn_webcache_str_variable,
+				offsetof(ngx_http_tcdn_webcache_req_ctx_t, cache_generation),
+				NGX_HTTP_VAR_NOCACHEABLE,
+				0
+		},
+		{ ngx_null_string, NULL, NULL, 0, 0, 0 }
+};
+
+/**
+ * TCDN-webcache module's metrics names, as output by the
+ * 'tcdn_webcache_status' handler (see 'ngx_http_tcdn_webcache_metrics_t').
+ */
+static const struct {
+	ngx_str_t name;
+	size_t offset;
+} ngx_http_tcdn_webcache_metrics_names[]= {
+#define METRICS_NAME(FIELD) \
+		{ ngx_string(#FIELD), \
+				offsetof(ngx_http_tcdn_webcache_metrics_t, FIELD) }
+		METRICS_NAME(requests_routed),
+		METRICS_NAME(requests_peer),
+		METRICS_NAME(requests_shield),
+		METRICS_NAME(requests_loop),
+		METRICS_NAME(requests_no_host),
+		METRICS_NAME(requests_no_table),
+		METRICS_NAME(requests_unknown_host),
+		METRICS_NAME(requests_internal_error),
+		METRICS_NAME(tracker_sync_updated),
+		METRICS_NAME(tracker_sync_not_modified),
+		METRICS_NAME(tracker_sync_failed),
+		METRICS_NAME(tracker_sync_malformed),
+		METRICS_NAME(buckets_discarded),
+		METRICS_NAME(prefetch_issued),
+		METRICS_NAME(prefetch_skipped),
+		METRICS_NAME(requests_shaped),
+		METRICS_NAME(requests_over_connections),
+		METRICS_NAME(requests_over_rate),
+		METRICS_NAME(requests_denied_address),
+		METRICS_NAME(requests_denied_referer),
+		METRICS_NAME(requests_denied_geoloc),
+		METRICS_NAME(purges),
+		METRICS_NAME(buckets_state_exhausted),
+		METRICS_NAME(resolve_failed),
+		METRICS_NAME(requests_inactive_bucket),
+		METRICS_NAME(buckets_transitions),
+		METRICS_NAME(requests_denied_signature),
+		METRICS_NAME(warmups),
+		METRICS_NAME(warmup_requests),
+		METRICS_NAME(handoff_exported),
+		METRICS_NAME(handoff_imported),
+		METRICS_NAME(handoff_failed),
+#undef METRICS_NAME
+		{ ngx_null_string, 0 }
+};
+
 /**
  * TCDN-webcache module's configuration functions context structure.
  * It defines the set of callback functions for creating the three
@@ -347,12 +1814,12 @@ static ngx_command_t ngx_http_tcdn_webcache_commands[]= {
  * https://github.com/nginx/nginx/blob/master/src/http/ngx_http_config.h)
  */
 static ngx_http_module_t ngx_http_tcdn_webcache_module_ctx = {
-		NULL, //< preconfiguration
+		ngx_http_tcdn_webcache_add_variables, //< preconfiguration
 		ngx_http_tcdn_webcache_init, //< postconfiguration
 		ngx_http_tcdn_webcache_main_conf_create, //< create main configuration
 		NULL, //< init main configuration
-		NULL, //< create server configuration
-		NULL, //< merge server configuration
+		ngx_http_tcdn_webcache_srv_conf_create, //< create server configuration
+		ngx_http_tcdn_webcache_srv_conf_merge, //< merge server configuration
 		NULL, //< create location conf.
 		NULL //< merge location configuration
 };
@@ -396,28 +1863,59 @@ static unsigned char *thread_pool_name_cstr= (unsigned char*)
 		"tcdn_webcache_thread_pool";
 
 /**
- * Postconfiguration callback. Refer to 'ngx_http_tcdn_webcache_module_ctx'.
+ * Preconfiguration callback. Refer to 'ngx_http_tcdn_webcache_module_ctx'.
+ * Registers the module's variables (see 'ngx_http_tcdn_webcache_vars').
  * @param ngx_conf
  * @return Status code NGX_OK on succeed, NGX_ERROR otherwise
  * (see 'ngx_core.h').
  */
-static ngx_int_t ngx_http_tcdn_webcache_init(ngx_conf_t *ngx_conf)
+static ngx_int_t ngx_http_tcdn_webcache_add_variables(ngx_conf_t *ngx_conf)
 {
-	ngx_http_core_main_conf_t *core_main_conf;
+	ngx_http_variable_t *var, *v;
 	ngx_log_t *ngx_log;
-    ngx_http_handler_pt *ngx_http_handler;
 
 	/* Check arguments */
-	if(ngx_conf== NULL)
+	if(ngx_conf== NULL || (ngx_log= ngx_conf->log)== NULL)
 		return NGX_ERROR;
 
-	/* Get logs context */
-	if((ngx_log= ngx_conf->log)== NULL)
-		return NGX_ERROR;
-	LOGD(ngx_log, "Registering 'tcdn_webcache' module... \n");
+	for(v= ngx_http_tcdn_webcache_vars; v->name.len> 0; v++) {
+		var= ngx_http_add_variable(ngx_conf, &v->name, v->flags);
+		CHECK_DO(var!= NULL, return NGX_ERROR);
+		var->get_handler= v->get_handler;
+		var->data= v->data;
+	}
+	return NGX_OK;
+}
 
-	core_main_conf= ngx_http_conf_get_module_main_conf(ngx_conf,
-			ngx_http_core_module);
+/**
+ * Postconfiguration callback. Refer to 'ngx_http_tcdn_webcache_module_ctx'.
+ * @param ngx_conf
+ * @return Status code NGX_OK on succeed, NGX_ERROR otherwise
+ * (see 'ngx_core.h').
+ */
+static ngx_int_t ngx_http_tcdn_webcache_init(ngx_conf_t *ngx_conf)
+{
+	ngx_http_core_main_conf_t *core_main_conf;
+	ngx_http_tcdn_webcache_main_conf_t *main_conf;
+	ngx_http_variable_t *var;
+	ngx_log_t *ngx_log;
+    ngx_http_handler_pt *ngx_http_handler;
+    ngx_shm_zone_t *shm_zone;
+    ngx_str_t metrics_zone_name= ngx_string(METRICS_ZONE_NAME);
+    ngx_str_t buckets_zone_name= ngx_string(BUCKETS_ZONE_NAME);
+    ngx_uint_t i;
+
+	/* Check arguments */
+	if(ngx_conf== NULL)
+		return NGX_ERROR;
+
+	/* Get logs context */
+	if((ngx_log= ngx_conf->log)== NULL)
+		return NGX_ERROR;
+	LOGD(ngx_log, "Registering 'tcdn_webcache' module... \n");
+
+	core_main_conf= ngx_http_conf_get_module_main_conf(ngx_conf,
+			ngx_http_core_module);
     CHECK_DO(core_main_conf!= NULL, return NGX_ERROR);
 
     /* Push handler to phases array */
@@ -427,6 +1925,52 @@ static ngx_int_t ngx_http_tcdn_webcache_init(ngx_conf_t *ngx_conf)
 
     *ngx_http_handler= ngx_http_tcdn_webcache_handler_phase0;
 
+    /* Only measure lookup time if '$tcdn_lookup_time' is used somewhere
+     * (all the configuration referencing variables is parsed at this point:
+     * used variables are already indexed) */
+    main_conf= ngx_http_conf_get_module_main_conf(ngx_conf,
+    		ngx_http_tcdn_webcache_module);
+    CHECK_DO(main_conf!= NULL, return NGX_ERROR);
+    var= core_main_conf->variables.elts;
+    for(i= 0; i< core_main_conf->variables.nelts; i++) {
+    	if(var[i].name.len== sizeof("tcdn_lookup_time")- 1 &&
+    			ngx_strncmp(var[i].name.data, "tcdn_lookup_time",
+    					var[i].name.len)== 0) {
+    		main_conf->flag_lookup_time= 1;
+    		break;
+    	}
+    }
+
+    /* Metrics are kept in shared memory (common to all workers) */
+    shm_zone= ngx_shared_memory_add(ngx_conf, &metrics_zone_name,
+    		METRICS_ZONE_SIZE, &ngx_http_tcdn_webcache_module);
+    CHECK_DO(shm_zone!= NULL, return NGX_ERROR);
+    shm_zone->init= ngx_http_tcdn_webcache_metrics_zone_init;
+    shm_zone->data= main_conf;
+
+    /* Buckets limits accounting is shared by all workers too */
+    shm_zone= ngx_shared_memory_add(ngx_conf, &buckets_zone_name,
+    		BUCKETS_ZONE_SIZE, &ngx_http_tcdn_webcache_module);
+    CHECK_DO(shm_zone!= NULL, return NGX_ERROR);
+    shm_zone->init= ngx_http_tcdn_webcache_buckets_zone_init;
+    shm_zone->data= main_conf;
+
+    ngx_conf_init_uint_value(main_conf->prefetch_concurrency,
+    		PREFETCH_CONCURRENCY_DEFAULT);
+    ngx_conf_init_value(main_conf->purge_ttl, PURGE_TTL_DEFAULT);
+    ngx_conf_init_value(main_conf->resolve_valid, RESOLVE_VALID_DEFAULT);
+
+    /* Build the cluster consistent-hashing ring (if a cluster is set) */
+    if(main_conf->peers!= NULL) {
+    	main_conf->peers_ring= peers_ring_create(ngx_conf, main_conf->peers,
+    			&main_conf->peer_self);
+    	if(main_conf->peers_ring== NULL)
+    		return NGX_ERROR;
+    	main_conf->peers_addrs= peers_addrs_create(ngx_conf, main_conf->peers);
+    	if(main_conf->peers_addrs== NULL)
+    		return NGX_ERROR;
+    }
+
     LOGD(ngx_log, "Registering 'tcdn_webcache' module succeed.\n");
     return NGX_OK;
 }
@@ -446,6 +1990,9 @@ static void* ngx_http_tcdn_webcache_main_conf_create(ngx_conf_t *ngx_conf)
 	ngx_pool_t *main_conf_pool= NULL; //alias
 	ngx_thread_pool_t *thread_pool= NULL; //alias
 	ngx_thread_task_t *sync_tracker_thread_task= NULL;
+#if (NGX_HTTP_CACHE)
+	ngx_thread_task_t *handoff_thread_task= NULL;
+#endif
 	ngx_str_t thread_pool_name= {
 			strlen((const char*)thread_pool_name_cstr),
 			thread_pool_name_cstr
@@ -489,6 +2036,14 @@ static void* ngx_http_tcdn_webcache_main_conf_create(ngx_conf_t *ngx_conf)
 
 	// Set by ngx_pcalloc(): main_conf->bucket_uri= { 0, NULL };
 
+	main_conf->prefetch_concurrency= NGX_CONF_UNSET_UINT;
+
+	// Set by ngx_pcalloc(): main_conf->country= NULL;
+
+	main_conf->purge_ttl= NGX_CONF_UNSET;
+
+	main_conf->resolve_valid= NGX_CONF_UNSET;
+
 	// Set by ngx_pcalloc(): main_conf->bucket_json_monot_ts_secs= 0;
 
     CHECK_DO(ngx_thread_mutex_create(&main_conf->sync_tracker_thr_mutex,
@@ -496,11 +2051,29 @@ static void* ngx_http_tcdn_webcache_main_conf_create(ngx_conf_t *ngx_conf)
 
     // Set by ngx_pcalloc():  main_conf->flag_sync_tracker_locked= 0;
 
-    // Set by ngx_pcalloc(): main_conf->jobj_buckets_cache[2]= {NULL, NULL};
+    // Set by ngx_pcalloc(): main_conf->routing_table[2]= {NULL, NULL};
+
+    // Set by ngx_pcalloc(): main_conf->routing_table_idx= 0
+
+    // Set by ngx_pcalloc(): main_conf->buckets_generation= 0
+
+    // Set by ngx_pcalloc(): main_conf->routing_table_next_ts= 0
+
+    // Set by ngx_pcalloc(): main_conf->routing_table_next= NULL
+
+    /* Transition timer is not to delay worker processes shutdown (its log
+     * is set when armed; see 'transition_timer_arm()') */
+    main_conf->transition_timer.handler= transition_timer_handler;
+    main_conf->transition_timer.data= main_conf;
+    main_conf->transition_timer.cancelable= 1;
+
+    // Set by ngx_pcalloc(): main_conf->tracker_etag[]= {0}
 
-    // Set by ngx_pcalloc(): main_conf->buckets_cache_idx= 0
+    // Set by ngx_pcalloc(): main_conf->tracker_body= NULL
 
-    CHECK_DO(ngx_thread_mutex_create(&main_conf->jobj_buckets_cache_mutex,
+    // Set by ngx_pcalloc(): main_conf->resolve_monot_ts_secs= 0
+
+    CHECK_DO(ngx_thread_mutex_create(&main_conf->routing_table_mutex,
     		ngx_log)==NGX_OK, goto end);
 
     main_conf->ngx_pool= main_conf_pool;
@@ -523,12 +2096,14 @@ static void* ngx_http_tcdn_webcache_main_conf_create(ngx_conf_t *ngx_conf)
 
 	sync_tracker_thread_task->handler= sync_tracker_thr;
 
-	/* Implementation note: 'ngx_thread_task_t::event.handler'
-	 * is strictly associated with the request that launches the thread.
-	 * Thus, if the request is finished, this callback will *NEVER* be called
-	 * (should be used with EAGAIN and an alive request... this is the reason
-	 * why we do not use it). Nevertheless, it is mandatory to define the
+	/* Implementation note: 'ngx_thread_task_t::event.handler' is called by
+	 * the worker's event loop once the thread finished, whether the request
+	 * that launched it is alive or not; we use it to arm the buckets
+	 * activation window transition timer (see
+	 * 'sync_tracker_thr_completion()'). It is mandatory to define the
 	 * pointer (setting it to NULL is not allowed and causes a fault).
+	 * The event log is set when the task is posted: the configuration log
+	 * is not valid in the worker processes.
 	 */
 	sync_tracker_thread_task->event.handler= sync_tracker_thr_completion;
 	sync_tracker_thread_task->event.data= sync_tracker_thread_task->ctx;
@@ -538,6 +2113,42 @@ static void* ngx_http_tcdn_webcache_main_conf_create(ngx_conf_t *ngx_conf)
 			sync_tracker_thread_task->ctx;
 	*ref_main_conf= main_conf;
 
+#if (NGX_HTTP_CACHE)
+	/* Cache handoff import task: its context is the import job (the event
+	 * log is set when the task is posted, as the tracker's one) */
+	handoff_thread_task= ngx_thread_task_alloc(ngx_conf->pool, sizeof(
+			ngx_http_tcdn_webcache_handoff_t));
+	CHECK_DO(handoff_thread_task!= NULL, goto end);
+	main_conf->ngx_handoff_thread_task= handoff_thread_task;
+	handoff_thread_task->handler= handoff_thr;
+	handoff_thread_task->event.handler= handoff_thr_completion;
+	handoff_thread_task->event.data= handoff_thread_task->ctx;
+	((ngx_http_tcdn_webcache_handoff_t*)handoff_thread_task->ctx)->main_conf=
+			main_conf;
+#endif
+
+	// Set by ngx_pcalloc(): main_conf->flag_lookup_time= 0
+
+	// Set by ngx_pcalloc(): main_conf->metrics= NULL
+
+	// Set by ngx_pcalloc(): main_conf->buckets_state= NULL
+
+	// Set by ngx_pcalloc(): main_conf->buckets_shpool= NULL
+
+	// Set by ngx_pcalloc(): main_conf->peers= NULL
+
+	// Set by ngx_pcalloc(): main_conf->trusted= NULL
+
+	// Set by ngx_pcalloc(): main_conf->peers_ring= NULL
+
+	// Set by ngx_pcalloc(): main_conf->peer_self= NULL
+
+	// Set by ngx_pcalloc(): main_conf->peers_addrs= NULL
+
+	// Set by ngx_pcalloc(): main_conf->prefetch_inflight= 0
+
+	// Set by ngx_pcalloc(): main_conf->purge_regex= NULL
+
 	// Reserved for future use: initialize new fields here...
 
 	/* We also use this space for globally initialize libcurl.
@@ -580,22 +2191,19 @@ static void ngx_http_tcdn_webcache_main_conf_release(
     ASSERT(ngx_thread_mutex_destroy(&main_conf->sync_tracker_thr_mutex,
     		ngx_log)==NGX_OK);
 
-    /* Release buckets registers */
-    for(i= 0; i< JOBJ_BUCKETS_CACHE_NUM; i++) {
-    	struct json_object *jobj= main_conf->jobj_buckets_cache[i];
-    	if(jobj!= NULL) {
-    		register int loop_guard= 100, flag_obj_freed= 0;
-    		while(loop_guard> 0 && flag_obj_freed== 0) {
-    			// 'json_object_put()' returns 1 if the object was freed
-    			flag_obj_freed= json_object_put(jobj);
-    			loop_guard--;
-    		}
-    		main_conf->jobj_buckets_cache[i]= NULL;
-    	}
+    /* Release buckets routing tables (and their transition timer) */
+    if(main_conf->transition_timer.timer_set)
+    	ngx_del_timer(&main_conf->transition_timer);
+    for(i= 0; i< ROUTING_TABLE_NUM; i++)
+    	tcdn_routing_table_release(&main_conf->routing_table[i]);
+    tcdn_routing_table_release(&main_conf->routing_table_next);
+    if(main_conf->tracker_body!= NULL) {
+    	free(main_conf->tracker_body);
+    	main_conf->tracker_body= NULL;
     }
 
 	/* Release web-caching buckets mutual-exclusion lock */
-    ASSERT(ngx_thread_mutex_destroy(&main_conf->jobj_buckets_cache_mutex,
+    ASSERT(ngx_thread_mutex_destroy(&main_conf->routing_table_mutex,
     		ngx_log)==NGX_OK);
 
     //{ //RAL: This seems to be performed automatically by Nginx's core when
@@ -651,6 +2259,356 @@ static char* ngx_http_tcdn_webcache_set_main(ngx_conf_t *ngx_conf,
 	return NGX_CONF_OK;
 }
 
+/**
+ * Allocates and initializes server configuration context structure.
+ * Refer to 'ngx_http_tcdn_webcache_module_ctx'.
+ * @param ngx_conf
+ * @return Server configuration context structure if succeeds, NULL
+ * otherwise.
+ */
+static void* ngx_http_tcdn_webcache_srv_conf_create(ngx_conf_t *ngx_conf)
+{
+	ngx_http_tcdn_webcache_srv_conf_t *srv_conf;
+
+	/* Check arguments */
+	if(ngx_conf== NULL)
+		return NULL;
+
+	srv_conf= ngx_pcalloc(ngx_conf->pool, sizeof(
+			ngx_http_tcdn_webcache_srv_conf_t));
+	if(srv_conf== NULL)
+		return NULL;
+
+	srv_conf->routing= NGX_CONF_UNSET;
+	return srv_conf;
+}
+
+/**
+ * Merges server configuration context structures.
+ * Refer to 'ngx_http_tcdn_webcache_module_ctx'.
+ * @param ngx_conf
+ * @param parent Parent (main level) server configuration.
+ * @param child Server configuration.
+ * @return NGX_CONF_OK (see 'ngx_conf_file.h').
+ */
+static char* ngx_http_tcdn_webcache_srv_conf_merge(ngx_conf_t *ngx_conf,
+		void *parent, void *child)
+{
+	ngx_http_tcdn_webcache_srv_conf_t *prev= parent, *srv_conf= child;
+
+	ngx_conf_merge_value(srv_conf->routing, prev->routing, 1);
+	return NGX_CONF_OK;
+}
+
+/**
+ * 'tcdn_webcache_status' command setter function: installs the metrics
+ * status handler as the location's content handler.
+ * @param ngx_conf
+ * @param ngx_command
+ * @param opaque_conf
+ * @return NGX_CONF_OK if succeed, NGX_CONF_ERROR otherwise
+ * (see 'ngx_conf_file.h').
+ */
+static char* ngx_http_tcdn_webcache_set_status(ngx_conf_t *ngx_conf,
+		ngx_command_t *ngx_command, void *opaque_conf)
+{
+	ngx_http_core_loc_conf_t *core_loc_conf;
+
+	/* Check arguments */
+	if(ngx_conf== NULL)
+		return NGX_CONF_ERROR;
+
+	core_loc_conf= ngx_http_conf_get_module_loc_conf(ngx_conf,
+			ngx_http_core_module);
+	if(core_loc_conf== NULL)
+		return NGX_CONF_ERROR;
+	core_loc_conf->handler= ngx_http_tcdn_webcache_status_handler;
+	return NGX_CONF_OK;
+}
+
+/**
+ * 'tcdn_webcache_purge' command setter function: installs the purge handler
+ * as the location's content handler (see
+ * 'ngx_http_tcdn_webcache_purge_handler()').
+ * @param ngx_conf
+ * @param ngx_command
+ * @param opaque_conf
+ * @return NGX_CONF_OK if succeed, NGX_CONF_ERROR otherwise
+ * (see 'ngx_conf_file.h').
+ */
+static char* ngx_http_tcdn_webcache_set_purge(ngx_conf_t *ngx_conf,
+		ngx_command_t *ngx_command, void *opaque_conf)
+{
+	ngx_http_core_loc_conf_t *core_loc_conf;
+
+	/* Check arguments */
+	if(ngx_conf== NULL)
+		return NGX_CONF_ERROR;
+
+	core_loc_conf= ngx_http_conf_get_module_loc_conf(ngx_conf,
+			ngx_http_core_module);
+	if(core_loc_conf== NULL)
+		return NGX_CONF_ERROR;
+	core_loc_conf->handler= ngx_http_tcdn_webcache_purge_handler;
+	return NGX_CONF_OK;
+}
+
+/**
+ * 'tcdn_webcache_warmup' command setter function: installs the cache
+ * warm-up handler as the location's content handler (see
+ * 'ngx_http_tcdn_webcache_warmup_handler()').
+ * @param ngx_conf
+ * @param ngx_command
+ * @param opaque_conf
+ * @return NGX_CONF_OK if succeed, NGX_CONF_ERROR otherwise
+ * (see 'ngx_conf_file.h').
+ */
+static char* ngx_http_tcdn_webcache_set_warmup(ngx_conf_t *ngx_conf,
+		ngx_command_t *ngx_command, void *opaque_conf)
+{
+	ngx_http_core_loc_conf_t *core_loc_conf;
+
+	/* Check arguments */
+	if(ngx_conf== NULL)
+		return NGX_CONF_ERROR;
+
+	core_loc_conf= ngx_http_conf_get_module_loc_conf(ngx_conf,
+			ngx_http_core_module);
+	if(core_loc_conf== NULL)
+		return NGX_CONF_ERROR;
+	core_loc_conf->handler= ngx_http_tcdn_webcache_warmup_handler;
+	return NGX_CONF_OK;
+}
+
+#if (NGX_HTTP_CACHE)
+/**
+ * 'tcdn_webcache_handoff' command setter function: installs the cache
+ * handoff handler as the location's content handler (see
+ * 'ngx_http_tcdn_webcache_handoff_handler()').
+ * @param ngx_conf
+ * @param ngx_command
+ * @param opaque_conf
+ * @return NGX_CONF_OK if succeed, NGX_CONF_ERROR otherwise
+ * (see 'ngx_conf_file.h').
+ */
+static char* ngx_http_tcdn_webcache_set_handoff(ngx_conf_t *ngx_conf,
+		ngx_command_t *ngx_command, void *opaque_conf)
+{
+	ngx_http_core_loc_conf_t *core_loc_conf;
+
+	/* Check arguments */
+	if(ngx_conf== NULL)
+		return NGX_CONF_ERROR;
+
+	core_loc_conf= ngx_http_conf_get_module_loc_conf(ngx_conf,
+			ngx_http_core_module);
+	if(core_loc_conf== NULL)
+		return NGX_CONF_ERROR;
+	core_loc_conf->handler= ngx_http_tcdn_webcache_handoff_handler;
+	return NGX_CONF_OK;
+}
+#endif
+
+/**
+ * 'tcdn_webcache_peer' command setter function. Syntax:<br>
+ * tcdn_webcache_peer address [weight=number] [tag=name] [self];<br>
+ * Declares a peer of the webcache cluster. Content is sharded among peers by
+ * consistent hashing: requests for content owned by another peer are
+ * forwarded to it (see 'INT_REDIR_PEER_PATH'). Exactly one of the peers
+ * should be tagged as 'self' (this node); otherwise, all the requests are
+ * forwarded.
+ * @param ngx_conf
+ * @param ngx_command
+ * @param opaque_main_conf
+ * @return NGX_CONF_OK if succeed, NGX_CONF_ERROR otherwise
+ * (see 'ngx_conf_file.h').
+ */
+static char* ngx_http_tcdn_webcache_set_peer(ngx_conf_t *ngx_conf,
+		ngx_command_t *ngx_command, void *opaque_main_conf)
+{
+	ngx_uint_t i;
+	ngx_int_t weight;
+	ngx_str_t *value;
+	ngx_http_tcdn_webcache_peer_t *peer;
+	ngx_http_tcdn_webcache_main_conf_t *main_conf= opaque_main_conf;
+
+	/* Check arguments */
+	if(ngx_conf== NULL || main_conf== NULL)
+		return NGX_CONF_ERROR;
+
+	if(main_conf->peers== NULL) {
+		main_conf->peers= ngx_array_create(ngx_conf->pool, 4,
+				sizeof(ngx_http_tcdn_webcache_peer_t));
+		if(main_conf->peers== NULL)
+			return NGX_CONF_ERROR;
+	}
+	peer= ngx_array_push(main_conf->peers);
+	if(peer== NULL)
+		return NGX_CONF_ERROR;
+
+	value= ngx_conf->args->elts;
+	peer->name= value[1];
+	peer->tag= value[1];
+	peer->weight= 1;
+	peer->self= 0;
+
+	for(i= 2; i< ngx_conf->args->nelts; i++) {
+		if(ngx_strncmp(value[i].data, "weight=", 7)== 0) {
+			weight= ngx_atoi(&value[i].data[7], value[i].len- 7);
+			if(weight== NGX_ERROR || weight== 0 || weight> 100)
+				goto invalid;
+			peer->weight= (ngx_uint_t)weight;
+		} else if(ngx_strncmp(value[i].data, "tag=", 4)== 0 &&
+				value[i].len> 4) {
+			peer->tag.data= &value[i].data[4];
+			peer->tag.len= value[i].len- 4;
+		} else if(ngx_strcmp(value[i].data, "self")== 0) {
+			peer->self= 1;
+		} else {
+			goto invalid;
+		}
+	}
+	return NGX_CONF_OK;
+
+invalid:
+	ngx_conf_log_error(NGX_LOG_EMERG, ngx_conf, 0, "invalid parameter \"%V\"",
+			&value[i]);
+	return NGX_CONF_ERROR;
+}
+
+/**
+ * 'tcdn_webcache_trusted' command setter function. Syntax:<br>
+ * tcdn_webcache_trusted address | CIDR;<br>
+ * Declares an address (or network) trusted to forward requests to this node
+ * besides the cluster peers, so that the hop-count header-field is accepted
+ * from it (see 'HOP_HEADER_NAME'); e.g. the edge nodes of a shield.
+ * @param ngx_conf
+ * @param ngx_command
+ * @param opaque_main_conf
+ * @return NGX_CONF_OK if succeed, NGX_CONF_ERROR otherwise
+ * (see 'ngx_conf_file.h').
+ */
+static char* ngx_http_tcdn_webcache_set_trusted(ngx_conf_t *ngx_conf,
+		ngx_command_t *ngx_command, void *opaque_main_conf)
+{
+	ngx_int_t ret_code;
+	ngx_str_t *value;
+	ngx_cidr_t *cidr;
+	ngx_http_tcdn_webcache_main_conf_t *main_conf= opaque_main_conf;
+
+	/* Check arguments */
+	if(ngx_conf== NULL || main_conf== NULL)
+		return NGX_CONF_ERROR;
+
+	if(main_conf->trusted== NULL) {
+		main_conf->trusted= ngx_array_create(ngx_conf->pool, 4,
+				sizeof(ngx_cidr_t));
+		if(main_conf->trusted== NULL)
+			return NGX_CONF_ERROR;
+	}
+	cidr= ngx_array_push(main_conf->trusted);
+	if(cidr== NULL)
+		return NGX_CONF_ERROR;
+
+	value= ngx_conf->args->elts;
+	ret_code= ngx_ptocidr(&value[1], cidr);
+	if(ret_code== NGX_ERROR) {
+		ngx_conf_log_error(NGX_LOG_EMERG, ngx_conf, 0, "invalid parameter "
+				"\"%V\"", &value[1]);
+		return NGX_CONF_ERROR;
+	}
+	if(ret_code== NGX_DONE)
+		ngx_conf_log_error(NGX_LOG_WARN, ngx_conf, 0, "low address bits of "
+				"%V are meaningless", &value[1]);
+	return NGX_CONF_OK;
+}
+
+/**
+ * Metrics shared memory zone initialization callback.
+ * The metrics structure is allocated only once: on configuration reload, the
+ * counters of the previous cycle are kept.
+ * @param shm_zone Shared memory zone; its data is the module's main
+ * configuration context structure.
+ * @param data Previous cycle's zone data (main configuration context
+ * structure), NULL if none.
+ * @return Status code NGX_OK on succeed, NGX_ERROR otherwise
+ * (see 'ngx_core.h').
+ */
+static ngx_int_t ngx_http_tcdn_webcache_metrics_zone_init(
+		ngx_shm_zone_t *shm_zone, void *data)
+{
+	ngx_log_t *ngx_log;
+	ngx_slab_pool_t *shpool;
+	ngx_http_tcdn_webcache_main_conf_t *main_conf, *main_conf_prev= data;
+
+	/* Check arguments */
+	if(shm_zone== NULL || (main_conf= shm_zone->data)== NULL ||
+			(ngx_log= shm_zone->shm.log)== NULL)
+		return NGX_ERROR;
+
+	if(main_conf_prev!= NULL) {
+		main_conf->metrics= main_conf_prev->metrics;
+		return NGX_OK;
+	}
+
+	shpool= (ngx_slab_pool_t*)shm_zone->shm.addr;
+	if(shm_zone->shm.exists) {
+		main_conf->metrics= shpool->data;
+		return NGX_OK;
+	}
+
+	main_conf->metrics= ngx_slab_calloc(shpool,
+			sizeof(ngx_http_tcdn_webcache_metrics_t));
+	CHECK_DO(main_conf->metrics!= NULL, return NGX_ERROR);
+	shpool->data= main_conf->metrics;
+	return NGX_OK;
+}
+
+/**
+ * Buckets shared state memory zone initialization callback.
+ * The states are allocated only once: on configuration reload, those of the
+ * previous cycle are kept (with their requests in progress), as well as the
+ * purge rules in effect.
+ * @param shm_zone Shared memory zone; its data is the module's main
+ * configuration context structure.
+ * @param data Previous cycle's zone data (main configuration context
+ * structure), NULL if none.
+ * @return Status code NGX_OK on succeed, NGX_ERROR otherwise
+ * (see 'ngx_core.h').
+ */
+static ngx_int_t ngx_http_tcdn_webcache_buckets_zone_init(
+		ngx_shm_zone_t *shm_zone, void *data)
+{
+	ngx_log_t *ngx_log;
+	ngx_slab_pool_t *shpool;
+	ngx_http_tcdn_webcache_main_conf_t *main_conf, *main_conf_prev= data;
+
+	/* Check arguments */
+	if(shm_zone== NULL || (main_conf= shm_zone->data)== NULL ||
+			(ngx_log= shm_zone->shm.log)== NULL)
+		return NGX_ERROR;
+
+	shpool= (ngx_slab_pool_t*)shm_zone->shm.addr;
+	main_conf->buckets_shpool= shpool;
+
+	if(main_conf_prev!= NULL) {
+		main_conf->buckets_state= main_conf_prev->buckets_state;
+		return NGX_OK;
+	}
+
+	if(shm_zone->shm.exists) {
+		main_conf->buckets_state= shpool->data;
+		return NGX_OK;
+	}
+
+	main_conf->buckets_state= ngx_slab_calloc(shpool,
+			sizeof(ngx_http_tcdn_webcache_buckets_state_t));
+	CHECK_DO(main_conf->buckets_state!= NULL, return NGX_ERROR);
+	main_conf->buckets_state->purge_serial= (ngx_uint_t)ngx_time();
+	shpool->data= main_conf->buckets_state;
+	return NGX_OK;
+}
+
 /**
  * Module process exit callback.
  * @param cycle
@@ -700,17 +2658,26 @@ static void exit_master(ngx_cycle_t *cycle)
  * Additionally, response can be delegated to a proxy server either by
  * using an internal redirection (see 'ngx_http_internal_redirect()') or by
  * performing a so-called sub-request ('ngx_http_subrequest').
+ * Request failures never terminate the worker process: the request is just
+ * responded with the corresponding HTTP error status (and the failure
+ * counted in the module's metrics; see 'ngx_http_tcdn_webcache_metrics_t').
  * @param r HTTP request context structure (includes information such as
  * request method, URI, and headers).
- * @return Status code NGX_OK on succeed. See 'ngx_core.h' for other values.
+ * @return Status code NGX_OK on succeed, NGX_DECLINED if routing is disabled
+ * for the server, or HTTP error status code. See 'ngx_core.h' for other
+ * values.
  */
 static ngx_int_t ngx_http_tcdn_webcache_handler_phase0(ngx_http_request_t *r)
 {
 	ngx_connection_t *ngx_connection;
 	ngx_log_t *ngx_log;
 	ngx_http_tcdn_webcache_main_conf_t *main_conf;
+	ngx_http_tcdn_webcache_srv_conf_t *srv_conf;
+	ngx_http_tcdn_webcache_req_ctx_t *ctx;
 	ngx_int_t ret_code;
-	char *orig_host= NULL, *orig_port= NULL;
+	struct timespec ts_start= {0}, ts_end= {0};
+	const char *path;
+	ngx_str_t *upstream, uri, args;
 
 	/* Check arguments */
 	if(r== NULL || (ngx_connection= r->connection)== NULL ||
@@ -725,7 +2692,12 @@ static ngx_int_t ngx_http_tcdn_webcache_handler_phase0(ngx_http_request_t *r)
 
 	/* Get module's main configuration context structure */
 	main_conf= ngx_http_get_module_main_conf(r, ngx_http_tcdn_webcache_module);
-	CHECK_DO(main_conf!= NULL, return NGX_ERROR);
+	CHECK_DO(main_conf!= NULL, return NGX_HTTP_INTERNAL_SERVER_ERROR);
+
+	/* Requests to servers not routing (e.g. monitoring) are not handled */
+	srv_conf= ngx_http_get_module_srv_conf(r, ngx_http_tcdn_webcache_module);
+	if(srv_conf!= NULL && !srv_conf->routing)
+		return NGX_DECLINED;
 
 	/* Synchronize buckets information.
 	 * We just check for errors but *always* continue with request processing!
@@ -735,221 +2707,3148 @@ static ngx_int_t ngx_http_tcdn_webcache_handler_phase0(ngx_http_request_t *r)
 	ret_code= synchronize_buckets_information(main_conf, ngx_log);
 	ASSERT(ret_code== NGX_OK); // just check and trace if error occurred
 
-	ret_code= buckets_information_fetch_host_origin(main_conf, &r->headers_in,
-			ngx_log, &orig_host, &orig_port);
-	CHECK_DO(ret_code== NGX_OK, return NGX_ERROR);
+	/* Create request context (exposed through the module's variables) */
+	ctx= ngx_http_tcdn_webcache_req_ctx_create(r);
+	if(ctx== NULL) {
+		METRICS_INC(main_conf, requests_internal_error);
+		CHECK_DO(0, return NGX_HTTP_INTERNAL_SERVER_ERROR);
+	}
+	ctx->hop= request_hop_count(main_conf, r);
+	ctx->from_peer= ctx->hop> 0 && cidrs_match(main_conf->peers_addrs,
+			r->connection->sockaddr);
+	if(ctx->hop>= HOPS_MAX) {
+		ngx_log_error(NGX_LOG_ERR, ngx_log, 0, "Forwarding loop detected "
+				"(%ui hops)\n", ctx->hop);
+		METRICS_INC(main_conf, requests_loop);
+		return NGX_HTTP_BAD_GATEWAY;
+	}
+
+	if(main_conf->flag_lookup_time)
+		ASSERT(clock_gettime(CLOCK_MONOTONIC, &ts_start)== 0);
+	ngx_probe(tcdn_webcache, lookup__start, r);
+	ret_code= buckets_information_fetch_host_origin(main_conf, r, ngx_log,
+			ctx);
+	ngx_probe(tcdn_webcache, lookup__done, r, ret_code);
+	if(main_conf->flag_lookup_time &&
+			clock_gettime(CLOCK_MONOTONIC, &ts_end)== 0) {
+		ctx->lookup_time_usecs= (ts_end.tv_sec- ts_start.tv_sec)* 1000000+
+				(ts_end.tv_nsec- ts_start.tv_nsec)/ 1000;
+	}
+	if(ret_code!= NGX_OK)
+		return ret_code; // HTTP error status (failure already counted)
+
+	/* Redirect internally to proxied path (cluster peer owning the
+	 * requested content, bucket's shield or origin-server) */
+	ngx_probe(tcdn_webcache, redirect__start, r);
+	if(ctx->peer.len> 0) {
+		path= INT_REDIR_PEER_PATH;
+		upstream= &ctx->peer;
+	} else if(ctx->shield.len> 0) {
+		path= INT_REDIR_SHIELD_PATH;
+		upstream= &ctx->shield;
+	} else {
+		path= INT_REDIR_PATH;
+		upstream= &ctx->origin;
+	}
+	uri= r->uri; // Original URI (memory is kept by the request)
+	args= r->args;
+	ret_code= perform_http_internal_redirect(r, ngx_log, path, upstream);
+	ngx_probe(tcdn_webcache, redirect__done, r, ret_code);
+	if(ret_code== NGX_ERROR) {
+		METRICS_INC(main_conf, requests_internal_error);
+		return NGX_HTTP_INTERNAL_SERVER_ERROR;
+	}
+	METRICS_INC(main_conf, requests_routed);
+	if(ctx->peer.len> 0) {
+		METRICS_INC(main_conf, requests_peer);
+	} else if(ctx->shield.len> 0) {
+		METRICS_INC(main_conf, requests_shield);
+	}
+
+	/* Prefetch the next media segments (see 'segments_prefetch()') */
+	if(ctx->prefetch> 0 && r->method== NGX_HTTP_GET)
+		segments_prefetch(main_conf, r, ngx_log, ctx->prefetch,
+				ctx->prefetch_foreign, path, upstream, &uri, &args);
 
-	/* Redirect internally to proxied path */
-	return perform_http_internal_redirect(r, ngx_log, orig_host, orig_port);
+	/* Release the reference taken by the redirection (as in
+	 * 'ngx_http_core_try_files_phase()'), otherwise the connection of a
+	 * request finalized synchronously (e.g. cache hit) is never closed */
+	ngx_http_finalize_request(r, NGX_DONE);
+	return NGX_DONE;
 }
 
 /**
- * Fetch origin server corresponding to the declared HTTP host-header.
+ * Metrics status content handler (see 'tcdn_webcache_status' directive).
+ * Outputs the module's metrics counters as plain text, one
+ * "<name> <value>" pair per line.
+ * @param r HTTP request context structure.
+ * @return Status code NGX_OK on succeed. See 'ngx_core.h' for other values.
  */
-static ngx_int_t buckets_information_fetch_host_origin(
-		ngx_http_tcdn_webcache_main_conf_t *main_conf,
-		ngx_http_headers_in_t *headers_in, ngx_log_t *ngx_log,
-		char **ref_orig_host, char **ref_orig_port)
+static ngx_int_t ngx_http_tcdn_webcache_status_handler(ngx_http_request_t *r)
 {
-	ngx_table_elt_t *host;
-	ngx_thread_mutex_t *p_buckets_mutex;
+	register size_t i, size= 0;
 	ngx_int_t ret_code;
+	ngx_buf_t *b;
+	ngx_chain_t out;
+	ngx_http_tcdn_webcache_main_conf_t *main_conf;
 
-	/* Check arguments */
-	if(main_conf== NULL || headers_in== NULL || ngx_log== NULL ||
-			ref_orig_host== NULL || ref_orig_port== NULL)
-		return NGX_ERROR;
+	if(!(r->method& (NGX_HTTP_GET|NGX_HTTP_HEAD)))
+		return NGX_HTTP_NOT_ALLOWED;
 
-	/* Get host-header */
-	host= headers_in->host;
-	CHECK_DO(host!= NULL, return NGX_ERROR);
+	ret_code= ngx_http_discard_request_body(r);
+	if(ret_code!= NGX_OK)
+		return ret_code;
 
-    /* Get buckets information set */
-    p_buckets_mutex= &main_conf->jobj_buckets_cache_mutex;
-	ASSERT(ngx_thread_mutex_lock(p_buckets_mutex, ngx_log)== NGX_OK);
-	ret_code= buckets_information_fetch_host_origin2(
-			main_conf->jobj_buckets_cache[main_conf->buckets_cache_idx],
-			&host->value, ngx_log, ref_orig_host, ref_orig_port);
-    ASSERT(ngx_thread_mutex_unlock(p_buckets_mutex, ngx_log)== NGX_OK);
+	main_conf= ngx_http_get_module_main_conf(r, ngx_http_tcdn_webcache_module);
+	if(main_conf== NULL || main_conf->metrics== NULL)
+		return NGX_HTTP_SERVICE_UNAVAILABLE;
+
+	r->headers_out.content_type_len= sizeof("text/plain")- 1;
+	ngx_str_set(&r->headers_out.content_type, "text/plain");
+	r->headers_out.content_type_lowcase= NULL;
+
+	for(i= 0; ngx_http_tcdn_webcache_metrics_names[i].name.len> 0; i++)
+		size+= ngx_http_tcdn_webcache_metrics_names[i].name.len+
+				sizeof(" \n")- 1+ NGX_ATOMIC_T_LEN;
+
+	b= ngx_create_temp_buf(r->pool, size);
+	if(b== NULL)
+		return NGX_HTTP_INTERNAL_SERVER_ERROR;
+	out.buf= b;
+	out.next= NULL;
+
+	for(i= 0; ngx_http_tcdn_webcache_metrics_names[i].name.len> 0; i++) {
+		ngx_atomic_t *counter= (ngx_atomic_t*)((char*)main_conf->metrics+
+				ngx_http_tcdn_webcache_metrics_names[i].offset);
+		b->last= ngx_sprintf(b->last, "%V %uA\n",
+				&ngx_http_tcdn_webcache_metrics_names[i].name, *counter);
+	}
 
-	return ret_code;
+	r->headers_out.status= NGX_HTTP_OK;
+	r->headers_out.content_length_n= b->last- b->pos;
+	b->last_buf= (r== r->main)? 1: 0;
+	b->last_in_chain= 1;
+
+	ret_code= ngx_http_send_header(r);
+	if(ret_code== NGX_ERROR || ret_code> NGX_OK || r->header_only)
+		return ret_code;
+	return ngx_http_output_filter(r, &out);
+}
+
+/**
+ * Purge content handler (see 'tcdn_webcache_purge' directive).
+ * Adds a purge rule, invalidating the cached objects of a bucket host-name
+ * whose URI matches a prefix or a regular expression (see
+ * '$tcdn_cache_generation'). Requests ('POST' or 'DELETE') arguments are:
+ * - 'host': bucket host-name (required);
+ * - 'prefix': URI prefix (defaults to "/", the whole bucket), or 'regex':
+ * URI regular expression (PCRE).
+ * For example:
+ * @code
+ *     curl -X POST \
+ *         'http://127.0.0.1:8089/tcdn_purge?host=example.com&prefix=/live/'
+ * @endcode
+ * Rules are in effect for 'tcdn_webcache_purge_ttl' (it should be longer
+ * than the cache 'inactive' time, so that the invalidated objects are
+ * deleted by the cache manager before the rule expires). They are common to
+ * all the worker processes and kept on configuration reload, but they are
+ * neither kept on restart nor propagated to other webcache nodes.
+ * Outputs the rule serial number as plain text ("purge <serial>").
+ * @param r HTTP request context structure.
+ * @return Status code NGX_OK on succeed; NGX_HTTP_BAD_REQUEST if the
+ * arguments are not valid, NGX_HTTP_SERVICE_UNAVAILABLE if 'PURGES_MAX'
+ * rules are in effect. See 'ngx_core.h' for other values.
+ */
+static ngx_int_t ngx_http_tcdn_webcache_purge_handler(ngx_http_request_t *r)
+{
+	register ngx_uint_t i;
+	ngx_int_t ret_code;
+	ngx_buf_t *b;
+	ngx_chain_t out;
+	ngx_str_t arg, host_arg;
+	ngx_flag_t regex= 0;
+	u_char *p, *host, *pattern;
+	size_t host_len, pattern_len;
+	ngx_uint_t serial;
+	time_t now;
+	ngx_log_t *ngx_log= r->connection->log;
+	ngx_http_tcdn_webcache_main_conf_t *main_conf;
+	ngx_http_tcdn_webcache_buckets_state_t *buckets_state;
+	ngx_http_tcdn_webcache_purge_t *purge;
+#if (NGX_PCRE)
+	ngx_regex_compile_t rc;
+	u_char errstr[NGX_MAX_CONF_ERRSTR];
+#endif
+
+	if(!(r->method& (NGX_HTTP_POST|NGX_HTTP_DELETE)))
+		return NGX_HTTP_NOT_ALLOWED;
+
+	ret_code= ngx_http_discard_request_body(r);
+	if(ret_code!= NGX_OK)
+		return ret_code;
+
+	main_conf= ngx_http_get_module_main_conf(r, ngx_http_tcdn_webcache_module);
+	if(main_conf== NULL || (buckets_state= main_conf->buckets_state)== NULL)
+		return NGX_HTTP_SERVICE_UNAVAILABLE;
+
+	/* Bucket host-name */
+	if(ngx_http_arg(r, (u_char*)"host", sizeof("host")- 1, &arg)!= NGX_OK)
+		return NGX_HTTP_BAD_REQUEST;
+	ret_code= host_arg_parse(r, &arg, &host_arg);
+	if(ret_code!= NGX_OK)
+		return ret_code;
+	host= host_arg.data;
+	host_len= host_arg.len;
+
+	/* URI prefix or regular expression (NULL-terminated) */
+	if(ngx_http_arg(r, (u_char*)"regex", sizeof("regex")- 1, &arg)== NGX_OK) {
+		regex= 1;
+	} else if(ngx_http_arg(r, (u_char*)"prefix", sizeof("prefix")- 1, &arg)!=
+			NGX_OK) {
+		ngx_str_set(&arg, "/");
+	}
+	if(arg.len== 0 || arg.len>= PURGE_PATTERN_LEN_MAX)
+		return NGX_HTTP_BAD_REQUEST;
+	pattern= p= ngx_pnalloc(r->pool, arg.len+ 1);
+	CHECK_DO(pattern!= NULL, return NGX_HTTP_INTERNAL_SERVER_ERROR);
+	ngx_unescape_uri(&p, &arg.data, arg.len, 0);
+	pattern_len= p- pattern;
+	*p= '\0';
+	if(pattern_len== 0)
+		return NGX_HTTP_BAD_REQUEST;
+
+	if(regex) {
+#if (NGX_PCRE)
+		ngx_memzero(&rc, sizeof(ngx_regex_compile_t));
+		rc.pattern.data= pattern;
+		rc.pattern.len= pattern_len;
+		rc.pool= r->pool;
+		rc.err.len= NGX_MAX_CONF_ERRSTR;
+		rc.err.data= errstr;
+		if(ngx_regex_compile(&rc)!= NGX_OK) {
+			ngx_log_error(NGX_LOG_INFO, ngx_log, 0, "Invalid purge rule: %V",
+					&rc.err);
+			return NGX_HTTP_BAD_REQUEST;
+		}
+#else
+		return NGX_HTTP_NOT_IMPLEMENTED;
+#endif
+	}
+
+	/* Take a free rule (or an expired one) */
+	now= ngx_time();
+	ngx_shmtx_lock(&main_conf->buckets_shpool->mutex);
+	for(i= 0; i< PURGES_MAX; i++) {
+		purge= &buckets_state->purge[i];
+		if(purge->serial== 0) {
+			buckets_state->purges_num++;
+			break;
+		}
+		if(purge->expires<= now)
+			break;
+	}
+	if(i== PURGES_MAX) {
+		ngx_shmtx_unlock(&main_conf->buckets_shpool->mutex);
+		ngx_log_error(NGX_LOG_WARN, ngx_log, 0, "All the purge rules are in "
+				"use; purge of bucket '%*s' rejected\n", host_len, host);
+		return NGX_HTTP_SERVICE_UNAVAILABLE;
+	}
+	serial= ngx_max(buckets_state->purge_serial+ 1, (ngx_uint_t)now);
+	buckets_state->purge_serial= serial;
+	purge->serial= serial;
+	purge->expires= now+ main_conf->purge_ttl;
+	purge->hash= ngx_crc32_short(host, host_len);
+	purge->host_len= host_len;
+	ngx_memcpy(purge->host, host, host_len);
+	purge->regex= regex;
+	purge->pattern_len= pattern_len;
+	ngx_memcpy(purge->pattern, pattern, pattern_len+ 1);
+	ngx_shmtx_unlock(&main_conf->buckets_shpool->mutex);
+
+	ngx_log_error(NGX_LOG_NOTICE, ngx_log, 0, "Purge rule %ui: bucket '%*s' "
+			"%s '%s'\n", serial, host_len, host, regex? "regex": "prefix",
+			pattern);
+	METRICS_INC(main_conf, purges);
+
+	r->headers_out.content_type_len= sizeof("text/plain")- 1;
+	ngx_str_set(&r->headers_out.content_type, "text/plain");
+	r->headers_out.content_type_lowcase= NULL;
+
+	b= ngx_create_temp_buf(r->pool, sizeof("purge \n")- 1+ NGX_INT_T_LEN);
+	if(b== NULL)
+		return NGX_HTTP_INTERNAL_SERVER_ERROR;
+	out.buf= b;
+	out.next= NULL;
+	b->last= ngx_sprintf(b->last, "purge %ui\n", serial);
+
+	r->headers_out.status= NGX_HTTP_OK;
+	r->headers_out.content_length_n= b->last- b->pos;
+	b->last_buf= (r== r->main)? 1: 0;
+	b->last_in_chain= 1;
+
+	ret_code= ngx_http_send_header(r);
+	if(ret_code== NGX_ERROR || ret_code> NGX_OK || r->header_only)
+		return ret_code;
+	return ngx_http_output_filter(r, &out);
+}
+
+/**
+ * Cache warm-up content handler (see 'tcdn_webcache_warmup' directive).
+ * Fills this node's cache with a bucket's content before clients request it
+ * (e.g. when the node joins the cluster or the bucket goes live), so that
+ * the first wave of client requests are hits:
+ * - 'POST' starts a job (see 'warmup_start()'): the request body is the list
+ * of URLs to be warmed up, one per line; lines starting with '#' are ignored
+ * (so a HLS manifest can be posted as is). URLs are absolute
+ * ("http://host/path"), absolute paths, or paths relative to the 'base'
+ * argument (e.g. the manifest URI). The bucket is given by the 'bucket'
+ * (identifier) or 'host' (host-name) arguments or else by the first
+ * absolute URL (URLs of other host-names are skipped). The 'concurrency'
+ * and 'rate' arguments bound the job's subrequests in progress and per
+ * second (WARMUP_CONCURRENCY_DEFAULT and WARMUP_RATE_DEFAULT by default).
+ * Outputs the job identifier and its number of URLs as plain text
+ * ("warmup <id> <urls>");
+ * - 'GET' reports the progress of the jobs, one line per job;
+ * - 'DELETE' cancels the job given by the 'id' argument (subrequests in
+ * progress are completed).
+ * For example:
+ * @code
+ *     curl --data-binary @index.m3u8 \
+ *         'http://127.0.0.1:8089/tcdn_warmup?bucket=86&base=/live/index.m3u8'
+ *     curl 'http://127.0.0.1:8089/tcdn_warmup'
+ * @endcode
+ * Each URL is requested by a background subrequest (header-only, so the
+ * response is just cached) routed as a client request of the bucket, in the
+ * first server routing the buckets requests (see 'tcdn_webcache_routing')
+ * and through the same internal redirection locations; the bucket's access
+ * policy, signed URLs, limits and activation window are not applied. URLs
+ * owned by another cluster peer are skipped: each node warms up its own
+ * share (the same list is to be posted to all of them). Jobs are run by the
+ * worker process that received them; they are neither kept on restart nor
+ * resumed if the worker process exits.
+ * @param r HTTP request context structure.
+ * @return Status code NGX_OK on succeed (NGX_DONE if the request body is
+ * being read); NGX_HTTP_BAD_REQUEST if the arguments are not valid,
+ * NGX_HTTP_NOT_FOUND if the bucket or job is not known,
+ * NGX_HTTP_SERVICE_UNAVAILABLE if WARMUPS_MAX jobs are running. See
+ * 'ngx_core.h' for other values.
+ */
+static ngx_int_t ngx_http_tcdn_webcache_warmup_handler(ngx_http_request_t *r)
+{
+	ngx_int_t ret_code;
+	ngx_http_tcdn_webcache_main_conf_t *main_conf;
+
+	if(!(r->method& (NGX_HTTP_GET|NGX_HTTP_HEAD|NGX_HTTP_POST|
+			NGX_HTTP_DELETE)))
+		return NGX_HTTP_NOT_ALLOWED;
+
+	main_conf= ngx_http_get_module_main_conf(r, ngx_http_tcdn_webcache_module);
+	if(main_conf== NULL || main_conf->buckets_state== NULL)
+		return NGX_HTTP_SERVICE_UNAVAILABLE;
+
+	if(r->method& NGX_HTTP_POST) {
+		ret_code= ngx_http_read_client_request_body(r, warmup_body_handler);
+		if(ret_code>= NGX_HTTP_SPECIAL_RESPONSE)
+			return ret_code;
+		return NGX_DONE;
+	}
+
+	ret_code= ngx_http_discard_request_body(r);
+	if(ret_code!= NGX_OK)
+		return ret_code;
+	if(r->method& NGX_HTTP_DELETE)
+		return warmup_cancel(r, main_conf);
+	return warmup_report(r, main_conf);
+}
+
+#if (NGX_HTTP_CACHE)
+/**
+ * Cache handoff content handler (see 'tcdn_webcache_handoff' directive).
+ * Hands the hot set of a cache over between nodes, so that a node replacing
+ * another one (or a new ring neighbour) does not start cold: the new node
+ * pulls the most requested objects of the old one as cache files, instead
+ * of requesting them to the origin-servers. The cache is given by the
+ * 'zone' argument (a 'proxy_cache_path' zone name):
+ * - 'GET' lists the up to 'limit' (HANDOFF_KEYS_DEFAULT by default) most
+ * requested keys of the cache, or of a bucket's partition if the 'bucket'
+ * argument is given (see 'proxy_cache_partition'), most requested first:
+ * one "<md5 key in hex> <uses>" line per key;
+ * - 'GET' with the 'key' argument sends the cache file of the key as is;
+ * - 'POST' with the 'from' argument (the peer's address, e.g.
+ * "10.0.0.1:8089") imports the peer's hot set: its keys list is requested
+ * (with the same 'bucket' and 'limit' arguments) to the same location URI,
+ * and then its files, which are added to this node's cache index as the
+ * cache loader does (see 'ngx_http_file_cache_import()'). The import is run
+ * by an off-load thread (see 'handoff_thr()'), one at a time per worker
+ * process; its results are logged and counted in the module's metrics.
+ * For example, on the new node:
+ * @code
+ *     curl -X POST -G http://127.0.0.1:8089/tcdn_handoff -d zone=one \
+ *         -d from=10.0.0.1:8089 -d bucket=86
+ * @endcode
+ * Cache files are portable between nodes of the same configuration (the
+ * cache keys are the same); each file is checked to be the one of its key
+ * before it is imported, and keys already cached are not imported.
+ * @param r HTTP request context structure.
+ * @return Status code NGX_OK on succeed; NGX_HTTP_BAD_REQUEST if the
+ * arguments are not valid, NGX_HTTP_NOT_FOUND if the cache zone or the key
+ * is not known, NGX_HTTP_CONFLICT if an import is in progress. See
+ * 'ngx_core.h' for other values.
+ */
+static ngx_int_t ngx_http_tcdn_webcache_handoff_handler(ngx_http_request_t *r)
+{
+	ngx_int_t ret_code;
+	ngx_str_t zone, key_hex;
+	ngx_http_file_cache_t *cache;
+	ngx_http_tcdn_webcache_main_conf_t *main_conf;
+
+	if(!(r->method& (NGX_HTTP_GET|NGX_HTTP_HEAD|NGX_HTTP_POST)))
+		return NGX_HTTP_NOT_ALLOWED;
+
+	main_conf= ngx_http_get_module_main_conf(r, ngx_http_tcdn_webcache_module);
+	if(main_conf== NULL)
+		return NGX_HTTP_SERVICE_UNAVAILABLE;
+
+	ret_code= ngx_http_discard_request_body(r);
+	if(ret_code!= NGX_OK)
+		return ret_code;
+
+	if(ngx_http_arg(r, (u_char*)"zone", sizeof("zone")- 1, &zone)!= NGX_OK ||
+			zone.len== 0)
+		return NGX_HTTP_BAD_REQUEST;
+	if((cache= handoff_cache_get(&zone))== NULL)
+		return NGX_HTTP_NOT_FOUND;
+
+	if(r->method& NGX_HTTP_POST)
+		return handoff_start(r, main_conf, cache, &zone);
+	if(ngx_http_arg(r, (u_char*)"key", sizeof("key")- 1, &key_hex)== NGX_OK)
+		return handoff_file_send(r, main_conf, cache, &key_hex);
+	return handoff_keys_send(r, cache);
+}
+#endif
+
+/**
+ * Parses a bucket host-name request argument: unescaped, in lower-case and
+ * without port (as in the routing table).
+ * @param r HTTP request context structure.
+ * @param arg Argument value.
+ * @param host Output host-name (allocated in the request pool).
+ * @return Status code NGX_OK on succeed, NGX_HTTP_BAD_REQUEST if the
+ * host-name is not valid, NGX_HTTP_INTERNAL_SERVER_ERROR otherwise.
+ */
+static ngx_int_t host_arg_parse(ngx_http_request_t *r, ngx_str_t *arg,
+		ngx_str_t *host)
+{
+	u_char *p, *src;
+
+	if(arg->len== 0 || arg->len> BUCKET_KEY_LEN_MAX)
+		return NGX_HTTP_BAD_REQUEST;
+	host->data= p= ngx_pnalloc(r->pool, arg->len);
+	if(host->data== NULL)
+		return NGX_HTTP_INTERNAL_SERVER_ERROR;
+	src= arg->data;
+	ngx_unescape_uri(&p, &src, arg->len, 0);
+	host->len= p- host->data;
+	if((p= ngx_strlchr(host->data, host->data+ host->len, ':'))!= NULL)
+		host->len= p- host->data;
+	if(host->len== 0)
+		return NGX_HTTP_BAD_REQUEST;
+	ngx_strlow(host->data, host->data, host->len);
+	return NGX_OK;
+}
+
+/**
+ * Sends a plain text response of the module's content handlers.
+ * @param r HTTP request context structure.
+ * @param status HTTP status code.
+ * @param b Response body.
+ * @return Status code NGX_OK on succeed. See 'ngx_core.h' for other values.
+ */
+static ngx_int_t text_response_send(ngx_http_request_t *r, ngx_uint_t status,
+		ngx_buf_t *b)
+{
+	ngx_int_t ret_code;
+	ngx_chain_t out;
+
+	r->headers_out.content_type_len= sizeof("text/plain")- 1;
+	ngx_str_set(&r->headers_out.content_type, "text/plain");
+	r->headers_out.content_type_lowcase= NULL;
+
+	out.buf= b;
+	out.next= NULL;
+
+	r->headers_out.status= status;
+	r->headers_out.content_length_n= b->last- b->pos;
+	if(b->last== b->pos)
+		r->header_only= 1; // Empty body
+	b->last_buf= (r== r->main)? 1: 0;
+	b->last_in_chain= 1;
+
+	ret_code= ngx_http_send_header(r);
+	if(ret_code== NGX_ERROR || ret_code> NGX_OK || r->header_only)
+		return ret_code;
+	return ngx_http_output_filter(r, &out);
+}
+
+/**
+ * Get the module's request context structure.
+ * As the module's contexts are cleared by Nginx on internal redirection,
+ * the context is looked-up in the request's pool clean-up handlers if
+ * needed (and set again as the module's context): the request's own
+ * context (e.g. cache warm-up subrequests) or else, for subrequests, their
+ * main request's one (e.g. media segment prefetch subrequests).
+ * @param r HTTP request context structure.
+ * @return Pointer to the request context structure; NULL if the request was
+ * not handled by this module.
+ */
+static ngx_http_tcdn_webcache_req_ctx_t* ngx_http_tcdn_webcache_req_ctx_get(
+		ngx_http_request_t *r)
+{
+	ngx_pool_cleanup_t *cln;
+	ngx_http_tcdn_webcache_req_ctx_t *ctx, *ctx_found;
+
+	ctx= ngx_http_get_module_ctx(r, ngx_http_tcdn_webcache_module);
+	if(ctx!= NULL || !r->internal)
+		return ctx;
+
+	for(cln= r->pool->cleanup; cln!= NULL; cln= cln->next) {
+		if(cln->handler!= ngx_http_tcdn_webcache_req_ctx_cleanup)
+			continue;
+		ctx_found= cln->data;
+		if(ctx_found->request== r) {
+			ctx= ctx_found;
+			break;
+		}
+		if(ctx_found->request== r->main)
+			ctx= ctx_found;
+	}
+	if(ctx!= NULL)
+		ngx_http_set_ctx(r, ctx, ngx_http_tcdn_webcache_module);
+	return ctx;
+}
+
+/**
+ * Allocates and initializes the module's request context structure (see
+ * 'ngx_http_tcdn_webcache_req_ctx_get()').
+ * @param r HTTP request context structure.
+ * @return Pointer to the request context structure on success, NULL if
+ * fails.
+ */
+static ngx_http_tcdn_webcache_req_ctx_t* ngx_http_tcdn_webcache_req_ctx_create(
+		ngx_http_request_t *r)
+{
+	ngx_pool_cleanup_t *cln;
+	ngx_http_tcdn_webcache_req_ctx_t *ctx;
+
+	cln= ngx_pool_cleanup_add(r->pool,
+			sizeof(ngx_http_tcdn_webcache_req_ctx_t));
+	if(cln== NULL)
+		return NULL;
+	cln->handler= ngx_http_tcdn_webcache_req_ctx_cleanup;
+
+	ctx= cln->data;
+	ctx->request= r;
+	ctx->warmup= 0;
+	ctx->lookup_time_usecs= -1;
+	ctx->table_generation= 0;
+	ngx_str_null(&ctx->bucket_id);
+	ngx_str_null(&ctx->origin);
+	ngx_str_null(&ctx->origin_host);
+	ngx_str_null(&ctx->origin_scheme);
+	ngx_str_null(&ctx->peer);
+	ngx_str_null(&ctx->shield);
+	ctx->hop= 0;
+	ctx->from_peer= 0;
+	ctx->stale_while_revalidate= 0;
+	ctx->stale_if_error= 0;
+	ctx->prefetch= 0;
+	ctx->prefetch_foreign= 0;
+	ctx->slice= 0;
+	ngx_str_null(&ctx->cache_generation);
+
+	ngx_http_set_ctx(r, ctx, ngx_http_tcdn_webcache_module);
+	return ctx;
+}
+
+/**
+ * Request context clean-up handler. Nothing to release (context memory
+ * belongs to the request pool); it is just used to tag the context in the
+ * pool clean-up handlers list (see 'ngx_http_tcdn_webcache_req_ctx_get()').
+ * @param data Pointer to the request context structure.
+ */
+static void ngx_http_tcdn_webcache_req_ctx_cleanup(void *data)
+{
+	// Nothing to do
+}
+
+/**
+ * Fetch origin server corresponding to the declared HTTP host-header.
+ * The routing information (bucket identifier, origin-server, cluster peer
+ * owning the requested content, bucket's shield, cache key generation and
+ * buckets information generation) is copied to the request context.
+ * @param main_conf Module's main configuration context structure.
+ * @param r HTTP request context structure.
+ * @param ngx_log Log context structure.
+ * @param ctx Module's request context structure.
+ * Failures are counted in the module's metrics.
+ * @return Status code NGX_OK on succeed; otherwise, the HTTP error status
+ * code to respond with: NGX_HTTP_BAD_REQUEST if the request has no
+ * host-header, NGX_HTTP_SERVICE_UNAVAILABLE if no buckets information was
+ * received from the tracker yet (or if the bucket is not active, or if its
+ * admission limits reject the request), NGX_HTTP_BAD_GATEWAY if no bucket
+ * matches the host-header (no origin-server known), NGX_HTTP_FORBIDDEN if
+ * the bucket's access policy denies the request (or if its signed URL is not
+ * valid), NGX_HTTP_INTERNAL_SERVER_ERROR on internal errors (see
+ * 'ngx_http_request.h').
+ */
+static ngx_int_t buckets_information_fetch_host_origin(
+		ngx_http_tcdn_webcache_main_conf_t *main_conf, ngx_http_request_t *r,
+		ngx_log_t *ngx_log, ngx_http_tcdn_webcache_req_ctx_t *ctx)
+{
+	ngx_table_elt_t *host;
+	ngx_thread_mutex_t *p_buckets_mutex;
+	const tcdn_routing_table_t *routing_table;
+	const tcdn_routing_entry_t *entry;
+	ngx_http_tcdn_webcache_peer_t *peer;
+	ngx_uint_t purge_serial;
+	u_char *p;
+	ngx_int_t end_code= NGX_HTTP_INTERNAL_SERVER_ERROR;
+
+	/* Check arguments */
+	if(main_conf== NULL || r== NULL || ngx_log== NULL || ctx== NULL)
+		return NGX_HTTP_INTERNAL_SERVER_ERROR;
+
+	/* Get host-header (may be missing in HTTP/1.0 requests) */
+	host= r->headers_in.host;
+	if(host== NULL || host->value.len== 0) {
+		METRICS_INC(main_conf, requests_no_host);
+		return NGX_HTTP_BAD_REQUEST;
+	}
+	LOGD(ngx_log, "HTTP host-header input: '%V'\n", &host->value);
+
+	/* Look-up in the buckets routing table (routing information is copied
+	 * to the request memory pool before releasing the lock) */
+	p_buckets_mutex= &main_conf->routing_table_mutex;
+	ASSERT(ngx_thread_mutex_lock(p_buckets_mutex, ngx_log)== NGX_OK);
+	ctx->table_generation= main_conf->buckets_generation;
+	routing_table= main_conf->routing_table[main_conf->routing_table_idx];
+	if(routing_table== NULL) {
+		METRICS_INC(main_conf, requests_no_table);
+		end_code= NGX_HTTP_SERVICE_UNAVAILABLE;
+		goto end;
+	}
+	entry= tcdn_routing_table_lookup(routing_table,
+			(const char*)host->value.data, host->value.len);
+	if(entry== NULL) {
+		METRICS_INC(main_conf, requests_unknown_host);
+		end_code= NGX_HTTP_BAD_GATEWAY;
+		goto end;
+	}
+	LOGD(ngx_log, "Bucket '%s' (id: '%s') origin: '%s://%s:%ud'\n",
+			entry->host, entry->bucket_id, entry->https? "https": "http",
+			entry->origin_host, entry->origin_port);
+
+	if(entry->bucket_id_len> 0) {
+		ctx->bucket_id.data= ngx_pnalloc(r->pool, entry->bucket_id_len);
+		CHECK_DO(ctx->bucket_id.data!= NULL, goto end_error);
+		ngx_memcpy(ctx->bucket_id.data, entry->bucket_id,
+				entry->bucket_id_len);
+		ctx->bucket_id.len= entry->bucket_id_len;
+	}
+
+	/* Buckets disabled or out of their activation window fail fast (the
+	 * table in use was compiled for the current time: no dates are evaluated
+	 * here). Cache warm-ups may fill the cache before a bucket goes live */
+	if(!entry->active && !ctx->warmup) {
+		METRICS_INC(main_conf, requests_inactive_bucket);
+		end_code= NGX_HTTP_SERVICE_UNAVAILABLE;
+		goto end;
+	}
+
+	ctx->origin_host.data= ngx_pnalloc(r->pool, entry->origin_host_len+
+			sizeof(":65535")- 1);
+	CHECK_DO(ctx->origin_host.data!= NULL, goto end_error);
+	p= ngx_cpymem(ctx->origin_host.data, entry->origin_host,
+			entry->origin_host_len);
+	if(entry->origin_port!= (entry->https?
+			TCDN_ROUTING_ORIGIN_PORT_HTTPS_DEFAULT:
+			TCDN_ROUTING_ORIGIN_PORT_DEFAULT))
+		p= ngx_sprintf(p, ":%ud", entry->origin_port);
+	ctx->origin_host.len= p- ctx->origin_host.data;
+
+	/* Scheme string memory is static */
+	if(entry->https) {
+		ngx_str_set(&ctx->origin_scheme, "https");
+	} else {
+		ngx_str_set(&ctx->origin_scheme, "http");
+	}
+
+	/* Resolved origin-servers are proxied to their address (see
+	 * 'tcdn_webcache_resolve_valid') */
+	if(entry->origin_addr_len> 0) {
+		ctx->origin.data= ngx_pnalloc(r->pool, entry->origin_addr_len+
+				sizeof(":65535")- 1);
+		CHECK_DO(ctx->origin.data!= NULL, goto end_error);
+		ctx->origin.len= ngx_sprintf(ctx->origin.data, "%*s:%ud",
+				entry->origin_addr_len, entry->origin_addr,
+				entry->origin_port)- ctx->origin.data;
+	} else {
+		ctx->origin.data= ngx_pnalloc(r->pool, entry->origin_host_len+
+				sizeof(":65535")- 1);
+		CHECK_DO(ctx->origin.data!= NULL, goto end_error);
+		ctx->origin.len= ngx_sprintf(ctx->origin.data, "%*s:%ud",
+				entry->origin_host_len, entry->origin_host,
+				entry->origin_port)- ctx->origin.data;
+	}
+
+	ctx->stale_while_revalidate= entry->stale_while_revalidate;
+	ctx->stale_if_error= entry->stale_if_error;
+	ctx->slice= entry->slice;
+
+	/* Client requests are checked against the bucket's access policy and
+	 * signed URLs, and admitted and paced by its limits (requests forwarded
+	 * by a trusted webcache node were by that node; cache warm-ups are
+	 * issued by the node's administrator) */
+	if(ctx->hop== 0 && !ctx->warmup &&
+			((end_code= bucket_access_check(main_conf, r, ngx_log, entry))!=
+			NGX_OK ||
+			(end_code= bucket_signature_check(main_conf, r, ngx_log, entry))!=
+			NGX_OK ||
+			(end_code= bucket_limits_apply(main_conf, r, ngx_log, entry))!=
+			NGX_OK)) {
+		if(end_code== NGX_HTTP_INTERNAL_SERVER_ERROR)
+			goto end_error;
+		goto end;
+	}
+	end_code= NGX_HTTP_INTERNAL_SERVER_ERROR;
+
+	/* Requests forwarded by a cluster peer are never forwarded again (but
+	 * the ones forwarded by trusted nodes out of the cluster, e.g. edges to
+	 * a shield cluster, are sharded; peer name memory belongs to the
+	 * configuration) */
+	if(main_conf->peers_ring!= NULL && !ctx->from_peer &&
+			(peer= peers_select(main_conf, entry, &r->uri, &r->args))!= NULL &&
+			!peer->self) {
+		ctx->peer= peer->name;
+		end_code= NGX_OK;
+		goto end;
+	}
+
+	/* Content owned by this node: cache key generation of the requested
+	 * content (see '$tcdn_cache_generation') */
+	purge_serial= purges_match(main_conf, ngx_log, entry->host,
+			entry->host_len, &r->uri);
+	if(entry->lastinvalidated> 0 || purge_serial> 0) {
+		ctx->cache_generation.data= ngx_pnalloc(r->pool, sizeof("#.")- 1+
+				NGX_INT_T_LEN* 2);
+		CHECK_DO(ctx->cache_generation.data!= NULL, goto end_error);
+		p= ngx_sprintf(ctx->cache_generation.data, "#%ui",
+				(ngx_uint_t)entry->lastinvalidated);
+		if(purge_serial> 0)
+			p= ngx_sprintf(p, ".%ui", purge_serial);
+		ctx->cache_generation.len= p- ctx->cache_generation.data;
+	}
+
+	/* Content owned by this node: next media segments are prefetched into
+	 * its cache (only on client requests, so that forwarded prefetches do
+	 * not cascade), but the ones owned by another cluster peer */
+	if(ctx->hop== 0 && entry->prefetch> 0) {
+		ctx->prefetch= entry->prefetch;
+		ctx->prefetch_foreign= segments_prefetch_foreign(main_conf, r,
+				ngx_log, entry, entry->prefetch);
+	}
+
+	/* Content owned by this node: misses go to the shield, if any, unless
+	 * this node is the shield */
+	if(entry->shield_host_len> 0) {
+		ctx->shield.data= ngx_pnalloc(r->pool, entry->shield_host_len+
+				sizeof(":65535")- 1);
+		CHECK_DO(ctx->shield.data!= NULL, goto end_error);
+		ctx->shield.len= ngx_sprintf(ctx->shield.data, "%*s:%ud",
+				entry->shield_host_len, entry->shield_host,
+				entry->shield_port)- ctx->shield.data;
+		if(main_conf->peer_self!= NULL &&
+				main_conf->peer_self->name.len== ctx->shield.len &&
+				ngx_strncasecmp(main_conf->peer_self->name.data,
+						ctx->shield.data, ctx->shield.len)== 0) {
+			ngx_str_null(&ctx->shield);
+		} else if(entry->shield_addr_len> 0) {
+			ctx->shield.data= ngx_pnalloc(r->pool, entry->shield_addr_len+
+					sizeof(":65535")- 1);
+			CHECK_DO(ctx->shield.data!= NULL, goto end_error);
+			ctx->shield.len= ngx_sprintf(ctx->shield.data, "%*s:%ud",
+					entry->shield_addr_len, entry->shield_addr,
+					entry->shield_port)- ctx->shield.data;
+		}
+	}
+
+	end_code= NGX_OK;
+	goto end;
+end_error:
+	METRICS_INC(main_conf, requests_internal_error);
+end:
+	ASSERT(ngx_thread_mutex_unlock(p_buckets_mutex, ngx_log)== NGX_OK);
+	return end_code;
+}
+
+/**
+ * Get the request hop-count (see 'HOP_HEADER_NAME').
+ * The header-field is only trusted from the cluster peers and the
+ * 'tcdn_webcache_trusted' addresses (client address as set by the
+ * connection, or by the 'realip' module); from any other source, it is
+ * ignored and removed from the request headers, so that it is not proxied
+ * (see 'ngx_http_proxy_create_request()').
+ * @param main_conf Module's main configuration context structure.
+ * @param r HTTP request context structure.
+ * @return Hop-count; zero if the header-field is not present or not
+ * trusted, one if it is not a valid number.
+ */
+static ngx_uint_t request_hop_count(
+		ngx_http_tcdn_webcache_main_conf_t *main_conf, ngx_http_request_t *r)
+{
+	ngx_uint_t i;
+	ngx_int_t hop;
+	ngx_flag_t trusted;
+	ngx_list_part_t *part= &r->headers_in.headers.part;
+	ngx_table_elt_t *header= part->elts;
+
+	trusted= cidrs_match(main_conf->peers_addrs, r->connection->sockaddr) ||
+			cidrs_match(main_conf->trusted, r->connection->sockaddr);
+
+	for(i= 0; ; i++) {
+		if(i>= part->nelts) {
+			if(part->next== NULL)
+				break;
+			part= part->next;
+			header= part->elts;
+			i= 0;
+		}
+		if(header[i].key.len== sizeof(HOP_HEADER_NAME)- 1 &&
+				ngx_strncasecmp(header[i].key.data, (u_char*)HOP_HEADER_NAME,
+						sizeof(HOP_HEADER_NAME)- 1)== 0) {
+			if(!trusted) {
+				/* Removed (all the occurrences) */
+				header[i].hash= 0;
+				continue;
+			}
+			hop= ngx_atoi(header[i].value.data, header[i].value.len);
+			return hop!= NGX_ERROR? (ngx_uint_t)hop: 1;
+		}
+	}
+	return 0;
+}
+
+/**
+ * Checks whether an address belongs to any of the given networks (as in
+ * 'ngx_http_get_forwarded_addr_internal()'; IPv4-mapped IPv6 addresses are
+ * matched as IPv4).
+ * @param cidrs Networks array ('ngx_cidr_t'); NULL matches no address.
+ * @param sockaddr Address to be checked.
+ * @return Non-zero if the address matches, zero otherwise.
+ */
+static ngx_flag_t cidrs_match(ngx_array_t *cidrs, struct sockaddr *sockaddr)
+{
+	ngx_uint_t i, family;
+	in_addr_t inaddr= 0;
+	ngx_cidr_t *cidr;
+#if (NGX_HAVE_INET6)
+	ngx_uint_t n;
+	u_char *p;
+	struct in6_addr *inaddr6= NULL;
+#endif
+
+	if(cidrs== NULL)
+		return 0;
+
+	family= sockaddr->sa_family;
+	if(family== AF_INET)
+		inaddr= ((struct sockaddr_in*)sockaddr)->sin_addr.s_addr;
+#if (NGX_HAVE_INET6)
+	else if(family== AF_INET6) {
+		inaddr6= &((struct sockaddr_in6*)sockaddr)->sin6_addr;
+		if(IN6_IS_ADDR_V4MAPPED(inaddr6)) {
+			family= AF_INET;
+			p= inaddr6->s6_addr;
+			inaddr= htonl((p[12]<< 24)+ (p[13]<< 16)+ (p[14]<< 8)+ p[15]);
+		}
+	}
+#endif
+
+	cidr= cidrs->elts;
+	for(i= 0; i< cidrs->nelts; i++) {
+		if(cidr[i].family!= family)
+			continue;
+		switch(family) {
+#if (NGX_HAVE_INET6)
+		case AF_INET6:
+			for(n= 0; n< 16; n++) {
+				if((inaddr6->s6_addr[n]& cidr[i].u.in6.mask.s6_addr[n])!=
+						cidr[i].u.in6.addr.s6_addr[n])
+					break;
+			}
+			if(n== 16)
+				return 1;
+			break;
+#endif
+		default: /* AF_INET */
+			if((inaddr& cidr[i].u.in.mask)== cidr[i].u.in.addr)
+				return 1;
+			break;
+		}
+	}
+	return 0;
+}
+
+/**
+ * Checks the request against its bucket's access policy (see
+ * 'tcdn_routing_access_check()'): client address (as set by the
+ * connection, or by the 'realip' module), referer header-field and country
+ * (see 'tcdn_webcache_country').
+ * Denials are counted in the module's metrics.
+ * @param main_conf Module's main configuration context structure.
+ * @param r HTTP request context structure.
+ * @param ngx_log Log context structure.
+ * @param entry Bucket routing entry.
+ * @return Status code NGX_OK if the request is allowed;
+ * NGX_HTTP_FORBIDDEN if it is denied, NGX_HTTP_INTERNAL_SERVER_ERROR
+ * otherwise (see 'ngx_http_request.h').
+ */
+static ngx_int_t bucket_access_check(
+		ngx_http_tcdn_webcache_main_conf_t *main_conf, ngx_http_request_t *r,
+		ngx_log_t *ngx_log, const tcdn_routing_entry_t *entry)
+{
+	struct sockaddr *sockaddr= r->connection->sockaddr;
+	const u_char *addr= NULL;
+	size_t addr_len= 0;
+	const char *referer= NULL, *country= NULL;
+	size_t referer_len= 0;
+	char country_code[3];
+	ngx_str_t value;
+#if (NGX_HAVE_INET6)
+	struct sockaddr_in6 *sin6;
+#endif
+
+	if(entry->access== NULL)
+		return NGX_OK;
+
+	/* Client address (IPv4-mapped IPv6 addresses are checked as IPv4) */
+	switch(sockaddr->sa_family) {
+	case AF_INET:
+		addr= (const u_char*)&((struct sockaddr_in*)sockaddr)->sin_addr;
+		addr_len= 4;
+		break;
+#if (NGX_HAVE_INET6)
+	case AF_INET6:
+		sin6= (struct sockaddr_in6*)sockaddr;
+		addr= sin6->sin6_addr.s6_addr;
+		addr_len= 16;
+		if(IN6_IS_ADDR_V4MAPPED(&sin6->sin6_addr)) {
+			addr+= 12;
+			addr_len= 4;
+		}
+		break;
+#endif
+	default:
+		break;
+	}
+
+	if(r->headers_in.referer!= NULL) {
+		referer= (const char*)r->headers_in.referer->value.data;
+		referer_len= r->headers_in.referer->value.len;
+	}
+
+	if(main_conf->country!= NULL) {
+		CHECK_DO(ngx_http_complex_value(r, main_conf->country, &value)==
+				NGX_OK, return NGX_HTTP_INTERNAL_SERVER_ERROR);
+		if(value.len== 2) {
+			country_code[0]= value.data[0];
+			country_code[1]= value.data[1];
+			country_code[2]= '\0';
+			country= country_code;
+		}
+	}
+
+	switch(tcdn_routing_access_check(entry, addr, addr_len, referer,
+			referer_len, country)) {
+	case TCDN_ROUTING_ACCESS_ALLOWED:
+		return NGX_OK;
+	case TCDN_ROUTING_ACCESS_DENIED_ADDRESS:
+		METRICS_INC(main_conf, requests_denied_address);
+		break;
+	case TCDN_ROUTING_ACCESS_DENIED_REFERER:
+		METRICS_INC(main_conf, requests_denied_referer);
+		break;
+	default:
+		METRICS_INC(main_conf, requests_denied_geoloc);
+		break;
+	}
+	LOGD(ngx_log, "Request denied by bucket '%s' access policy\n",
+			entry->host);
+	return NGX_HTTP_FORBIDDEN;
+}
+
+/**
+ * Checks the request's signed URL, if the bucket's URLs are signed
+ * ('redir'): the query-string carries the token expiration time
+ * (REDIR_ARG_EXPIRES, seconds since the Epoch) and the token (REDIR_ARG_TOKEN),
+ * the hexadecimal HMAC-MD5 or HMAC-SHA256 ('redir_hash_type') of the bucket's
+ * secret over the expiration time digits followed by the URI path (e.g.
+ * "1500000000/video/index.m3u8"). The token must not be expired, nor expire
+ * later than the bucket's maximum lifetime ('redir.expires').
+ * The HMAC keys are precomputed once per routing table (see
+ * 'redir_key_compute()'); requests are denied if the bucket's key could not
+ * be computed (or if Nginx was built without OpenSSL).
+ * Requests forwarded by a trusted webcache node (see 'request_hop_count()')
+ * are not checked again, since that node did; a hop-count header-field sent
+ * by any other client does not exempt the request.
+ * @param main_conf Module's main configuration context structure.
+ * @param r HTTP request context structure.
+ * @param ngx_log Log context structure.
+ * @param entry Bucket routing entry.
+ * @return Status code NGX_OK if the request is not signed or if its
+ * signature is valid, NGX_HTTP_FORBIDDEN if it is denied,
+ * NGX_HTTP_INTERNAL_SERVER_ERROR otherwise (see 'ngx_http_request.h').
+ */
+static ngx_int_t bucket_signature_check(
+		ngx_http_tcdn_webcache_main_conf_t *main_conf, ngx_http_request_t *r,
+		ngx_log_t *ngx_log, const tcdn_routing_entry_t *entry)
+{
+	ngx_str_t expires, token;
+	time_t expires_ts, now;
+#if (NGX_OPENSSL)
+	const ngx_http_tcdn_webcache_redir_key_t *redir_key= entry->redir_key;
+	ngx_http_tcdn_webcache_redir_key_t hmac;
+	u_char digest[SHA256_DIGEST_LENGTH], token_digest[SHA256_DIGEST_LENGTH];
+	size_t digest_len, i;
+	ngx_int_t n;
+	int ok;
+#endif
+
+	if(entry->redir_secret_len== 0)
+		return NGX_OK;
+
+	if(ngx_http_arg(r, (u_char*)REDIR_ARG_EXPIRES,
+			sizeof(REDIR_ARG_EXPIRES)- 1, &expires)!= NGX_OK ||
+			ngx_http_arg(r, (u_char*)REDIR_ARG_TOKEN,
+			sizeof(REDIR_ARG_TOKEN)- 1, &token)!= NGX_OK)
+		goto denied;
+
+	/* Expiration time */
+	expires_ts= ngx_atotm(expires.data, expires.len);
+	now= ngx_time();
+	if(expires_ts== NGX_ERROR || expires_ts< now ||
+			(entry->redir_expires> 0 &&
+			expires_ts- now> (time_t)entry->redir_expires))
+		goto denied;
+
+#if (NGX_OPENSSL)
+	if(redir_key== NULL)
+		goto denied;
+
+	/* HMAC: the precomputed inner and outer states digest the message and
+	 * the inner digest respectively */
+	if(entry->redir_hash_type== TCDN_ROUTING_REDIR_HASH_SHA256) {
+		digest_len= SHA256_DIGEST_LENGTH;
+		hmac= *redir_key;
+		ok= SHA256_Update(&hmac.inner.sha256, expires.data, expires.len) &&
+				SHA256_Update(&hmac.inner.sha256, r->uri.data, r->uri.len) &&
+				SHA256_Final(digest, &hmac.inner.sha256) &&
+				SHA256_Update(&hmac.outer.sha256, digest, digest_len) &&
+				SHA256_Final(digest, &hmac.outer.sha256);
+	} else {
+		digest_len= MD5_DIGEST_LENGTH;
+		hmac= *redir_key;
+		ok= MD5_Update(&hmac.inner.md5, expires.data, expires.len) &&
+				MD5_Update(&hmac.inner.md5, r->uri.data, r->uri.len) &&
+				MD5_Final(digest, &hmac.inner.md5) &&
+				MD5_Update(&hmac.outer.md5, digest, digest_len) &&
+				MD5_Final(digest, &hmac.outer.md5);
+	}
+	CHECK_DO(ok, return NGX_HTTP_INTERNAL_SERVER_ERROR);
+
+	/* Token (hexadecimal, case-insensitive), compared in constant time */
+	if(token.len!= digest_len* 2)
+		goto denied;
+	for(i= 0; i< digest_len; i++) {
+		if((n= ngx_hextoi(&token.data[i* 2], 2))== NGX_ERROR)
+			goto denied;
+		token_digest[i]= (u_char)n;
+	}
+	if(CRYPTO_memcmp(token_digest, digest, digest_len)== 0)
+		return NGX_OK;
+#endif
+
+denied:
+	METRICS_INC(main_conf, requests_denied_signature);
+	LOGD(ngx_log, "Request denied by bucket '%s' signed URLs\n", entry->host);
+	return NGX_HTTP_FORBIDDEN;
+}
+
+/**
+ * Applies the request's bucket limits:
+ * - admission control: the request is rejected if the bucket reached its
+ * maximum number of requests in progress ('max_connections') or exceeded
+ * its maximum request rate ('max_request_rate'), so that a bucket can not
+ * exhaust the node's workers;
+ * - bandwidth: the per connection limit ('bwidth') is the request's rate
+ * limit (as 'limit_rate'; it takes precedence over the location's one), and
+ * the aggregate limit ('max_bandwidth') attaches the request to the
+ * bucket's shared shaper, which paces the response in the write filter.
+ * The bucket's accounting is shared by all the worker processes (see
+ * 'ngx_http_tcdn_webcache_bucket_state_t').
+ * Requests forwarded by a trusted webcache node (see 'request_hop_count()')
+ * are neither admitted nor paced again, since that node admitted them and
+ * paces the response to its client.
+ * @param main_conf Module's main configuration context structure.
+ * @param r HTTP request context structure.
+ * @param ngx_log Log context structure.
+ * @param entry Bucket routing entry.
+ * @return Status code NGX_OK on succeed (also if the bucket could not be
+ * limited because all the buckets shared states are in use);
+ * NGX_HTTP_SERVICE_UNAVAILABLE if the request is rejected,
+ * NGX_HTTP_INTERNAL_SERVER_ERROR otherwise (see 'ngx_http_request.h').
+ */
+static ngx_int_t bucket_limits_apply(
+		ngx_http_tcdn_webcache_main_conf_t *main_conf, ngx_http_request_t *r,
+		ngx_log_t *ngx_log, const tcdn_routing_entry_t *entry)
+{
+	ngx_pool_cleanup_t *cln;
+	ngx_http_tcdn_webcache_bucket_req_t *bucket_req;
+	ngx_http_tcdn_webcache_bucket_state_t *bucket_state;
+	const char *key;
+	size_t key_len;
+	ngx_msec_int_t elapsed;
+	ngx_int_t burst_requests;
+	off_t rate, burst;
+
+	/* Bandwidth limits are in kbit/s */
+	if(entry->bwidth> 0)
+		r->limit_rate= (size_t)entry->bwidth* 125;
+
+	if((entry->max_connections== 0 && entry->max_request_rate== 0 &&
+			entry->max_bandwidth== 0) || main_conf->buckets_state== NULL)
+		return NGX_OK;
+	rate= (off_t)entry->max_bandwidth* 125;
+	burst= ngx_max(rate* SHAPER_BURST_MSEC/ 1000, 1);
+	burst_requests= (ngx_int_t)entry->max_request_rate* 1000;
+
+	/* Buckets are keyed by identifier (shared by all the bucket's
+	 * host-names), or by host-name if the bucket has none */
+	key= entry->bucket_id_len> 0? entry->bucket_id: entry->host;
+	key_len= entry->bucket_id_len> 0? entry->bucket_id_len: entry->host_len;
+
+	cln= ngx_pool_cleanup_add(r->pool,
+			sizeof(ngx_http_tcdn_webcache_bucket_req_t));
+	CHECK_DO(cln!= NULL, return NGX_HTTP_INTERNAL_SERVER_ERROR);
+
+	ngx_shmtx_lock(&main_conf->buckets_shpool->mutex);
+	bucket_state= bucket_state_get(main_conf->buckets_state, key, key_len);
+	if(bucket_state== NULL) {
+		ngx_shmtx_unlock(&main_conf->buckets_shpool->mutex);
+		ngx_log_error(NGX_LOG_WARN, ngx_log, 0, "All the buckets shared "
+				"states are in use; bucket '%s' not limited\n", entry->host);
+		METRICS_INC(main_conf, buckets_state_exhausted);
+		return NGX_OK;
+	}
+	bucket_state->used= ngx_current_msec;
+
+	if(entry->max_connections> 0 &&
+			bucket_state->active>= entry->max_connections) {
+		ngx_shmtx_unlock(&main_conf->buckets_shpool->mutex);
+		LOGD(ngx_log, "Bucket '%s' reached its maximum connections\n",
+				entry->host);
+		METRICS_INC(main_conf, requests_over_connections);
+		return bucket_limits_reject(r, ngx_log);
+	}
+
+	if(entry->max_request_rate> 0) {
+		/* Refill (the rate is integer: no fraction of a token is lost) */
+		elapsed= (ngx_msec_int_t)(ngx_current_msec-
+				bucket_state->requests_last);
+		if(elapsed>= 1000 || elapsed< 0)
+			bucket_state->requests= burst_requests;
+		else
+			bucket_state->requests+= (ngx_int_t)entry->max_request_rate*
+					elapsed;
+		if(bucket_state->requests> burst_requests)
+			bucket_state->requests= burst_requests;
+		bucket_state->requests_last= ngx_current_msec;
+
+		if(bucket_state->requests< 1000) {
+			ngx_shmtx_unlock(&main_conf->buckets_shpool->mutex);
+			LOGD(ngx_log, "Bucket '%s' exceeded its maximum request rate\n",
+					entry->host);
+			METRICS_INC(main_conf, requests_over_rate);
+			return bucket_limits_reject(r, ngx_log);
+		}
+		bucket_state->requests-= 1000;
+	}
+
+	bucket_state->active++;
+	ngx_shmtx_unlock(&main_conf->buckets_shpool->mutex);
+
+	bucket_req= cln->data;
+	bucket_req->shpool= main_conf->buckets_shpool;
+	bucket_req->bucket_state= bucket_state;
+	cln->handler= bucket_limits_cleanup;
+
+	if(entry->max_bandwidth== 0)
+		return NGX_OK;
+
+	bucket_req->shaper.acquire= bucket_shaper_acquire;
+	bucket_req->shaper.release= bucket_shaper_release;
+	bucket_req->shaper.data= bucket_req;
+	bucket_req->rate= rate;
+	bucket_req->burst= burst;
+	bucket_req->next= ngx_current_msec;
+
+	r->shaper= &bucket_req->shaper;
+	METRICS_INC(main_conf, requests_shaped);
+	return NGX_OK;
+}
+
+/**
+ * Rejects a request over its bucket's admission limits: the client is asked
+ * to retry later (see 'ADMISSION_RETRY_AFTER').
+ * @param r HTTP request context structure.
+ * @param ngx_log Log context structure.
+ * @return The HTTP error status code to respond with:
+ * NGX_HTTP_SERVICE_UNAVAILABLE, or NGX_HTTP_INTERNAL_SERVER_ERROR on
+ * internal errors (see 'ngx_http_request.h').
+ */
+static ngx_int_t bucket_limits_reject(ngx_http_request_t *r,
+		ngx_log_t *ngx_log)
+{
+	ngx_table_elt_t *h;
+
+	h= ngx_list_push(&r->headers_out.headers);
+	CHECK_DO(h!= NULL, return NGX_HTTP_INTERNAL_SERVER_ERROR);
+	h->hash= 1;
+	ngx_str_set(&h->key, "Retry-After");
+	ngx_str_set(&h->value, ADMISSION_RETRY_AFTER);
+	return NGX_HTTP_SERVICE_UNAVAILABLE;
+}
+
+/**
+ * Gets the shared state of a bucket, taking a free one (or the least
+ * recently used idle one) if the bucket has none. Should be called with the
+ * buckets zone slab pool mutex locked.
+ * @param buckets_state Buckets shared states.
+ * @param key Bucket key.
+ * @param key_len Bucket key length.
+ * @return The bucket's state, NULL if all of them are in use.
+ */
+static ngx_http_tcdn_webcache_bucket_state_t* bucket_state_get(
+		ngx_http_tcdn_webcache_buckets_state_t *buckets_state,
+		const char *key, size_t key_len)
+{
+	register ngx_uint_t i;
+	uint32_t hash;
+	size_t cmp_len= ngx_min(key_len, BUCKET_KEY_LEN_MAX);
+	ngx_http_tcdn_webcache_bucket_state_t *bucket_state, *lru= NULL;
+
+	hash= ngx_crc32_short((u_char*)key, key_len);
+	for(i= 0; i< BUCKETS_STATE_MAX; i++) {
+		bucket_state= &buckets_state->state[(hash+ i)% BUCKETS_STATE_MAX];
+		if(bucket_state->key_len== 0) {
+			lru= bucket_state; // Free: the bucket has no state
+			break;
+		}
+		if(bucket_state->hash== hash && bucket_state->key_len== key_len &&
+				ngx_memcmp(bucket_state->key, key, cmp_len)== 0)
+			return bucket_state;
+		if(bucket_state->active== 0 && (lru== NULL ||
+				(ngx_msec_int_t)(bucket_state->used- lru->used)< 0))
+			lru= bucket_state;
+	}
+	if(lru== NULL)
+		return NULL;
+
+	/* A taken state starts with its full bursts (tokens are refilled up to
+	 * the burst after a burst period) */
+	lru->hash= hash;
+	lru->key_len= key_len;
+	ngx_memcpy(lru->key, key, cmp_len);
+	lru->active= 0;
+	lru->used= ngx_current_msec;
+	lru->requests= 0;
+	lru->requests_last= ngx_current_msec- 1000;
+	lru->tokens= 0;
+	lru->last= ngx_current_msec- SHAPER_BURST_MSEC;
+	return lru;
+}
+
+/**
+ * Request output shaper acquire handler (see 'ngx_http_shaper_t'): grants
+ * the response its fair share of the bucket's tokens, or the delay until
+ * they are earned.
+ * @param r HTTP request context structure.
+ * @param limit Reference to the send limit, in bytes (zero means no limit),
+ * lowered to the granted tokens.
+ * @return Delay in milliseconds; zero if the tokens are granted.
+ */
+static ngx_msec_t bucket_shaper_acquire(ngx_http_request_t *r, off_t *limit)
+{
+	ngx_http_tcdn_webcache_bucket_req_t *shaping= r->shaper->data;
+	ngx_http_tcdn_webcache_bucket_state_t *bucket_shaper= shaping->bucket_state;
+	ngx_msec_int_t elapsed;
+	ngx_msec_t delay= 0;
+	off_t earned, share;
+
+	/* Response's own pace */
+	elapsed= (ngx_msec_int_t)(shaping->next- ngx_current_msec);
+	if(elapsed> 0)
+		return (ngx_msec_t)elapsed;
+
+	ngx_shmtx_lock(&shaping->shpool->mutex);
+
+	/* Refill; the time-stamp is not advanced until a whole byte is earned,
+	 * so that slow buckets do not lose tokens */
+	elapsed= (ngx_msec_int_t)(ngx_current_msec- bucket_shaper->last);
+	if(elapsed>= SHAPER_BURST_MSEC || elapsed< 0) {
+		bucket_shaper->tokens= shaping->burst;
+		bucket_shaper->last= ngx_current_msec;
+	} else if((earned= shaping->rate* elapsed/ 1000)> 0) {
+		bucket_shaper->tokens+= earned;
+		bucket_shaper->last= ngx_current_msec;
+	}
+	if(bucket_shaper->tokens> shaping->burst)
+		bucket_shaper->tokens= shaping->burst;
+
+	/* Fair share of the burst (at least a memory page, if the burst allows
+	 * it, to avoid tiny writes) */
+	share= shaping->burst/ ngx_max(bucket_shaper->active, 1);
+	if(share< (off_t)ngx_pagesize)
+		share= ngx_min((off_t)ngx_pagesize, shaping->burst);
+
+	if(bucket_shaper->tokens< share) {
+		delay= (ngx_msec_t)((share- bucket_shaper->tokens)* 1000/
+				shaping->rate)+ 1;
+	} else {
+		if(*limit== 0 || *limit> share)
+			*limit= share;
+		bucket_shaper->tokens-= *limit;
+	}
+
+	ngx_shmtx_unlock(&shaping->shpool->mutex);
+	return delay;
+}
+
+/**
+ * Request output shaper release handler (see 'ngx_http_shaper_t'): gives
+ * back the granted tokens not sent, and paces the response at its fair
+ * share of the bucket's bandwidth.
+ * @param r HTTP request context structure.
+ * @param limit Granted tokens (send limit), in bytes.
+ * @param sent Bytes actually sent.
+ */
+static void bucket_shaper_release(ngx_http_request_t *r, off_t limit,
+		off_t sent)
+{
+	ngx_http_tcdn_webcache_bucket_req_t *shaping= r->shaper->data;
+	ngx_http_tcdn_webcache_bucket_state_t *bucket_shaper= shaping->bucket_state;
+
+	ngx_shmtx_lock(&shaping->shpool->mutex);
+	bucket_shaper->tokens+= limit- sent;
+	if(bucket_shaper->tokens> shaping->burst)
+		bucket_shaper->tokens= shaping->burst;
+	shaping->next= ngx_current_msec+ (ngx_msec_t)(sent* 1000*
+			(off_t)ngx_max(bucket_shaper->active, 1)/ shaping->rate);
+	ngx_shmtx_unlock(&shaping->shpool->mutex);
+}
+
+/**
+ * Request bucket limits clean-up handler: the request is no longer in
+ * progress in its bucket.
+ * @param data Request bucket limits context structure.
+ */
+static void bucket_limits_cleanup(void *data)
+{
+	ngx_http_tcdn_webcache_bucket_req_t *bucket_req= data;
+
+	ngx_shmtx_lock(&bucket_req->shpool->mutex);
+	bucket_req->bucket_state->active--;
+	ngx_shmtx_unlock(&bucket_req->shpool->mutex);
+}
+
+/**
+ * Gets the serial number of the latest purge rule in effect matching a
+ * request (see 'tcdn_webcache_purge'). Expired rules found are freed.
+ * @param main_conf Module's main configuration context structure.
+ * @param ngx_log Log context structure.
+ * @param host Bucket host-name (lower-case, without port).
+ * @param host_len Bucket host-name length.
+ * @param uri Request URI (path).
+ * @return The rule serial number; zero if no rule matches.
+ */
+static ngx_uint_t purges_match(ngx_http_tcdn_webcache_main_conf_t *main_conf,
+		ngx_log_t *ngx_log, const char *host, size_t host_len,
+		ngx_str_t *uri)
+{
+	register ngx_uint_t i;
+	ngx_uint_t serial= 0;
+	uint32_t hash;
+	time_t now;
+	ngx_http_tcdn_webcache_buckets_state_t *buckets_state;
+	ngx_http_tcdn_webcache_purge_t *purge;
+
+	buckets_state= main_conf->buckets_state;
+	if(buckets_state== NULL || buckets_state->purges_num== 0)
+		return 0;
+
+	hash= ngx_crc32_short((u_char*)host, host_len);
+	now= ngx_time();
+	ngx_shmtx_lock(&main_conf->buckets_shpool->mutex);
+	for(i= 0; i< PURGES_MAX; i++) {
+		purge= &buckets_state->purge[i];
+		if(purge->serial== 0)
+			continue;
+		if(purge->expires<= now) {
+			purge->serial= 0;
+			buckets_state->purges_num--;
+			continue;
+		}
+		if(purge->serial<= serial || purge->hash!= hash ||
+				purge->host_len!= host_len ||
+				ngx_memcmp(purge->host, host, host_len)!= 0)
+			continue;
+		if(!purge->regex) {
+			if(uri->len>= purge->pattern_len && ngx_memcmp(uri->data,
+					purge->pattern, purge->pattern_len)== 0)
+				serial= purge->serial;
+			continue;
+		}
+#if (NGX_PCRE)
+		if(purge_regex_match(main_conf, ngx_log, i, purge, uri))
+			serial= purge->serial;
+#endif
+	}
+	ngx_shmtx_unlock(&main_conf->buckets_shpool->mutex);
+	return serial;
+}
+
+#if (NGX_PCRE)
+/**
+ * Matches a request URI against a purge rule regular expression. The
+ * expression is compiled once per rule and worker process (the first time
+ * the rule is checked by the worker). Should be called with the buckets
+ * zone slab pool mutex locked.
+ * @param main_conf Module's main configuration context structure.
+ * @param ngx_log Log context structure.
+ * @param slot Purge rule index.
+ * @param purge Purge rule.
+ * @param uri Request URI (path).
+ * @return Non-zero if the URI matches, zero otherwise.
+ */
+static ngx_int_t purge_regex_match(
+		ngx_http_tcdn_webcache_main_conf_t *main_conf, ngx_log_t *ngx_log,
+		ngx_uint_t slot, ngx_http_tcdn_webcache_purge_t *purge, ngx_str_t *uri)
+{
+	ngx_http_tcdn_webcache_purge_regex_t *purge_regex;
+	ngx_regex_compile_t rc;
+	u_char errstr[NGX_MAX_CONF_ERRSTR];
+
+	if(main_conf->purge_regex== NULL) {
+		main_conf->purge_regex= ngx_pcalloc(main_conf->ngx_pool, PURGES_MAX*
+				sizeof(ngx_http_tcdn_webcache_purge_regex_t));
+		CHECK_DO(main_conf->purge_regex!= NULL, return 0);
+	}
+
+	purge_regex= &main_conf->purge_regex[slot];
+	if(purge_regex->serial!= purge->serial) {
+		if(purge_regex->ngx_pool!= NULL)
+			ngx_destroy_pool(purge_regex->ngx_pool);
+		purge_regex->serial= purge->serial;
+		purge_regex->regex= NULL;
+		purge_regex->ngx_pool= ngx_create_pool(1024, ngx_log);
+		CHECK_DO(purge_regex->ngx_pool!= NULL, return 0);
+
+		ngx_memzero(&rc, sizeof(ngx_regex_compile_t));
+		rc.pattern.data= purge->pattern;
+		rc.pattern.len= purge->pattern_len;
+		rc.pool= purge_regex->ngx_pool;
+		rc.err.len= NGX_MAX_CONF_ERRSTR;
+		rc.err.data= errstr;
+		CHECK_DO(ngx_regex_compile(&rc)== NGX_OK, return 0);
+		purge_regex->regex= rc.regex;
+	}
+
+	return purge_regex->regex!= NULL &&
+			ngx_regex_exec(purge_regex->regex, uri, NULL, 0)>= 0;
+}
+#endif
+
+/**
+ * Creates the cluster consistent-hashing ring.
+ * Each peer is given 'PEERS_RING_POINTS_PER_WEIGHT' points per weight
+ * unit, hashed as in 'ngx_http_upstream_hash_module.c' (compatible with
+ * Cache::Memcached::Fast): crc32(HOST \0 PORT PREV_HASH). Thus, all the
+ * nodes of the cluster (configured with the same peers) agree on the owner
+ * of each content, and adding or removing a peer only moves the content
+ * owned by that peer.
+ * @param ngx_conf
+ * @param peers Cluster peers array.
+ * @param ref_peer_self Reference to the 'self' peer pointer to be set (NULL
+ * if none is declared).
+ * @return Pointer to the ring on success (allocated in the configuration
+ * pool), NULL otherwise.
+ */
+static ngx_http_tcdn_webcache_ring_t* peers_ring_create(ngx_conf_t *ngx_conf,
+		ngx_array_t *peers, ngx_http_tcdn_webcache_peer_t **ref_peer_self)
+{
+	u_char *host, *port;
+	size_t host_len, port_len;
+	uint32_t hash, base_hash;
+	ngx_uint_t i, j, npoints= 0, nself= 0;
+	ngx_http_tcdn_webcache_peer_t *peer;
+	ngx_http_tcdn_webcache_ring_t *ring;
+	union {
+		uint32_t value;
+		u_char byte[4];
+	} prev_hash;
+
+	peer= peers->elts;
+	*ref_peer_self= NULL;
+	for(i= 0; i< peers->nelts; i++) {
+		npoints+= peer[i].weight* PEERS_RING_POINTS_PER_WEIGHT;
+		if(peer[i].self) {
+			*ref_peer_self= &peer[i];
+			nself++;
+		}
+	}
+	if(nself> 1) {
+		ngx_conf_log_error(NGX_LOG_EMERG, ngx_conf, 0, "only one "
+				"\"tcdn_webcache_peer\" can be \"self\"");
+		return NULL;
+	}
+	if(nself== 0)
+		ngx_conf_log_error(NGX_LOG_WARN, ngx_conf, 0, "no \"self\" "
+				"\"tcdn_webcache_peer\": all requests will be forwarded");
+
+	ring= ngx_palloc(ngx_conf->pool, sizeof(ngx_http_tcdn_webcache_ring_t)+
+			sizeof(ngx_http_tcdn_webcache_ring_point_t)* (npoints- 1));
+	if(ring== NULL)
+		return NULL;
+	ring->number= 0;
+
+	for(i= 0; i< peers->nelts; i++) {
+		/* Split "host:port" */
+		host= peer[i].name.data;
+		host_len= peer[i].name.len;
+		port= NULL;
+		port_len= 0;
+		for(j= 0; j< peer[i].name.len; j++) {
+			u_char c= peer[i].name.data[peer[i].name.len- j- 1];
+			if(c== ':') {
+				host_len= peer[i].name.len- j- 1;
+				port= peer[i].name.data+ peer[i].name.len- j;
+				port_len= j;
+				break;
+			}
+			if(c< '0' || c> '9')
+				break;
+		}
+
+		ngx_crc32_init(base_hash);
+		ngx_crc32_update(&base_hash, host, host_len);
+		ngx_crc32_update(&base_hash, (u_char*)"", 1);
+		ngx_crc32_update(&base_hash, port, port_len);
+
+		prev_hash.value= 0;
+		for(j= 0; j< peer[i].weight* PEERS_RING_POINTS_PER_WEIGHT; j++) {
+			hash= base_hash;
+			ngx_crc32_update(&hash, prev_hash.byte, 4);
+			ngx_crc32_final(hash);
+
+			ring->point[ring->number].hash= hash;
+			ring->point[ring->number].peer= &peer[i];
+			ring->number++;
+
+#if (NGX_HAVE_LITTLE_ENDIAN)
+			prev_hash.value= hash;
+#else
+			prev_hash.byte[0]= (u_char)(hash& 0xff);
+			prev_hash.byte[1]= (u_char)((hash>> 8)& 0xff);
+			prev_hash.byte[2]= (u_char)((hash>> 16)& 0xff);
+			prev_hash.byte[3]= (u_char)((hash>> 24)& 0xff);
+#endif
+		}
+	}
+
+	ngx_qsort(ring->point, ring->number,
+			sizeof(ngx_http_tcdn_webcache_ring_point_t), peers_ring_cmp_points);
+
+	/* Remove duplicated points */
+	for(i= 0, j= 1; j< ring->number; j++) {
+		if(ring->point[i].hash!= ring->point[j].hash)
+			ring->point[++i]= ring->point[j];
+	}
+	ring->number= i+ 1;
+	return ring;
+}
+
+/**
+ * Resolves the cluster peers addresses (see 'request_hop_count()').
+ * Peer names are resolved once, on configuration (as the upstream servers
+ * are); each resolved address is a full-mask network.
+ * @param ngx_conf
+ * @param peers Cluster peers array.
+ * @return Pointer to the addresses array ('ngx_cidr_t') on success
+ * (allocated in the configuration pool), NULL otherwise.
+ */
+static ngx_array_t* peers_addrs_create(ngx_conf_t *ngx_conf,
+		ngx_array_t *peers)
+{
+	ngx_uint_t i, j;
+	ngx_url_t u;
+	ngx_cidr_t *cidr;
+	ngx_array_t *addrs;
+	ngx_http_tcdn_webcache_peer_t *peer= peers->elts;
+
+	addrs= ngx_array_create(ngx_conf->pool, peers->nelts, sizeof(ngx_cidr_t));
+	if(addrs== NULL)
+		return NULL;
+
+	for(i= 0; i< peers->nelts; i++) {
+		if(peer[i].self)
+			continue;
+		ngx_memzero(&u, sizeof(ngx_url_t));
+		u.url= peer[i].name;
+		u.default_port= 80;
+		if(ngx_parse_url(ngx_conf->pool, &u)!= NGX_OK) {
+			ngx_conf_log_error(NGX_LOG_EMERG, ngx_conf, 0, "%s in "
+					"\"tcdn_webcache_peer\" \"%V\"", u.err!= NULL? u.err:
+					"invalid address", &peer[i].name);
+			return NULL;
+		}
+		for(j= 0; j< u.naddrs; j++) {
+			cidr= ngx_array_push(addrs);
+			if(cidr== NULL)
+				return NULL;
+			ngx_memzero(cidr, sizeof(ngx_cidr_t));
+			cidr->family= u.addrs[j].sockaddr->sa_family;
+			switch(cidr->family) {
+#if (NGX_HAVE_INET6)
+			case AF_INET6:
+				cidr->u.in6.addr= ((struct sockaddr_in6*)
+						u.addrs[j].sockaddr)->sin6_addr;
+				ngx_memset(cidr->u.in6.mask.s6_addr, 0xff, 16);
+				break;
+#endif
+			default: /* AF_INET */
+				cidr->u.in.addr= ((struct sockaddr_in*)
+						u.addrs[j].sockaddr)->sin_addr.s_addr;
+				cidr->u.in.mask= 0xffffffff;
+				break;
+			}
+		}
+	}
+	return addrs;
+}
+
+/**
+ * Cluster consistent-hashing ring points comparison function (for sorting).
+ */
+static int peers_ring_cmp_points(const void *one, const void *two)
+{
+	const ngx_http_tcdn_webcache_ring_point_t *first= one, *second= two;
+
+	if(first->hash< second->hash)
+		return -1;
+	else if(first->hash> second->hash)
+		return 1;
+	return 0;
+}
+
+/**
+ * Finds the peer owning a given hash in the cluster consistent-hashing ring:
+ * the peer of the first point (clockwise) greater or equal than the hash.
+ * If node tags are given, points of peers not having one of the tags are
+ * skipped.
+ * @param ring Cluster consistent-hashing ring.
+ * @param hash Content hash.
+ * @param node_tags Bucket's comma-separated node tags list.
+ * @param node_tags_len Node tags list length (zero if no tags).
+ * @return Pointer to the owner peer, NULL if no peer has the node tags.
+ */
+static ngx_http_tcdn_webcache_peer_t* peers_ring_find(
+		ngx_http_tcdn_webcache_ring_t *ring, uint32_t hash,
+		const char *node_tags, size_t node_tags_len)
+{
+	ngx_uint_t i, j, k, n;
+	ngx_http_tcdn_webcache_ring_point_t *point= &ring->point[0];
+
+	/* Binary search of the first point >= hash */
+	i= 0;
+	j= ring->number;
+	while(i< j) {
+		k= (i+ j)/ 2;
+		if(hash> point[k].hash)
+			i= k+ 1;
+		else if(hash< point[k].hash)
+			j= k;
+		else {
+			i= k;
+			break;
+		}
+	}
+
+	for(n= 0; n< ring->number; n++) {
+		const char *p, *tag, *end= node_tags+ node_tags_len;
+		ngx_http_tcdn_webcache_peer_t *peer= point[(i+ n)% ring->number].peer;
+
+		if(node_tags_len== 0)
+			return peer;
+		for(tag= node_tags; tag< end; tag= p+ 1) {
+			if((p= (const char*)ngx_strlchr((u_char*)tag, (u_char*)end,
+					','))== NULL)
+				p= end;
+			if((size_t)(p- tag)== peer->tag.len &&
+					ngx_strncmp(tag, peer->tag.data, peer->tag.len)== 0)
+				return peer;
+		}
+	}
+	return NULL;
+}
+
+/**
+ * Selects the cluster peer owning the requested content (hashing the
+ * bucket host-name, URI and query-string).
+ * @param main_conf Module's main configuration context structure.
+ * @param entry Bucket routing entry.
+ * @param uri Requested URI.
+ * @param args Requested query-string.
+ * @return Pointer to the owner peer, NULL if none.
+ */
+static ngx_http_tcdn_webcache_peer_t* peers_select(
+		ngx_http_tcdn_webcache_main_conf_t *main_conf,
+		const tcdn_routing_entry_t *entry, const ngx_str_t *uri,
+		const ngx_str_t *args)
+{
+	uint32_t hash;
+
+	ngx_crc32_init(hash);
+	ngx_crc32_update(&hash, (u_char*)entry->host, entry->host_len);
+	ngx_crc32_update(&hash, uri->data, uri->len);
+	if(args->len> 0) {
+		ngx_crc32_update(&hash, (u_char*)"?", 1);
+		ngx_crc32_update(&hash, args->data, args->len);
+	}
+	ngx_crc32_final(hash);
+
+	return peers_ring_find(main_conf->peers_ring, hash, entry->node_tags,
+			entry->node_tags_len);
+}
+
+/**
+ * Performs an internal redirection to a given configured location.
+ * @param r HTTP request context structure (includes information such as
+ * request method, URI, and headers).
+ * @param ngx_log Log context structure.
+ * @param path Internal redirection prefix path (e.g. 'INT_REDIR_PATH').
+ * @param upstream Origin-server or cluster peer, as "host:port".
+ * @return Status code NGX_OK on succeed. See 'ngx_core.h' for other values.
+ */
+static ngx_int_t perform_http_internal_redirect(ngx_http_request_t *r,
+		ngx_log_t *ngx_log, const char *path, ngx_str_t *upstream)
+{
+	register size_t uri_args_len, path_len;
+	u_char *p;
+	ngx_str_t ngx_str_proxy_selected= {0};
+
+	/* Check arguments */
+	if(r== NULL || ngx_log== NULL || path== NULL || upstream== NULL ||
+			upstream->len== 0)
+		return NGX_ERROR;
+
+	/* Sanity checks... */
+	uri_args_len= r->uri.len+ r->args.len;
+	if((r->uri.len> 0 && r->uri.data== NULL) ||
+			(r->args.len> 0 && r->args.data== NULL) ||
+			uri_args_len> URI_MAX_LEN_GUARD) {
+		CHECK_DO(0, return NGX_ERROR)
+	}
+
+	/* Print new redirection URI. Note it is allocated in the request pool:
+	 * the redirected request keeps referencing it (e.g. its subrequests are
+	 * issued to the same URI) */
+	path_len= strlen(path);
+	ngx_str_proxy_selected.len= path_len+ upstream->len+ uri_args_len+ 1;
+	ngx_str_proxy_selected.data= ngx_pnalloc(r->pool,
+			ngx_str_proxy_selected.len);
+	CHECK_DO(ngx_str_proxy_selected.data!= NULL, return NGX_ERROR);
+	p= ngx_cpymem(ngx_str_proxy_selected.data, path, path_len);
+	p= ngx_cpymem(p, upstream->data, upstream->len);
+	p= ngx_cpymem(p, r->uri.data, r->uri.len);
+	*p++= '?';
+	ngx_memcpy(p, r->args.data, r->args.len);
+
+	/* Actually redirect with given arguments (namely, query-string) */
+	LOGD(ngx_log, "Performing internal redirection to URI '%V'... \n",
+			&ngx_str_proxy_selected);
+	return ngx_http_internal_redirect(r, &ngx_str_proxy_selected, NULL);
+}
+
+/**
+ * Finds the media segment number of a request URI: the last run of decimal
+ * digits of the URI last path segment, just before its extension (e.g.
+ * "00042" in "/live/channel/segment_00042.ts").
+ * @param uri Request URI (path).
+ * @param ref_pos Reference to the segment number position to be set.
+ * @param ref_len Reference to the segment number length to be set (number
+ * of digits, at most 'SEGMENT_NUMBER_DIGITS_MAX').
+ * @return Status code NGX_OK if the URI refers to a numbered segment,
+ * NGX_DECLINED otherwise.
+ */
+static ngx_int_t segment_number_find(const ngx_str_t *uri, size_t *ref_pos,
+		size_t *ref_len)
+{
+	register size_t start, end;
+
+	if(uri->len== 0)
+		return NGX_DECLINED;
+
+	/* Find the extension of the last path segment, if any */
+	for(end= uri->len; end> 0 && uri->data[end- 1]!= '/'; end--) {
+		if(uri->data[end- 1]== '.')
+			break;
+	}
+	if(end== 0 || uri->data[end- 1]!= '.')
+		end= uri->len; // No extension
+	else
+		end--;
+
+	for(start= end; start> 0 && uri->data[start- 1]>= '0' &&
+			uri->data[start- 1]<= '9'; start--);
+	if(start== end || end- start> SEGMENT_NUMBER_DIGITS_MAX)
+		return NGX_DECLINED;
+
+	*ref_pos= start;
+	*ref_len= end- start;
+	return NGX_OK;
+}
+
+/**
+ * Prints the URI of another segment of a numbered segment URI (same number
+ * width, zero-padded; see 'segment_number_find()').
+ * @param p Destination buffer (at least 'uri->len+ NGX_INT_T_LEN' bytes).
+ * @param uri Numbered segment URI.
+ * @param number_pos Segment number position in the URI.
+ * @param number_len Segment number length.
+ * @param number Segment number to be printed.
+ * @return Pointer to the end of the printed URI.
+ */
+static u_char* segment_uri_print(u_char *p, const ngx_str_t *uri,
+		size_t number_pos, size_t number_len, ngx_uint_t number)
+{
+	size_t digits_len;
+	u_char digits[NGX_INT_T_LEN];
+
+	digits_len= ngx_sprintf(digits, "%ui", number)- digits;
+	p= ngx_cpymem(p, uri->data, number_pos);
+	if(digits_len< number_len)
+		p= ngx_cpymem(p, "000000000", number_len- digits_len);
+	p= ngx_cpymem(p, digits, digits_len);
+	return ngx_cpymem(p, &uri->data[number_pos+ number_len],
+			uri->len- number_pos- number_len);
+}
+
+/**
+ * Finds the next media segments of a numbered segment request owned by
+ * another cluster peer (see 'peers_select()'). They are not prefetched by
+ * this node, which does not cache them: their owner caches them when the
+ * client requests them (through this node).
+ * @param main_conf Module's main configuration context structure.
+ * @param r HTTP request context structure (not redirected yet).
+ * @param ngx_log Log context structure.
+ * @param entry Bucket routing entry.
+ * @param prefetch Number of next segments to be prefetched.
+ * @return Next segments owned by another peer (bit 'i- 1' set for the i-th
+ * next segment); zero if no cluster is configured.
+ */
+static ngx_uint_t segments_prefetch_foreign(
+		ngx_http_tcdn_webcache_main_conf_t *main_conf, ngx_http_request_t *r,
+		ngx_log_t *ngx_log, const tcdn_routing_entry_t *entry,
+		ngx_uint_t prefetch)
+{
+	register ngx_uint_t i, number;
+	size_t number_pos, number_len;
+	ngx_uint_t foreign= 0;
+	ngx_str_t next_uri;
+	ngx_http_tcdn_webcache_peer_t *peer;
+
+	if(main_conf->peers_ring== NULL ||
+			segment_number_find(&r->uri, &number_pos, &number_len)!= NGX_OK)
+		return 0;
+	number= ngx_atoi(&r->uri.data[number_pos], number_len);
+	CHECK_DO(number!= (ngx_uint_t)NGX_ERROR, return 0);
+
+	next_uri.data= ngx_pnalloc(r->pool, r->uri.len+ NGX_INT_T_LEN);
+	CHECK_DO(next_uri.data!= NULL, return ~(ngx_uint_t)0);
+	for(i= 1; i<= prefetch; i++) {
+		next_uri.len= segment_uri_print(next_uri.data, &r->uri, number_pos,
+				number_len, number+ i)- next_uri.data;
+		peer= peers_select(main_conf, entry, &next_uri, &r->args);
+		if(peer!= NULL && !peer->self)
+			foreign|= (ngx_uint_t)1<< (i- 1);
+	}
+	return foreign;
+}
+
+/**
+ * Prefetches the next media segments of a numbered segment request (e.g.
+ * "segment_00043.ts" and "segment_00044.ts" are prefetched when
+ * "segment_00042.ts" is requested) into the cache of the redirection
+ * location, so that the client's next requests are cache hits.
+ * Each segment is requested by a background subrequest (header-only, so the
+ * response is just cached) through the same internal redirection location
+ * as the main request. The number of prefetches in progress per worker
+ * process is limited by 'tcdn_webcache_prefetch_concurrency': segments
+ * exceeding the budget are skipped (and counted). Segments owned by another
+ * cluster peer are skipped too (see 'segments_prefetch_foreign()').
+ * Failures are just traced: the main request is never affected.
+ * @param main_conf Module's main configuration context structure.
+ * @param r HTTP request context structure (already redirected).
+ * @param ngx_log Log context structure.
+ * @param prefetch Number of next segments to be prefetched.
+ * @param foreign Next segments owned by another cluster peer (bit 'i- 1'
+ * set for the i-th next segment).
+ * @param path Internal redirection prefix path (e.g. 'INT_REDIR_PATH').
+ * @param upstream Origin-server or shield, as "host:port".
+ * @param uri Original request URI.
+ * @param args Original request query-string.
+ */
+static void segments_prefetch(ngx_http_tcdn_webcache_main_conf_t *main_conf,
+		ngx_http_request_t *r, ngx_log_t *ngx_log, ngx_uint_t prefetch,
+		ngx_uint_t foreign, const char *path, const ngx_str_t *upstream,
+		const ngx_str_t *uri, const ngx_str_t *args)
+{
+	register ngx_uint_t i, number;
+	size_t number_pos, number_len, path_len;
+	u_char *p;
+	ngx_str_t sr_uri;
+	ngx_http_request_t *sr;
+	ngx_http_post_subrequest_t *ps;
+	ngx_pool_cleanup_t *cln;
+	ngx_http_tcdn_webcache_prefetch_t *prefetch_ctx;
+
+	if(segment_number_find(uri, &number_pos, &number_len)!= NGX_OK)
+		return;
+	number= ngx_atoi(&uri->data[number_pos], number_len);
+	CHECK_DO(number!= (ngx_uint_t)NGX_ERROR, return);
+	path_len= strlen(path);
+
+	for(i= 1; i<= prefetch; i++) {
+		if(foreign& ((ngx_uint_t)1<< (i- 1)))
+			continue; // Owned (and cached when requested) by another peer
+		if(main_conf->prefetch_inflight>= main_conf->prefetch_concurrency) {
+			METRICS_INC(main_conf, prefetch_skipped);
+			continue;
+		}
+
+		/* Next segment URI, redirected as the main request (see
+		 * 'perform_http_internal_redirect()') */
+		sr_uri.data= ngx_pnalloc(r->pool, path_len+ upstream->len+
+				uri->len+ NGX_INT_T_LEN+ args->len+ 1);
+		CHECK_DO(sr_uri.data!= NULL, return);
+		p= ngx_cpymem(sr_uri.data, path, path_len);
+		p= ngx_cpymem(p, upstream->data, upstream->len);
+		p= segment_uri_print(p, uri, number_pos, number_len, number+ i);
+		*p++= '?';
+		p= ngx_cpymem(p, args->data, args->len);
+		sr_uri.len= p- sr_uri.data;
+
+		/* Prefetch context, released when the subrequest is done (or, at
+		 * last, when the request pool is destroyed) */
+		cln= ngx_pool_cleanup_add(r->pool,
+				sizeof(ngx_http_tcdn_webcache_prefetch_t));
+		CHECK_DO(cln!= NULL, return);
+		prefetch_ctx= cln->data;
+		prefetch_ctx->main_conf= main_conf;
+		prefetch_ctx->released= 1;
+		cln->handler= segments_prefetch_cleanup;
+
+		ps= ngx_palloc(r->pool, sizeof(ngx_http_post_subrequest_t));
+		CHECK_DO(ps!= NULL, return);
+		ps->handler= segments_prefetch_done;
+		ps->data= prefetch_ctx;
+
+		LOGD(ngx_log, "Prefetching segment '%V'...\n", &sr_uri);
+		if(ngx_http_subrequest(r, &sr_uri, NULL, &sr, ps,
+				NGX_HTTP_SUBREQUEST_BACKGROUND)!= NGX_OK) {
+			ngx_log_error(NGX_LOG_ERR, ngx_log, 0, "Could not prefetch "
+					"segment '%V'\n", &sr_uri);
+			return;
+		}
+		sr->header_only= 1;
+
+		prefetch_ctx->released= 0;
+		main_conf->prefetch_inflight++;
+		METRICS_INC(main_conf, prefetch_issued);
+	}
+}
+
+/**
+ * Media segment prefetch subrequest post-handler (see
+ * 'segments_prefetch()'): releases the prefetch concurrency budget.
+ * @param r HTTP subrequest context structure.
+ * @param data Prefetch context structure.
+ * @param rc Subrequest status code.
+ * @return The subrequest status code.
+ */
+static ngx_int_t segments_prefetch_done(ngx_http_request_t *r, void *data,
+		ngx_int_t rc)
+{
+	segments_prefetch_cleanup(data);
+	return rc;
+}
+
+/**
+ * Media segment prefetch context release (see
+ * 'ngx_http_tcdn_webcache_prefetch_t'). It is also used as the request pool
+ * clean-up handler.
+ * @param data Prefetch context structure.
+ */
+static void segments_prefetch_cleanup(void *data)
+{
+	ngx_http_tcdn_webcache_prefetch_t *prefetch_ctx= data;
+
+	if(prefetch_ctx->released)
+		return;
+	prefetch_ctx->released= 1;
+	prefetch_ctx->main_conf->prefetch_inflight--;
+}
+
+/**
+ * Cache warm-up request body handler (see
+ * 'ngx_http_tcdn_webcache_warmup_handler()').
+ * @param r HTTP request context structure.
+ */
+static void warmup_body_handler(ngx_http_request_t *r)
+{
+	ngx_http_tcdn_webcache_main_conf_t *main_conf;
+
+	main_conf= ngx_http_get_module_main_conf(r, ngx_http_tcdn_webcache_module);
+	ngx_http_finalize_request(r, warmup_start(r, main_conf));
+}
+
+/**
+ * Starts a cache warm-up job (see 'ngx_http_tcdn_webcache_warmup_handler()'):
+ * parses the request arguments and URLs list, takes a job progress slot and
+ * issues the first subrequests (see 'warmup_issue()').
+ * @param r HTTP request context structure (body already read).
+ * @param main_conf Module's main configuration context structure.
+ * @return Status code NGX_OK on succeed; otherwise, the HTTP error status
+ * code to respond with. See 'ngx_core.h' for other values.
+ */
+static ngx_int_t warmup_start(ngx_http_request_t *r,
+		ngx_http_tcdn_webcache_main_conf_t *main_conf)
+{
+	register ngx_uint_t i;
+	ngx_int_t ret_code, n;
+	ngx_uint_t concurrency= WARMUP_CONCURRENCY_DEFAULT;
+	ngx_uint_t rate= WARMUP_RATE_DEFAULT, skipped= 0;
+	ngx_str_t arg, host= ngx_null_string, base= ngx_string("/");
+	size_t body_len= 0, size;
+	ssize_t n_read;
+	u_char *body, *p, *last, *line, *line_end, *src;
+	ngx_chain_t *cl;
+	ngx_array_t uris;
+	ngx_pool_cleanup_t *cln;
+	ngx_buf_t *b;
+	ngx_log_t *ngx_log= r->connection->log;
+	ngx_http_core_main_conf_t *core_main_conf;
+	ngx_http_core_srv_conf_t **servers, *server= NULL;
+	ngx_http_tcdn_webcache_srv_conf_t *srv_conf;
+	ngx_thread_mutex_t *p_buckets_mutex;
+	const tcdn_routing_table_t *routing_table;
+	ngx_http_tcdn_webcache_buckets_state_t *buckets_state;
+	ngx_http_tcdn_webcache_warmup_t *warmup= NULL, *slot;
+	ngx_http_tcdn_webcache_warmup_uri_t *warmup_uri;
+	ngx_http_tcdn_webcache_warmup_job_t *job;
+
+	if(main_conf== NULL || (buckets_state= main_conf->buckets_state)== NULL)
+		return NGX_HTTP_SERVICE_UNAVAILABLE;
+
+	/* Job arguments */
+	if(ngx_http_arg(r, (u_char*)"concurrency", sizeof("concurrency")- 1,
+			&arg)== NGX_OK) {
+		n= ngx_atoi(arg.data, arg.len);
+		if(n< 1 || n> WARMUP_CONCURRENCY_MAX)
+			return NGX_HTTP_BAD_REQUEST;
+		concurrency= (ngx_uint_t)n;
+	}
+	if(ngx_http_arg(r, (u_char*)"rate", sizeof("rate")- 1, &arg)== NGX_OK) {
+		n= ngx_atoi(arg.data, arg.len);
+		if(n== NGX_ERROR || n> WARMUP_RATE_MAX)
+			return NGX_HTTP_BAD_REQUEST;
+		rate= (ngx_uint_t)n;
+	}
+	if(ngx_http_arg(r, (u_char*)"base", sizeof("base")- 1, &arg)== NGX_OK) {
+		base.data= p= ngx_pnalloc(r->pool, arg.len);
+		CHECK_DO(base.data!= NULL, return NGX_HTTP_INTERNAL_SERVER_ERROR);
+		src= arg.data;
+		ngx_unescape_uri(&p, &src, arg.len, 0);
+		if(p== base.data || base.data[0]!= '/')
+			return NGX_HTTP_BAD_REQUEST;
+		while(p[-1]!= '/')
+			p--; // Base "directory"
+		base.len= p- base.data;
+	}
+
+	/* Bucket host-name */
+	if(ngx_http_arg(r, (u_char*)"bucket", sizeof("bucket")- 1, &arg)==
+			NGX_OK) {
+		ret_code= warmup_bucket_host(main_conf, r, &arg, &host);
+		if(ret_code!= NGX_OK)
+			return ret_code;
+	} else if(ngx_http_arg(r, (u_char*)"host", sizeof("host")- 1, &arg)==
+			NGX_OK) {
+		ret_code= host_arg_parse(r, &arg, &host);
+		if(ret_code!= NGX_OK)
+			return ret_code;
+	}
+
+	/* Subrequests are run in the first server routing the buckets requests
+	 * (where the internal redirection locations are) */
+	core_main_conf= ngx_http_get_module_main_conf(r, ngx_http_core_module);
+	servers= core_main_conf->servers.elts;
+	for(i= 0; i< core_main_conf->servers.nelts; i++) {
+		srv_conf= servers[i]->ctx->srv_conf[ngx_http_tcdn_webcache_module.
+				ctx_index];
+		if(srv_conf->routing) {
+			server= servers[i];
+			break;
+		}
+	}
+	if(server== NULL) {
+		ngx_log_error(NGX_LOG_ERR, ngx_log, 0, "No server routes the "
+				"buckets requests; cache warm-up rejected\n");
+		return NGX_HTTP_SERVICE_UNAVAILABLE;
+	}
+
+	/* URLs list: the request body (in memory or in a temporary file) */
+	if(r->request_body== NULL || r->request_body->bufs== NULL)
+		return NGX_HTTP_BAD_REQUEST;
+	for(cl= r->request_body->bufs; cl!= NULL; cl= cl->next)
+		body_len+= ngx_buf_size(cl->buf);
+	body= p= ngx_pnalloc(r->pool, body_len+ 1);
+	CHECK_DO(body!= NULL, return NGX_HTTP_INTERNAL_SERVER_ERROR);
+	for(cl= r->request_body->bufs; cl!= NULL; cl= cl->next) {
+		size= ngx_buf_size(cl->buf);
+		if(ngx_buf_in_memory(cl->buf)) {
+			p= ngx_cpymem(p, cl->buf->pos, size);
+			continue;
+		}
+		n_read= ngx_read_file(cl->buf->file, p, size, cl->buf->file_pos);
+		CHECK_DO(n_read== (ssize_t)size,
+				return NGX_HTTP_INTERNAL_SERVER_ERROR);
+		p+= size;
+	}
+
+	CHECK_DO(ngx_array_init(&uris, r->pool, 64,
+			sizeof(ngx_http_tcdn_webcache_warmup_uri_t))== NGX_OK,
+			return NGX_HTTP_INTERNAL_SERVER_ERROR);
+	for(line= body; line< body+ body_len; line= line_end+ 1) {
+		line_end= ngx_strlchr(line, body+ body_len, LF);
+		if(line_end== NULL)
+			line_end= body+ body_len;
+		for(p= line; p< line_end && (*p== ' ' || *p== '\t'); p++);
+		for(last= line_end; last> p && (last[-1]== ' ' ||
+				last[-1]== '\t' || last[-1]== CR); last--);
+		if(p== last || *p== '#')
+			continue; // Empty line or comment (e.g. HLS tags)
+
+		if(uris.nelts>= WARMUP_URLS_MAX)
+			return NGX_HTTP_REQUEST_ENTITY_TOO_LARGE;
+		warmup_uri= ngx_array_push(&uris);
+		CHECK_DO(warmup_uri!= NULL, return NGX_HTTP_INTERNAL_SERVER_ERROR);
+		ret_code= warmup_url_parse(r, &host, &base, p, last, warmup_uri);
+		if(ret_code== NGX_DECLINED) {
+			uris.nelts--;
+			skipped++;
+		} else if(ret_code!= NGX_OK) {
+			return ret_code;
+		}
+	}
+	if(uris.nelts== 0 || host.len== 0)
+		return NGX_HTTP_BAD_REQUEST;
+
+	/* The bucket must be known (it may not be active yet) */
+	p_buckets_mutex= &main_conf->routing_table_mutex;
+	ASSERT(ngx_thread_mutex_lock(p_buckets_mutex, ngx_log)== NGX_OK);
+	routing_table= main_conf->routing_table[main_conf->routing_table_idx];
+	ret_code= routing_table== NULL? NGX_HTTP_SERVICE_UNAVAILABLE:
+			(tcdn_routing_table_lookup(routing_table, (const char*)host.data,
+			host.len)== NULL? NGX_HTTP_NOT_FOUND: NGX_OK);
+	ASSERT(ngx_thread_mutex_unlock(p_buckets_mutex, ngx_log)== NGX_OK);
+	if(ret_code!= NGX_OK)
+		return ret_code;
+
+	/* Job (it is aborted if the request is terminated) */
+	cln= ngx_pool_cleanup_add(r->pool, 0);
+	CHECK_DO(cln!= NULL, return NGX_HTTP_INTERNAL_SERVER_ERROR);
+	job= ngx_pcalloc(r->pool, sizeof(ngx_http_tcdn_webcache_warmup_job_t));
+	CHECK_DO(job!= NULL, return NGX_HTTP_INTERNAL_SERVER_ERROR);
+	b= ngx_create_temp_buf(r->pool, sizeof("warmup  \n")- 1+
+			NGX_INT_T_LEN* 2);
+	CHECK_DO(b!= NULL, return NGX_HTTP_INTERNAL_SERVER_ERROR);
+
+	/* Take a free progress slot (or the oldest finished one) */
+	ngx_shmtx_lock(&main_conf->buckets_shpool->mutex);
+	for(i= 0; i< WARMUPS_MAX; i++) {
+		slot= &buckets_state->warmup[i];
+		if(slot->state== WARMUP_RUNNING)
+			continue;
+		if(warmup== NULL || slot->id< warmup->id)
+			warmup= slot;
+	}
+	if(warmup== NULL) {
+		ngx_shmtx_unlock(&main_conf->buckets_shpool->mutex);
+		ngx_log_error(NGX_LOG_WARN, ngx_log, 0, "All the cache warm-up jobs "
+				"are running; warm-up of bucket '%V' rejected\n", &host);
+		return NGX_HTTP_SERVICE_UNAVAILABLE;
+	}
+	ngx_memzero(warmup, sizeof(ngx_http_tcdn_webcache_warmup_t));
+	warmup->id= ++buckets_state->warmup_serial;
+	warmup->state= WARMUP_RUNNING;
+	warmup->pid= ngx_pid;
+	warmup->urls= uris.nelts;
+	warmup->skipped= skipped;
+	warmup->host_len= host.len;
+	ngx_memcpy(warmup->host, host.data, host.len);
+	ngx_shmtx_unlock(&main_conf->buckets_shpool->mutex);
+
+	job->main_conf= main_conf;
+	job->r= r;
+	job->warmup= warmup;
+	job->id= warmup->id;
+	job->server= server;
+	job->host.hash= 1;
+	ngx_str_set(&job->host.key, "Host");
+	job->host.value= host;
+	job->host.lowcase_key= (u_char*)"host";
+	job->uris= uris.elts;
+	job->uris_num= uris.nelts;
+	job->concurrency= concurrency;
+	job->interval= rate> 0? 1000/ rate: 0;
+	job->next_msec= ngx_current_msec;
+	job->timer.handler= warmup_timer_handler;
+	job->timer.data= job;
+	job->timer.log= ngx_log;
+	job->timer.cancelable= 1;
+	cln->handler= warmup_cleanup;
+	cln->data= job;
+
+	/* The job holds a reference to the request until it ends (see
+	 * 'warmup_finish()') */
+	r->main->count++;
+	ngx_log_error(NGX_LOG_NOTICE, ngx_log, 0, "Cache warm-up %ui: bucket "
+			"'%V', %ui URLs (%ui skipped)\n", job->id, &host, job->uris_num,
+			skipped);
+	METRICS_INC(main_conf, warmups);
+	warmup_issue(job);
+
+	b->last= ngx_sprintf(b->last, "warmup %ui %ui\n", job->id,
+			job->uris_num);
+	return text_response_send(r, NGX_HTTP_ACCEPTED, b);
+}
+
+/**
+ * Gets the host-name of a bucket given its identifier (see 'warmup_start()').
+ * @param main_conf Module's main configuration context structure.
+ * @param r HTTP request context structure.
+ * @param bucket_id Bucket identifier.
+ * @param host Output host-name (allocated in the request pool).
+ * @return Status code NGX_OK on succeed, NGX_HTTP_NOT_FOUND if no bucket has
+ * the identifier, NGX_HTTP_SERVICE_UNAVAILABLE if no buckets information
+ * was received from the tracker yet, NGX_HTTP_INTERNAL_SERVER_ERROR
+ * otherwise.
+ */
+static ngx_int_t warmup_bucket_host(
+		ngx_http_tcdn_webcache_main_conf_t *main_conf, ngx_http_request_t *r,
+		const ngx_str_t *bucket_id, ngx_str_t *host)
+{
+	register size_t i;
+	ngx_log_t *ngx_log= r->connection->log;
+	ngx_thread_mutex_t *p_buckets_mutex;
+	const tcdn_routing_table_t *routing_table;
+	const tcdn_routing_entry_t *entry;
+	ngx_int_t end_code= NGX_HTTP_NOT_FOUND;
+
+	if(bucket_id->len== 0)
+		return NGX_HTTP_BAD_REQUEST;
+
+	p_buckets_mutex= &main_conf->routing_table_mutex;
+	ASSERT(ngx_thread_mutex_lock(p_buckets_mutex, ngx_log)== NGX_OK);
+	routing_table= main_conf->routing_table[main_conf->routing_table_idx];
+	if(routing_table== NULL) {
+		end_code= NGX_HTTP_SERVICE_UNAVAILABLE;
+		goto end;
+	}
+	for(i= 0; i< tcdn_routing_table_size(routing_table); i++) {
+		entry= tcdn_routing_table_get(routing_table, i);
+		if(entry->bucket_id_len!= bucket_id->len || ngx_strncmp(
+				entry->bucket_id, bucket_id->data, bucket_id->len)!= 0)
+			continue;
+		host->data= ngx_pnalloc(r->pool, entry->host_len);
+		CHECK_DO(host->data!= NULL, end_code= NGX_HTTP_INTERNAL_SERVER_ERROR;
+				goto end);
+		ngx_memcpy(host->data, entry->host, entry->host_len);
+		host->len= entry->host_len;
+		end_code= NGX_OK;
+		break;
+	}
+end:
+	ASSERT(ngx_thread_mutex_unlock(p_buckets_mutex, ngx_log)== NGX_OK);
+	return end_code;
+}
+
+/**
+ * Parses a cache warm-up URLs list line (see 'warmup_start()').
+ * @param r HTTP request context structure.
+ * @param host Job's bucket host-name; set by the first absolute URL if
+ * empty.
+ * @param base Base URI path of the relative URLs (ending with '/').
+ * @param p Line start (not empty).
+ * @param last Line end.
+ * @param warmup_uri Output URL (its memory belongs to the request pool).
+ * @return Status code NGX_OK on succeed, NGX_DECLINED if the URL is of
+ * another host-name, NGX_HTTP_BAD_REQUEST if it is not valid,
+ * NGX_HTTP_INTERNAL_SERVER_ERROR otherwise.
+ */
+static ngx_int_t warmup_url_parse(ngx_http_request_t *r, ngx_str_t *host,
+		const ngx_str_t *base, u_char *p, u_char *last,
+		ngx_http_tcdn_webcache_warmup_uri_t *warmup_uri)
+{
+	u_char *authority, *authority_end, *query, *uri, *src;
+	size_t prefix_len= 0;
+	ngx_log_t *ngx_log= r->connection->log;
+
+	/* Absolute URLs: the host-name (without port) must be the job's one */
+	if(last- p> (ssize_t)sizeof("http://")- 1 &&
+			ngx_strncasecmp(p, (u_char*)"http://", sizeof("http://")- 1)==
+			0) {
+		authority= p+ sizeof("http://")- 1;
+	} else if(last- p> (ssize_t)sizeof("https://")- 1 &&
+			ngx_strncasecmp(p, (u_char*)"https://", sizeof("https://")- 1)==
+			0) {
+		authority= p+ sizeof("https://")- 1;
+	} else {
+		authority= NULL;
+	}
+	if(authority!= NULL) {
+		if((p= ngx_strlchr(authority, last, '/'))== NULL)
+			p= last;
+		if((authority_end= ngx_strlchr(authority, p, ':'))== NULL)
+			authority_end= p;
+		if(authority_end== authority ||
+				authority_end- authority> BUCKET_KEY_LEN_MAX)
+			return NGX_HTTP_BAD_REQUEST;
+		if(host->len== 0) {
+			host->data= ngx_pnalloc(r->pool, authority_end- authority);
+			CHECK_DO(host->data!= NULL,
+					return NGX_HTTP_INTERNAL_SERVER_ERROR);
+			host->len= authority_end- authority;
+			ngx_strlow(host->data, authority, host->len);
+		} else if(host->len!= (size_t)(authority_end- authority) ||
+				ngx_strncasecmp(host->data, authority, host->len)!= 0) {
+			return NGX_DECLINED;
+		}
+	} else if(*p!= '/') {
+		prefix_len= base->len; // Relative URL
+	}
+
+	/* Query-string (kept as is; its memory is the request body's one) */
+	if((query= ngx_strlchr(p, last, '?'))!= NULL) {
+		warmup_uri->args.data= query+ 1;
+		warmup_uri->args.len= last- query- 1;
+		last= query;
+	} else {
+		ngx_str_null(&warmup_uri->args);
+	}
+
+	/* URI path (unescaped, as the requests' one; "/" if empty) */
+	uri= ngx_pnalloc(r->pool, prefix_len+ (last- p)+ 1);
+	CHECK_DO(uri!= NULL, return NGX_HTTP_INTERNAL_SERVER_ERROR);
+	warmup_uri->uri.data= uri;
+	if(p== last)
+		*uri++= '/';
+	uri= ngx_cpymem(uri, base->data, prefix_len);
+	src= p;
+	ngx_unescape_uri(&uri, &src, last- p, NGX_UNESCAPE_URI);
+	warmup_uri->uri.len= uri- warmup_uri->uri.data;
+	return NGX_OK;
+}
+
+/**
+ * Reports the cache warm-up jobs progress (see
+ * 'ngx_http_tcdn_webcache_warmup_handler()'), one line per job:
+ * "warmup <id> host=<host> state=<running|done|canceled|aborted> urls=<n>
+ * warmed=<n> failed=<n> skipped=<n> inflight=<n> pid=<pid>".
+ * @param r HTTP request context structure.
+ * @param main_conf Module's main configuration context structure.
+ * @return Status code NGX_OK on succeed. See 'ngx_core.h' for other values.
+ */
+static ngx_int_t warmup_report(ngx_http_request_t *r,
+		ngx_http_tcdn_webcache_main_conf_t *main_conf)
+{
+	register ngx_uint_t i;
+	ngx_buf_t *b;
+	ngx_http_tcdn_webcache_warmup_t *warmup;
+	static const char *states[]= {"", "running", "done", "canceled",
+			"aborted"};
+
+	b= ngx_create_temp_buf(r->pool, WARMUPS_MAX* (sizeof("warmup  host= "
+			"state=canceled urls= warmed= failed= skipped= inflight= pid=\n")-
+			1+ BUCKET_KEY_LEN_MAX+ NGX_INT_T_LEN* 7));
+	if(b== NULL)
+		return NGX_HTTP_INTERNAL_SERVER_ERROR;
+
+	ngx_shmtx_lock(&main_conf->buckets_shpool->mutex);
+	for(i= 0; i< WARMUPS_MAX; i++) {
+		warmup= &main_conf->buckets_state->warmup[i];
+		if(warmup->id== 0 || warmup->state> WARMUP_ABORTED)
+			continue;
+		b->last= ngx_sprintf(b->last, "warmup %ui host=%*s state=%s urls=%ui "
+				"warmed=%ui failed=%ui skipped=%ui inflight=%ui pid=%P\n",
+				warmup->id, warmup->host_len, warmup->host,
+				states[warmup->state], warmup->urls, warmup->warmed,
+				warmup->failed, warmup->skipped, warmup->inflight,
+				warmup->pid);
+	}
+	ngx_shmtx_unlock(&main_conf->buckets_shpool->mutex);
+
+	return text_response_send(r, NGX_HTTP_OK, b);
+}
+
+/**
+ * Cancels a running cache warm-up job (see
+ * 'ngx_http_tcdn_webcache_warmup_handler()'): no more subrequests are
+ * issued by the worker process running it. Outputs "warmup <id> canceled".
+ * @param r HTTP request context structure.
+ * @param main_conf Module's main configuration context structure.
+ * @return Status code NGX_OK on succeed, NGX_HTTP_BAD_REQUEST if the 'id'
+ * argument is not valid, NGX_HTTP_NOT_FOUND if the job is not running. See
+ * 'ngx_core.h' for other values.
+ */
+static ngx_int_t warmup_cancel(ngx_http_request_t *r,
+		ngx_http_tcdn_webcache_main_conf_t *main_conf)
+{
+	register ngx_uint_t i;
+	ngx_int_t id;
+	ngx_str_t arg;
+	ngx_buf_t *b;
+	ngx_http_tcdn_webcache_warmup_t *warmup;
+
+	if(ngx_http_arg(r, (u_char*)"id", sizeof("id")- 1, &arg)!= NGX_OK ||
+			(id= ngx_atoi(arg.data, arg.len))== NGX_ERROR || id== 0)
+		return NGX_HTTP_BAD_REQUEST;
+
+	ngx_shmtx_lock(&main_conf->buckets_shpool->mutex);
+	for(i= 0; i< WARMUPS_MAX; i++) {
+		warmup= &main_conf->buckets_state->warmup[i];
+		if(warmup->id== (ngx_uint_t)id && warmup->state== WARMUP_RUNNING) {
+			warmup->cancel= 1;
+			break;
+		}
+	}
+	ngx_shmtx_unlock(&main_conf->buckets_shpool->mutex);
+	if(i== WARMUPS_MAX)
+		return NGX_HTTP_NOT_FOUND;
+
+	b= ngx_create_temp_buf(r->pool, sizeof("warmup  canceled\n")- 1+
+			NGX_INT_T_LEN);
+	if(b== NULL)
+		return NGX_HTTP_INTERNAL_SERVER_ERROR;
+	b->last= ngx_sprintf(b->last, "warmup %i canceled\n", id);
+	return text_response_send(r, NGX_HTTP_OK, b);
+}
+
+/**
+ * Issues the next cache warm-up subrequests of a job, as long as the job's
+ * concurrency and rate allow it (otherwise, it is called again when a
+ * subrequest is done, or by the job's timer). The job ends once all its
+ * subrequests are done, or if it is canceled (or the worker process is
+ * exiting) and none is in progress.
+ * @param job Cache warm-up job.
+ */
+static void warmup_issue(ngx_http_tcdn_webcache_warmup_job_t *job)
+{
+	ngx_msec_int_t delay;
+	ngx_flag_t stop;
+
+	stop= job->warmup->cancel || ngx_exiting || job->r->connection->error;
+	while(!stop && job->next< job->uris_num &&
+			job->inflight< job->concurrency) {
+		if(job->interval> 0) {
+			delay= (ngx_msec_int_t)(job->next_msec- ngx_current_msec);
+			if(delay> 0) {
+				if(!job->timer.timer_set)
+					ngx_add_timer(&job->timer, (ngx_msec_t)delay);
+				return;
+			}
+			if(delay< 0)
+				job->next_msec= ngx_current_msec;
+			job->next_msec+= job->interval;
+		}
+		warmup_subrequest(job, &job->uris[job->next++]);
+	}
+	if(job->inflight== 0 && (stop || job->next== job->uris_num))
+		warmup_finish(job);
+}
+
+/**
+ * Issues a cache warm-up subrequest. It is routed as a client request of
+ * the job's bucket (see 'buckets_information_fetch_host_origin()') and
+ * redirected, as 'perform_http_internal_redirect()' does, before it runs;
+ * URLs owned by another cluster peer, or that can not be routed, are
+ * dropped (counted as skipped or failed respectively).
+ * @param job Cache warm-up job.
+ * @param warmup_uri URL to be warmed up.
+ */
+static void warmup_subrequest(ngx_http_tcdn_webcache_warmup_job_t *job,
+		ngx_http_tcdn_webcache_warmup_uri_t *warmup_uri)
+{
+	ngx_int_t ret_code;
+	size_t path_len;
+	u_char *p;
+	const char *path;
+	ngx_str_t *upstream;
+	ngx_http_request_t *r= job->r, *sr;
+	ngx_log_t *ngx_log= r->connection->log;
+	ngx_http_post_subrequest_t *ps;
+	ngx_http_tcdn_webcache_warmup_sr_t *warmup_sr;
+	ngx_http_tcdn_webcache_req_ctx_t *ctx;
+
+	warmup_sr= ngx_palloc(r->pool, sizeof(ngx_http_tcdn_webcache_warmup_sr_t));
+	CHECK_DO(warmup_sr!= NULL, goto failed);
+	warmup_sr->job= job;
+	warmup_sr->done= 0;
+	ps= ngx_palloc(r->pool, sizeof(ngx_http_post_subrequest_t));
+	CHECK_DO(ps!= NULL, goto failed);
+	ps->handler= warmup_done;
+	ps->data= warmup_sr;
+
+	if(ngx_http_subrequest(r, &warmup_uri->uri, &warmup_uri->args, &sr, ps,
+			NGX_HTTP_SUBREQUEST_BACKGROUND)!= NGX_OK) {
+		ngx_log_error(NGX_LOG_ERR, ngx_log, 0, "Could not warm up '%V'\n",
+				&warmup_uri->uri);
+		goto failed;
+	}
+
+	/* A client GET request of the bucket (no body), in the routing
+	 * server */
+	sr->header_only= 1;
+	sr->request_body= NULL;
+	sr->headers_in.content_length_n= -1;
+	sr->headers_in.chunked= 0;
+	sr->headers_in.host= &job->host;
+	sr->headers_in.server= job->host.value;
+	sr->srv_conf= job->server->ctx->srv_conf;
+	sr->loc_conf= job->server->ctx->loc_conf;
+
+	ctx= ngx_http_tcdn_webcache_req_ctx_create(sr);
+	CHECK_DO(ctx!= NULL, goto drop);
+	ctx->warmup= 1;
+	ret_code= buckets_information_fetch_host_origin(job->main_conf, sr,
+			ngx_log, ctx);
+	if(ret_code!= NGX_OK || ctx->peer.len> 0)
+		goto drop;
+	if(ctx->shield.len> 0) {
+		path= INT_REDIR_SHIELD_PATH;
+		upstream= &ctx->shield;
+	} else {
+		path= INT_REDIR_PATH;
+		upstream= &ctx->origin;
+	}
+
+	path_len= strlen(path);
+	sr->uri.data= ngx_pnalloc(r->pool, path_len+ upstream->len+
+			warmup_uri->uri.len+ warmup_uri->args.len+ 1);
+	CHECK_DO(sr->uri.data!= NULL, goto drop);
+	p= ngx_cpymem(sr->uri.data, path, path_len);
+	p= ngx_cpymem(p, upstream->data, upstream->len);
+	p= ngx_cpymem(p, warmup_uri->uri.data, warmup_uri->uri.len);
+	*p++= '?';
+	p= ngx_cpymem(p, warmup_uri->args.data, warmup_uri->args.len);
+	sr->uri.len= p- sr->uri.data;
+	ngx_str_null(&sr->args);
+
+	LOGD(ngx_log, "Warming up '%V'...\n", &sr->uri);
+	job->inflight++;
+	job->warmup->inflight= job->inflight;
+	METRICS_INC(job->main_conf, warmup_requests);
+	return;
+
+drop:
+	/* The subrequest is dropped before it runs */
+	sr->write_event_handler= ngx_http_request_empty_handler;
+	ngx_http_finalize_request(sr, NGX_DONE);
+	if(ctx!= NULL && ctx->peer.len> 0) {
+		job->warmup->skipped++;
+		return;
+	}
+failed:
+	job->warmup->failed++;
+}
+
+/**
+ * Cache warm-up subrequest post-handler (see 'warmup_subrequest()'):
+ * accounts the subrequest and issues the next ones.
+ * @param r HTTP subrequest context structure.
+ * @param data Cache warm-up subrequest context structure.
+ * @param rc Subrequest status code.
+ * @return The subrequest status code.
+ */
+static ngx_int_t warmup_done(ngx_http_request_t *r, void *data,
+		ngx_int_t rc)
+{
+	ngx_uint_t status;
+	ngx_http_tcdn_webcache_warmup_sr_t *warmup_sr= data;
+	ngx_http_tcdn_webcache_warmup_job_t *job= warmup_sr->job;
+
+	if(warmup_sr->done || job->finished)
+		return rc;
+	warmup_sr->done= 1;
+
+	status= rc>= NGX_HTTP_SPECIAL_RESPONSE? (ngx_uint_t)rc:
+			r->headers_out.status;
+	if(rc== NGX_ERROR || status< NGX_HTTP_OK ||
+			status>= NGX_HTTP_BAD_REQUEST) {
+		job->warmup->failed++;
+	} else {
+		job->warmup->warmed++;
+	}
+	job->inflight--;
+	job->warmup->inflight= job->inflight;
+	LOGD(r->connection->log, "Warmed up '%V' (status %ui)\n", &r->uri,
+			status);
+
+	warmup_issue(job);
+	return rc;
+}
+
+/**
+ * Cache warm-up job timer handler (see 'warmup_issue()'). It is also called
+ * when the worker process is exiting (the timer is cancelable).
+ * @param ev Timer event.
+ */
+static void warmup_timer_handler(ngx_event_t *ev)
+{
+	ngx_http_tcdn_webcache_warmup_job_t *job= ev->data;
+	ngx_connection_t *c= job->r->connection;
+
+	warmup_issue(job);
+	ngx_http_run_posted_requests(c);
+}
+
+/**
+ * Ends a cache warm-up job (see 'warmup_issue()'): sets its final state and
+ * releases the job's reference to the warm-up request.
+ * @param job Cache warm-up job.
+ */
+static void warmup_finish(ngx_http_tcdn_webcache_warmup_job_t *job)
+{
+	ngx_http_tcdn_webcache_warmup_t *warmup= job->warmup;
+
+	if(job->finished)
+		return;
+	job->finished= 1;
+	if(job->timer.timer_set)
+		ngx_del_timer(&job->timer);
+
+	if(warmup->cancel)
+		warmup->state= WARMUP_CANCELED;
+	else if(job->next< job->uris_num)
+		warmup->state= WARMUP_ABORTED;
+	else
+		warmup->state= WARMUP_DONE;
+	ngx_log_error(NGX_LOG_NOTICE, job->r->connection->log, 0, "Cache warm-up "
+			"%ui %s: %ui URLs warmed up, %ui failed, %ui skipped\n", job->id,
+			warmup->state== WARMUP_DONE? "done": (warmup->state==
+			WARMUP_CANCELED? "canceled": "aborted"), warmup->warmed,
+			warmup->failed, warmup->skipped);
+
+	ngx_http_finalize_request(job->r, NGX_DONE);
+}
+
+/**
+ * Cache warm-up job release: request pool clean-up handler. Jobs whose
+ * request is terminated before they end are aborted.
+ * @param data Cache warm-up job.
+ */
+static void warmup_cleanup(void *data)
+{
+	ngx_http_tcdn_webcache_warmup_job_t *job= data;
+
+	if(job->timer.timer_set)
+		ngx_del_timer(&job->timer);
+	if(job->finished)
+		return;
+	job->finished= 1;
+	if(job->warmup->id== job->id) {
+		job->warmup->inflight= 0;
+		job->warmup->state= WARMUP_ABORTED;
+	}
+}
+
+#if (NGX_HTTP_CACHE)
+/**
+ * Gets a proxy cache given its zone name (see 'proxy_cache_path').
+ * @param zone Cache zone name.
+ * @return The cache on success; NULL if there is no such cache.
+ */
+static ngx_http_file_cache_t* handoff_cache_get(const ngx_str_t *zone)
+{
+	register ngx_uint_t i;
+	ngx_list_part_t *part;
+	ngx_shm_zone_t *shm_zone;
+	ngx_http_file_cache_t *cache;
+
+	part= (ngx_list_part_t*)&ngx_cycle->shared_memory.part;
+	shm_zone= part->elts;
+	for(i= 0;; i++) {
+		if(i>= part->nelts) {
+			if(part->next== NULL)
+				break;
+			part= part->next;
+			shm_zone= part->elts;
+			i= 0;
+		}
+		if(shm_zone[i].tag!= &ngx_http_proxy_module ||
+				shm_zone[i].shm.name.len!= zone->len ||
+				ngx_strncmp(shm_zone[i].shm.name.data, zone->data, zone->len)!=
+				0)
+			continue;
+		cache= shm_zone[i].data;
+		return cache->sh!= NULL? cache: NULL;
+	}
+	return NULL;
+}
+
+/**
+ * Sends the most requested keys of a cache (see
+ * 'ngx_http_tcdn_webcache_handoff_handler()').
+ * @param r HTTP request context structure.
+ * @param cache Cache.
+ * @return Status code NGX_OK on succeed. See 'ngx_core.h' for other values.
+ */
+static ngx_int_t handoff_keys_send(ngx_http_request_t *r,
+		ngx_http_file_cache_t *cache)
+{
+	register ngx_uint_t i;
+	ngx_int_t limit= HANDOFF_KEYS_DEFAULT;
+	ngx_uint_t hot_num;
+	ngx_str_t arg, bucket= ngx_null_string;
+	ngx_buf_t *b;
+	ngx_http_file_cache_hot_t *hot;
+
+	if(ngx_http_arg(r, (u_char*)"limit", sizeof("limit")- 1, &arg)== NGX_OK) {
+		limit= ngx_atoi(arg.data, arg.len);
+		if(limit< 1 || limit> HANDOFF_KEYS_MAX)
+			return NGX_HTTP_BAD_REQUEST;
+	}
+	(void)ngx_http_arg(r, (u_char*)"bucket", sizeof("bucket")- 1, &bucket);
+
+	hot= ngx_palloc(r->pool, limit* sizeof(ngx_http_file_cache_hot_t));
+	if(hot== NULL)
+		return NGX_HTTP_INTERNAL_SERVER_ERROR;
+	hot_num= ngx_http_file_cache_hot(cache, &bucket, hot, (ngx_uint_t)limit);
+
+	b= ngx_create_temp_buf(r->pool, hot_num* (2* NGX_HTTP_CACHE_KEY_LEN+
+			sizeof(" \n")- 1+ NGX_INT_T_LEN)+ 1);
+	if(b== NULL)
+		return NGX_HTTP_INTERNAL_SERVER_ERROR;
+	for(i= 0; i< hot_num; i++) {
+		b->last= ngx_hex_dump(b->last, hot[i].key, NGX_HTTP_CACHE_KEY_LEN);
+		b->last= ngx_sprintf(b->last, " %ui\n", hot[i].uses);
+	}
+	return text_response_send(r, NGX_HTTP_OK, b);
+}
+
+/**
+ * Sends a cache file as is (see 'ngx_http_tcdn_webcache_handoff_handler()').
+ * @param r HTTP request context structure.
+ * @param main_conf Module's main configuration context structure.
+ * @param cache Cache.
+ * @param key_hex Cache key (MD5) in hexadecimal.
+ * @return Status code NGX_OK on succeed, NGX_HTTP_BAD_REQUEST if the key is
+ * not valid, NGX_HTTP_NOT_FOUND if it is not cached. See 'ngx_core.h' for
+ * other values.
+ */
+static ngx_int_t handoff_file_send(ngx_http_request_t *r,
+		ngx_http_tcdn_webcache_main_conf_t *main_conf,
+		ngx_http_file_cache_t *cache, ngx_str_t *key_hex)
+{
+	register ngx_uint_t i;
+	ngx_int_t ret_code, n;
+	ngx_fd_t fd;
+	ngx_str_t name;
+	ngx_buf_t *b;
+	ngx_chain_t out;
+	ngx_file_info_t fi;
+	ngx_pool_cleanup_t *cln;
+	ngx_pool_cleanup_file_t *clnf;
+	ngx_log_t *ngx_log= r->connection->log;
+	u_char key[NGX_HTTP_CACHE_KEY_LEN];
+
+	if(key_hex->len!= 2* NGX_HTTP_CACHE_KEY_LEN)
+		return NGX_HTTP_BAD_REQUEST;
+	for(i= 0; i< NGX_HTTP_CACHE_KEY_LEN; i++) {
+		if((n= ngx_hextoi(&key_hex->data[2* i], 2))== NGX_ERROR)
+			return NGX_HTTP_BAD_REQUEST;
+		key[i]= (u_char)n;
+	}
+	if(ngx_http_file_cache_file_name(cache, key, &name, r->pool)!= NGX_OK)
+		return NGX_HTTP_INTERNAL_SERVER_ERROR;
+
+	cln= ngx_pool_cleanup_add(r->pool, sizeof(ngx_pool_cleanup_file_t));
+	b= ngx_calloc_buf(r->pool);
+	if(cln== NULL || b== NULL ||
+			(b->file= ngx_pcalloc(r->pool, sizeof(ngx_file_t)))== NULL)
+		return NGX_HTTP_INTERNAL_SERVER_ERROR;
+
+	fd= ngx_open_file(name.data, NGX_FILE_RDONLY, NGX_FILE_OPEN, 0);
+	if(fd== NGX_INVALID_FILE) {
+		if(ngx_errno== NGX_ENOENT)
+			return NGX_HTTP_NOT_FOUND;
+		ngx_log_error(NGX_LOG_ERR, ngx_log, ngx_errno, ngx_open_file_n
+				" \"%s\" failed", name.data);
+		return NGX_HTTP_INTERNAL_SERVER_ERROR;
+	}
+	cln->handler= ngx_pool_cleanup_file;
+	clnf= cln->data;
+	clnf->fd= fd;
+	clnf->name= name.data;
+	clnf->log= r->pool->log;
+	if(ngx_fd_info(fd, &fi)== NGX_FILE_ERROR) {
+		ngx_log_error(NGX_LOG_ERR, ngx_log, ngx_errno, ngx_fd_info_n
+				" \"%s\" failed", name.data);
+		return NGX_HTTP_INTERNAL_SERVER_ERROR;
+	}
+
+	r->headers_out.status= NGX_HTTP_OK;
+	r->headers_out.content_length_n= ngx_file_size(&fi);
+	ngx_str_set(&r->headers_out.content_type, "application/octet-stream");
+	r->headers_out.content_type_len= r->headers_out.content_type.len;
+	r->headers_out.content_type_lowcase= NULL;
+	METRICS_INC(main_conf, handoff_exported);
+
+	ret_code= ngx_http_send_header(r);
+	if(ret_code== NGX_ERROR || ret_code> NGX_OK || r->header_only ||
+			ngx_file_size(&fi)== 0)
+		return ret_code;
+
+	b->file_pos= 0;
+	b->file_last= ngx_file_size(&fi);
+	b->in_file= 1;
+	b->last_buf= 1;
+	b->last_in_chain= 1;
+	b->file->fd= fd;
+	b->file->name= name;
+	b->file->log= ngx_log;
+	b->file->directio= 0;
+
+	out.buf= b;
+	out.next= NULL;
+	return ngx_http_output_filter(r, &out);
+}
+
+/**
+ * Starts a cache handoff import (see
+ * 'ngx_http_tcdn_webcache_handoff_handler()'): launches the import
+ * off-load thread task. Outputs "handoff <from> started".
+ * @param r HTTP request context structure.
+ * @param main_conf Module's main configuration context structure.
+ * @param cache Cache.
+ * @param zone Cache zone name (as in the request arguments).
+ * @return Status code NGX_OK on succeed, NGX_HTTP_BAD_REQUEST if the
+ * arguments are not valid, NGX_HTTP_CONFLICT if an import is in progress.
+ * See 'ngx_core.h' for other values.
+ */
+static ngx_int_t handoff_start(ngx_http_request_t *r,
+		ngx_http_tcdn_webcache_main_conf_t *main_conf,
+		ngx_http_file_cache_t *cache, ngx_str_t *zone)
+{
+	ngx_int_t limit= HANDOFF_KEYS_DEFAULT;
+	ngx_str_t from, arg, bucket= ngx_null_string;
+	u_char *p;
+	ngx_buf_t *b;
+	ngx_thread_task_t *thread_task;
+	ngx_http_tcdn_webcache_handoff_t *handoff;
+	ngx_log_t *ngx_log= r->connection->log;
+
+	thread_task= main_conf->ngx_handoff_thread_task;
+	CHECK_DO(thread_task!= NULL && main_conf->ngx_thread_pool!= NULL,
+			return NGX_HTTP_INTERNAL_SERVER_ERROR);
+	handoff= thread_task->ctx;
+	if(handoff->running)
+		return NGX_HTTP_CONFLICT;
+
+	/* Arguments (the peer address is a plain "host[:port]") */
+	if(ngx_http_arg(r, (u_char*)"from", sizeof("from")- 1, &from)!= NGX_OK ||
+			from.len== 0)
+		return NGX_HTTP_BAD_REQUEST;
+	for(p= from.data; p< from.data+ from.len; p++) {
+		if(!((*p>= '0' && *p<= '9') || (*p>= 'a' && *p<= 'z') ||
+				(*p>= 'A' && *p<= 'Z') || *p== '.' || *p== '-' || *p== ':' ||
+				*p== '[' || *p== ']'))
+			return NGX_HTTP_BAD_REQUEST;
+	}
+	if(ngx_http_arg(r, (u_char*)"limit", sizeof("limit")- 1, &arg)== NGX_OK) {
+		limit= ngx_atoi(arg.data, arg.len);
+		if(limit< 1 || limit> HANDOFF_KEYS_MAX)
+			return NGX_HTTP_BAD_REQUEST;
+	}
+	(void)ngx_http_arg(r, (u_char*)"bucket", sizeof("bucket")- 1, &bucket);
+	if(sizeof("http://?zone=")+ from.len+ r->uri.len+ zone->len>
+			HANDOFF_URL_LEN_MAX ||
+			sizeof("&limit=&bucket=")+ NGX_INT_T_LEN+ bucket.len>
+			HANDOFF_URL_LEN_MAX)
+		return NGX_HTTP_BAD_REQUEST;
+
+	b= ngx_create_temp_buf(r->pool, sizeof("handoff  started\n")- 1+
+			from.len);
+	if(b== NULL)
+		return NGX_HTTP_INTERNAL_SERVER_ERROR;
+
+	/* Job (the same location URI is requested to the peer) */
+	handoff->cache= cache;
+	*ngx_sprintf((u_char*)handoff->url, "http://%V%V?zone=%V", &from, &r->uri,
+			zone)= '\0';
+	p= ngx_sprintf((u_char*)handoff->list_args, "&limit=%i", limit);
+	if(bucket.len> 0)
+		p= ngx_sprintf(p, "&bucket=%V", &bucket);
+	*p= '\0';
+	handoff->imported= 0;
+	handoff->cached= 0;
+	handoff->failed= 0;
+
+	thread_task->event.log= ngx_cycle->log;
+	CHECK_DO(ngx_thread_task_post(main_conf->ngx_thread_pool, thread_task)==
+			NGX_OK, return NGX_HTTP_INTERNAL_SERVER_ERROR);
+	handoff->running= 1;
+	ngx_log_error(NGX_LOG_NOTICE, ngx_log, 0, "Cache handoff: importing "
+			"cache '%V' hot set from '%V'\n", zone, &from);
+
+	b->last= ngx_sprintf(b->last, "handoff %V started\n", &from);
+	return text_response_send(r, NGX_HTTP_ACCEPTED, b);
 }
 
 /**
- *
+ * Cache handoff import thread (see 'handoff_start()'): requests the peer's
+ * keys list, then each file (through the same connection, kept alive),
+ * which is written in the cache's temporary directory (skipped by the cache
+ * loader, that may be still running) and imported into the cache index
+ * (see 'ngx_http_file_cache_import()'). Files left behind (e.g. if the
+ * worker process is terminated) are overwritten by the next handoff.
+ * This function is executed in a separate thread of the thread-pool.
+ * @param data Opaque pointer to our private thread context structure: the
+ * import job.
+ * @param ngx_log Nginx's log context structure for the thread's context.
  */
-static ngx_int_t buckets_information_fetch_host_origin2(
-		struct json_object *jobj_buckets_cache, ngx_str_t *hdr_host,
-		ngx_log_t *ngx_log, char **ref_orig_host, char **ref_orig_port)
+static void handoff_thr(void *data, ngx_log_t *ngx_log)
 {
-	register int i;
-	register size_t json_buckets_len;
+	register size_t i;
+	ngx_int_t ret_code, uses;
+	ngx_str_t name, temp= ngx_null_string; // 'temp.data' release-me (heap)
+	char *url= NULL; // release-me (heap allocated)
+	char *line, *line_end, *p;
+	ngx_pool_t *pool= NULL; // release-me
+	CURL *curl_handle= NULL; // release-me (heap allocated)
+	curl_mem_ctx_t curl_mem_ctx= {0}; // release-me (has heap allocated member)
+	CURLcode curl_code;
+	long http_code= 0;
+	ngx_http_file_cache_t *cache;
+	ngx_http_tcdn_webcache_handoff_t *handoff= data;
+	u_char key[NGX_HTTP_CACHE_KEY_LEN];
 
 	/* Check arguments */
-	if(jobj_buckets_cache== NULL || hdr_host== NULL || ngx_log== NULL ||
-			ref_orig_host== NULL || ref_orig_port== NULL)
-		return NGX_ERROR;
-	CHECK_DO(hdr_host->data!= NULL && hdr_host->len> 0, return NGX_ERROR);
-	LOGD(ngx_log, "HTTP host-header input: '%s' (lenght: %d)\n",
-			hdr_host->data, hdr_host->len);
-
-	json_buckets_len= json_object_array_length(jobj_buckets_cache);
-	printf("Filtered buckets.json to %d webcache buckets...\n",
-			(int)json_buckets_len);
-
-	/* Filter by HTTP header 'host' */
-	for(i= 0; i< (int)json_buckets_len; i++) {
-		register size_t origin_list_len;
-		register json_bool flag_found;
-		const char *host, *origin_host, *origin_port;
-		struct json_object *jobj_bucket_cache;
-		struct json_object *jobj_origin, *jobj_origin_host, *jobj_origin_port;
-		struct json_object *jobj_aux1= NULL, *jobj_aux2= NULL;
-
-		/* Get web-cache bucket */
-		jobj_bucket_cache= json_object_array_get_idx(jobj_buckets_cache, i);
-		CHECK_DO(jobj_bucket_cache!= NULL, exit(-1));
-
-		/* We will filter the bucket by the field 'host' */
-		flag_found= json_object_object_get_ex(jobj_bucket_cache, "host",
-				&jobj_aux1);
-		if(flag_found== 0 || jobj_aux1== NULL ||
-				(host= json_object_get_string(jobj_aux1))== NULL ||
-				strncmp(host, (const char*)hdr_host->data, hdr_host->len)!= 0)
-			continue;
-		LOGD(ngx_log, "'host' in bucket is: '%s'\n", host); //comment-me
-		LOGD(ngx_log, "'awa' bucket is: '%s'\n", json_object_to_json_string(
-				jobj_bucket_cache)); //comment-me
-
-		/* Parse 'origin-server' host and port. JSON tree is as follows:
-		 * {
-		 *     ...
-		 *     "awa_params": {
-		 *         ...
-		 *         "origins": {
-		 *             ...
-		 *             "origin_list":[
-		 *                 {..., "host":"10.95.150.104", ..."port":80, ...},
-		 *                 {...},
-		 *                 ...
-		 *             ]
-		 *             ...
-		 *         }
-		 *         ...
-		 *     }
-		 *     ...
-		 *     host: "myhost.example.com",
-		 *     ...
-		 * }
-		 */
-		// Get "awa_params"
-		flag_found= json_object_object_get_ex(jobj_bucket_cache, "awa_params",
-				&jobj_aux1);
-		if(flag_found== 0 || jobj_aux1== NULL)
-			continue;
-		// We have 'jobj_aux1'<- "awa_params"; get 'origins'
-		flag_found= json_object_object_get_ex(jobj_aux1, "origins", &jobj_aux2);
-		if(flag_found== 0 || jobj_aux2== NULL)
+	if(handoff== NULL || ngx_log== NULL)
+		return;
+	cache= handoff->cache;
+
+	pool= ngx_create_pool(NGX_DEFAULT_POOL_SIZE, ngx_log);
+	CHECK_DO(pool!= NULL, goto end);
+	url= (char*)malloc(2* HANDOFF_URL_LEN_MAX);
+	CHECK_DO(url!= NULL, goto end);
+	curl_mem_ctx.data= malloc(TRACKER_BODY_SIZE_INI); // grows as needed
+	CHECK_DO(curl_mem_ctx.data!= NULL, goto end);
+	curl_mem_ctx.data[0]= 0;
+	curl_mem_ctx.capacity= TRACKER_BODY_SIZE_INI;
+	curl_mem_ctx.ngx_log= ngx_log;
+
+	/* Temporary directory: the one of 'use_temp_path=off' if configured,
+	 * otherwise created under the cache directory (same file system) */
+	temp.len= cache->temp_path!= NULL? cache->temp_path->name.len:
+			cache->path->name.len+ sizeof("/temp")- 1;
+	temp.data= (u_char*)malloc(temp.len+ 1);
+	CHECK_DO(temp.data!= NULL, goto end);
+	if(cache->temp_path!= NULL) {
+		*ngx_cpymem(temp.data, cache->temp_path->name.data, temp.len)= '\0';
+	} else {
+		*ngx_sprintf(temp.data, "%V/temp", &cache->path->name)= '\0';
+		if(ngx_create_dir(temp.data, 0700)== NGX_FILE_ERROR &&
+				ngx_errno!= NGX_EEXIST) {
+			ngx_log_error(NGX_LOG_ERR, ngx_log, ngx_errno, "Cache handoff: "
+					ngx_create_dir_n " \"%V\" failed\n", &temp);
+			goto end;
+		}
+	}
+
+	/* Keys list */
+	curl_handle= curl_easy_init();
+	CHECK_DO(curl_handle!= NULL, goto end);
+	snprintf(url, 2* HANDOFF_URL_LEN_MAX, "%s%s", handoff->url,
+			handoff->list_args);
+	LOGD(ngx_log, "Cache handoff: GET <- '%s'...\n", url);
+	CHECK_DO(curl_easy_setopt(curl_handle, CURLOPT_URL, url)== CURLE_OK,
+			goto end);
+	CHECK_DO(curl_easy_setopt(curl_handle, CURLOPT_WRITEFUNCTION,
+			curl_write_body_callback)== CURLE_OK, goto end);
+	CHECK_DO(curl_easy_setopt(curl_handle, CURLOPT_WRITEDATA,
+			(void*)&curl_mem_ctx)== CURLE_OK, goto end);
+	CHECK_DO(curl_easy_setopt(curl_handle, CURLOPT_USERAGENT,
+			"libcurl-agent/1.0")== CURLE_OK, goto end);
+	curl_code= curl_easy_perform(curl_handle);
+	if(curl_code== CURLE_OK)
+		curl_code= curl_easy_getinfo(curl_handle, CURLINFO_RESPONSE_CODE,
+				&http_code);
+	if(curl_code!= CURLE_OK || http_code!= 200) {
+		ngx_log_error(NGX_LOG_ERR, ngx_log, 0, "Cache handoff: could not get "
+				"the keys list from '%s': %s (status %l)\n", handoff->url,
+				curl_easy_strerror(curl_code), http_code);
+		goto end;
+	}
+
+	/* Files, most requested first: "<key in hex> <uses>" lines */
+	for(line= curl_mem_ctx.data; line< curl_mem_ctx.data+ curl_mem_ctx.size &&
+			!ngx_quit && !ngx_terminate && !ngx_exiting; line= line_end+ 1) {
+		if((line_end= strchr(line, '\n'))== NULL)
+			line_end= curl_mem_ctx.data+ curl_mem_ctx.size;
+		if(line_end- line< 2* NGX_HTTP_CACHE_KEY_LEN+ 2 ||
+				line[2* NGX_HTTP_CACHE_KEY_LEN]!= ' ')
 			continue;
-		// We have 'jobj_aux2'<- "origins"; get 'origin_list'
-		flag_found= json_object_object_get_ex(jobj_aux2, "origin_list",
-				&jobj_aux1);
-		if(flag_found== 0 || jobj_aux1== NULL)
+		for(i= 0; i< NGX_HTTP_CACHE_KEY_LEN; i++) {
+			ret_code= ngx_hextoi((u_char*)&line[2* i], 2);
+			if(ret_code== NGX_ERROR)
+				break;
+			key[i]= (u_char)ret_code;
+		}
+		p= &line[2* NGX_HTTP_CACHE_KEY_LEN+ 1];
+		uses= ngx_atoi((u_char*)p, line_end- p);
+		if(i< NGX_HTTP_CACHE_KEY_LEN || uses== NGX_ERROR)
 			continue;
-		// We have 'jobj_aux1'<- "origin_list
-
-		/* We will take the first entry available */
-		origin_list_len= json_object_array_length(jobj_aux1);
-		if(!origin_list_len)
+		line[2* NGX_HTTP_CACHE_KEY_LEN]= '\0'; // Key in hex
+
+		/* Received in the temporary directory */
+		ngx_reset_pool(pool);
+		name.len= temp.len+ sizeof("/.handoff")- 1+ 2* NGX_HTTP_CACHE_KEY_LEN;
+		name.data= ngx_pnalloc(pool, name.len+ 1);
+		CHECK_DO(name.data!= NULL, goto end);
+		*ngx_sprintf(name.data, "%V/%s.handoff", &temp, line)= '\0';
+		if(handoff_file_fetch(handoff, curl_handle, line,
+				(const char*)name.data, ngx_log)!= NGX_OK) {
+			(void)ngx_delete_file(name.data);
+			handoff->failed++;
+			METRICS_INC(handoff->main_conf, handoff_failed);
 			continue;
-		jobj_origin= json_object_array_get_idx(jobj_aux1, 0);
-		CHECK_DO(jobj_origin!= NULL, exit(-1));
-
-		/* origin-host */
-		flag_found= json_object_object_get_ex(jobj_origin, "host",
-				&jobj_origin_host);
-		if(flag_found!= 0) {
-			origin_host= json_object_get_string(jobj_origin_host);
-			if(origin_host!= NULL && strlen(origin_host)> 0) {
-				LOGD(ngx_log, "origin-host: '%s'\n", origin_host);
-				*ref_orig_host= strdup(origin_host);
-			}
 		}
 
-		/* origin-port */
-		flag_found= json_object_object_get_ex(jobj_origin, "port",
-				&jobj_origin_port);
-		if(flag_found!= 0) {
-			origin_port= json_object_get_string(jobj_origin_port);
-			if(origin_port!= NULL && strlen(origin_port)> 0) {
-				LOGD(ngx_log, "origin-port: '%s'\n", origin_port);
-				*ref_orig_port= strdup(origin_port);
-			}
+		ret_code= ngx_http_file_cache_import(cache, key, (ngx_uint_t)uses,
+				&name, pool, ngx_log);
+		if(ret_code== NGX_OK) {
+			handoff->imported++;
+			METRICS_INC(handoff->main_conf, handoff_imported);
+		} else if(ret_code== NGX_DECLINED) {
+			handoff->cached++;
+		} else {
+			handoff->failed++;
+			METRICS_INC(handoff->main_conf, handoff_failed);
 		}
-		break;
 	}
-	return NGX_OK;
+
+end:
+	if(curl_handle!= NULL)
+		curl_easy_cleanup(curl_handle);
+	if(curl_mem_ctx.data!= NULL)
+		free(curl_mem_ctx.data);
+	if(url!= NULL)
+		free(url);
+	if(temp.data!= NULL)
+		free(temp.data);
+	if(pool!= NULL)
+		ngx_destroy_pool(pool);
 }
 
 /**
- * Performs an internal redirection to a given configured location.
- * @param r HTTP request context structure (includes information such as
- * request method, URI, and headers).
- * @param ngx_log Log context structure.
- * @return Status code NGX_OK on succeed. See 'ngx_core.h' for other values.
+ * Requests a cache file to the handoff peer (see 'handoff_thr()').
+ * @param handoff Cache handoff import job.
+ * @param curl_handle The job's curl session.
+ * @param key_hex Cache key in hexadecimal.
+ * @param file_name Name of the file the cache file is written to.
+ * @param ngx_log Nginx's log context structure.
+ * @return Status code NGX_OK on succeed, NGX_ERROR otherwise.
  */
-static ngx_int_t perform_http_internal_redirect(ngx_http_request_t *r,
-		ngx_log_t *ngx_log, char *orig_host, char *orig_port)
+static ngx_int_t handoff_file_fetch(ngx_http_tcdn_webcache_handoff_t *handoff,
+		CURL *curl_handle, const char *key_hex, const char *file_name,
+		ngx_log_t *ngx_log)
 {
-	register size_t uri_args_len;
-	ngx_int_t end_code= NGX_ERROR;
-	int redir_max_len= INT_REDIR_PATH_MAX_LEN;
-	char new_uri[INT_REDIR_PATH_MAX_LEN]= {0}, *p_new_uri= new_uri;
-	char *new_uri_dyn= NULL; //release-me (heap-allocated)
-	ngx_str_t ngx_str_proxy_selected= {0};
-
-	/* Check arguments */
-	if(r== NULL || ngx_log== NULL || orig_host== NULL || orig_port== NULL)
+	FILE *file;
+	CURLcode curl_code;
+	long http_code= 0;
+	char url[2* HANDOFF_URL_LEN_MAX];
+
+	snprintf(url, sizeof(url), "%s&key=%s", handoff->url, key_hex);
+	if((file= fopen(file_name, "wb"))== NULL) {
+		ngx_log_error(NGX_LOG_ERR, ngx_log, ngx_errno, "Cache handoff: could "
+				"not create '%s'\n", file_name);
 		return NGX_ERROR;
-
-	/* Sanity checks... */
-	uri_args_len= r->uri.len+ r->args.len;
-	if((r->uri.len> 0 && r->uri.data== NULL) ||
-			(r->args.len> 0 && r->args.data== NULL) ||
-			uri_args_len> URI_MAX_LEN_GUARD) {
-		CHECK_DO(0, goto end)
 	}
 
-	/* We should normally use stack-allocated URL's (this code is supposed
-	 * rare to be executed)
-	 */
-	if(uri_args_len> URI_MAX_LEN) {
-		ngx_log_error(NGX_LOG_ALERT, ngx_log, 0, "Request URI is very long "
-				"(%d characters). Managing with heap.\n", (int)uri_args_len);
-		redir_max_len= INT_REDIR_PATH_MAX_LEN- URI_MAX_LEN+ uri_args_len;
-		new_uri_dyn= (char*)calloc(1, redir_max_len);
-		CHECK_DO(new_uri_dyn!= NULL, goto end);
-		p_new_uri= new_uri_dyn;
+	/* Default write function: 'fwrite()' to the file */
+	CHECK_DO(curl_easy_setopt(curl_handle, CURLOPT_URL, url)== CURLE_OK,
+			fclose(file); return NGX_ERROR);
+	CHECK_DO(curl_easy_setopt(curl_handle, CURLOPT_WRITEFUNCTION, NULL)==
+			CURLE_OK, fclose(file); return NGX_ERROR);
+	CHECK_DO(curl_easy_setopt(curl_handle, CURLOPT_WRITEDATA, (void*)file)==
+			CURLE_OK, fclose(file); return NGX_ERROR);
+	curl_code= curl_easy_perform(curl_handle);
+	if(curl_code== CURLE_OK)
+		curl_code= curl_easy_getinfo(curl_handle, CURLINFO_RESPONSE_CODE,
+				&http_code);
+	if(fclose(file)!= 0 && curl_code== CURLE_OK)
+		curl_code= CURLE_WRITE_ERROR;
+
+	if(curl_code!= CURLE_OK || http_code!= 200) {
+		LOGD(ngx_log, "Cache handoff: could not get '%s': %s (status %l)\n",
+				url, curl_easy_strerror(curl_code), http_code);
+		return NGX_ERROR;
 	}
+	return NGX_OK;
+}
 
-	/* Print new redirection URI */
-	snprintf(p_new_uri, redir_max_len- 1, "%s%s:%s%.*s?%.*s", INT_REDIR_PATH,
-			orig_host, orig_port,
-			(int)r->uri.len, r->uri.data!= NULL? r->uri.data: (u_char*)"",
-			(int)r->args.len, r->args.data!= NULL? r->args.data: (u_char*)"");
+/**
+ * Cache handoff import thread completion handler (see 'handoff_thr()').
+ * Executed by the worker's event loop.
+ * @param ev Thread task event; its data is the import job.
+ */
+static void handoff_thr_completion(ngx_event_t *ev)
+{
+	ngx_http_tcdn_webcache_handoff_t *handoff;
 
-	/* Actually redirect with given arguments (namely, query-string) */
-	LOGD(ngx_log, "Performing internal redirection to URI '%s'... \n",
-			p_new_uri);
-	ngx_str_proxy_selected.len= strlen(p_new_uri);
-	ngx_str_proxy_selected.data= (u_char*)p_new_uri;
-	end_code= ngx_http_internal_redirect(r, &ngx_str_proxy_selected, NULL);
+	/* Check arguments */
+	if(ev== NULL || (handoff= ev->data)== NULL || ev->log== NULL)
+		return;
 
-end:
-	if(new_uri_dyn!= NULL)
-		free(new_uri_dyn);
-	return end_code;
+	handoff->running= 0;
+	ngx_log_error(NGX_LOG_NOTICE, ev->log, 0, "Cache handoff from '%s' "
+			"done: %ui files imported, %ui already cached, %ui failed\n",
+			handoff->url, handoff->imported, handoff->cached,
+			handoff->failed);
 }
+#endif
 
 /**
  * Creates tracker synchronization off-load task resources.
@@ -1038,8 +5937,10 @@ static ngx_int_t synchronize_buckets_information_launch_thread(
 	thread_task= main_conf->ngx_sync_tracker_thread_task;
 	CHECK_DO(thread_task!= NULL, return NGX_ERROR);
 
-	/* Actually launch the off-load thread */
+	/* Actually launch the off-load thread (its completion handler may
+	 * outlive the requests: it logs to the cycle's log) */
 	LOGD(ngx_log, "Launching the off-load thread\n");
+	thread_task->event.log= ngx_cycle->log;
 	CHECK_DO(ngx_thread_task_post(thread_pool, thread_task)== NGX_OK,
 			return NGX_ERROR);
 
@@ -1061,7 +5962,7 @@ static void sync_tracker_thr(void *data, ngx_log_t *ngx_log)
 	ngx_str_t *ref_tracker_url, *ref_bucket_uri;
 	ngx_thread_mutex_t *p_sync_mutex;
 	register uint64_t curr_ts_secs; //Current monotonic time-stamp [seconds]
-	register int i, buckets_cache_idx_new, json_buckets_len;
+	register int routing_table_idx_new;
 	ngx_thread_mutex_t *p_buckets_mutex;
     int end_code= NGX_ERROR;
     ngx_http_tcdn_webcache_main_conf_t *main_conf= NULL; // alias
@@ -1070,8 +5971,13 @@ static void sync_tracker_thr(void *data, ngx_log_t *ngx_log)
     CURL *curl_handle= NULL; // release-me (heap allocated)
     curl_mem_ctx_t curl_mem_ctx= {0}; // release-me (has heap allocated member)
     CURLcode curl_code= CURLE_COULDNT_CONNECT; // initialize to any error...
-    struct json_object *jobj_buckets= NULL, // release-me (heap allocated)
-    		*jobj_buckets_cache= NULL; // release-me (heap allocated)
+    struct curl_slist *curl_headers= NULL; // release-me (heap allocated)
+    long http_code= 0;
+    tcdn_routing_table_t *routing_table= NULL; // release-me (heap allocated)
+    tcdn_routing_table_t *routing_table_next= NULL; // release-me (heap alloc.)
+    tcdn_routing_table_t *routing_table_old;
+    unsigned int now, transition_ts;
+    int flag_transition;
     struct timespec ts_curr= {0};
 
     /* Check arguments */
@@ -1080,7 +5986,7 @@ static void sync_tracker_thr(void *data, ngx_log_t *ngx_log)
 
     /* Get main configuration context structure */
     main_conf= *(ngx_http_tcdn_webcache_main_conf_t**)data;
-    CHECK_DO(main_conf!= NULL, goto end);
+    CHECK_DO(main_conf!= NULL, return);
 
     LOGD(ngx_log, "Entering tracker synchronization thread "
     		"(data pointer= %p)... \n", main_conf);
@@ -1107,9 +6013,11 @@ static void sync_tracker_thr(void *data, ngx_log_t *ngx_log)
 
     /* **** Prepare curl GET request **** */
 
-    curl_mem_ctx.data= malloc(1); // will grown as needed by reallocation
+    curl_mem_ctx.data= malloc(TRACKER_BODY_SIZE_INI); // grows as needed
     CHECK_DO(curl_mem_ctx.data!= NULL, goto end);
+    curl_mem_ctx.data[0]= 0;
     curl_mem_ctx.size= 0; // no data at this point yet
+    curl_mem_ctx.capacity= TRACKER_BODY_SIZE_INI;
     curl_mem_ctx.ngx_log= ngx_log;
 
     /* Initialize the curl session */
@@ -1135,74 +6043,160 @@ static void sync_tracker_thr(void *data, ngx_log_t *ngx_log)
     CHECK_DO(curl_easy_setopt(curl_handle, CURLOPT_USERAGENT,
     		"libcurl-agent/1.0")== CURLE_OK, goto end);
 
+    /* Accept any compression supported by libcurl (e.g. gzip); the buckets
+     * information set is large and highly compressible */
+    CHECK_DO(curl_easy_setopt(curl_handle, CURLOPT_ACCEPT_ENCODING, "")==
+    		CURLE_OK, goto end);
+
+    /* Get the entity-tag of the response */
+    CHECK_DO(curl_easy_setopt(curl_handle, CURLOPT_HEADERFUNCTION,
+    		curl_header_callback)== CURLE_OK, goto end);
+    CHECK_DO(curl_easy_setopt(curl_handle, CURLOPT_HEADERDATA,
+    		(void *)&curl_mem_ctx)== CURLE_OK, goto end);
+
+    /* Conditional request: if the buckets information did not change since
+     * the last synchronization, tracker just responds '304 Not Modified' and
+     * we avoid downloading and parsing it again */
+    if(main_conf->tracker_etag[0]!= 0) {
+    	char if_none_match[sizeof("If-None-Match: ")+ TRACKER_ETAG_MAX_LEN];
+
+    	snprintf(if_none_match, sizeof(if_none_match), "If-None-Match: %s",
+    			main_conf->tracker_etag);
+    	curl_headers= curl_slist_append(curl_headers, if_none_match);
+    	CHECK_DO(curl_headers!= NULL, goto end);
+    	CHECK_DO(curl_easy_setopt(curl_handle, CURLOPT_HTTPHEADER,
+    			curl_headers)== CURLE_OK, goto end);
+    }
+
     /* Perform HTTP-GET method */
-    if((curl_code= curl_easy_perform(curl_handle))!= CURLE_OK) {
+    ngx_probe(tcdn_webcache, tracker__fetch__start, tracker_fullurl);
+    curl_code= curl_easy_perform(curl_handle);
+    if(curl_code== CURLE_OK)
+    	curl_code= curl_easy_getinfo(curl_handle, CURLINFO_RESPONSE_CODE,
+    			&http_code);
+    ngx_probe(tcdn_webcache, tracker__fetch__done, (int)curl_code, http_code,
+    		curl_mem_ctx.size);
+    if(curl_code!= CURLE_OK) {
     	ngx_log_error(NGX_LOG_ERR, ngx_log, 0,
-    			"curl_easy_perform() failed: %s\n",
-				curl_easy_strerror(curl_code));
+    			"curl request failed: %s\n", curl_easy_strerror(curl_code));
+    	CHECK_DO(0, goto end); // Force tracing error point
+    }
+
+    /* Buckets information not modified: just refresh time-stamp, unless
+     * the host-names resolution expired or the table for the next buckets
+     * activation window transition is still to be compiled (then the set in
+     * use is compiled and resolved again) */
+    if(http_code== 304) {
+    	LOGD(ngx_log, "Buckets information not modified (ETag: %s)\n",
+    			main_conf->tracker_etag);
+    	CHECK_DO(clock_gettime(CLOCK_MONOTONIC, &ts_curr)== 0, goto end);
+    	main_conf->bucket_json_monot_ts_secs= (uint64_t)ts_curr.tv_sec;
+    	METRICS_INC(main_conf, tracker_sync_not_modified);
+    	p_buckets_mutex= &main_conf->routing_table_mutex;
+    	ASSERT(ngx_thread_mutex_lock(p_buckets_mutex, ngx_log)== NGX_OK);
+    	flag_transition= main_conf->routing_table_next_ts!= 0 &&
+    			main_conf->routing_table_next== NULL;
+    	ASSERT(ngx_thread_mutex_unlock(p_buckets_mutex, ngx_log)== NGX_OK);
+    	if(main_conf->tracker_body== NULL || (!flag_transition &&
+    			(main_conf->resolve_valid== 0 || (uint64_t)ts_curr.tv_sec<
+    			main_conf->resolve_monot_ts_secs+ main_conf->resolve_valid))) {
+    		end_code= NGX_OK;
+    		goto end;
+    	}
+    	LOGD(ngx_log, "Compiling buckets information again...\n");
+    	free(curl_mem_ctx.data);
+    	curl_mem_ctx.data= main_conf->tracker_body;
+    	curl_mem_ctx.size= main_conf->tracker_body_size;
+    	main_conf->tracker_body= NULL;
+    	ngx_cpystrn((u_char*)curl_mem_ctx.etag,
+    			(u_char*)main_conf->tracker_etag, sizeof(curl_mem_ctx.etag));
+    } else if(http_code!= 200) {
+    	ngx_log_error(NGX_LOG_ERR, ngx_log, 0, "Tracker responded with "
+    			"status %ld\n", http_code);
     	CHECK_DO(0, goto end); // Force tracing error point
     }
     CHECK_DO(curl_mem_ctx.data!= NULL, goto end);
     LOGD(ngx_log, "successfully received buckets.json (%lu bytes retrieved)\n",
     		(long)curl_mem_ctx.size);
 
-	/* Parse the JSON -this may be CPU-heavy- */
-    LOGD(ngx_log, "Parsing buckets.json...\n");
-	jobj_buckets= json_tokener_parse(curl_mem_ctx.data);
-	json_buckets_len= json_object_array_length(jobj_buckets);
-	LOGD(ngx_log, "The 'buckets.json' has %d buckets...\n", json_buckets_len);
-
-	/* We only need '\"platform\": 8' buckets */
-	jobj_buckets_cache= json_object_new_array();
-	for(i= 0; i< json_buckets_len; i++) {
-		json_bool flag_found;
-		int32_t platform_val;
-		struct json_object *jobj_value= NULL;
-		struct json_object *jobj_bucket= json_object_array_get_idx(
-				jobj_buckets, i);
-		flag_found= json_object_object_get_ex(jobj_bucket, "platform",
-				&jobj_value);
-		if(flag_found== 0 || (platform_val= json_object_get_int(jobj_value))!=
-				BUCKET_JSON_PLATFORM)
-			continue;
-		/* We've found a cache-proxy bucket; store it */
-		// Increment the reference count of ''jobj_value, thereby grabbing
-		// shared ownership of obj.
-		jobj_bucket= json_object_get(jobj_bucket);
-		CHECK_DO(json_object_array_add(jobj_buckets_cache, jobj_bucket)== 0,
-				exit(-1));
-	}
-	json_buckets_len= json_object_array_length(jobj_buckets_cache);
-	LOGD(ngx_log, "Tracker: filtered buckets.json to %d webcache buckets...\n",
-			json_buckets_len);
-	LOGD(ngx_log, "\n'%s'\n", json_object_to_json_string(
-			jobj_buckets_cache)); //comment-me
-
-    /* Release old buckets information; store new one */
-    buckets_cache_idx_new= (main_conf->buckets_cache_idx+ 1)%
-    		JOBJ_BUCKETS_CACHE_NUM;
-	if(main_conf->jobj_buckets_cache[buckets_cache_idx_new]!= NULL) {
-		struct json_object *jobj=
-				main_conf->jobj_buckets_cache[buckets_cache_idx_new];
-		register int loop_guard= 100, flag_obj_freed= 0;
-		while(loop_guard> 0 && flag_obj_freed== 0) {
-			// 'json_object_put()' returns 1 if the object was freed
-			flag_obj_freed= json_object_put(jobj);
-			loop_guard--;
-		}
-		CHECK_DO(flag_obj_freed== 1, goto end);
-		main_conf->jobj_buckets_cache[buckets_cache_idx_new]= NULL;
+	/* Parse the JSON and compile the routing table -this may be
+	 * CPU-heavy-. We only need '\"platform\": 8' buckets.
+	 * If the buckets information is malformed we just keep on using the
+	 * current routing table.
+	 */
+    LOGD(ngx_log, "Compiling buckets.json...\n");
+	CHECK_DO(clock_gettime(CLOCK_REALTIME, &ts_curr)== 0, goto end);
+	now= (unsigned int)ts_curr.tv_sec;
+	routing_table= tcdn_routing_table_compile_json(curl_mem_ctx.data,
+			curl_mem_ctx.size, BUCKET_JSON_PLATFORM, now);
+	if(routing_table== NULL) {
+		ngx_log_error(NGX_LOG_ERR, ngx_log, 0, "Malformed buckets information "
+				"received from tracker (%uz bytes)\n", curl_mem_ctx.size);
+		METRICS_INC(main_conf, tracker_sync_malformed);
+		CHECK_DO(0, goto end); // Force tracing error point
+	}
+	if(tcdn_routing_table_discarded(routing_table)> 0) {
+		ngx_log_error(NGX_LOG_WARN, ngx_log, 0, "Discarded %uz malformed or "
+				"duplicated webcache buckets\n",
+				tcdn_routing_table_discarded(routing_table));
+		if(main_conf->metrics!= NULL)
+			(void)ngx_atomic_fetch_add(&main_conf->metrics->buckets_discarded,
+					tcdn_routing_table_discarded(routing_table));
+	}
+	LOGD(ngx_log, "Tracker: compiled %d webcache buckets...\n",
+			(int)tcdn_routing_table_size(routing_table));
+
+	/* Compute the signed URLs keys and resolve the origin-servers and
+	 * shields host-names (this may block this thread, never the requests) */
+	CHECK_DO(routing_table_prepare(main_conf, routing_table, ngx_log)==
+			NGX_OK, goto end);
+
+	/* Compile the table for the next buckets activation window transition
+	 * in advance: it is put in use at that very moment by the transition
+	 * timer (see 'transition_timer_handler()') */
+	transition_ts= tcdn_routing_table_next_transition(routing_table);
+	if(transition_ts!= 0) {
+		LOGD(ngx_log, "Compiling buckets.json for next transition (%uD)...\n",
+				transition_ts);
+		routing_table_next= tcdn_routing_table_compile_json(
+				curl_mem_ctx.data, curl_mem_ctx.size, BUCKET_JSON_PLATFORM,
+				transition_ts);
+		CHECK_DO(routing_table_next!= NULL, goto end);
+		CHECK_DO(routing_table_prepare(main_conf, routing_table_next,
+				ngx_log)== NGX_OK, goto end);
 	}
-	main_conf->jobj_buckets_cache[buckets_cache_idx_new]= jobj_buckets_cache;
-	jobj_buckets_cache= NULL; // Avoid aliasing
-	CHECK_DO(main_conf->jobj_buckets_cache[buckets_cache_idx_new]!= NULL,
-			goto end);
 
-    /* Switch to new buckets information set */
-    p_buckets_mutex= &main_conf->jobj_buckets_cache_mutex;
+    /* Switch to new buckets information set; requests only read the table
+     * in use, so the old ones are released out of the lock */
+    p_buckets_mutex= &main_conf->routing_table_mutex;
 	ASSERT(ngx_thread_mutex_lock(p_buckets_mutex, ngx_log)== NGX_OK);
-    main_conf->buckets_cache_idx= buckets_cache_idx_new;
+    routing_table_idx_new= (main_conf->routing_table_idx+ 1)%
+    		ROUTING_TABLE_NUM;
+    routing_table_old= main_conf->routing_table[routing_table_idx_new];
+	main_conf->routing_table[routing_table_idx_new]= routing_table;
+	routing_table= routing_table_old;
+    main_conf->routing_table_idx= routing_table_idx_new;
+    main_conf->buckets_generation++;
+    routing_table_old= main_conf->routing_table_next;
+    main_conf->routing_table_next= routing_table_next;
+    routing_table_next= routing_table_old;
+    main_conf->routing_table_next_ts= (time_t)transition_ts;
     ASSERT(ngx_thread_mutex_unlock(p_buckets_mutex, ngx_log)== NGX_OK);
+    ngx_probe(tcdn_webcache, table__swap, routing_table_idx_new,
+    		tcdn_routing_table_size(
+    				main_conf->routing_table[routing_table_idx_new]));
+    METRICS_INC(main_conf, tracker_sync_updated);
+
+    /* Keep the entity-tag of the set in use for next conditional request */
+    ngx_cpystrn((u_char*)main_conf->tracker_etag, (u_char*)curl_mem_ctx.etag,
+    		sizeof(main_conf->tracker_etag));
+
+    /* Keep the set in use to compile it again (see 'tracker_body') */
+    if(main_conf->tracker_body!= NULL)
+    	free(main_conf->tracker_body);
+    main_conf->tracker_body= curl_mem_ctx.data;
+    main_conf->tracker_body_size= curl_mem_ctx.size;
+    curl_mem_ctx.data= NULL; // Avoid aliasing
 
     /* Succeed -> update last refresh time-stamp */
 	CHECK_DO(clock_gettime(CLOCK_MONOTONIC, &ts_curr)== 0, goto end);
@@ -1212,6 +6206,10 @@ static void sync_tracker_thr(void *data, ngx_log_t *ngx_log)
 
     end_code= NGX_OK;
 end:
+	/* On failure, the last good buckets information is kept in use */
+	if(end_code!= NGX_OK)
+		METRICS_INC(main_conf, tracker_sync_failed);
+
 	/* Signal we have (successfully or not) completed the task */
 	p_sync_mutex= &main_conf->sync_tracker_thr_mutex;
 	ASSERT(ngx_thread_mutex_lock(p_sync_mutex, ngx_log)== NGX_OK);
@@ -1227,25 +6225,10 @@ end:
     	free(curl_mem_ctx.data);
     if(curl_handle!= NULL)
     	curl_easy_cleanup(curl_handle);
-	/* Decrement the reference count of json_object -free if it reaches zero- */
-    if(jobj_buckets!= NULL) {
-		register int loop_guard= 100, flag_obj_freed= 0;
-		while(loop_guard> 0 && flag_obj_freed== 0) {
-			// 'json_object_put()' returns 1 if the object was freed
-			flag_obj_freed= json_object_put(jobj_buckets);
-			loop_guard--;
-		}
-		ASSERT(flag_obj_freed== 1);
-    }
-    if(jobj_buckets_cache!= NULL) {
-		register int loop_guard= 100, flag_obj_freed= 0;
-		while(loop_guard> 0 && flag_obj_freed== 0) {
-			// 'json_object_put()' returns 1 if the object was freed
-			flag_obj_freed= json_object_put(jobj_buckets_cache);
-			loop_guard--;
-		}
-		ASSERT(flag_obj_freed== 1);
-    }
+    if(curl_headers!= NULL)
+    	curl_slist_free_all(curl_headers);
+    tcdn_routing_table_release(&routing_table);
+    tcdn_routing_table_release(&routing_table_next);
     return;
 }
 
@@ -1270,9 +6253,17 @@ static size_t curl_write_body_callback(void *contents, size_t size,
 			(ngx_log= curl_mem_ctx->ngx_log)== NULL)
 		return 0;
 
-	p_data= (char*)realloc(curl_mem_ctx->data, curl_mem_ctx->size+ realsize+ 1);
-	CHECK_DO(p_data!= NULL, return 0);
-	curl_mem_ctx->data= p_data;
+	/* Grow buffer geometrically to avoid reallocating for each chunk */
+	if(curl_mem_ctx->size+ realsize+ 1> curl_mem_ctx->capacity) {
+		size_t capacity= curl_mem_ctx->capacity> 0?
+				curl_mem_ctx->capacity* 2: TRACKER_BODY_SIZE_INI;
+		while(capacity< curl_mem_ctx->size+ realsize+ 1)
+			capacity*= 2;
+		p_data= (char*)realloc(curl_mem_ctx->data, capacity);
+		CHECK_DO(p_data!= NULL, return 0);
+		curl_mem_ctx->data= p_data;
+		curl_mem_ctx->capacity= capacity;
+	}
 
 	memcpy(&(curl_mem_ctx->data[curl_mem_ctx->size]), contents, realsize);
 	curl_mem_ctx->size+= realsize;
@@ -1281,9 +6272,513 @@ static size_t curl_write_body_callback(void *contents, size_t size,
 	return realsize;
 }
 
+/**
+ * Header callback used by our lib-curl handler to get the response
+ * entity-tag ('ETag' header-field).
+ * @param buffer Pointer to the header line (not NULL-terminated)
+ * @param size Always 1
+ * @param nitems Header line size in bytes
+ * @param userp private user data pointer
+ * @return total number of bytes processed.
+ */
+static size_t curl_header_callback(char *buffer, size_t size, size_t nitems,
+		void *userp)
+{
+	size_t realsize= size* nitems, etag_len;
+	curl_mem_ctx_t *curl_mem_ctx= (curl_mem_ctx_t*)userp;
+	u_char *p_etag, *p_end;
+
+	/* Check arguments */
+	if(buffer== NULL || curl_mem_ctx== NULL)
+		return 0;
+
+	if(realsize<= sizeof("ETag:")- 1 || ngx_strncasecmp((u_char*)buffer,
+			(u_char*)"ETag:", sizeof("ETag:")- 1)!= 0)
+		return realsize;
+
+	/* Trim value */
+	p_etag= (u_char*)buffer+ sizeof("ETag:")- 1;
+	p_end= (u_char*)buffer+ realsize;
+	while(p_etag< p_end && (*p_etag== ' ' || *p_etag== '\t'))
+		p_etag++;
+	while(p_end> p_etag && (p_end[-1]== '\r' || p_end[-1]== '\n' ||
+			p_end[-1]== ' '))
+		p_end--;
+	etag_len= p_end- p_etag;
+
+	/* Entity-tags exceeding our buffer are just ignored */
+	if(etag_len> 0 && etag_len< sizeof(curl_mem_ctx->etag))
+		ngx_cpystrn((u_char*)curl_mem_ctx->etag, p_etag, etag_len+ 1);
+
+	return realsize;
+}
+
+/**
+ * Tracker synchronization thread completion handler.
+ * This function is executed by the worker's event loop once the thread
+ * finished (successfully or not): the buckets activation window transition
+ * timer is armed for the table in use.
+ * @param ev Thread task event; its data is our private thread context
+ * structure (see 'sync_tracker_thr()').
+ */
 static void sync_tracker_thr_completion(ngx_event_t *ev)
 {
-	// We do not use this callback but it *must* be defined
-	// (It's not avoided to be NULL)
-	//LOGD(ev->log, "Tracker synchronization completed.\n");
+	ngx_log_t *ngx_log;
+	ngx_http_tcdn_webcache_main_conf_t *main_conf;
+
+	/* Check arguments */
+	if(ev== NULL || ev->data== NULL || (ngx_log= ev->log)== NULL)
+		return;
+
+	main_conf= *(ngx_http_tcdn_webcache_main_conf_t**)ev->data;
+	CHECK_DO(main_conf!= NULL, return);
+	LOGD(ngx_log, "Tracker synchronization completed.\n");
+
+	transition_timer_arm(main_conf, ngx_log);
+}
+
+/**
+ * Prepares a routing table before it is put in use: computes its signed
+ * URLs keys (see 'redir_key_compute()') and resolves its origin-servers and
+ * shields host-names, if they are resolved in the background (see
+ * 'tcdn_webcache_resolve_valid').
+ * Executed by the tracker synchronization thread.
+ * @param main_conf Module's main configuration context structure.
+ * @param routing_table Routing table to be prepared.
+ * @param ngx_log Nginx's log context structure.
+ * @return Status code NGX_OK on succeed, NGX_ERROR otherwise.
+ */
+static ngx_int_t routing_table_prepare(
+		ngx_http_tcdn_webcache_main_conf_t *main_conf,
+		tcdn_routing_table_t *routing_table, ngx_log_t *ngx_log)
+{
+	int failed;
+	struct timespec ts_curr= {0};
+
+	/* Check arguments */
+	if(main_conf== NULL || routing_table== NULL || ngx_log== NULL)
+		return NGX_ERROR;
+
+#if (NGX_OPENSSL)
+	/* Requests to buckets whose key could not be computed are denied */
+	failed= tcdn_routing_table_keys(routing_table,
+			sizeof(ngx_http_tcdn_webcache_redir_key_t), redir_key_compute,
+			ngx_log);
+	CHECK_DO(failed>= 0, return NGX_ERROR);
+	if(failed> 0)
+		ngx_log_error(NGX_LOG_WARN, ngx_log, 0, "Could not compute %d "
+				"buckets signed URLs keys\n", failed);
+#endif
+
+	if(main_conf->resolve_valid== 0)
+		return NGX_OK;
+
+	failed= tcdn_routing_table_resolve(routing_table, host_resolve, ngx_log);
+	CHECK_DO(failed>= 0, return NGX_ERROR);
+	if(failed> 0) {
+		ngx_log_error(NGX_LOG_WARN, ngx_log, 0, "Could not resolve %d "
+				"buckets host-names\n", failed);
+		if(main_conf->metrics!= NULL)
+			(void)ngx_atomic_fetch_add(&main_conf->metrics->resolve_failed,
+					failed);
+	}
+	CHECK_DO(clock_gettime(CLOCK_MONOTONIC, &ts_curr)== 0, return NGX_ERROR);
+	main_conf->resolve_monot_ts_secs= (uint64_t)ts_curr.tv_sec;
+	return NGX_OK;
+}
+
+/**
+ * Arms the buckets activation window transition timer for the next
+ * transition of the routing table in use (disarms it if there is none).
+ * Executed by the worker's event loop.
+ * @param main_conf Module's main configuration context structure.
+ * @param ngx_log Nginx's log context structure.
+ */
+static void transition_timer_arm(ngx_http_tcdn_webcache_main_conf_t *main_conf,
+		ngx_log_t *ngx_log)
+{
+	time_t transition_ts;
+	ngx_time_t *tp;
+	ngx_msec_t delay= 0;
+	ngx_thread_mutex_t *p_buckets_mutex;
+
+	/* Check arguments */
+	if(main_conf== NULL || ngx_log== NULL)
+		return;
+
+	p_buckets_mutex= &main_conf->routing_table_mutex;
+	ASSERT(ngx_thread_mutex_lock(p_buckets_mutex, ngx_log)== NGX_OK);
+	transition_ts= main_conf->routing_table_next_ts;
+	ASSERT(ngx_thread_mutex_unlock(p_buckets_mutex, ngx_log)== NGX_OK);
+
+	if(transition_ts== 0) {
+		if(main_conf->transition_timer.timer_set)
+			ngx_del_timer(&main_conf->transition_timer);
+		return;
+	}
+
+	/* Timer expires at the transition second (not before, so that the
+	 * transition is never anticipated) */
+	tp= ngx_timeofday();
+	if(transition_ts> tp->sec) {
+		delay= (ngx_msec_t)(transition_ts- tp->sec)* 1000- tp->msec;
+		if(delay> TRANSITION_DELAY_MAX)
+			delay= TRANSITION_DELAY_MAX;
+	}
+	LOGD(ngx_log, "Next buckets transition at %T (in %M msecs)\n",
+			transition_ts, delay);
+	main_conf->transition_timer.log= ngx_cycle->log;
+	ngx_add_timer(&main_conf->transition_timer, delay);
+}
+
+/**
+ * Buckets activation window transition timer handler.
+ * Executed by the worker's event loop: the routing table compiled in
+ * advance for the transition is put in use (no information is fetched nor
+ * compiled here), and the tracker synchronization thread is launched to
+ * compile the table for the following transition. If the timer expired
+ * before the transition (see 'TRANSITION_DELAY_MAX'), it is armed again.
+ * If the table for the transition was not compiled in time (e.g. the
+ * tracker was not reachable), the transition is left to the next periodic
+ * synchronization (never retried from here, so that the tracker is not
+ * flooded).
+ * @param ev Timer event; its data is the module's main configuration
+ * context structure.
+ */
+static void transition_timer_handler(ngx_event_t *ev)
+{
+	ngx_log_t *ngx_log;
+	ngx_http_tcdn_webcache_main_conf_t *main_conf;
+	ngx_thread_mutex_t *p_buckets_mutex, *p_sync_mutex;
+	tcdn_routing_table_t *routing_table_old= NULL;
+	register int routing_table_idx_new= -1;
+	int flag_pending, flag_compile;
+
+	/* Check arguments */
+	if(ev== NULL || (main_conf= ev->data)== NULL ||
+			(ngx_log= ev->log)== NULL)
+		return;
+
+	/* Timer cancelled: the worker process is exiting */
+	if(ngx_exiting)
+		return;
+
+	p_buckets_mutex= &main_conf->routing_table_mutex;
+	ASSERT(ngx_thread_mutex_lock(p_buckets_mutex, ngx_log)== NGX_OK);
+	if(main_conf->routing_table_next_ts!= 0 &&
+			ngx_time()>= main_conf->routing_table_next_ts &&
+			main_conf->routing_table_next!= NULL) {
+		routing_table_idx_new= (main_conf->routing_table_idx+ 1)%
+				ROUTING_TABLE_NUM;
+		routing_table_old= main_conf->routing_table[routing_table_idx_new];
+		main_conf->routing_table[routing_table_idx_new]=
+				main_conf->routing_table_next;
+		main_conf->routing_table_next= NULL;
+		main_conf->routing_table_idx= routing_table_idx_new;
+		main_conf->buckets_generation++;
+		main_conf->routing_table_next_ts= (time_t)
+				tcdn_routing_table_next_transition(
+						main_conf->routing_table[routing_table_idx_new]);
+	}
+	flag_pending= main_conf->routing_table_next!= NULL;
+	flag_compile= main_conf->routing_table_next_ts!= 0 && !flag_pending &&
+			(routing_table_idx_new>= 0 ||
+			ngx_time()< main_conf->routing_table_next_ts);
+	ASSERT(ngx_thread_mutex_unlock(p_buckets_mutex, ngx_log)== NGX_OK);
+
+	if(routing_table_idx_new>= 0) {
+		LOGD(ngx_log, "Buckets activation window transition\n");
+		tcdn_routing_table_release(&routing_table_old);
+		ngx_probe(tcdn_webcache, table__swap, routing_table_idx_new,
+				tcdn_routing_table_size(
+						main_conf->routing_table[routing_table_idx_new]));
+		METRICS_INC(main_conf, buckets_transitions);
+	}
+
+	/* The table for the next transition is compiled by the synchronization
+	 * thread (whose completion arms the timer again); if it is already
+	 * running, it will arm the timer anyway */
+	if(!flag_compile) {
+		if(flag_pending)
+			transition_timer_arm(main_conf, ngx_log);
+		return;
+	}
+	p_sync_mutex= &main_conf->sync_tracker_thr_mutex;
+	ASSERT(ngx_thread_mutex_lock(p_sync_mutex, ngx_log)== NGX_OK);
+	if(main_conf->flag_sync_tracker_locked== 0 &&
+			synchronize_buckets_information_launch_thread(main_conf,
+			ngx_log)!= NGX_OK)
+		ngx_log_error(NGX_LOG_ERR, ngx_log, 0, "Could not launch tracker "
+				"synchronization at buckets transition\n");
+	ASSERT(ngx_thread_mutex_unlock(p_sync_mutex, ngx_log)== NGX_OK);
+}
+
+/**
+ * Buckets host-names resolver (see 'tcdn_routing_table_resolve()'), run by
+ * the tracker synchronization thread: blocking system resolver (thus, it
+ * also honors '/etc/hosts'); the first address is used.
+ * @param host Host-name to be resolved.
+ * @param addr Output buffer of TCDN_ROUTING_ADDR_LEN_MAX bytes.
+ * @param opaque Log context structure.
+ * @return Zero on success, non-zero if the host-name can not be resolved.
+ */
+static int host_resolve(const char *host, char *addr, void *opaque)
+{
+	int ret_code;
+	struct addrinfo hints, *res= NULL;
+	ngx_log_t *ngx_log= (ngx_log_t*)opaque;
+
+	ngx_memzero(&hints, sizeof(hints));
+	hints.ai_family= AF_UNSPEC;
+	hints.ai_socktype= SOCK_STREAM;
+	hints.ai_flags= AI_ADDRCONFIG;
+	ret_code= getaddrinfo(host, NULL, &hints, &res);
+	if(ret_code!= 0 || res== NULL) {
+		ngx_log_error(NGX_LOG_WARN, ngx_log, 0, "Could not resolve '%s': %s\n",
+				host, gai_strerror(ret_code));
+		return -1;
+	}
+
+	if(res->ai_family== AF_INET6) {
+		addr[0]= '[';
+		ret_code= inet_ntop(AF_INET6,
+				&((struct sockaddr_in6*)res->ai_addr)->sin6_addr, addr+ 1,
+				TCDN_ROUTING_ADDR_LEN_MAX- 2)!= NULL? 0: -1;
+		if(ret_code== 0)
+			strcat(addr, "]");
+	} else {
+		ret_code= inet_ntop(AF_INET,
+				&((struct sockaddr_in*)res->ai_addr)->sin_addr, addr,
+				TCDN_ROUTING_ADDR_LEN_MAX)!= NULL? 0: -1;
+	}
+	freeaddrinfo(res);
+	LOGD(ngx_log, "Resolved '%s': %s\n", host, ret_code== 0? addr: "-");
+	return ret_code;
+}
+
+#if (NGX_OPENSSL)
+/**
+ * Buckets signed URLs key callback (see 'tcdn_routing_table_keys()'), run by
+ * the tracker synchronization thread: HMAC inner and outer hash states of
+ * the secret (secrets longer than the hash block are hashed first, as in
+ * RFC 2104). The key is a 'ngx_http_tcdn_webcache_redir_key_t' structure.
+ * @param secret Bucket's secret.
+ * @param secret_len Length of the secret.
+ * @param hash_type Bucket's signed URLs hash type.
+ * @param key Output key.
+ * @param opaque Log context structure.
+ * @return Zero on success, non-zero if the key can not be computed.
+ */
+static int redir_key_compute(const char *secret, size_t secret_len,
+		unsigned int hash_type, void *key, void *opaque)
+{
+	ngx_http_tcdn_webcache_redir_key_t *redir_key= key;
+	u_char block[REDIR_HMAC_BLOCK_SIZE], ipad[REDIR_HMAC_BLOCK_SIZE],
+			opad[REDIR_HMAC_BLOCK_SIZE];
+	size_t i;
+	int ok;
+
+	ngx_memzero(block, sizeof(block));
+	if(secret_len> sizeof(block)) {
+		if(hash_type== TCDN_ROUTING_REDIR_HASH_SHA256)
+			SHA256((const u_char*)secret, secret_len, block);
+		else
+			MD5((const u_char*)secret, secret_len, block);
+	} else {
+		ngx_memcpy(block, secret, secret_len);
+	}
+	for(i= 0; i< sizeof(block); i++) {
+		ipad[i]= block[i]^ 0x36;
+		opad[i]= block[i]^ 0x5c;
+	}
+
+	if(hash_type== TCDN_ROUTING_REDIR_HASH_SHA256) {
+		ok= SHA256_Init(&redir_key->inner.sha256) &&
+				SHA256_Update(&redir_key->inner.sha256, ipad, sizeof(ipad)) &&
+				SHA256_Init(&redir_key->outer.sha256) &&
+				SHA256_Update(&redir_key->outer.sha256, opad, sizeof(opad));
+	} else {
+		ok= MD5_Init(&redir_key->inner.md5) &&
+				MD5_Update(&redir_key->inner.md5, ipad, sizeof(ipad)) &&
+				MD5_Init(&redir_key->outer.md5) &&
+				MD5_Update(&redir_key->outer.md5, opad, sizeof(opad));
+	}
+
+	/* Secret derived data is not left on the stack */
+	OPENSSL_cleanse(block, sizeof(block));
+	OPENSSL_cleanse(ipad, sizeof(ipad));
+	OPENSSL_cleanse(opad, sizeof(opad));
+	return ok? 0: -1;
+}
+#endif
+
+/**
+ * Variable '$tcdn_lookup_time' getter (see 'ngx_http_tcdn_webcache_vars').
+ * @param r HTTP request context structure.
+ * @param v Variable value to be set.
+ * @param data Variable private data (not used).
+ * @return Status code NGX_OK on succeed, NGX_ERROR otherwise
+ * (see 'ngx_core.h').
+ */
+static ngx_int_t ngx_http_tcdn_webcache_lookup_time_variable(
+		ngx_http_request_t *r, ngx_http_variable_value_t *v, uintptr_t data)
+{
+	u_char *p;
+	ngx_http_tcdn_webcache_req_ctx_t *ctx;
+
+	ctx= ngx_http_tcdn_webcache_req_ctx_get(r);
+	if(ctx== NULL || ctx->lookup_time_usecs< 0) {
+		v->not_found= 1;
+		return NGX_OK;
+	}
+
+	p= ngx_pnalloc(r->pool, NGX_INT_T_LEN+ sizeof(".000000")- 1);
+	if(p== NULL)
+		return NGX_ERROR;
+
+	v->len= ngx_sprintf(p, "%i.%06i", ctx->lookup_time_usecs/ 1000000,
+			ctx->lookup_time_usecs% 1000000)- p;
+	v->valid= 1;
+	v->no_cacheable= 0;
+	v->not_found= 0;
+	v->data= p;
+	return NGX_OK;
+}
+
+/**
+ * Variable '$tcdn_table_generation' getter
+ * (see 'ngx_http_tcdn_webcache_vars').
+ * @param r HTTP request context structure.
+ * @param v Variable value to be set.
+ * @param data Variable private data (not used).
+ * @return Status code NGX_OK on succeed, NGX_ERROR otherwise
+ * (see 'ngx_core.h').
+ */
+static ngx_int_t ngx_http_tcdn_webcache_table_generation_variable(
+		ngx_http_request_t *r, ngx_http_variable_value_t *v, uintptr_t data)
+{
+	u_char *p;
+	ngx_http_tcdn_webcache_req_ctx_t *ctx;
+
+	ctx= ngx_http_tcdn_webcache_req_ctx_get(r);
+	if(ctx== NULL) {
+		v->not_found= 1;
+		return NGX_OK;
+	}
+
+	p= ngx_pnalloc(r->pool, NGX_INT_T_LEN);
+	if(p== NULL)
+		return NGX_ERROR;
+
+	v->len= ngx_sprintf(p, "%ui", ctx->table_generation)- p;
+	v->valid= 1;
+	v->no_cacheable= 0;
+	v->not_found= 0;
+	v->data= p;
+	return NGX_OK;
+}
+
+/**
+ * String variables ('$tcdn_bucket_id' and '$tcdn_origin') getter
+ * (see 'ngx_http_tcdn_webcache_vars').
+ * @param r HTTP request context structure.
+ * @param v Variable value to be set.
+ * @param data Offset of the 'ngx_str_t' field in the request context
+ * structure.
+ * @return Status code NGX_OK on succeed, NGX_ERROR otherwise
+ * (see 'ngx_core.h').
+ */
+static ngx_int_t ngx_http_tcdn_webcache_str_variable(ngx_http_request_t *r,
+		ngx_http_variable_value_t *v, uintptr_t data)
+{
+	ngx_str_t *str;
+	ngx_http_tcdn_webcache_req_ctx_t *ctx;
+
+	ctx= ngx_http_tcdn_webcache_req_ctx_get(r);
+	if(ctx== NULL) {
+		v->not_found= 1;
+		return NGX_OK;
+	}
+
+	str= (ngx_str_t*)((char*)ctx+ data);
+	if(str->len== 0) {
+		v->not_found= 1;
+		return NGX_OK;
+	}
+
+	v->len= str->len;
+	v->valid= 1;
+	v->no_cacheable= 0;
+	v->not_found= 0;
+	v->data= str->data;
+	return NGX_OK;
+}
+
+/**
+ * Variable '$tcdn_hop_next' getter (see 'ngx_http_tcdn_webcache_vars'):
+ * hop-count of the request plus one.
+ * @param r HTTP request context structure.
+ * @param v Variable value to be set.
+ * @param data Variable private data (not used).
+ * @return Status code NGX_OK on succeed, NGX_ERROR otherwise
+ * (see 'ngx_core.h').
+ */
+static ngx_int_t ngx_http_tcdn_webcache_hop_next_variable(
+		ngx_http_request_t *r, ngx_http_variable_value_t *v, uintptr_t data)
+{
+	u_char *p;
+	ngx_http_tcdn_webcache_req_ctx_t *ctx;
+
+	ctx= ngx_http_tcdn_webcache_req_ctx_get(r);
+	if(ctx== NULL) {
+		v->not_found= 1;
+		return NGX_OK;
+	}
+
+	p= ngx_pnalloc(r->pool, NGX_INT_T_LEN);
+	if(p== NULL)
+		return NGX_ERROR;
+
+	v->len= ngx_sprintf(p, "%ui", ctx->hop+ 1)- p;
+	v->valid= 1;
+	v->no_cacheable= 0;
+	v->not_found= 0;
+	v->data= p;
+	return NGX_OK;
+}
+
+/**
+ * Unsigned integer variables ('$tcdn_stale_while_revalidate',
+ * '$tcdn_stale_if_error' and '$tcdn_slice') getter (see
+ * 'ngx_http_tcdn_webcache_vars').
+ * @param r HTTP request context structure.
+ * @param v Variable value to be set.
+ * @param data Offset of the 'ngx_uint_t' field in the request context
+ * structure; the variable is not found if the field is zero.
+ * @return Status code NGX_OK on succeed, NGX_ERROR otherwise
+ * (see 'ngx_core.h').
+ */
+static ngx_int_t ngx_http_tcdn_webcache_uint_variable(ngx_http_request_t *r,
+		ngx_http_variable_value_t *v, uintptr_t data)
+{
+	u_char *p;
+	ngx_uint_t value;
+	ngx_http_tcdn_webcache_req_ctx_t *ctx;
+
+	ctx= ngx_http_tcdn_webcache_req_ctx_get(r);
+	if(ctx== NULL || (value= *(ngx_uint_t*)((char*)ctx+ data))== 0) {
+		v->not_found= 1;
+		return NGX_OK;
+	}
+
+	p= ngx_pnalloc(r->pool, NGX_INT_T_LEN);
+	if(p== NULL)
+		return NGX_ERROR;
+
+	v->len= ngx_sprintf(p, "%ui", value)- p;
+	v->valid= 1;
+	v->no_cacheable= 0;
+	v->not_found= 0;
+	v->data= p;
+	return NGX_OK;
 }
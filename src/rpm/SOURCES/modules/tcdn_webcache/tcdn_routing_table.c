@@ -0,0 +1,1492 @@
+/**
+ * @file tcdn_routing_table.c
+ * @brief Webcache buckets routing table implementation.
+ * @author Rafael Antoniello
+ */
+
+#include "tcdn_routing_table.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <stdint.h>
+#include <arpa/inet.h>
+#include <json-c/json.h>
+
+/* **** Definitions **** */
+
+/**
+ * Minimum hash index capacity (number of slots).
+ */
+#define HASH_CAPACITY_MIN 16
+
+/**
+ * Maximum JSON nesting depth accepted when parsing the buckets information.
+ * Actual buckets information is not nested deeper than 5 levels.
+ */
+#define JSON_DEPTH_MAX 32
+
+/**
+ * Lower-case conversion of an ASCII character.
+ */
+#define LOWER(C) (((C)>= 'A' && (C)<= 'Z')? (C)- 'A'+ 'a': (C))
+
+/**
+ * Upper-case conversion of an ASCII character.
+ */
+#define UPPER(C) (((C)>= 'a' && (C)<= 'z')? (C)- 'a'+ 'A': (C))
+
+/**
+ * ASCII letter check.
+ */
+#define IS_ALPHA(C) (((C)>= 'a' && (C)<= 'z') || ((C)>= 'A' && (C)<= 'Z'))
+
+/**
+ * Maximum length of a referer host-name (longer ones never match).
+ */
+#define REFERER_HOST_LEN_MAX 255
+
+/**
+ * Minimum capacity (number of elements) of the access policies arrays.
+ */
+#define ACCESS_ARRAY_CAPACITY_MIN 64
+
+/**
+ * Client address tries node flags: the node ends a prefix of the
+ * whitelist and/or of the blacklist.
+ */
+#define ACCESS_WHITELISTED 1
+#define ACCESS_BLACKLISTED 2
+
+/**
+ * Signing keys alignment (see 'tcdn_routing_table_keys()').
+ */
+#define KEY_ALIGN 16
+
+/**
+ * Client address binary trie node: a bit of the address prefix. Nodes are
+ * referenced by their index in the routing table's nodes array; index zero
+ * means no node.
+ */
+typedef struct access_node_s {
+	uint32_t child[2];
+	uint32_t flags;
+} access_node_t;
+
+/**
+ * Bucket access policy (see 'tcdn_routing_access_check()').
+ */
+struct tcdn_routing_access_s {
+	/**
+	 * Client address tries (IPv4 and IPv6) root nodes; zero if the bucket
+	 * has no address of the family. Nodes belong to the routing table.
+	 */
+	const access_node_t *nodes;
+	uint32_t root[2];
+	/**
+	 * Non-zero if the bucket has a whitelist.
+	 */
+	int whitelist;
+	/**
+	 * Referer host-names (lower-case, sorted), and whether requests without
+	 * referer are allowed ("none"). Non-zero 'referers_enforced' if the
+	 * bucket has a referer list.
+	 */
+	const char **referers;
+	size_t referers_first;
+	size_t referers_num;
+	int referers_none;
+	int referers_enforced;
+	/**
+	 * Allowed and denied country codes (upper-case, concatenated; e.g.
+	 * "ESPT"), as offsets in the access strings memory.
+	 */
+	const char *strings;
+	size_t allow_offset;
+	size_t allow_num;
+	size_t deny_offset;
+	size_t deny_num;
+};
+
+/**
+ * Host-name to be resolved (see 'tcdn_routing_table_resolve()'): an
+ * origin-server or shield host-name and its entry address buffer.
+ */
+typedef struct resolve_item_s {
+	const char *host;
+	char *addr;
+} resolve_item_t;
+
+/**
+ * Routing table context structure.
+ */
+struct tcdn_routing_table_s {
+	/**
+	 * Routing entries, in the buckets information order.
+	 */
+	tcdn_routing_entry_t *entries;
+	size_t entries_num;
+	/**
+	 * Hash index: open addressing (linear probing) table of 'capacity'
+	 * slots (power of 2). Each slot holds the entry index plus one (zero
+	 * means empty slot).
+	 */
+	uint32_t *slots;
+	size_t capacity;
+	/**
+	 * Strings memory (all the entries strings are stored here).
+	 */
+	char *strings;
+	/**
+	 * Number of buckets discarded (malformed or duplicated).
+	 */
+	size_t discarded;
+	/**
+	 * Next activation window transition time (zero if none; see
+	 * 'tcdn_routing_table_next_transition()').
+	 */
+	unsigned int next_transition;
+	/**
+	 * Access policies, one per entry (see 'tcdn_routing_access_check()').
+	 */
+	tcdn_routing_access_t *accesses;
+	/**
+	 * Access policies memory: client address tries nodes (node zero is not
+	 * used), referer host-names and access strings (referer host-names and
+	 * country codes). While compiling, referer host-names are offsets in
+	 * the access strings memory, as it may be reallocated.
+	 */
+	access_node_t *nodes;
+	size_t nodes_num, nodes_capacity;
+	const char **referers;
+	size_t referers_num, referers_capacity;
+	char *access_strings;
+	size_t access_strings_len, access_strings_capacity;
+	/**
+	 * Resolved addresses memory: two buffers of TCDN_ROUTING_ADDR_LEN_MAX
+	 * bytes (origin-server and shield) per entry; NULL until the table is
+	 * resolved.
+	 */
+	char *addrs;
+	/**
+	 * Signing keys memory (see 'tcdn_routing_table_keys()'); NULL until the
+	 * keys are computed.
+	 */
+	char *keys;
+};
+
+/* **** Prototypes **** */
+
+static int bucket_parse(struct json_object *jobj_bucket, int platform,
+		unsigned int now, tcdn_routing_entry_t *entry,
+		struct json_object **ref_jobj_node_tags,
+		unsigned int *ref_next_transition);
+static void transition_update(unsigned int *ref_next_transition,
+		unsigned int now, unsigned int date);
+static size_t node_tags_join(struct json_object *jobj_node_tags, char *out);
+static int origin_port_parse(struct json_object *jobj_port,
+		unsigned int *ref_port);
+static int server_parse(struct json_object *jobj_server,
+		const char **ref_host, size_t *ref_host_len, unsigned int *ref_port);
+static unsigned int uint_param_parse(struct json_object *jobj_params,
+		const char *key, unsigned int max);
+static size_t host_key_len(const char *host, size_t host_len);
+static uint32_t host_hash(const char *host, size_t host_len);
+static int host_equal(const char *host1, const char *host2, size_t len);
+static const tcdn_routing_entry_t* hash_find(
+		const tcdn_routing_table_t *routing_table, const char *host,
+		size_t host_len);
+static int access_compile(tcdn_routing_table_t *routing_table,
+		struct json_object *jobj_bucket, tcdn_routing_access_t *access);
+static int access_addresses_compile(tcdn_routing_table_t *routing_table,
+		tcdn_routing_access_t *access, struct json_object *jobj_list,
+		uint32_t flag);
+static uint32_t access_node_new(tcdn_routing_table_t *routing_table);
+static int access_referers_compile(tcdn_routing_table_t *routing_table,
+		tcdn_routing_access_t *access, struct json_object *jobj_list);
+static int access_countries_compile(tcdn_routing_table_t *routing_table,
+		struct json_object *jobj_list, size_t *ref_offset, size_t *ref_num);
+static int cidr_parse(const char *str, size_t len, unsigned char *addr,
+		size_t *ref_addr_len, unsigned int *ref_bits);
+static uint32_t access_addr_match(const tcdn_routing_access_t *access,
+		const unsigned char *addr, size_t addr_len);
+static int access_referer_match(const tcdn_routing_access_t *access,
+		const char *referer, size_t referer_len);
+static int access_country_match(const char *countries, size_t countries_num,
+		const char *country);
+static int referer_cmp(const void *p1, const void *p2);
+static int resolve_item_cmp(const void *p1, const void *p2);
+static void* array_reserve(void *array, size_t *ref_capacity, size_t num,
+		size_t elem_size);
+
+/* **** Implementations **** */
+
+tcdn_routing_table_t* tcdn_routing_table_compile_json(const char *buf,
+		size_t buf_size, int platform, unsigned int now)
+{
+	struct json_tokener *tok= NULL; // release-me (heap allocated)
+	struct json_object *jobj_buckets= NULL; // release-me (heap allocated)
+	tcdn_routing_table_t *routing_table= NULL;
+
+	/* Check arguments */
+	if(buf== NULL || buf_size== 0 || buf_size> INT32_MAX)
+		return NULL;
+
+	tok= json_tokener_new_ex(JSON_DEPTH_MAX);
+	if(tok== NULL)
+		goto end;
+
+	/* Parse (the whole text must be consumed; trailing garbage is an
+	 * error) */
+	jobj_buckets= json_tokener_parse_ex(tok, buf, (int)buf_size);
+	if(jobj_buckets== NULL ||
+			json_tokener_get_error(tok)!= json_tokener_success)
+		goto end;
+	while(tok->char_offset< (int)buf_size &&
+			(buf[tok->char_offset]== ' ' || buf[tok->char_offset]== '\t' ||
+			buf[tok->char_offset]== '\r' || buf[tok->char_offset]== '\n'))
+		tok->char_offset++;
+	if(tok->char_offset< (int)buf_size && buf[tok->char_offset]!= '\0')
+		goto end;
+
+	routing_table= tcdn_routing_table_compile(jobj_buckets, platform, now);
+end:
+	if(jobj_buckets!= NULL)
+		json_object_put(jobj_buckets);
+	if(tok!= NULL)
+		json_tokener_free(tok);
+	return routing_table;
+}
+
+tcdn_routing_table_t* tcdn_routing_table_compile(
+		struct json_object *jobj_buckets, int platform, unsigned int now)
+{
+	register size_t i, buckets_num, strings_size= 0;
+	char *p;
+	int end_code= -1;
+	tcdn_routing_table_t *routing_table= NULL;
+	struct json_object **jobj_node_tags= NULL; // release-me (heap allocated)
+
+	/* Check arguments */
+	if(jobj_buckets== NULL || !json_object_is_type(jobj_buckets,
+			json_type_array))
+		return NULL;
+
+	/* Allocate context structure */
+	routing_table= (tcdn_routing_table_t*)calloc(1, sizeof(
+			tcdn_routing_table_t));
+	if(routing_table== NULL)
+		goto end;
+
+	/* Allocate entries and hash index for the worst case (all the buckets
+	 * are routable); index is kept at most half-full */
+	buckets_num= json_object_array_length(jobj_buckets);
+	if(buckets_num>= UINT32_MAX/ 4)
+		goto end;
+	routing_table->entries= (tcdn_routing_entry_t*)calloc(
+			buckets_num> 0? buckets_num: 1, sizeof(tcdn_routing_entry_t));
+	if(routing_table->entries== NULL)
+		goto end;
+	routing_table->capacity= HASH_CAPACITY_MIN;
+	while(routing_table->capacity< 2* buckets_num)
+		routing_table->capacity<<= 1;
+	routing_table->slots= (uint32_t*)calloc(routing_table->capacity,
+			sizeof(uint32_t));
+	if(routing_table->slots== NULL)
+		goto end;
+	jobj_node_tags= (struct json_object**)calloc(
+			buckets_num> 0? buckets_num: 1, sizeof(struct json_object*));
+	if(jobj_node_tags== NULL)
+		goto end;
+	routing_table->accesses= (tcdn_routing_access_t*)calloc(
+			buckets_num> 0? buckets_num: 1, sizeof(tcdn_routing_access_t));
+	if(routing_table->accesses== NULL)
+		goto end;
+	routing_table->nodes_num= 1; // Node zero is not used
+
+	/* Parse buckets and index them. At this point entries strings point to
+	 * the JSON object memory */
+	for(i= 0; i< buckets_num; i++) {
+		register uint32_t slot, mask= routing_table->capacity- 1;
+		register size_t idx= routing_table->entries_num;
+		tcdn_routing_entry_t *entry= &routing_table->entries[idx];
+		const tcdn_routing_entry_t *entry_dup;
+		int ret_code= bucket_parse(json_object_array_get_idx(jobj_buckets,
+				i), platform, now, entry, &jobj_node_tags[idx],
+				&routing_table->next_transition);
+
+		if(ret_code> 0)
+			continue; // Not of the requested platform
+		if(ret_code< 0) {
+			routing_table->discarded++;
+			continue; // Malformed
+		}
+
+		/* Duplicated host-name: an active bucket replaces the inactive one
+		 * indexed (in place, so that the index is kept) */
+		if((entry_dup= hash_find(routing_table, entry->host,
+				entry->host_len))!= NULL) {
+			routing_table->discarded++;
+			if(entry_dup->active || !entry->active)
+				continue;
+			idx= entry_dup- routing_table->entries;
+			routing_table->entries[idx]= *entry;
+			jobj_node_tags[idx]= jobj_node_tags[routing_table->entries_num];
+			memset(&routing_table->accesses[idx], 0,
+					sizeof(tcdn_routing_access_t));
+			if(access_compile(routing_table, json_object_array_get_idx(
+					jobj_buckets, i), &routing_table->accesses[idx])!= 0)
+				goto end;
+			continue;
+		}
+		if(access_compile(routing_table, json_object_array_get_idx(
+				jobj_buckets, i), &routing_table->accesses[idx])!= 0)
+			goto end;
+
+		slot= host_hash(entry->host, entry->host_len)& mask;
+		while(routing_table->slots[slot]!= 0)
+			slot= (slot+ 1)& mask;
+		routing_table->slots[slot]= (uint32_t)idx+ 1;
+		routing_table->entries_num++;
+	}
+	for(i= 0; i< routing_table->entries_num; i++) {
+		tcdn_routing_entry_t *entry= &routing_table->entries[i];
+
+		strings_size+= entry->host_len+ entry->bucket_id_len+
+				entry->origin_host_len+ entry->node_tags_len+
+				entry->shield_host_len+ entry->redir_secret_len+ 6;
+	}
+
+	/* Copy strings to our own memory (host-names in lower-case) */
+	routing_table->strings= (char*)malloc(strings_size> 0? strings_size: 1);
+	if(routing_table->strings== NULL)
+		goto end;
+	p= routing_table->strings;
+	for(i= 0; i< routing_table->entries_num; i++) {
+		register size_t j;
+		tcdn_routing_entry_t *entry= &routing_table->entries[i];
+
+		for(j= 0; j< entry->host_len; j++)
+			p[j]= LOWER(entry->host[j]);
+		p[j]= '\0';
+		entry->host= p;
+		p+= entry->host_len+ 1;
+
+		memcpy(p, entry->bucket_id, entry->bucket_id_len);
+		p[entry->bucket_id_len]= '\0';
+		entry->bucket_id= p;
+		p+= entry->bucket_id_len+ 1;
+
+		memcpy(p, entry->origin_host, entry->origin_host_len);
+		p[entry->origin_host_len]= '\0';
+		entry->origin_host= p;
+		p+= entry->origin_host_len+ 1;
+
+		node_tags_join(jobj_node_tags[i], p);
+		p[entry->node_tags_len]= '\0';
+		entry->node_tags= p;
+		p+= entry->node_tags_len+ 1;
+
+		memcpy(p, entry->shield_host, entry->shield_host_len);
+		p[entry->shield_host_len]= '\0';
+		entry->shield_host= p;
+		p+= entry->shield_host_len+ 1;
+
+		memcpy(p, entry->redir_secret, entry->redir_secret_len);
+		p[entry->redir_secret_len]= '\0';
+		entry->redir_secret= p;
+		p+= entry->redir_secret_len+ 1;
+
+		entry->origin_addr= entry->shield_addr= ""; // Not resolved
+		entry->redir_key= NULL;
+	}
+
+	/* Resolve the access policies memory references (it is not reallocated
+	 * any more) */
+	for(i= 0; i< routing_table->referers_num; i++)
+		routing_table->referers[i]= routing_table->access_strings+
+				(uintptr_t)routing_table->referers[i];
+	for(i= 0; i< routing_table->entries_num; i++) {
+		tcdn_routing_access_t *access= &routing_table->accesses[i];
+
+		routing_table->entries[i].access= NULL;
+		if(access->root[0]== 0 && access->root[1]== 0 &&
+				!access->referers_enforced && access->allow_num== 0 &&
+				access->deny_num== 0)
+			continue; // No access policy
+		access->nodes= routing_table->nodes;
+		access->strings= routing_table->access_strings;
+		if(access->referers_num> 0) {
+			access->referers= &routing_table->referers[
+					access->referers_first];
+			qsort(access->referers, access->referers_num,
+					sizeof(const char*), referer_cmp);
+		}
+		routing_table->entries[i].access= access;
+	}
+
+	end_code= 0;
+end:
+	if(jobj_node_tags!= NULL)
+		free(jobj_node_tags);
+	if(end_code!= 0)
+		tcdn_routing_table_release(&routing_table);
+	return routing_table;
+}
+
+void tcdn_routing_table_release(tcdn_routing_table_t **ref_routing_table)
+{
+	tcdn_routing_table_t *routing_table;
+
+	if(ref_routing_table== NULL ||
+			(routing_table= *ref_routing_table)== NULL)
+		return;
+
+	if(routing_table->entries!= NULL)
+		free(routing_table->entries);
+	if(routing_table->slots!= NULL)
+		free(routing_table->slots);
+	if(routing_table->strings!= NULL)
+		free(routing_table->strings);
+	if(routing_table->accesses!= NULL)
+		free(routing_table->accesses);
+	if(routing_table->nodes!= NULL)
+		free(routing_table->nodes);
+	if(routing_table->referers!= NULL)
+		free(routing_table->referers);
+	if(routing_table->access_strings!= NULL)
+		free(routing_table->access_strings);
+	if(routing_table->addrs!= NULL)
+		free(routing_table->addrs);
+	if(routing_table->keys!= NULL)
+		free(routing_table->keys);
+	free(routing_table);
+	*ref_routing_table= NULL;
+}
+
+const tcdn_routing_entry_t* tcdn_routing_table_lookup(
+		const tcdn_routing_table_t *routing_table, const char *host,
+		size_t host_len)
+{
+	/* Check arguments */
+	if(routing_table== NULL || host== NULL)
+		return NULL;
+
+	host_len= host_key_len(host, host_len);
+	if(host_len== 0)
+		return NULL;
+
+	return hash_find(routing_table, host, host_len);
+}
+
+size_t tcdn_routing_table_size(const tcdn_routing_table_t *routing_table)
+{
+	return routing_table!= NULL? routing_table->entries_num: 0;
+}
+
+const tcdn_routing_entry_t* tcdn_routing_table_get(
+		const tcdn_routing_table_t *routing_table, size_t idx)
+{
+	if(routing_table== NULL || idx>= routing_table->entries_num)
+		return NULL;
+	return &routing_table->entries[idx];
+}
+
+int tcdn_routing_table_resolve(tcdn_routing_table_t *routing_table,
+		tcdn_routing_resolve_fxn_t resolve, void *opaque)
+{
+	register size_t i, items_num= 0;
+	int failed= 0;
+	resolve_item_t *items;
+
+	/* Check arguments */
+	if(routing_table== NULL || resolve== NULL)
+		return -1;
+	if(routing_table->entries_num== 0)
+		return 0;
+
+	if(routing_table->addrs== NULL) {
+		routing_table->addrs= (char*)malloc(routing_table->entries_num* 2*
+				TCDN_ROUTING_ADDR_LEN_MAX);
+		if(routing_table->addrs== NULL)
+			return -1;
+	}
+	items= (resolve_item_t*)malloc(routing_table->entries_num* 2*
+			sizeof(resolve_item_t));
+	if(items== NULL)
+		return -1;
+
+	/* Sort the host-names so that each distinct one is resolved once */
+	for(i= 0; i< routing_table->entries_num; i++) {
+		const tcdn_routing_entry_t *entry= &routing_table->entries[i];
+		char *addrs= &routing_table->addrs[2* i* TCDN_ROUTING_ADDR_LEN_MAX];
+
+		if(!entry->active)
+			continue; // Not to be proxied
+		items[items_num].host= entry->origin_host;
+		items[items_num++].addr= addrs;
+		if(entry->shield_host_len> 0) {
+			items[items_num].host= entry->shield_host;
+			items[items_num++].addr= addrs+ TCDN_ROUTING_ADDR_LEN_MAX;
+		}
+	}
+	qsort(items, items_num, sizeof(resolve_item_t), resolve_item_cmp);
+
+	for(i= 0; i< items_num; i++) {
+		char *addr= items[i].addr;
+
+		if(i> 0 && strcmp(items[i].host, items[i- 1].host)== 0) {
+			memcpy(addr, items[i- 1].addr, TCDN_ROUTING_ADDR_LEN_MAX);
+			continue;
+		}
+		addr[0]= '\0';
+		if(resolve(items[i].host, addr, opaque)!= 0) {
+			addr[0]= '\0';
+			failed++;
+		}
+		addr[TCDN_ROUTING_ADDR_LEN_MAX- 1]= '\0';
+	}
+	free(items);
+
+	for(i= 0; i< routing_table->entries_num; i++) {
+		tcdn_routing_entry_t *entry= &routing_table->entries[i];
+		char *addrs= &routing_table->addrs[2* i* TCDN_ROUTING_ADDR_LEN_MAX];
+
+		if(!entry->active)
+			continue;
+		entry->origin_addr= addrs;
+		entry->origin_addr_len= strlen(entry->origin_addr);
+		if(entry->shield_host_len> 0) {
+			entry->shield_addr= addrs+ TCDN_ROUTING_ADDR_LEN_MAX;
+			entry->shield_addr_len= strlen(entry->shield_addr);
+		}
+	}
+	return failed;
+}
+
+int tcdn_routing_table_keys(tcdn_routing_table_t *routing_table,
+		size_t key_size, tcdn_routing_key_fxn_t key, void *opaque)
+{
+	register size_t i, keys_num= 0;
+	int failed= 0;
+
+	/* Check arguments */
+	if(routing_table== NULL || key_size== 0 || key== NULL)
+		return -1;
+
+	for(i= 0; i< routing_table->entries_num; i++) {
+		tcdn_routing_entry_t *entry= &routing_table->entries[i];
+
+		entry->redir_key= NULL;
+		if(entry->active && entry->redir_secret_len> 0)
+			keys_num++;
+	}
+	if(routing_table->keys!= NULL) {
+		free(routing_table->keys);
+		routing_table->keys= NULL;
+	}
+	if(keys_num== 0)
+		return 0;
+
+	/* Allocate keys memory (malloc() memory is aligned for any type) */
+	key_size= (key_size+ KEY_ALIGN- 1)& ~((size_t)KEY_ALIGN- 1);
+	if(keys_num> SIZE_MAX/ key_size)
+		return -1;
+	routing_table->keys= (char*)calloc(keys_num, key_size);
+	if(routing_table->keys== NULL)
+		return -1;
+
+	for(i= 0, keys_num= 0; i< routing_table->entries_num; i++) {
+		tcdn_routing_entry_t *entry= &routing_table->entries[i];
+		char *p= &routing_table->keys[keys_num* key_size];
+
+		if(!entry->active || entry->redir_secret_len== 0)
+			continue; // Not signed, or not to be served
+		keys_num++;
+		if(key(entry->redir_secret, entry->redir_secret_len,
+				entry->redir_hash_type, p, opaque)!= 0) {
+			failed++;
+			continue;
+		}
+		entry->redir_key= p;
+	}
+	return failed;
+}
+
+size_t tcdn_routing_table_discarded(const tcdn_routing_table_t *routing_table)
+{
+	return routing_table!= NULL? routing_table->discarded: 0;
+}
+
+unsigned int tcdn_routing_table_next_transition(
+		const tcdn_routing_table_t *routing_table)
+{
+	return routing_table!= NULL? routing_table->next_transition: 0;
+}
+
+int tcdn_routing_access_check(const tcdn_routing_entry_t *entry,
+		const unsigned char *addr, size_t addr_len, const char *referer,
+		size_t referer_len, const char *country)
+{
+	const tcdn_routing_access_t *access;
+	uint32_t flags;
+
+	if(entry== NULL || (access= entry->access)== NULL)
+		return TCDN_ROUTING_ACCESS_ALLOWED;
+
+	/* Client address */
+	if(access->root[0]!= 0 || access->root[1]!= 0) {
+		flags= access_addr_match(access, addr, addr_len);
+		if((flags& ACCESS_BLACKLISTED) ||
+				(access->whitelist && !(flags& ACCESS_WHITELISTED)))
+			return TCDN_ROUTING_ACCESS_DENIED_ADDRESS;
+	}
+
+	/* Referer */
+	if(access->referers_enforced &&
+			!access_referer_match(access, referer, referer_len))
+		return TCDN_ROUTING_ACCESS_DENIED_REFERER;
+
+	/* Country (not checked if unknown) */
+	if(country!= NULL && IS_ALPHA(country[0]) && IS_ALPHA(country[1]) &&
+			country[2]== '\0') {
+		if(access_country_match(access->strings+ access->deny_offset,
+				access->deny_num, country) || (access->allow_num> 0 &&
+				!access_country_match(access->strings+ access->allow_offset,
+						access->allow_num, country)))
+			return TCDN_ROUTING_ACCESS_DENIED_GEOLOC;
+	}
+	return TCDN_ROUTING_ACCESS_ALLOWED;
+}
+
+/**
+ * Parses a bucket JSON object into a routing entry.
+ * Entry strings will point to the JSON object memory, except the node tags
+ * list (only its length is set; see 'node_tags_join()').
+ * @param jobj_bucket Bucket JSON object.
+ * @param platform Requested platform identifier.
+ * @param now Time the table is compiled for (seconds since the Epoch).
+ * @param entry Routing entry to be filled.
+ * @param ref_jobj_node_tags Reference to the bucket's node tags JSON array
+ * to be set (NULL if the bucket has no node tags).
+ * @param ref_next_transition Reference to the next activation window
+ * transition time, updated with the bucket's window if it is routable.
+ * @return 0 if the bucket is routable, 1 if it does not belong to the
+ * requested platform, -1 if it is malformed.
+ */
+static int bucket_parse(struct json_object *jobj_bucket, int platform,
+		unsigned int now, tcdn_routing_entry_t *entry,
+		struct json_object **ref_jobj_node_tags,
+		unsigned int *ref_next_transition)
+{
+	struct json_object *jobj_aux= NULL, *jobj_origin= NULL, *jobj_awa= NULL;
+	struct json_object *jobj_redir= NULL;
+	const char *str;
+	unsigned int start, end;
+
+	if(jobj_bucket== NULL || !json_object_is_type(jobj_bucket,
+			json_type_object))
+		return -1;
+
+	/* Platform */
+	if(!json_object_object_get_ex(jobj_bucket, "platform", &jobj_aux) ||
+			!json_object_is_type(jobj_aux, json_type_int) ||
+			json_object_get_int(jobj_aux)!= platform)
+		return 1;
+
+	/* Host-name */
+	if(!json_object_object_get_ex(jobj_bucket, "host", &jobj_aux) ||
+			!json_object_is_type(jobj_aux, json_type_string) ||
+			(entry->host_len= json_object_get_string_len(jobj_aux))== 0)
+		return -1;
+	entry->host= json_object_get_string(jobj_aux);
+	if(memchr(entry->host, '\0', entry->host_len)!= NULL ||
+			host_key_len(entry->host, entry->host_len)!= entry->host_len)
+		return -1; // Host-name would never match a host-header value
+
+	/* Bucket identifier (optional; integer or string) */
+	entry->bucket_id= "";
+	entry->bucket_id_len= 0;
+	if(json_object_object_get_ex(jobj_bucket, "id", &jobj_aux) &&
+			(json_object_is_type(jobj_aux, json_type_int) ||
+			json_object_is_type(jobj_aux, json_type_string)) &&
+			(str= json_object_get_string(jobj_aux))!= NULL) {
+		entry->bucket_id= str;
+		entry->bucket_id_len= strlen(str);
+	}
+
+	/* Origin-server: first entry of "awa_params.origins.origin_list" */
+	if(!json_object_object_get_ex(jobj_bucket, "awa_params", &jobj_awa) ||
+			!json_object_object_get_ex(jobj_awa, "origins", &jobj_aux) ||
+			!json_object_object_get_ex(jobj_aux, "origin_list", &jobj_aux) ||
+			!json_object_is_type(jobj_aux, json_type_array) ||
+			json_object_array_length(jobj_aux)== 0 ||
+			(jobj_origin= json_object_array_get_idx(jobj_aux, 0))== NULL)
+		return -1;
+	/* Origin-server TLS (optional; ignored if invalid); the default port is
+	 * then the HTTPS one */
+	entry->https= 0;
+	if(json_object_object_get_ex(jobj_bucket, "https", &jobj_aux) &&
+			json_object_object_get_ex(jobj_aux, "enabled", &jobj_aux) &&
+			json_object_is_type(jobj_aux, json_type_boolean))
+		entry->https= json_object_get_boolean(jobj_aux)? 1: 0;
+	entry->origin_port= entry->https? TCDN_ROUTING_ORIGIN_PORT_HTTPS_DEFAULT:
+			TCDN_ROUTING_ORIGIN_PORT_DEFAULT;
+	if(server_parse(jobj_origin, &entry->origin_host, &entry->origin_host_len,
+			&entry->origin_port)!= 0)
+		return -1;
+
+	/* Shield (optional; ignored if invalid) */
+	entry->shield_port= TCDN_ROUTING_ORIGIN_PORT_DEFAULT;
+	if(!json_object_object_get_ex(jobj_awa, "shield", &jobj_aux) ||
+			server_parse(jobj_aux, &entry->shield_host,
+					&entry->shield_host_len, &entry->shield_port)!= 0) {
+		entry->shield_host= "";
+		entry->shield_host_len= 0;
+		entry->shield_port= 0;
+	}
+
+	/* Stale windows, segments prefetch and slice size (optional; ignored if
+	 * invalid) */
+	entry->stale_while_revalidate= uint_param_parse(jobj_awa,
+			"stale_while_revalidate", TCDN_ROUTING_STALE_MAX);
+	entry->stale_if_error= uint_param_parse(jobj_awa, "stale_if_error",
+			TCDN_ROUTING_STALE_MAX);
+	entry->prefetch= uint_param_parse(jobj_awa, "prefetch",
+			TCDN_ROUTING_PREFETCH_MAX);
+	entry->slice= uint_param_parse(jobj_awa, "slice", TCDN_ROUTING_SLICE_MAX);
+	if(entry->slice< TCDN_ROUTING_SLICE_MIN)
+		entry->slice= 0;
+
+	/* Bandwidth limits (optional; ignored if invalid) */
+	entry->max_bandwidth= uint_param_parse(jobj_bucket, "max_bandwidth",
+			TCDN_ROUTING_BANDWIDTH_MAX);
+	entry->bwidth= uint_param_parse(jobj_bucket, "bwidth",
+			TCDN_ROUTING_BANDWIDTH_MAX);
+
+	/* Admission limits (optional; ignored if invalid) */
+	entry->max_connections= uint_param_parse(jobj_bucket, "max_connections",
+			TCDN_ROUTING_ADMISSION_MAX);
+	entry->max_request_rate= uint_param_parse(jobj_bucket,
+			"max_request_rate", TCDN_ROUTING_ADMISSION_MAX);
+
+	/* Last invalidation time (optional; ignored if invalid) */
+	entry->lastinvalidated= uint_param_parse(jobj_bucket, "lastinvalidated",
+			TCDN_ROUTING_TIMESTAMP_MAX);
+
+	/* Signed URLs (optional; requests are not signed if the secret is not
+	 * valid, other parameters ignored if invalid) */
+	entry->redir_secret= "";
+	entry->redir_secret_len= 0;
+	entry->redir_hash_type= TCDN_ROUTING_REDIR_HASH_MD5;
+	entry->redir_expires= 0;
+	if(json_object_object_get_ex(jobj_bucket, "redir", &jobj_redir) &&
+			json_object_object_get_ex(jobj_redir, "enabled", &jobj_aux) &&
+			json_object_is_type(jobj_aux, json_type_boolean) &&
+			json_object_get_boolean(jobj_aux) &&
+			json_object_object_get_ex(jobj_redir, "secret", &jobj_aux) &&
+			json_object_is_type(jobj_aux, json_type_string) &&
+			json_object_get_string_len(jobj_aux)> 0) {
+		entry->redir_secret= json_object_get_string(jobj_aux);
+		entry->redir_secret_len= json_object_get_string_len(jobj_aux);
+		entry->redir_hash_type= uint_param_parse(jobj_bucket,
+				"redir_hash_type", TCDN_ROUTING_REDIR_HASH_SHA256);
+		entry->redir_expires= uint_param_parse(jobj_redir, "expires",
+				TCDN_ROUTING_REDIR_EXPIRES_MAX);
+	}
+
+	/* Node tags (optional) */
+	*ref_jobj_node_tags= NULL;
+	if(json_object_object_get_ex(jobj_bucket, "node_tag", &jobj_aux) &&
+			json_object_object_get_ex(jobj_aux, "tag_list", &jobj_aux) &&
+			json_object_is_type(jobj_aux, json_type_array))
+		*ref_jobj_node_tags= jobj_aux;
+	entry->node_tags= "";
+	entry->node_tags_len= node_tags_join(*ref_jobj_node_tags, NULL);
+
+	/* Activation (optional; ignored if invalid). Disabled buckets never
+	 * change, whatever their window is */
+	entry->active= 0;
+	if(json_object_object_get_ex(jobj_bucket, "enabled", &jobj_aux) &&
+			json_object_is_type(jobj_aux, json_type_boolean) &&
+			!json_object_get_boolean(jobj_aux))
+		return 0;
+	start= uint_param_parse(jobj_bucket, "startdate",
+			TCDN_ROUTING_TIMESTAMP_MAX);
+	end= uint_param_parse(jobj_bucket, "enddate", TCDN_ROUTING_TIMESTAMP_MAX);
+	entry->active= start<= now && (end== 0 || now< end);
+	transition_update(ref_next_transition, now, start);
+	transition_update(ref_next_transition, now, end);
+
+	return 0;
+}
+
+/**
+ * Updates the next activation window transition time with a bucket's
+ * window start or end date.
+ * @param ref_next_transition Reference to the next transition time (zero if
+ * none yet).
+ * @param now Time the table is compiled for.
+ * @param date Window start or end date (zero if unbounded).
+ */
+static void transition_update(unsigned int *ref_next_transition,
+		unsigned int now, unsigned int date)
+{
+	if(date> now && (*ref_next_transition== 0 || date< *ref_next_transition))
+		*ref_next_transition= date;
+}
+
+/**
+ * Joins the valid node tags of a bucket as a comma-separated list.
+ * Non-string, empty or comma-containing tags are skipped.
+ * @param jobj_node_tags Node tags JSON array (may be NULL).
+ * @param out Output buffer (not NULL-terminated on return); may be NULL to
+ * just get the joined list length.
+ * @return Joined list length.
+ */
+static size_t node_tags_join(struct json_object *jobj_node_tags, char *out)
+{
+	register size_t i, len= 0;
+
+	if(jobj_node_tags== NULL)
+		return 0;
+
+	for(i= 0; i< json_object_array_length(jobj_node_tags); i++) {
+		struct json_object *jobj_tag= json_object_array_get_idx(
+				jobj_node_tags, i);
+		const char *tag;
+		size_t tag_len;
+
+		if(jobj_tag== NULL || !json_object_is_type(jobj_tag, json_type_string))
+			continue;
+		tag= json_object_get_string(jobj_tag);
+		tag_len= json_object_get_string_len(jobj_tag);
+		if(tag_len== 0 || memchr(tag, ',', tag_len)!= NULL ||
+				memchr(tag, '\0', tag_len)!= NULL)
+			continue;
+
+		if(len> 0) {
+			if(out!= NULL)
+				out[len]= ',';
+			len++;
+		}
+		if(out!= NULL)
+			memcpy(&out[len], tag, tag_len);
+		len+= tag_len;
+	}
+	return len;
+}
+
+/**
+ * Parses a server (origin-server or shield) JSON object: non-empty 'host'
+ * string and optional 'port'.
+ * Host string will point to the JSON object memory.
+ * @param jobj_server Server JSON object.
+ * @param ref_host Reference to the host to be set.
+ * @param ref_host_len Reference to the host length to be set.
+ * @param ref_port Reference to the port to be set (holding the default port
+ * on input; left unchanged if not specified).
+ * @return 0 on success, -1 if the server is not valid.
+ */
+static int server_parse(struct json_object *jobj_server,
+		const char **ref_host, size_t *ref_host_len, unsigned int *ref_port)
+{
+	struct json_object *jobj_aux= NULL;
+
+	if(jobj_server== NULL ||
+			!json_object_object_get_ex(jobj_server, "host", &jobj_aux) ||
+			!json_object_is_type(jobj_aux, json_type_string) ||
+			(*ref_host_len= json_object_get_string_len(jobj_aux))== 0)
+		return -1;
+	*ref_host= json_object_get_string(jobj_aux);
+	if(memchr(*ref_host, '\0', *ref_host_len)!= NULL)
+		return -1;
+
+	if(json_object_object_get_ex(jobj_server, "port", &jobj_aux) &&
+			origin_port_parse(jobj_aux, ref_port)!= 0)
+		return -1;
+	return 0;
+}
+
+/**
+ * Parses a bucket unsigned integer parameter (JSON integer), e.g. a stale
+ * window in seconds.
+ * @param jobj_params JSON object holding the parameter (bucket or bucket's
+ * 'awa_params').
+ * @param key Parameter name.
+ * @param max Maximum valid value.
+ * @return The parameter value; zero if it is not specified or not valid.
+ */
+static unsigned int uint_param_parse(struct json_object *jobj_params,
+		const char *key, unsigned int max)
+{
+	struct json_object *jobj_aux= NULL;
+	int64_t value;
+
+	if(!json_object_object_get_ex(jobj_params, key, &jobj_aux) ||
+			!json_object_is_type(jobj_aux, json_type_int))
+		return 0;
+	value= json_object_get_int64(jobj_aux);
+	if(value< 0 || value> max)
+		return 0;
+	return (unsigned int)value;
+}
+
+/**
+ * Parses origin-server port (JSON integer or decimal string).
+ * @param jobj_port Port JSON object.
+ * @param ref_port Reference to the port value to be set.
+ * @return 0 on success, -1 if the port is not valid.
+ */
+static int origin_port_parse(struct json_object *jobj_port,
+		unsigned int *ref_port)
+{
+	int64_t port= 0;
+
+	if(json_object_is_type(jobj_port, json_type_int)) {
+		port= json_object_get_int64(jobj_port);
+	} else if(json_object_is_type(jobj_port, json_type_string)) {
+		const char *str= json_object_get_string(jobj_port);
+		int len= json_object_get_string_len(jobj_port);
+		register int i;
+
+		if(len<= 0 || len> 5)
+			return -1;
+		for(i= 0; i< len; i++) {
+			if(str[i]< '0' || str[i]> '9')
+				return -1;
+			port= port* 10+ (str[i]- '0');
+		}
+	} else {
+		return -1;
+	}
+
+	if(port<= 0 || port> 65535)
+		return -1;
+	*ref_port= (unsigned int)port;
+	return 0;
+}
+
+/**
+ * Get the length of the host-name part of a host-header value (that is,
+ * excluding an eventual ":port" suffix).
+ * @param host Host-header value.
+ * @param host_len Host-header value length.
+ * @return Host-name length.
+ */
+static size_t host_key_len(const char *host, size_t host_len)
+{
+	const char *p;
+
+	/* IPv6 literal (e.g. "[::1]:8080") */
+	if(host_len> 0 && host[0]== '[') {
+		p= memchr(host, ']', host_len);
+		return p!= NULL? (size_t)(p- host)+ 1: host_len;
+	}
+
+	p= memchr(host, ':', host_len);
+	return p!= NULL? (size_t)(p- host): host_len;
+}
+
+/**
+ * Case-insensitive host-name hash (32-bit FNV-1a).
+ */
+static uint32_t host_hash(const char *host, size_t host_len)
+{
+	register size_t i;
+	register uint32_t hash= 2166136261u;
+
+	for(i= 0; i< host_len; i++) {
+		hash^= (uint8_t)LOWER(host[i]);
+		hash*= 16777619u;
+	}
+	return hash;
+}
+
+/**
+ * Case-insensitive host-names comparison.
+ * @return Non-zero if equal.
+ */
+static int host_equal(const char *host1, const char *host2, size_t len)
+{
+	register size_t i;
+
+	for(i= 0; i< len; i++) {
+		if(LOWER(host1[i])!= LOWER(host2[i]))
+			return 0;
+	}
+	return 1;
+}
+
+/**
+ * Finds the entry of a given host-name in the hash index.
+ */
+static const tcdn_routing_entry_t* hash_find(
+		const tcdn_routing_table_t *routing_table, const char *host,
+		size_t host_len)
+{
+	register uint32_t slot, mask= routing_table->capacity- 1;
+
+	slot= host_hash(host, host_len)& mask;
+	while(routing_table->slots[slot]!= 0) {
+		const tcdn_routing_entry_t *entry=
+				&routing_table->entries[routing_table->slots[slot]- 1];
+		if(entry->host_len== host_len &&
+				host_equal(entry->host, host, host_len))
+			return entry;
+		slot= (slot+ 1)& mask;
+	}
+	return NULL;
+}
+
+/**
+ * Compiles the access policy of a bucket: client address lists into binary
+ * tries, referer list into a (later sorted) host-names array, and countries
+ * lists into country codes strings.
+ * Lists are optional; non-array lists and invalid elements are ignored.
+ * @param routing_table Routing table being compiled.
+ * @param jobj_bucket Bucket JSON object.
+ * @param access Access policy to be filled (zeroed).
+ * @return 0 on success, -1 if memory allocation fails.
+ */
+static int access_compile(tcdn_routing_table_t *routing_table,
+		struct json_object *jobj_bucket, tcdn_routing_access_t *access)
+{
+	struct json_object *jobj_list= NULL;
+	int num;
+
+	if(json_object_object_get_ex(jobj_bucket, "blacklist", &jobj_list) &&
+			access_addresses_compile(routing_table, access, jobj_list,
+					ACCESS_BLACKLISTED)< 0)
+		return -1;
+	if(json_object_object_get_ex(jobj_bucket, "whitelist", &jobj_list)) {
+		if((num= access_addresses_compile(routing_table, access, jobj_list,
+				ACCESS_WHITELISTED))< 0)
+			return -1;
+		access->whitelist= num> 0;
+	}
+
+	if(json_object_object_get_ex(jobj_bucket, "referer", &jobj_list) &&
+			access_referers_compile(routing_table, access, jobj_list)!= 0)
+		return -1;
+
+	if(json_object_object_get_ex(jobj_bucket, "geoloc-allow", &jobj_list) &&
+			access_countries_compile(routing_table, jobj_list,
+					&access->allow_offset, &access->allow_num)!= 0)
+		return -1;
+	if(json_object_object_get_ex(jobj_bucket, "geoloc-deny", &jobj_list) &&
+			access_countries_compile(routing_table, jobj_list,
+					&access->deny_offset, &access->deny_num)!= 0)
+		return -1;
+	return 0;
+}
+
+/**
+ * Inserts a client address list (IPv4/IPv6 addresses or CIDR prefixes)
+ * into the bucket's tries.
+ * @param routing_table Routing table being compiled.
+ * @param access Bucket access policy.
+ * @param jobj_list Addresses JSON array.
+ * @param flag List flag ('ACCESS_WHITELISTED' or 'ACCESS_BLACKLISTED').
+ * @return Number of valid addresses inserted, -1 if memory allocation
+ * fails.
+ */
+static int access_addresses_compile(tcdn_routing_table_t *routing_table,
+		tcdn_routing_access_t *access, struct json_object *jobj_list,
+		uint32_t flag)
+{
+	register size_t i;
+	register unsigned int bit;
+	int num= 0;
+
+	if(!json_object_is_type(jobj_list, json_type_array))
+		return 0;
+
+	for(i= 0; i< json_object_array_length(jobj_list); i++) {
+		struct json_object *jobj_addr= json_object_array_get_idx(jobj_list,
+				i);
+		unsigned char addr[16];
+		size_t addr_len;
+		unsigned int bits;
+		uint32_t node, *ref_root;
+
+		if(jobj_addr== NULL || !json_object_is_type(jobj_addr,
+				json_type_string) ||
+				cidr_parse(json_object_get_string(jobj_addr),
+						json_object_get_string_len(jobj_addr), addr,
+						&addr_len, &bits)!= 0)
+			continue;
+
+		/* Walk down the prefix bits, adding the missing nodes (the nodes
+		 * array may be reallocated: nodes are referenced by index) */
+		ref_root= &access->root[addr_len== 4? 0: 1];
+		if(*ref_root== 0 && (*ref_root= access_node_new(routing_table))== 0)
+			return -1;
+		node= *ref_root;
+		for(bit= 0; bit< bits; bit++) {
+			unsigned int b= (addr[bit>> 3]>> (7- (bit& 7)))& 1;
+			uint32_t child= routing_table->nodes[node].child[b];
+
+			if(child== 0) {
+				if((child= access_node_new(routing_table))== 0)
+					return -1;
+				routing_table->nodes[node].child[b]= child;
+			}
+			node= child;
+		}
+		routing_table->nodes[node].flags|= flag;
+		num++;
+	}
+	return num;
+}
+
+/**
+ * Allocates a client address tries node (zeroed).
+ * @param routing_table Routing table being compiled.
+ * @return Node index, 0 if memory allocation fails.
+ */
+static uint32_t access_node_new(tcdn_routing_table_t *routing_table)
+{
+	access_node_t *nodes;
+
+	if(routing_table->nodes_num>= UINT32_MAX)
+		return 0;
+	nodes= array_reserve(routing_table->nodes,
+			&routing_table->nodes_capacity, routing_table->nodes_num+ 1,
+			sizeof(access_node_t));
+	if(nodes== NULL)
+		return 0;
+	routing_table->nodes= nodes;
+	memset(&nodes[routing_table->nodes_num], 0, sizeof(access_node_t));
+	return (uint32_t)routing_table->nodes_num++;
+}
+
+/**
+ * Adds a referer list to the bucket's access policy. Valid elements are
+ * "none" (requests without referer are allowed), and host-names made of
+ * letters, digits, '-', '_' and '.', optionally prefixed by "*." (any
+ * sub-domain).
+ * @param routing_table Routing table being compiled.
+ * @param access Bucket access policy.
+ * @param jobj_list Referers JSON array.
+ * @return 0 on success, -1 if memory allocation fails.
+ */
+static int access_referers_compile(tcdn_routing_table_t *routing_table,
+		tcdn_routing_access_t *access, struct json_object *jobj_list)
+{
+	register size_t i, j;
+
+	if(!json_object_is_type(jobj_list, json_type_array))
+		return 0;
+
+	access->referers_first= routing_table->referers_num;
+	for(i= 0; i< json_object_array_length(jobj_list); i++) {
+		struct json_object *jobj_referer= json_object_array_get_idx(
+				jobj_list, i);
+		const char *host, **referers;
+		char *strings;
+		size_t host_len;
+
+		if(jobj_referer== NULL || !json_object_is_type(jobj_referer,
+				json_type_string))
+			continue;
+		host= json_object_get_string(jobj_referer);
+		host_len= json_object_get_string_len(jobj_referer);
+		if(host_len== 4 && strncasecmp(host, "none", 4)== 0) {
+			access->referers_none= 1;
+			continue;
+		}
+		if(host_len== 0 || host_len> REFERER_HOST_LEN_MAX)
+			continue;
+		for(j= (host_len> 2 && host[0]== '*' && host[1]== '.')? 1: 0;
+				j< host_len; j++) {
+			char c= host[j];
+			if(!IS_ALPHA(c) && !(c>= '0' && c<= '9') && c!= '-' &&
+					c!= '_' && c!= '.')
+				break;
+		}
+		if(j< host_len)
+			continue; // Invalid character
+
+		strings= array_reserve(routing_table->access_strings,
+				&routing_table->access_strings_capacity,
+				routing_table->access_strings_len+ host_len+ 1, 1);
+		if(strings== NULL)
+			return -1;
+		routing_table->access_strings= strings;
+		referers= array_reserve(routing_table->referers,
+				&routing_table->referers_capacity,
+				routing_table->referers_num+ 1, sizeof(const char*));
+		if(referers== NULL)
+			return -1;
+		routing_table->referers= referers;
+
+		strings+= routing_table->access_strings_len;
+		for(j= 0; j< host_len; j++)
+			strings[j]= LOWER(host[j]);
+		strings[host_len]= '\0';
+		referers[routing_table->referers_num++]= (const char*)(uintptr_t)
+				routing_table->access_strings_len;
+		routing_table->access_strings_len+= host_len+ 1;
+		access->referers_num++;
+	}
+	access->referers_enforced= access->referers_num> 0 ||
+			access->referers_none;
+	return 0;
+}
+
+/**
+ * Compiles a countries list (ISO 3166 two-letter codes) into a country
+ * codes string (upper-case, concatenated).
+ * @param routing_table Routing table being compiled.
+ * @param jobj_list Countries JSON array.
+ * @param ref_offset Reference to the string offset, in the access strings
+ * memory, to be set.
+ * @param ref_num Reference to the number of valid country codes to be set.
+ * @return 0 on success, -1 if memory allocation fails.
+ */
+static int access_countries_compile(tcdn_routing_table_t *routing_table,
+		struct json_object *jobj_list, size_t *ref_offset, size_t *ref_num)
+{
+	register size_t i;
+
+	if(!json_object_is_type(jobj_list, json_type_array))
+		return 0;
+
+	*ref_offset= routing_table->access_strings_len;
+	for(i= 0; i< json_object_array_length(jobj_list); i++) {
+		struct json_object *jobj_country= json_object_array_get_idx(
+				jobj_list, i);
+		const char *country;
+		char *strings;
+
+		if(jobj_country== NULL || !json_object_is_type(jobj_country,
+				json_type_string) ||
+				json_object_get_string_len(jobj_country)!= 2)
+			continue;
+		country= json_object_get_string(jobj_country);
+		if(!IS_ALPHA(country[0]) || !IS_ALPHA(country[1]))
+			continue;
+
+		strings= array_reserve(routing_table->access_strings,
+				&routing_table->access_strings_capacity,
+				routing_table->access_strings_len+ 2, 1);
+		if(strings== NULL)
+			return -1;
+		routing_table->access_strings= strings;
+		strings[routing_table->access_strings_len++]= UPPER(country[0]);
+		strings[routing_table->access_strings_len++]= UPPER(country[1]);
+		(*ref_num)++;
+	}
+	return 0;
+}
+
+/**
+ * Parses an IPv4/IPv6 address or CIDR prefix (e.g. "10.0.0.0/8" or
+ * "2001:db8::/32"). IPv4-mapped IPv6 prefixes are converted to IPv4.
+ * @param str Address string (not necessarily NULL-terminated).
+ * @param len Address string length.
+ * @param addr Address buffer (at least 16 bytes).
+ * @param ref_addr_len Reference to the address length to be set (4 or 16).
+ * @param ref_bits Reference to the prefix length, in bits, to be set.
+ * @return 0 on success, -1 if the address is not valid.
+ */
+static int cidr_parse(const char *str, size_t len, unsigned char *addr,
+		size_t *ref_addr_len, unsigned int *ref_bits)
+{
+	char buf[INET6_ADDRSTRLEN+ 1];
+	const char *slash= memchr(str, '/', len);
+	size_t addr_str_len= slash!= NULL? (size_t)(slash- str): len;
+	unsigned int bits;
+	register size_t i;
+	static const unsigned char v4mapped[12]= {
+			0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0xff, 0xff
+	};
+
+	if(addr_str_len== 0 || addr_str_len>= sizeof(buf) ||
+			memchr(str, '\0', len)!= NULL)
+		return -1;
+	memcpy(buf, str, addr_str_len);
+	buf[addr_str_len]= '\0';
+	if(memchr(buf, ':', addr_str_len)!= NULL) {
+		if(inet_pton(AF_INET6, buf, addr)!= 1)
+			return -1;
+		*ref_addr_len= 16;
+	} else {
+		if(inet_pton(AF_INET, buf, addr)!= 1)
+			return -1;
+		*ref_addr_len= 4;
+	}
+
+	bits= (unsigned int)*ref_addr_len* 8;
+	if(slash!= NULL) {
+		size_t bits_len= len- addr_str_len- 1;
+
+		if(bits_len== 0 || bits_len> 3)
+			return -1;
+		for(i= 0, bits= 0; i< bits_len; i++) {
+			if(slash[1+ i]< '0' || slash[1+ i]> '9')
+				return -1;
+			bits= bits* 10+ (slash[1+ i]- '0');
+		}
+		if(bits> *ref_addr_len* 8)
+			return -1;
+	}
+
+	if(*ref_addr_len== 16 && bits>= 96 &&
+			memcmp(addr, v4mapped, sizeof(v4mapped))== 0) {
+		memmove(addr, &addr[12], 4);
+		*ref_addr_len= 4;
+		bits-= 96;
+	}
+	*ref_bits= bits;
+	return 0;
+}
+
+/**
+ * Walks down the client address trie of its family.
+ * @return Flags of all the matching prefixes ('ACCESS_WHITELISTED' and/or
+ * 'ACCESS_BLACKLISTED'); zero if none matches.
+ */
+static uint32_t access_addr_match(const tcdn_routing_access_t *access,
+		const unsigned char *addr, size_t addr_len)
+{
+	register unsigned int bit, bits;
+	register uint32_t node, flags= 0;
+
+	if(addr== NULL || (addr_len!= 4 && addr_len!= 16))
+		return 0;
+
+	bits= (unsigned int)addr_len* 8;
+	node= access->root[addr_len== 4? 0: 1];
+	for(bit= 0; node!= 0; bit++) {
+		flags|= access->nodes[node].flags;
+		if(bit== bits)
+			break;
+		node= access->nodes[node].child[(addr[bit>> 3]>> (7- (bit& 7)))& 1];
+	}
+	return flags;
+}
+
+/**
+ * Matches a referer header-field value against the bucket's referer
+ * host-names: the exact host-name, then the wildcard of each parent
+ * domain (e.g. "*.example.com" for "www.example.com").
+ * @return Non-zero if allowed.
+ */
+static int access_referer_match(const tcdn_routing_access_t *access,
+		const char *referer, size_t referer_len)
+{
+	char key[1+ REFERER_HOST_LEN_MAX+ 1], c;
+	const char *host, *p, *end, *pkey;
+	register size_t i, host_len;
+
+	if(referer== NULL)
+		return access->referers_none;
+	if(access->referers_num== 0)
+		return 0;
+
+	/* Skip the scheme (e.g. "https://") and user information; the
+	 * host-name ends at the port, path, query or fragment */
+	end= referer+ referer_len;
+	host= referer;
+	for(p= referer; p+ 2< end && p- referer< 16; p++) {
+		if(p[0]== ':' && p[1]== '/' && p[2]== '/') {
+			host= p+ 3;
+			break;
+		}
+	}
+	for(p= host; p< end && *p!= '/' && *p!= '?' && *p!= '#'; p++) {
+		if(*p== '@')
+			host= p+ 1;
+	}
+	for(end= p, p= host; p< end && *p!= ':'; p++)
+		;
+	host_len= p- host;
+	if(host_len== 0 || host_len> REFERER_HOST_LEN_MAX)
+		return 0;
+
+	key[0]= '*';
+	for(i= 0; i< host_len; i++)
+		key[1+ i]= LOWER(host[i]);
+	key[1+ host_len]= '\0';
+
+	pkey= &key[1];
+	if(bsearch(&pkey, access->referers, access->referers_num,
+			sizeof(const char*), referer_cmp)!= NULL)
+		return 1;
+	for(i= 0; i< host_len; i++) {
+		if(key[1+ i]!= '.')
+			continue;
+		c= key[i];
+		key[i]= '*';
+		pkey= &key[i];
+		p= bsearch(&pkey, access->referers, access->referers_num,
+				sizeof(const char*), referer_cmp);
+		key[i]= c;
+		if(p!= NULL)
+			return 1;
+	}
+	return 0;
+}
+
+/**
+ * Finds a country code (case-insensitive) in a country codes string.
+ * @return Non-zero if found.
+ */
+static int access_country_match(const char *countries, size_t countries_num,
+		const char *country)
+{
+	register size_t i;
+
+	for(i= 0; i< countries_num; i++) {
+		if(countries[2* i]== UPPER(country[0]) &&
+				countries[2* i+ 1]== UPPER(country[1]))
+			return 1;
+	}
+	return 0;
+}
+
+/**
+ * Referer host-names comparison (for sorting and binary search).
+ */
+static int referer_cmp(const void *p1, const void *p2)
+{
+	return strcmp(*(const char* const*)p1, *(const char* const*)p2);
+}
+
+/**
+ * Resolve items comparison (by host-name, for sorting).
+ */
+static int resolve_item_cmp(const void *p1, const void *p2)
+{
+	return strcmp(((const resolve_item_t*)p1)->host,
+			((const resolve_item_t*)p2)->host);
+}
+
+/**
+ * Ensures the capacity of a growing array (doubled as needed).
+ * @param array Array (NULL if not allocated yet).
+ * @param ref_capacity Reference to the array capacity, in elements, to be
+ * updated.
+ * @param num Required number of elements.
+ * @param elem_size Element size.
+ * @return The (possibly reallocated) array, NULL if memory allocation
+ * fails (then the array is not released).
+ */
+static void* array_reserve(void *array, size_t *ref_capacity, size_t num,
+		size_t elem_size)
+{
+	size_t capacity= *ref_capacity;
+
+	if(num<= capacity && array!= NULL)
+		return array;
+	if(capacity< ACCESS_ARRAY_CAPACITY_MIN)
+		capacity= ACCESS_ARRAY_CAPACITY_MIN;
+	while(capacity< num)
+		capacity<<= 1;
+	array= realloc(array, capacity* elem_size);
+	if(array!= NULL)
+		*ref_capacity= capacity;
+	return array;
+}
@@ -0,0 +1,472 @@
+/**
+ * @file tcdn_routing_table.h
+ * @brief Webcache buckets routing table public interface.
+ * The routing table is compiled from the tracker's buckets information JSON
+ * and maps HTTP host-header values to the bucket's origin-server.
+ * This module does not depend on Nginx (only on json-c), so it can be unit
+ * tested and fuzzed in isolation (see 'utests/').
+ * Routing semantics (the "reference linear scan"):
+ * - only buckets of the requested platform are considered;
+ * - a bucket is routable if its 'host' is a non-empty host-name string (with
+ * no ":port" suffix) and the first entry of 'awa_params.origins.origin_list'
+ * has a non-empty 'host' and a valid (or missing, then 80; or 443 if the
+ * bucket is fetched over TLS) 'port';
+ * - host-names are matched exactly, case-insensitively, ignoring an eventual
+ * ":port" suffix of the host-header;
+ * - a table is compiled for a given time: a bucket is active if it is
+ * enabled ('enabled' is optional: values that are not booleans are ignored)
+ * and the time is in its activation window ('startdate' inclusive and
+ * 'enddate' exclusive, in seconds since the Epoch; both optional: zero or
+ * values that are not integers in the range [0, TCDN_ROUTING_TIMESTAMP_MAX]
+ * are ignored, the window is then unbounded). Inactive buckets are routed
+ * too, so that their requests can be failed at once;
+ * - if several routable buckets declare the same host, the first active one
+ * in the buckets information array wins (or the first one, if none of them
+ * is active);
+ * - the bucket's node tags ('node_tag.tag_list') are optional: non-string,
+ * empty or comma-containing tags are ignored;
+ * - the bucket's shield ('awa_params.shield': a parent webcache with the
+ * same 'host' and 'port' syntax as the origins) is optional: an invalid
+ * shield is ignored (the bucket is routed directly to the origin);
+ * - the bucket's stale windows ('awa_params.stale_while_revalidate' and
+ * 'awa_params.stale_if_error', in seconds) are optional: values that are
+ * not integers in the range [0, TCDN_ROUTING_STALE_MAX] are ignored (the
+ * window is disabled);
+ * - the bucket's segments prefetch ('awa_params.prefetch': number of next
+ * numbered media segments to be prefetched) is optional: values that are
+ * not integers in the range [0, TCDN_ROUTING_PREFETCH_MAX] are ignored
+ * (prefetch is disabled);
+ * - the bucket's slice size ('awa_params.slice', in bytes) is optional:
+ * values that are not integers in the range [TCDN_ROUTING_SLICE_MIN,
+ * TCDN_ROUTING_SLICE_MAX] are ignored (objects are cached whole);
+ * - the bucket's bandwidth limits ('max_bandwidth': whole bucket, and
+ * 'bwidth': per connection; both in kbit/s) are optional: values that are
+ * not integers in the range [0, TCDN_ROUTING_BANDWIDTH_MAX] are ignored
+ * (the bandwidth is not limited);
+ * - the bucket's admission limits ('max_connections': requests in progress,
+ * and 'max_request_rate': requests per second; both per node) are optional:
+ * values that are not integers in the range [0, TCDN_ROUTING_ADMISSION_MAX]
+ * are ignored (requests are not limited);
+ * - the bucket's last invalidation time ('lastinvalidated', in seconds since
+ * the Epoch) is optional: values that are not integers in the range
+ * [0, TCDN_ROUTING_TIMESTAMP_MAX] are ignored (never invalidated);
+ * - the bucket's origin-server TLS ('https.enabled') is optional: values that
+ * are not booleans are ignored (the origin is fetched over plain HTTP);
+ * - the bucket's signed URLs ('redir') are optional: requests are to be
+ * signed if 'redir.enabled' is true and 'redir.secret' is a non-empty
+ * string (see 'tcdn_routing_table_keys()'). The token maximum lifetime
+ * ('redir.expires', in seconds) is ignored if it is not an integer in the
+ * range [0, TCDN_ROUTING_REDIR_EXPIRES_MAX] (lifetime is not bounded), and
+ * the hash type ('redir_hash_type') if it is not TCDN_ROUTING_REDIR_HASH_MD5
+ * nor TCDN_ROUTING_REDIR_HASH_SHA256 (HMAC-MD5 is used);
+ * - the bucket's access policy is optional (see
+ * 'tcdn_routing_access_check()'): 'blacklist' and 'whitelist' are arrays of
+ * client IPv4/IPv6 addresses or CIDR prefixes (e.g. "10.0.0.0/8"),
+ * 'referer' is an array of referer host-names, either exact (e.g.
+ * "example.com") or wildcard (e.g. "*.example.com", any sub-domain), or
+ * "none" (requests without referer), and 'geoloc-allow' and 'geoloc-deny'
+ * are arrays of ISO 3166 two-letter country codes. Invalid elements are
+ * ignored (a list with no valid element is not enforced).
+ * The origin-servers and shields host-names may be resolved into numeric
+ * addresses once the table is compiled (see 'tcdn_routing_table_resolve()'),
+ * and the signed URLs keys precomputed (see 'tcdn_routing_table_keys()').
+ * A compiled (and resolved) table is immutable; thus, it can be safely read
+ * by several threads. It is valid until the next activation window
+ * transition of its buckets (see 'tcdn_routing_table_next_transition()'),
+ * when the table compiled for that time is to be used instead: requests
+ * never evaluate the activation windows.
+ * @author Rafael Antoniello
+ */
+
+#ifndef TCDN_WEBCACHE_TCDN_ROUTING_TABLE_H_
+#define TCDN_WEBCACHE_TCDN_ROUTING_TABLE_H_
+
+#include <stddef.h>
+
+/* **** Definitions **** */
+
+/* Forward definitions */
+typedef struct tcdn_routing_table_s tcdn_routing_table_t;
+typedef struct tcdn_routing_access_s tcdn_routing_access_t;
+struct json_object;
+
+/**
+ * Default origin-server port (used if not specified in the bucket).
+ */
+#define TCDN_ROUTING_ORIGIN_PORT_DEFAULT 80
+
+/**
+ * Default origin-server port of the buckets fetched over TLS.
+ */
+#define TCDN_ROUTING_ORIGIN_PORT_HTTPS_DEFAULT 443
+
+/**
+ * Maximum stale window of a bucket, in seconds (one week).
+ */
+#define TCDN_ROUTING_STALE_MAX (7* 24* 3600)
+
+/**
+ * Maximum number of next media segments to be prefetched per request.
+ */
+#define TCDN_ROUTING_PREFETCH_MAX 8
+
+/**
+ * Minimum and maximum byte-range slice size of a bucket, in bytes (64 KiB
+ * and 64 MiB).
+ */
+#define TCDN_ROUTING_SLICE_MIN (64* 1024)
+#define TCDN_ROUTING_SLICE_MAX (64* 1024* 1024)
+
+/**
+ * Maximum bandwidth limit of a bucket, in kbit/s (100 Gbit/s).
+ */
+#define TCDN_ROUTING_BANDWIDTH_MAX (100* 1000* 1000)
+
+/**
+ * Maximum admission limit of a bucket (connections, or requests per
+ * second).
+ */
+#define TCDN_ROUTING_ADMISSION_MAX (1000* 1000)
+
+/**
+ * Maximum timestamp of a bucket, in seconds since the Epoch.
+ */
+#define TCDN_ROUTING_TIMESTAMP_MAX 0xffffffffU
+
+/**
+ * Maximum signed URLs token lifetime of a bucket, in seconds (one year).
+ */
+#define TCDN_ROUTING_REDIR_EXPIRES_MAX (365* 24* 3600)
+
+/**
+ * Signed URLs hash types ('redir_hash_type'): HMAC-MD5 and HMAC-SHA256.
+ */
+#define TCDN_ROUTING_REDIR_HASH_MD5 0
+#define TCDN_ROUTING_REDIR_HASH_SHA256 1
+
+/**
+ * Maximum length of a resolved numeric address, including the brackets of
+ * IPv6 addresses and the NULL-terminating character (see
+ * 'tcdn_routing_table_resolve()').
+ */
+#define TCDN_ROUTING_ADDR_LEN_MAX 48
+
+/**
+ * Access check results (see 'tcdn_routing_access_check()').
+ */
+#define TCDN_ROUTING_ACCESS_ALLOWED 0
+#define TCDN_ROUTING_ACCESS_DENIED_ADDRESS 1
+#define TCDN_ROUTING_ACCESS_DENIED_REFERER 2
+#define TCDN_ROUTING_ACCESS_DENIED_GEOLOC 3
+
+/**
+ * Routing table entry.
+ * All the strings are NULL-terminated and owned by the routing table.
+ */
+typedef struct tcdn_routing_entry_s {
+	/**
+	 * Bucket host-name (lower-case).
+	 */
+	const char *host;
+	size_t host_len;
+	/**
+	 * Bucket identifier; empty string if not specified.
+	 */
+	const char *bucket_id;
+	size_t bucket_id_len;
+	/**
+	 * Origin-server host.
+	 */
+	const char *origin_host;
+	size_t origin_host_len;
+	/**
+	 * Origin-server port.
+	 */
+	unsigned int origin_port;
+	/**
+	 * Non-zero if the origin-server is fetched over TLS.
+	 */
+	int https;
+	/**
+	 * Non-zero if the bucket is active at the time the table was compiled
+	 * for; requests to inactive buckets are not to be served.
+	 */
+	int active;
+	/**
+	 * Bucket's node tags, as a comma-separated list (e.g. "tag1,tag2");
+	 * empty string if the bucket has no node tags.
+	 */
+	const char *node_tags;
+	size_t node_tags_len;
+	/**
+	 * Shield (parent webcache) host; empty string if the bucket has no
+	 * shield.
+	 */
+	const char *shield_host;
+	size_t shield_host_len;
+	/**
+	 * Shield port (zero if the bucket has no shield).
+	 */
+	unsigned int shield_port;
+	/**
+	 * Seconds an expired cached object is served while it is refreshed in
+	 * the background (zero if disabled).
+	 */
+	unsigned int stale_while_revalidate;
+	/**
+	 * Seconds an expired cached object is served if the origin-server
+	 * fails (zero if disabled).
+	 */
+	unsigned int stale_if_error;
+	/**
+	 * Number of next media segments to be prefetched when a numbered
+	 * segment is requested (zero if disabled).
+	 */
+	unsigned int prefetch;
+	/**
+	 * Size in bytes of the byte-range slices large objects are fetched and
+	 * cached in (zero if objects are cached whole).
+	 */
+	unsigned int slice;
+	/**
+	 * Bandwidth limit of all the bucket's responses of a node, in kbit/s
+	 * (zero if not limited).
+	 */
+	unsigned int max_bandwidth;
+	/**
+	 * Bandwidth limit of each bucket's response, in kbit/s (zero if not
+	 * limited).
+	 */
+	unsigned int bwidth;
+	/**
+	 * Maximum number of the bucket's requests in progress in a node (zero
+	 * if not limited).
+	 */
+	unsigned int max_connections;
+	/**
+	 * Maximum number of the bucket's requests per second in a node (zero if
+	 * not limited).
+	 */
+	unsigned int max_request_rate;
+	/**
+	 * Time the bucket's cached objects were last invalidated, in seconds
+	 * since the Epoch (zero if never invalidated).
+	 */
+	unsigned int lastinvalidated;
+	/**
+	 * Secret the bucket's URLs are signed with; empty string if requests are
+	 * not signed.
+	 */
+	const char *redir_secret;
+	size_t redir_secret_len;
+	/**
+	 * Signed URLs hash type (TCDN_ROUTING_REDIR_HASH_MD5 or
+	 * TCDN_ROUTING_REDIR_HASH_SHA256).
+	 */
+	unsigned int redir_hash_type;
+	/**
+	 * Signed URLs token maximum lifetime, in seconds (zero if not bounded).
+	 */
+	unsigned int redir_expires;
+	/**
+	 * Signing key, as precomputed from the secret by
+	 * 'tcdn_routing_table_keys()' (opaque to the table); NULL if requests
+	 * are not signed or if the key was not computed.
+	 */
+	const void *redir_key;
+	/**
+	 * Compiled access policy (opaque; see 'tcdn_routing_access_check()');
+	 * NULL if the bucket has none.
+	 */
+	const tcdn_routing_access_t *access;
+	/**
+	 * Origin-server and shield numeric addresses (e.g. "192.0.2.1" or
+	 * "[2001:db8::1]"), as resolved by 'tcdn_routing_table_resolve()'; empty
+	 * strings if not resolved.
+	 */
+	const char *origin_addr;
+	size_t origin_addr_len;
+	const char *shield_addr;
+	size_t shield_addr_len;
+	// Reserved for future use: add other bucket parameters here
+} tcdn_routing_entry_t;
+
+/**
+ * Host-name resolver callback (see 'tcdn_routing_table_resolve()').
+ * @param host Host-name to be resolved (NULL-terminated).
+ * @param addr Output buffer of TCDN_ROUTING_ADDR_LEN_MAX bytes: numeric
+ * address the host-name resolves to (NULL-terminated; IPv6 addresses
+ * enclosed in brackets).
+ * @param opaque Callback private data.
+ * @return Zero on success, non-zero if the host-name can not be resolved.
+ */
+typedef int (*tcdn_routing_resolve_fxn_t)(const char *host, char *addr,
+		void *opaque);
+
+/**
+ * Signing key callback (see 'tcdn_routing_table_keys()').
+ * @param secret Bucket's secret (NULL-terminated).
+ * @param secret_len Length of the secret.
+ * @param hash_type Bucket's signed URLs hash type.
+ * @param key Output buffer of the requested key size.
+ * @param opaque Callback private data.
+ * @return Zero on success, non-zero if the key can not be computed.
+ */
+typedef int (*tcdn_routing_key_fxn_t)(const char *secret, size_t secret_len,
+		unsigned int hash_type, void *key, void *opaque);
+
+/* **** Prototypes **** */
+
+/**
+ * Compiles a routing table from the buckets information JSON text.
+ * @param buf Buckets information JSON text (an array of buckets). It does
+ * not need to be NULL-terminated.
+ * @param buf_size Size in bytes of the JSON text.
+ * @param platform Platform identifier of the buckets to be compiled.
+ * @param now Time the table is compiled for, in seconds since the Epoch
+ * (buckets activation windows are evaluated at this time).
+ * @return Pointer to the compiled routing table on success, NULL if the
+ * JSON text is malformed or is not an array, or if memory allocation fails.
+ * Release with 'tcdn_routing_table_release()'.
+ */
+tcdn_routing_table_t* tcdn_routing_table_compile_json(const char *buf,
+		size_t buf_size, int platform, unsigned int now);
+
+/**
+ * Compiles a routing table from an already parsed buckets information JSON.
+ * @param jobj_buckets JSON array of buckets.
+ * @param platform Platform identifier of the buckets to be compiled.
+ * @param now Time the table is compiled for, in seconds since the Epoch.
+ * @return Pointer to the compiled routing table on success, NULL if the
+ * JSON object is not an array or if memory allocation fails.
+ * Release with 'tcdn_routing_table_release()'.
+ */
+tcdn_routing_table_t* tcdn_routing_table_compile(
+		struct json_object *jobj_buckets, int platform, unsigned int now);
+
+/**
+ * Release routing table previously obtained in a call to
+ * 'tcdn_routing_table_compile()' or 'tcdn_routing_table_compile_json()'.
+ * @param ref_routing_table Reference to the pointer to the routing table to
+ * be released. Pointer is set to NULL on return.
+ */
+void tcdn_routing_table_release(tcdn_routing_table_t **ref_routing_table);
+
+/**
+ * Looks-up the routing entry corresponding to the given HTTP host-header.
+ * @param routing_table Routing table.
+ * @param host HTTP host-header value (not necessarily NULL-terminated; it
+ * may include a ":port" suffix).
+ * @param host_len Length of the host-header value.
+ * @return Pointer to the routing entry (valid while the routing table is not
+ * released), or NULL if no bucket matches.
+ */
+const tcdn_routing_entry_t* tcdn_routing_table_lookup(
+		const tcdn_routing_table_t *routing_table, const char *host,
+		size_t host_len);
+
+/**
+ * Get the number of entries (routable buckets) of the routing table.
+ * @param routing_table Routing table.
+ * @return Number of entries.
+ */
+size_t tcdn_routing_table_size(const tcdn_routing_table_t *routing_table);
+
+/**
+ * Get the routing table entry of a given index.
+ * Entries are kept in the same order as in the buckets information.
+ * @param routing_table Routing table.
+ * @param idx Entry index in the range [0.. tcdn_routing_table_size()- 1].
+ * @return Pointer to the routing entry, or NULL if the index is out of range.
+ */
+const tcdn_routing_entry_t* tcdn_routing_table_get(
+		const tcdn_routing_table_t *routing_table, size_t idx);
+
+/**
+ * Resolves the origin-servers and shields host-names of the active entries
+ * of a routing table into numeric addresses (see
+ * 'tcdn_routing_entry_t::origin_addr'). The resolver is called once per
+ * distinct host-name, in the caller's thread (it may block). As the table
+ * is modified, it must be called before the table is shared with other
+ * threads. Inactive entries are left with empty addresses.
+ * @param routing_table Routing table.
+ * @param resolve Resolver callback.
+ * @param opaque Resolver callback private data.
+ * @return Number of distinct host-names that could not be resolved (their
+ * entries are left with empty addresses), or -1 if the arguments are
+ * invalid or if memory allocation fails.
+ */
+int tcdn_routing_table_resolve(tcdn_routing_table_t *routing_table,
+		tcdn_routing_resolve_fxn_t resolve, void *opaque);
+
+/**
+ * Precomputes the signing keys of the active entries whose requests are
+ * signed (see 'tcdn_routing_entry_t::redir_key'), so that their secrets are
+ * not processed per request. The callback is called once per entry, in the
+ * caller's thread; keys are stored in the table memory (suitably aligned
+ * for any type). As the table is modified, it must be called before the
+ * table is shared with other threads.
+ * @param routing_table Routing table.
+ * @param key_size Size in bytes of each key.
+ * @param key Signing key callback.
+ * @param opaque Signing key callback private data.
+ * @return Number of keys that could not be computed (their entries are left
+ * without key), or -1 if the arguments are invalid or if memory allocation
+ * fails.
+ */
+int tcdn_routing_table_keys(tcdn_routing_table_t *routing_table,
+		size_t key_size, tcdn_routing_key_fxn_t key, void *opaque);
+
+/**
+ * Get the number of buckets of the requested platform that were discarded
+ * because they are malformed (e.g. missing host or origin) or duplicated.
+ * @param routing_table Routing table.
+ * @return Number of discarded buckets.
+ */
+size_t tcdn_routing_table_discarded(const tcdn_routing_table_t *routing_table);
+
+/**
+ * Get the time the routing table is valid until: the earliest start or end
+ * of an activation window of an enabled bucket after the time the table was
+ * compiled for. The table compiled for that time is to be used from then on.
+ * @param routing_table Routing table.
+ * @return Next transition time, in seconds since the Epoch; zero if the
+ * table is valid forever.
+ */
+unsigned int tcdn_routing_table_next_transition(
+		const tcdn_routing_table_t *routing_table);
+
+/**
+ * Checks a request against the access policy of its bucket. Checks are, in
+ * order:
+ * - client address: denied if it matches the 'blacklist', or if the bucket
+ * has a 'whitelist' and it does not match it (longest prefix walk of a
+ * binary trie: at most 32 or 128 steps);
+ * - referer: if the bucket has a 'referer' list, denied if the referer
+ * host-name matches none of its host-names (binary search of the exact
+ * host-name and of the wildcard of each parent domain), or if there is no
+ * referer and the list does not include "none";
+ * - country: denied if it is in 'geoloc-deny', or if the bucket has a
+ * 'geoloc-allow' list and it is not in it. Not checked if the country is
+ * unknown.
+ * @param entry Routing entry (the bucket).
+ * @param addr Client IP address, in network byte order (IPv4-mapped IPv6
+ * addresses should be given as IPv4).
+ * @param addr_len Client IP address length: 4 (IPv4) or 16 (IPv6); other
+ * lengths never match the address lists.
+ * @param referer Referer header-field value (not necessarily
+ * NULL-terminated; e.g. "https://www.example.com/page"), NULL if the
+ * request has none.
+ * @param referer_len Length of the referer header-field value.
+ * @param country Client ISO 3166 two-letter country code (NULL-terminated),
+ * NULL if unknown.
+ * @return TCDN_ROUTING_ACCESS_ALLOWED if the request is allowed (or the
+ * bucket has no access policy), otherwise the reason of the denial
+ * (TCDN_ROUTING_ACCESS_DENIED_ADDRESS, TCDN_ROUTING_ACCESS_DENIED_REFERER or
+ * TCDN_ROUTING_ACCESS_DENIED_GEOLOC).
+ */
+int tcdn_routing_access_check(const tcdn_routing_entry_t *entry,
+		const unsigned char *addr, size_t addr_len, const char *referer,
+		size_t referer_len, const char *country);
+
+#endif /* TCDN_WEBCACHE_TCDN_ROUTING_TABLE_H_ */
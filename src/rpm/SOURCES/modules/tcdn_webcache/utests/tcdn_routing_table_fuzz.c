@@ -0,0 +1,189 @@
+/**
+ * @file tcdn_routing_table_fuzz.c
+ * @brief Routing table compiler fuzzing harness.
+ * Feeds arbitrary bytes, as tracker's buckets information, to the routing
+ * table compiler and checks the compiled table invariants:
+ * - every entry is found by its own host-name (also in upper-case and with a
+ * ":port" suffix);
+ * - entries are well-formed (non-empty host-names and origin-servers, valid
+ * ports, no empty node tags, valid shields, bounded stale windows,
+ * segments prefetch, slice sizes, bandwidth and admission limits, and
+ * invalidation times, signed URLs parameters), also once resolved and
+ * with their signing keys computed (inactive buckets are not);
+ * - the next activation window transition is later than the compilation
+ * time;
+ * - access checks of arbitrary requests do not fail.
+ * Build with libFuzzer ('make fuzz') or, defining 'FUZZ_STANDALONE_MAIN',
+ * as a standalone program reading the input from a file or the standard
+ * input, suitable for AFL ('make fuzz-afl') or for replaying crashes.
+ * @author Rafael Antoniello
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "tcdn_routing_table.h"
+
+/* **** Definitions **** */
+
+#define PLATFORM 8
+#define NOW 1500000000U
+
+#define CHECK(COND) \
+	if(!(COND)) {\
+		fprintf(stderr, "%s:%d: Invariant failed: %s\n", __FILE__, __LINE__,\
+				#COND);\
+		abort();\
+	}
+
+/* **** Prototypes **** */
+
+int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size);
+static int resolve_stub(const char *host, char *addr, void *opaque);
+static int key_stub(const char *secret, size_t secret_len,
+		unsigned int hash_type, void *key, void *opaque);
+
+/* **** Implementations **** */
+
+int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size)
+{
+	register size_t i, j;
+	tcdn_routing_table_t *routing_table;
+
+	routing_table= tcdn_routing_table_compile_json((const char*)data, size,
+			PLATFORM, NOW);
+	if(routing_table== NULL)
+		return 0;
+	CHECK(tcdn_routing_table_next_transition(routing_table)== 0 ||
+			tcdn_routing_table_next_transition(routing_table)> NOW);
+	CHECK(tcdn_routing_table_resolve(routing_table, resolve_stub, NULL)>= 0);
+	CHECK(tcdn_routing_table_keys(routing_table, sizeof(uint64_t), key_stub,
+			NULL)>= 0);
+
+	for(i= 0; i< tcdn_routing_table_size(routing_table); i++) {
+		char host[512];
+		const tcdn_routing_entry_t *entry= tcdn_routing_table_get(
+				routing_table, i);
+
+		CHECK(entry!= NULL);
+		CHECK(entry->host_len> 0 && strlen(entry->host)== entry->host_len);
+		CHECK(strlen(entry->bucket_id)== entry->bucket_id_len);
+		CHECK(entry->origin_host_len> 0 &&
+				strlen(entry->origin_host)== entry->origin_host_len);
+		CHECK(entry->origin_port> 0 && entry->origin_port<= 65535);
+		CHECK(entry->https== 0 || entry->https== 1);
+		CHECK(entry->active== 0 || entry->active== 1);
+		CHECK(strlen(entry->node_tags)== entry->node_tags_len);
+		CHECK(entry->node_tags_len== 0 || (entry->node_tags[0]!= ',' &&
+				entry->node_tags[entry->node_tags_len- 1]!= ',' &&
+				strstr(entry->node_tags, ",,")== NULL));
+		CHECK(strlen(entry->shield_host)== entry->shield_host_len);
+		CHECK((entry->shield_host_len> 0)== (entry->shield_port> 0));
+		CHECK(entry->shield_port<= 65535);
+		CHECK(entry->stale_while_revalidate<= TCDN_ROUTING_STALE_MAX);
+		CHECK(entry->stale_if_error<= TCDN_ROUTING_STALE_MAX);
+		CHECK(entry->prefetch<= TCDN_ROUTING_PREFETCH_MAX);
+		CHECK(entry->slice== 0 || (entry->slice>= TCDN_ROUTING_SLICE_MIN &&
+				entry->slice<= TCDN_ROUTING_SLICE_MAX));
+		CHECK(entry->max_bandwidth<= TCDN_ROUTING_BANDWIDTH_MAX);
+		CHECK(entry->bwidth<= TCDN_ROUTING_BANDWIDTH_MAX);
+		CHECK(entry->max_connections<= TCDN_ROUTING_ADMISSION_MAX);
+		CHECK(entry->max_request_rate<= TCDN_ROUTING_ADMISSION_MAX);
+		CHECK(entry->lastinvalidated<= TCDN_ROUTING_TIMESTAMP_MAX);
+		CHECK(entry->redir_secret!= NULL);
+		CHECK(entry->redir_secret_len> 0 || (entry->redir_hash_type== 0 &&
+				entry->redir_expires== 0));
+		CHECK(entry->redir_hash_type<= TCDN_ROUTING_REDIR_HASH_SHA256);
+		CHECK(entry->redir_expires<= TCDN_ROUTING_REDIR_EXPIRES_MAX);
+		CHECK(entry->redir_key== NULL || (entry->active &&
+				entry->redir_secret_len> 0 &&
+				*(const uint64_t*)entry->redir_key== entry->redir_secret_len));
+		CHECK(strlen(entry->origin_addr)== entry->origin_addr_len);
+		CHECK(strlen(entry->shield_addr)== entry->shield_addr_len);
+		CHECK(entry->shield_host_len> 0 || entry->shield_addr_len== 0);
+		CHECK(entry->active || (entry->origin_addr_len== 0 &&
+				entry->shield_addr_len== 0));
+		CHECK(tcdn_routing_table_lookup(routing_table, entry->host,
+				entry->host_len)== entry);
+		CHECK(tcdn_routing_access_check(entry, data, size> 16? 16: size,
+				(const char*)data, size, NULL)<=
+				TCDN_ROUTING_ACCESS_DENIED_GEOLOC);
+		CHECK(tcdn_routing_access_check(entry, data, 4, NULL, 0, "ES")<=
+				TCDN_ROUTING_ACCESS_DENIED_GEOLOC);
+
+		if(entry->host_len+ sizeof(":8080")> sizeof(host))
+			continue;
+		for(j= 0; j< entry->host_len; j++) {
+			char c= entry->host[j];
+			CHECK(!(c>= 'A' && c<= 'Z'));
+			host[j]= (c>= 'a' && c<= 'z')? c- 'a'+ 'A': c;
+		}
+		memcpy(&host[j], ":8080", sizeof(":8080"));
+		CHECK(tcdn_routing_table_lookup(routing_table, host,
+				entry->host_len+ sizeof(":8080")- 1)== entry);
+	}
+	CHECK(tcdn_routing_table_get(routing_table,
+			tcdn_routing_table_size(routing_table))== NULL);
+
+	/* Arbitrary look-ups must not fail */
+	tcdn_routing_table_lookup(routing_table, (const char*)data, size);
+
+	tcdn_routing_table_release(&routing_table);
+	CHECK(routing_table== NULL);
+	return 0;
+}
+
+/**
+ * Stub host-names resolver: host-names of odd length are not resolved.
+ */
+static int resolve_stub(const char *host, char *addr, void *opaque)
+{
+	if(strlen(host)% 2)
+		return -1;
+	strcpy(addr, "192.0.2.1");
+	return 0;
+}
+
+/**
+ * Stub signing key function: the key is the secret length; secrets of odd
+ * length fail.
+ */
+static int key_stub(const char *secret, size_t secret_len,
+		unsigned int hash_type, void *key, void *opaque)
+{
+	if(secret_len% 2)
+		return -1;
+	*(uint64_t*)key= secret_len;
+	return 0;
+}
+
+#ifdef FUZZ_STANDALONE_MAIN
+int main(int argc, char *argv[])
+{
+	FILE *file= stdin;
+	uint8_t *data= NULL;
+	size_t size= 0, capacity= 0, n;
+
+	if(argc> 1 && (file= fopen(argv[1], "rb"))== NULL) {
+		perror(argv[1]);
+		return 1;
+	}
+	do {
+		if(size== capacity) {
+			capacity= capacity> 0? capacity* 2: 64* 1024;
+			if((data= realloc(data, capacity))== NULL)
+				return 1;
+		}
+		n= fread(data+ size, 1, capacity- size, file);
+		size+= n;
+	} while(n> 0);
+	if(file!= stdin)
+		fclose(file);
+
+	LLVMFuzzerTestOneInput(data, size);
+	free(data);
+	return 0;
+}
+#endif
@@ -0,0 +1,1350 @@
+/**
+ * @file tcdn_routing_table_proptest.c
+ * @brief Routing table compiler property tests.
+ * Generates random (and partially malformed) buckets information sets and
+ * checks that the compiled routing table agrees with the reference linear
+ * scan over the buckets JSON array (see routing semantics in
+ * 'tcdn_routing_table.h') for all the declared hosts (in random case and
+ * with or without ":port" suffix) and for unknown hosts.
+ * Access policies are checked against a reference linear scan of the
+ * bucket's lists for random client addresses, referers and countries.
+ * Host-names resolution is checked against a stub resolver (called once per
+ * distinct host-name of the active buckets; some host-names fail), and
+ * signing keys against a stub key function (called once per active signed
+ * bucket; some keys fail).
+ * Tables are compiled for a random time: buckets activation and the next
+ * activation window transition are checked against the reference scan, and
+ * the table compiled just before that transition must be the same.
+ * Also checks that truncated or corrupted JSON texts are handled gracefully.
+ * Usage: tcdn_routing_table_proptest [iterations [seed]]
+ * @author Rafael Antoniello
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <strings.h>
+#include <arpa/inet.h>
+#include <json-c/json.h>
+
+#include "tcdn_routing_table.h"
+
+/* **** Definitions **** */
+
+#define PLATFORM 8
+#define ITERATIONS_DEFAULT 500
+#define BUCKETS_MAX 300
+#define HOSTS_POOL_MAX 64
+#define HOST_LEN_MAX 64
+#define NODE_TAGS_LEN_MAX 256
+#define ACCESS_PROBES 16
+#define RESOLVED_MAX (2* BUCKETS_MAX)
+#define NOW_BASE 1500000000U
+#define NOW_RANGE 1000
+
+#define CHECK(COND) \
+	if(!(COND)) {\
+		fprintf(stderr, "%s:%d: Property failed (iteration %u, seed %u): "\
+				"%s\n", __FILE__, __LINE__, iteration, seed, #COND);\
+		exit(1);\
+	}
+
+/**
+ * Reference routing result.
+ */
+typedef struct ref_route_s {
+	const char *bucket_id;
+	const char *origin_host;
+	unsigned int origin_port;
+	int https;
+	int active;
+	char node_tags[NODE_TAGS_LEN_MAX];
+	const char *shield_host;
+	unsigned int shield_port;
+	unsigned int stale_while_revalidate;
+	unsigned int stale_if_error;
+	unsigned int prefetch;
+	unsigned int slice;
+	unsigned int max_bandwidth;
+	unsigned int bwidth;
+	unsigned int max_connections;
+	unsigned int max_request_rate;
+	unsigned int lastinvalidated;
+	const char *redir_secret;
+	unsigned int redir_hash_type;
+	unsigned int redir_expires;
+	struct json_object *jobj_bucket;
+} ref_route_t;
+
+/**
+ * Stub resolver calls (see 'resolve_stub()').
+ */
+typedef struct resolve_calls_s {
+	const char *hosts[RESOLVED_MAX];
+	int num;
+	int failed;
+} resolve_calls_t;
+
+/**
+ * Stub signing key (see 'key_stub()').
+ */
+typedef struct ref_key_s {
+	unsigned int hash;
+	unsigned int hash_type;
+} ref_key_t;
+
+/**
+ * Stub signing key calls (see 'key_stub()').
+ */
+typedef struct key_calls_s {
+	int num;
+	int failed;
+} key_calls_t;
+
+/* **** Prototypes **** */
+
+static unsigned int rnd(unsigned int n);
+static struct json_object* bucket_random(const char *host);
+static struct json_object* origin_port_random(void);
+static struct json_object* node_tag_random(void);
+static struct json_object* shield_random(void);
+static struct json_object* uint_param_random(unsigned int max);
+static struct json_object* date_random(void);
+static struct json_object* access_list_random(const char *const *pool,
+		size_t pool_size);
+static void access_probe_random(unsigned char *addr, size_t *ref_addr_len,
+		const char **ref_referer, const char **ref_country);
+static int ref_access_check(struct json_object *jobj_bucket,
+		const unsigned char *addr, size_t addr_len, const char *referer,
+		const char *country);
+static int ref_address_listed(struct json_object *jobj_list,
+		const unsigned char *addr, size_t addr_len, int *ref_valid);
+static int ref_referer_listed(struct json_object *jobj_list,
+		const char *referer, int *ref_valid);
+static int ref_country_listed(struct json_object *jobj_list,
+		const char *country, int *ref_valid);
+static int ref_lookup(struct json_object *jobj_buckets, const char *host,
+		unsigned int now, ref_route_t *route);
+static int ref_bucket_route(struct json_object *jobj_bucket, unsigned int now,
+		ref_route_t *route);
+static unsigned int ref_next_transition(struct json_object *jobj_buckets,
+		unsigned int now);
+static int ref_server(struct json_object *jobj_server, const char **ref_host,
+		unsigned int *ref_port, unsigned int default_port);
+static unsigned int ref_uint_param(struct json_object *jobj_awa,
+		const char *key, unsigned int max);
+static void host_random_case(const char *host, char *out, size_t out_size,
+		int flag_port);
+static int resolve_stub(const char *host, char *addr, void *opaque);
+static int ref_resolve(const char *host, char *addr);
+static int key_stub(const char *secret, size_t secret_len,
+		unsigned int hash_type, void *key, void *opaque);
+static unsigned int ref_key_hash(const char *secret, size_t secret_len);
+
+/* **** Implementations **** */
+
+static unsigned int iteration, seed;
+
+int main(int argc, char *argv[])
+{
+	unsigned int iterations= ITERATIONS_DEFAULT;
+	char hosts[HOSTS_POOL_MAX][HOST_LEN_MAX];
+
+	if(argc> 1)
+		iterations= (unsigned int)strtoul(argv[1], NULL, 10);
+	seed= argc> 2? (unsigned int)strtoul(argv[2], NULL, 10): 1;
+	srand(seed);
+
+	for(iteration= 0; iteration< iterations; iteration++) {
+		register int i;
+		int hosts_num= 1+ rnd(HOSTS_POOL_MAX), buckets_num= rnd(BUCKETS_MAX);
+		unsigned int now= NOW_BASE+ rnd(NOW_RANGE), next_transition;
+		const char *json;
+		size_t json_len, routable= 0;
+		struct json_object *jobj_buckets= json_object_new_array();
+		tcdn_routing_table_t *routing_table= NULL;
+
+		/* Hosts pool of unique host-names (small enough to have duplicated
+		 * buckets) */
+		for(i= 0; i< hosts_num; i++) {
+			snprintf(hosts[i], sizeof(hosts[i]), "%s%u-%d.%s",
+					rnd(2)? "img": "Video", rnd(1000), i,
+					rnd(2)? "terra.es": "CDN.example.com");
+		}
+
+		/* Random buckets set */
+		for(i= 0; i< buckets_num; i++)
+			json_object_array_add(jobj_buckets,
+					bucket_random(hosts[rnd(hosts_num)]));
+		json= json_object_to_json_string_ext(jobj_buckets,
+				rnd(2)? JSON_C_TO_STRING_PLAIN: JSON_C_TO_STRING_PRETTY);
+		json_len= strlen(json);
+
+		/* Compile; compare against the reference linear scan */
+		routing_table= tcdn_routing_table_compile_json(json, json_len,
+				PLATFORM, now);
+		CHECK(routing_table!= NULL);
+		next_transition= tcdn_routing_table_next_transition(routing_table);
+		CHECK(next_transition== ref_next_transition(jobj_buckets, now));
+
+		for(i= 0; i< hosts_num+ 8; i++) {
+			char host[HOST_LEN_MAX+ 8];
+			ref_route_t route;
+			const tcdn_routing_entry_t *entry;
+			int found, j;
+
+			if(i< hosts_num)
+				host_random_case(hosts[i], host, sizeof(host), rnd(2));
+			else
+				snprintf(host, sizeof(host), "unknown%d.terra.es", i);
+
+			found= ref_lookup(jobj_buckets, host, now, &route);
+			entry= tcdn_routing_table_lookup(routing_table, host,
+					strlen(host));
+			CHECK((entry!= NULL)== (found!= 0));
+			if(!found)
+				continue;
+			routable++;
+			CHECK(strcmp(entry->origin_host, route.origin_host)== 0);
+			CHECK(entry->origin_port== route.origin_port);
+			CHECK(entry->https== route.https);
+			CHECK(entry->active== route.active);
+			CHECK(strcmp(entry->bucket_id, route.bucket_id)== 0);
+			CHECK(strcmp(entry->node_tags, route.node_tags)== 0);
+			CHECK(strlen(entry->node_tags)== entry->node_tags_len);
+			CHECK(strcmp(entry->shield_host, route.shield_host)== 0);
+			CHECK(entry->shield_port== route.shield_port);
+			CHECK(entry->stale_while_revalidate==
+					route.stale_while_revalidate);
+			CHECK(entry->stale_if_error== route.stale_if_error);
+			CHECK(entry->prefetch== route.prefetch);
+			CHECK(entry->slice== route.slice);
+			CHECK(entry->max_bandwidth== route.max_bandwidth);
+			CHECK(entry->bwidth== route.bwidth);
+			CHECK(entry->max_connections== route.max_connections);
+			CHECK(entry->max_request_rate== route.max_request_rate);
+			CHECK(entry->lastinvalidated== route.lastinvalidated);
+			CHECK(strcmp(entry->redir_secret, route.redir_secret)== 0);
+			CHECK(strlen(entry->redir_secret)== entry->redir_secret_len);
+			CHECK(entry->redir_hash_type== route.redir_hash_type);
+			CHECK(entry->redir_expires== route.redir_expires);
+			CHECK(entry->redir_key== NULL);
+			CHECK(strncasecmp(entry->host, host, entry->host_len)== 0);
+
+			/* Access policy */
+			for(j= 0; j< ACCESS_PROBES; j++) {
+				unsigned char addr[16];
+				size_t addr_len;
+				const char *referer, *country;
+
+				access_probe_random(addr, &addr_len, &referer, &country);
+				CHECK(tcdn_routing_access_check(entry, addr, addr_len,
+						referer, referer!= NULL? strlen(referer): 0,
+						country)== ref_access_check(route.jobj_bucket, addr,
+						addr_len, referer, country));
+			}
+		}
+		CHECK(tcdn_routing_table_size(routing_table)== routable);
+
+		/* Resolve host-names; compare against the stub resolver */
+		{
+			resolve_calls_t calls= {{0}};
+			size_t k;
+
+			CHECK(tcdn_routing_table_resolve(routing_table, resolve_stub,
+					&calls)== calls.failed);
+			for(k= 0; k< tcdn_routing_table_size(routing_table); k++) {
+				const tcdn_routing_entry_t *entry= tcdn_routing_table_get(
+						routing_table, k);
+				char addr[TCDN_ROUTING_ADDR_LEN_MAX];
+
+				if(entry->active)
+					ref_resolve(entry->origin_host, addr);
+				else
+					addr[0]= '\0';
+				CHECK(strcmp(entry->origin_addr, addr)== 0);
+				CHECK(strlen(entry->origin_addr)== entry->origin_addr_len);
+				if(entry->active && entry->shield_host_len> 0)
+					ref_resolve(entry->shield_host, addr);
+				else
+					addr[0]= '\0';
+				CHECK(strcmp(entry->shield_addr, addr)== 0);
+				CHECK(strlen(entry->shield_addr)== entry->shield_addr_len);
+			}
+		}
+
+		/* Precompute signing keys; compare against the stub key function */
+		{
+			key_calls_t calls= {0};
+			int signed_num= 0;
+			size_t k;
+
+			CHECK(tcdn_routing_table_keys(routing_table, sizeof(ref_key_t),
+					key_stub, &calls)== calls.failed);
+			for(k= 0; k< tcdn_routing_table_size(routing_table); k++) {
+				const tcdn_routing_entry_t *entry= tcdn_routing_table_get(
+						routing_table, k);
+				const ref_key_t *key= (const ref_key_t*)entry->redir_key;
+				unsigned int hash= ref_key_hash(entry->redir_secret,
+						entry->redir_secret_len);
+
+				if(!entry->active || entry->redir_secret_len== 0) {
+					CHECK(key== NULL);
+					continue;
+				}
+				signed_num++;
+				if(hash% 5== 0) {
+					CHECK(key== NULL);
+					continue;
+				}
+				CHECK(key!= NULL && (uintptr_t)key% sizeof(double)== 0);
+				CHECK(key->hash== hash);
+				CHECK(key->hash_type== entry->redir_hash_type);
+			}
+			CHECK(calls.num== signed_num);
+		}
+
+		/* Compiling from the parsed object must give the same table */
+		{
+			tcdn_routing_table_t *routing_table2= tcdn_routing_table_compile(
+					jobj_buckets, PLATFORM, now);
+			CHECK(routing_table2!= NULL);
+			CHECK(tcdn_routing_table_size(routing_table2)== routable);
+			CHECK(tcdn_routing_table_discarded(routing_table2)==
+					tcdn_routing_table_discarded(routing_table));
+			tcdn_routing_table_release(&routing_table2);
+		}
+
+		/* The table is valid until the next transition: the one compiled
+		 * just before it must route the same way */
+		if(next_transition> now+ 1) {
+			tcdn_routing_table_t *routing_table2= tcdn_routing_table_compile(
+					jobj_buckets, PLATFORM, next_transition- 1);
+			size_t k;
+
+			CHECK(routing_table2!= NULL);
+			CHECK(tcdn_routing_table_size(routing_table2)== routable);
+			CHECK(tcdn_routing_table_next_transition(routing_table2)==
+					next_transition);
+			for(k= 0; k< routable; k++) {
+				const tcdn_routing_entry_t *entry= tcdn_routing_table_get(
+						routing_table, k);
+				const tcdn_routing_entry_t *entry2= tcdn_routing_table_get(
+						routing_table2, k);
+
+				CHECK(strcmp(entry->host, entry2->host)== 0);
+				CHECK(strcmp(entry->bucket_id, entry2->bucket_id)== 0);
+				CHECK(entry->active== entry2->active);
+			}
+			tcdn_routing_table_release(&routing_table2);
+		}
+		tcdn_routing_table_release(&routing_table);
+		CHECK(routing_table== NULL);
+
+		/* Truncated text must be rejected (an array is always truncated) */
+		if(json_len> 1) {
+			routing_table= tcdn_routing_table_compile_json(json,
+					rnd(json_len- 1)+ 1, PLATFORM, now);
+			CHECK(routing_table== NULL);
+		}
+
+		/* Corrupted text must not crash */
+		if(json_len> 0) {
+			char *corrupted= strdup(json);
+			CHECK(corrupted!= NULL);
+			for(i= 0; i< 4; i++)
+				corrupted[rnd(json_len)]= (char)rnd(256);
+			routing_table= tcdn_routing_table_compile_json(corrupted,
+					json_len, PLATFORM, now);
+			tcdn_routing_table_release(&routing_table);
+			free(corrupted);
+		}
+
+		json_object_put(jobj_buckets);
+	}
+
+	printf("%u iterations passed (seed %u)\n", iterations, seed);
+	return 0;
+}
+
+static unsigned int rnd(unsigned int n)
+{
+	return n> 0? (unsigned int)rand()% n: 0;
+}
+
+/**
+ * Random bucket: mostly well-formed, with a random subset of malformations.
+ */
+static struct json_object* bucket_random(const char *host)
+{
+	struct json_object *jobj_bucket= json_object_new_object();
+	struct json_object *jobj_awa, *jobj_origins, *jobj_origin_list;
+	unsigned int r;
+
+	/* Platform */
+	r= rnd(10);
+	if(r< 7)
+		json_object_object_add(jobj_bucket, "platform",
+				json_object_new_int(PLATFORM));
+	else if(r< 8)
+		json_object_object_add(jobj_bucket, "platform",
+				json_object_new_int(rnd(8)));
+	else if(r< 9)
+		json_object_object_add(jobj_bucket, "platform",
+				json_object_new_string("8"));
+
+	/* Host */
+	r= rnd(20);
+	if(r< 16)
+		json_object_object_add(jobj_bucket, "host",
+				json_object_new_string(host));
+	else if(r< 17)
+		json_object_object_add(jobj_bucket, "host",
+				json_object_new_string(""));
+	else if(r< 18)
+		json_object_object_add(jobj_bucket, "host",
+				json_object_new_int(rnd(100)));
+	else if(r< 19) {
+		char host_port[HOST_LEN_MAX+ 8];
+		snprintf(host_port, sizeof(host_port), "%s:81", host);
+		json_object_object_add(jobj_bucket, "host",
+				json_object_new_string(host_port));
+	}
+
+	/* Identifier */
+	r= rnd(10);
+	if(r< 6)
+		json_object_object_add(jobj_bucket, "id",
+				json_object_new_int(rnd(100000)));
+	else if(r< 8) {
+		char id[16];
+		snprintf(id, sizeof(id), "b-%u", rnd(1000));
+		json_object_object_add(jobj_bucket, "id", json_object_new_string(id));
+	} else if(r< 9)
+		json_object_object_add(jobj_bucket, "id", json_object_new_array());
+
+	/* Node tags */
+	if(rnd(4)!= 0)
+		json_object_object_add(jobj_bucket, "node_tag", node_tag_random());
+
+	/* Bandwidth limits */
+	if(rnd(3)== 0)
+		json_object_object_add(jobj_bucket, "max_bandwidth",
+				uint_param_random(TCDN_ROUTING_BANDWIDTH_MAX));
+	if(rnd(3)== 0)
+		json_object_object_add(jobj_bucket, "bwidth",
+				uint_param_random(TCDN_ROUTING_BANDWIDTH_MAX));
+
+	/* Admission limits */
+	if(rnd(3)== 0)
+		json_object_object_add(jobj_bucket, "max_connections",
+				uint_param_random(TCDN_ROUTING_ADMISSION_MAX));
+	if(rnd(3)== 0)
+		json_object_object_add(jobj_bucket, "max_request_rate",
+				uint_param_random(TCDN_ROUTING_ADMISSION_MAX));
+
+	/* Last invalidation time */
+	if(rnd(3)== 0)
+		json_object_object_add(jobj_bucket, "lastinvalidated",
+				uint_param_random(TCDN_ROUTING_TIMESTAMP_MAX- 1));
+
+	/* Origin-server TLS */
+	r= rnd(8);
+	if(r< 6) {
+		struct json_object *jobj_https= json_object_new_object();
+		if(r< 5)
+			json_object_object_add(jobj_https, "enabled",
+					json_object_new_boolean(rnd(2)));
+		else
+			json_object_object_add(jobj_https, "enabled",
+					json_object_new_int(1));
+		json_object_object_add(jobj_bucket, "https", jobj_https);
+	} else if(r< 7)
+		json_object_object_add(jobj_bucket, "https",
+				json_object_new_boolean(1));
+
+	/* Signed URLs */
+	r= rnd(10);
+	if(r< 7) {
+		static const char *const secrets[]= {
+				"", "s3cr3t", "k", "0123456789abcdef0123456789abcdef"
+				"0123456789abcdef0123456789abcdef0123456789", "p@ss word"
+		};
+		struct json_object *jobj_redir= json_object_new_object();
+
+		if(rnd(8)!= 0)
+			json_object_object_add(jobj_redir, "secret",
+					json_object_new_string(secrets[rnd(
+					sizeof(secrets)/ sizeof(secrets[0]))]));
+		else
+			json_object_object_add(jobj_redir, "secret",
+					json_object_new_int(rnd(100)));
+		if(rnd(8)!= 0)
+			json_object_object_add(jobj_redir, "expires",
+					uint_param_random(TCDN_ROUTING_REDIR_EXPIRES_MAX));
+		r= rnd(8);
+		if(r< 6)
+			json_object_object_add(jobj_redir, "enabled",
+					json_object_new_boolean(r< 4));
+		else if(r< 7)
+			json_object_object_add(jobj_redir, "enabled",
+					json_object_new_string("true"));
+		json_object_object_add(jobj_bucket, "redir", jobj_redir);
+		if(rnd(2))
+			json_object_object_add(jobj_bucket, "redir_hash_type",
+					uint_param_random(TCDN_ROUTING_REDIR_HASH_SHA256));
+	} else if(r< 8)
+		json_object_object_add(jobj_bucket, "redir",
+				json_object_new_string("s3cr3t"));
+
+	/* Activation */
+	r= rnd(10);
+	if(r< 6)
+		json_object_object_add(jobj_bucket, "enabled",
+				json_object_new_boolean(r< 5));
+	else if(r< 7)
+		json_object_object_add(jobj_bucket, "enabled",
+				json_object_new_string("false"));
+	if(rnd(2))
+		json_object_object_add(jobj_bucket, "startdate", date_random());
+	if(rnd(2))
+		json_object_object_add(jobj_bucket, "enddate", date_random());
+
+	/* Access policy */
+	if(rnd(4)== 0) {
+		static const char *const addresses[]= {
+				"10.0.0.0/8", "10.1.0.0/16", "10.1.2.0/24", "10.1.2.3",
+				"10.2.0.0/15", "10.3.3.3/32", "0.0.0.0/0",
+				"::ffff:10.2.0.0/112",
+				"2001:db8::/32", "2001:db8:1::/48", "2001:db8:1::1", "::/0",
+				"10.0.0.300", "10.0.0.0/33", "2001:db8::/129", "10.0.0.0/",
+				"", "x"
+		};
+		static const char *const referers[]= {
+				"example.com", "*.example.com", "www.Example.org",
+				"*.cdn.example.org", "none", "NONE", "bad host", "a/b", "*",
+				"*.", ""
+		};
+		static const char *const countries[]= {
+				"ES", "pt", "FR", "us", "ESP", "E", "1A", ""
+		};
+		const size_t addresses_num= sizeof(addresses)/ sizeof(addresses[0]);
+
+		if(rnd(2)== 0)
+			json_object_object_add(jobj_bucket, "blacklist",
+					access_list_random(addresses, addresses_num));
+		if(rnd(2)== 0)
+			json_object_object_add(jobj_bucket, "whitelist",
+					access_list_random(addresses, addresses_num));
+		if(rnd(2)== 0)
+			json_object_object_add(jobj_bucket, "referer",
+					access_list_random(referers,
+							sizeof(referers)/ sizeof(referers[0])));
+		if(rnd(3)== 0)
+			json_object_object_add(jobj_bucket, "geoloc-allow",
+					access_list_random(countries,
+							sizeof(countries)/ sizeof(countries[0])));
+		if(rnd(3)== 0)
+			json_object_object_add(jobj_bucket, "geoloc-deny",
+					access_list_random(countries,
+							sizeof(countries)/ sizeof(countries[0])));
+	}
+
+	/* Origins */
+	r= rnd(20);
+	if(r== 0)
+		return jobj_bucket; // No 'awa_params'
+	jobj_awa= json_object_new_object();
+	json_object_object_add(jobj_bucket, "awa_params", jobj_awa);
+	if(rnd(3)== 0)
+		json_object_object_add(jobj_awa, "shield", shield_random());
+	if(rnd(3)== 0)
+		json_object_object_add(jobj_awa, "stale_while_revalidate",
+				uint_param_random(TCDN_ROUTING_STALE_MAX));
+	if(rnd(3)== 0)
+		json_object_object_add(jobj_awa, "stale_if_error",
+				uint_param_random(TCDN_ROUTING_STALE_MAX));
+	if(rnd(3)== 0)
+		json_object_object_add(jobj_awa, "prefetch",
+				uint_param_random(TCDN_ROUTING_PREFETCH_MAX));
+	if(rnd(3)== 0)
+		json_object_object_add(jobj_awa, "slice",
+				uint_param_random(TCDN_ROUTING_SLICE_MAX));
+	if(r== 1)
+		return jobj_bucket; // No 'origins'
+	jobj_origins= json_object_new_object();
+	json_object_object_add(jobj_awa, "origins", jobj_origins);
+	json_object_object_add(jobj_origins, "policy",
+			json_object_new_string("round_robin"));
+	if(r== 2) {
+		json_object_object_add(jobj_origins, "origin_list",
+				json_object_new_object());
+		return jobj_bucket; // 'origin_list' is not an array
+	}
+	jobj_origin_list= json_object_new_array();
+	json_object_object_add(jobj_origins, "origin_list", jobj_origin_list);
+	if(r== 3)
+		return jobj_bucket; // Empty 'origin_list'
+
+	for(r= 1+ rnd(3); r> 0; r--) {
+		struct json_object *jobj_origin= json_object_new_object();
+		struct json_object *jobj_port;
+		unsigned int r2= rnd(20);
+		char origin_host[32];
+
+		snprintf(origin_host, sizeof(origin_host), "10.%u.%u.%u", rnd(256),
+				rnd(256), rnd(256));
+		if(r2< 18)
+			json_object_object_add(jobj_origin, "host",
+					json_object_new_string(origin_host));
+		else if(r2< 19)
+			json_object_object_add(jobj_origin, "host",
+					json_object_new_string(""));
+		if((jobj_port= origin_port_random())!= NULL)
+			json_object_object_add(jobj_origin, "port", jobj_port);
+		json_object_array_add(jobj_origin_list, jobj_origin);
+	}
+	return jobj_bucket;
+}
+
+/**
+ * Random origin port: integer, string, missing (NULL) or invalid.
+ */
+static struct json_object* origin_port_random()
+{
+	char str[16];
+	unsigned int r= rnd(20);
+
+	if(r< 10)
+		return json_object_new_int(1+ rnd(65535));
+	if(r< 13)
+		return NULL;
+	if(r< 15) {
+		snprintf(str, sizeof(str), "%u", 1+ rnd(65535));
+		return json_object_new_string(str);
+	}
+	if(r< 16)
+		return json_object_new_int(0);
+	if(r< 17)
+		return json_object_new_int(65536+ rnd(1000));
+	if(r< 18)
+		return json_object_new_int(-(int)rnd(100));
+	if(r< 19)
+		return json_object_new_string("80a");
+	return json_object_new_double(80.5);
+}
+
+/**
+ * Random node tags object: mostly well-formed tags, with some invalid ones.
+ */
+static struct json_object* node_tag_random()
+{
+	struct json_object *jobj_node_tag= json_object_new_object();
+	struct json_object *jobj_tag_list;
+	unsigned int r= rnd(10);
+	char tag[16];
+
+	if(r== 0)
+		return jobj_node_tag; // No 'tag_list'
+	if(r== 1) {
+		json_object_object_add(jobj_node_tag, "tag_list",
+				json_object_new_string("node-a"));
+		return jobj_node_tag; // 'tag_list' is not an array
+	}
+	jobj_tag_list= json_object_new_array();
+	json_object_object_add(jobj_node_tag, "tag_list", jobj_tag_list);
+
+	for(r= rnd(5); r> 0; r--) {
+		switch(rnd(8)) {
+		case 0:
+			json_object_array_add(jobj_tag_list, json_object_new_int(rnd(9)));
+			break;
+		case 1:
+			json_object_array_add(jobj_tag_list, json_object_new_string(""));
+			break;
+		case 2:
+			json_object_array_add(jobj_tag_list,
+					json_object_new_string("node-a,node-b"));
+			break;
+		default:
+			snprintf(tag, sizeof(tag), "node-%c", 'a'+ rnd(6));
+			json_object_array_add(jobj_tag_list, json_object_new_string(tag));
+			break;
+		}
+	}
+	return jobj_node_tag;
+}
+
+/**
+ * Random shield: mostly well-formed, some invalid (then ignored).
+ */
+static struct json_object* shield_random()
+{
+	struct json_object *jobj_shield, *jobj_port;
+	unsigned int r= rnd(10);
+	char shield_host[32];
+
+	if(r== 0)
+		return json_object_new_string("10.0.0.1:8080"); // Not an object
+	jobj_shield= json_object_new_object();
+	snprintf(shield_host, sizeof(shield_host), "shield%u.example.com",
+			rnd(10));
+	if(r== 1)
+		json_object_object_add(jobj_shield, "host", json_object_new_string(""));
+	else if(r> 2)
+		json_object_object_add(jobj_shield, "host",
+				json_object_new_string(shield_host));
+	if((jobj_port= origin_port_random())!= NULL)
+		json_object_object_add(jobj_shield, "port", jobj_port);
+	return jobj_shield;
+}
+
+/**
+ * Stub host-names resolver: checks that each host-name is resolved once.
+ */
+static int resolve_stub(const char *host, char *addr, void *opaque)
+{
+	resolve_calls_t *calls= (resolve_calls_t*)opaque;
+	int i;
+
+	for(i= 0; i< calls->num; i++)
+		CHECK(strcmp(calls->hosts[i], host)!= 0);
+	CHECK(calls->num< RESOLVED_MAX);
+	calls->hosts[calls->num++]= host;
+	if(ref_resolve(host, addr)!= 0) {
+		calls->failed++;
+		return -1;
+	}
+	return 0;
+}
+
+/**
+ * Stub signing key function: the key is a hash of the secret and the hash
+ * type; one out of five keys can not be computed.
+ */
+static int key_stub(const char *secret, size_t secret_len,
+		unsigned int hash_type, void *key, void *opaque)
+{
+	key_calls_t *calls= (key_calls_t*)opaque;
+	ref_key_t *ref_key= (ref_key_t*)key;
+
+	CHECK(secret_len> 0 && strlen(secret)== secret_len);
+	calls->num++;
+	ref_key->hash= ref_key_hash(secret, secret_len);
+	ref_key->hash_type= hash_type;
+	if(ref_key->hash% 5== 0) {
+		calls->failed++;
+		return -1;
+	}
+	return 0;
+}
+
+/**
+ * Reference signing key hash of a secret.
+ */
+static unsigned int ref_key_hash(const char *secret, size_t secret_len)
+{
+	unsigned int h= 5381;
+
+	while(secret_len-- > 0)
+		h= h* 33+ (unsigned char)*secret++;
+	return h;
+}
+
+/**
+ * Reference host-name resolution: a hash of the host-name as an IPv4 or
+ * IPv6 address; one out of seven host-names can not be resolved (empty
+ * address).
+ */
+static int ref_resolve(const char *host, char *addr)
+{
+	unsigned int h= 5381;
+
+	while(*host!= '\0')
+		h= h* 33+ (unsigned char)*host++;
+	addr[0]= '\0';
+	if(h% 7== 0)
+		return -1;
+	if(h% 2)
+		snprintf(addr, TCDN_ROUTING_ADDR_LEN_MAX, "10.%u.%u.%u",
+				(h>> 16)& 0xff, (h>> 8)& 0xff, h& 0xff);
+	else
+		snprintf(addr, TCDN_ROUTING_ADDR_LEN_MAX, "[fd00::%x]", h);
+	return 0;
+}
+
+/**
+ * Random unsigned integer parameter (e.g. stale window): mostly valid, some
+ * out of range or not an integer (then ignored).
+ */
+static struct json_object* uint_param_random(unsigned int max)
+{
+	switch(rnd(8)) {
+	case 0:
+		return json_object_new_int(-1- (int)rnd(100));
+	case 1:
+		return json_object_new_int64((int64_t)max+ 1+ rnd(100));
+	case 2:
+		return json_object_new_string("1");
+	case 3:
+		return json_object_new_double(1.5);
+	case 4:
+		return json_object_new_int64(max);
+	default:
+		return json_object_new_int64(rnd(max+ 1));
+	}
+}
+
+/**
+ * Random activation window date: mostly around the tested times, some
+ * unbounded (zero) or arbitrary (maybe invalid).
+ */
+static struct json_object* date_random(void)
+{
+	switch(rnd(6)) {
+	case 0:
+		return json_object_new_int(0);
+	case 1:
+		return uint_param_random(TCDN_ROUTING_TIMESTAMP_MAX- 1);
+	default:
+		return json_object_new_int64(NOW_BASE+ rnd(NOW_RANGE));
+	}
+}
+
+/**
+ * Reference linear scan: the first active routable bucket of the requested
+ * platform whose host-name matches wins; if none is active, the first
+ * routable one.
+ * @return 1 if found, 0 otherwise.
+ */
+static int ref_lookup(struct json_object *jobj_buckets, const char *host,
+		unsigned int now, ref_route_t *route)
+{
+	register size_t i, host_len;
+	const char *p;
+	int found= 0;
+
+	host_len= (p= strchr(host, ':'))!= NULL? (size_t)(p- host): strlen(host);
+
+	for(i= 0; i< json_object_array_length(jobj_buckets); i++) {
+		struct json_object *jobj_bucket= json_object_array_get_idx(
+				jobj_buckets, i);
+		struct json_object *jobj_aux;
+		const char *bucket_host;
+
+		if(!json_object_object_get_ex(jobj_bucket, "platform", &jobj_aux) ||
+				!json_object_is_type(jobj_aux, json_type_int) ||
+				json_object_get_int(jobj_aux)!= PLATFORM)
+			continue;
+		if(!json_object_object_get_ex(jobj_bucket, "host", &jobj_aux) ||
+				!json_object_is_type(jobj_aux, json_type_string))
+			continue;
+		bucket_host= json_object_get_string(jobj_aux);
+		if(strlen(bucket_host)!= host_len ||
+				strncasecmp(bucket_host, host, host_len)!= 0)
+			continue;
+		if(!found) {
+			if(!ref_bucket_route(jobj_bucket, now, route))
+				continue;
+			route->jobj_bucket= jobj_bucket;
+			found= 1;
+		} else {
+			ref_route_t route_dup;
+
+			if(!ref_bucket_route(jobj_bucket, now, &route_dup) ||
+					!route_dup.active)
+				continue;
+			*route= route_dup;
+			route->jobj_bucket= jobj_bucket;
+		}
+		if(route->active)
+			return 1;
+	}
+	return found;
+}
+
+/**
+ * Reference bucket routing information parsing.
+ * @return 1 if the bucket is routable, 0 otherwise.
+ */
+static int ref_bucket_route(struct json_object *jobj_bucket, unsigned int now,
+		ref_route_t *route)
+{
+	struct json_object *jobj_aux, *jobj_awa, *jobj_origin;
+	register size_t i;
+	unsigned int start, end;
+
+	route->bucket_id= "";
+	if(json_object_object_get_ex(jobj_bucket, "id", &jobj_aux) &&
+			(json_object_is_type(jobj_aux, json_type_int) ||
+			json_object_is_type(jobj_aux, json_type_string)))
+		route->bucket_id= json_object_get_string(jobj_aux);
+
+	if(!json_object_object_get_ex(jobj_bucket, "awa_params", &jobj_awa) ||
+			!json_object_object_get_ex(jobj_awa, "origins", &jobj_aux) ||
+			!json_object_object_get_ex(jobj_aux, "origin_list", &jobj_aux) ||
+			!json_object_is_type(jobj_aux, json_type_array) ||
+			json_object_array_length(jobj_aux)== 0)
+		return 0;
+	jobj_origin= json_object_array_get_idx(jobj_aux, 0);
+	route->https= json_object_object_get_ex(jobj_bucket, "https", &jobj_aux) &&
+			json_object_object_get_ex(jobj_aux, "enabled", &jobj_aux) &&
+			json_object_is_type(jobj_aux, json_type_boolean) &&
+			json_object_get_boolean(jobj_aux);
+	if(!ref_server(jobj_origin, &route->origin_host, &route->origin_port,
+			route->https? 443: 80))
+		return 0;
+
+	if(!json_object_object_get_ex(jobj_awa, "shield", &jobj_aux) ||
+			!json_object_is_type(jobj_aux, json_type_object) ||
+			!ref_server(jobj_aux, &route->shield_host, &route->shield_port,
+					80)) {
+		route->shield_host= "";
+		route->shield_port= 0;
+	}
+
+	route->stale_while_revalidate= ref_uint_param(jobj_awa,
+			"stale_while_revalidate", TCDN_ROUTING_STALE_MAX);
+	route->stale_if_error= ref_uint_param(jobj_awa, "stale_if_error",
+			TCDN_ROUTING_STALE_MAX);
+	route->prefetch= ref_uint_param(jobj_awa, "prefetch",
+			TCDN_ROUTING_PREFETCH_MAX);
+	route->slice= ref_uint_param(jobj_awa, "slice", TCDN_ROUTING_SLICE_MAX);
+	if(route->slice< TCDN_ROUTING_SLICE_MIN)
+		route->slice= 0;
+	route->max_bandwidth= ref_uint_param(jobj_bucket, "max_bandwidth",
+			TCDN_ROUTING_BANDWIDTH_MAX);
+	route->bwidth= ref_uint_param(jobj_bucket, "bwidth",
+			TCDN_ROUTING_BANDWIDTH_MAX);
+	route->max_connections= ref_uint_param(jobj_bucket, "max_connections",
+			TCDN_ROUTING_ADMISSION_MAX);
+	route->max_request_rate= ref_uint_param(jobj_bucket, "max_request_rate",
+			TCDN_ROUTING_ADMISSION_MAX);
+	route->lastinvalidated= ref_uint_param(jobj_bucket, "lastinvalidated",
+			TCDN_ROUTING_TIMESTAMP_MAX);
+
+	route->redir_secret= "";
+	route->redir_hash_type= TCDN_ROUTING_REDIR_HASH_MD5;
+	route->redir_expires= 0;
+	if(json_object_object_get_ex(jobj_bucket, "redir", &jobj_aux) &&
+			json_object_is_type(jobj_aux, json_type_object)) {
+		struct json_object *jobj_redir= jobj_aux;
+
+		if(json_object_object_get_ex(jobj_redir, "enabled", &jobj_aux) &&
+				json_object_is_type(jobj_aux, json_type_boolean) &&
+				json_object_get_boolean(jobj_aux) &&
+				json_object_object_get_ex(jobj_redir, "secret", &jobj_aux) &&
+				json_object_is_type(jobj_aux, json_type_string) &&
+				json_object_get_string(jobj_aux)[0]!= '\0') {
+			route->redir_secret= json_object_get_string(jobj_aux);
+			route->redir_hash_type= ref_uint_param(jobj_bucket,
+					"redir_hash_type", TCDN_ROUTING_REDIR_HASH_SHA256);
+			route->redir_expires= ref_uint_param(jobj_redir, "expires",
+					TCDN_ROUTING_REDIR_EXPIRES_MAX);
+		}
+	}
+
+	route->node_tags[0]= '\0';
+	if(json_object_object_get_ex(jobj_bucket, "node_tag", &jobj_aux) &&
+			json_object_object_get_ex(jobj_aux, "tag_list", &jobj_aux) &&
+			json_object_is_type(jobj_aux, json_type_array)) {
+		for(i= 0; i< json_object_array_length(jobj_aux); i++) {
+			struct json_object *jobj_tag= json_object_array_get_idx(jobj_aux,
+					i);
+			const char *tag= json_object_get_string(jobj_tag);
+
+			if(!json_object_is_type(jobj_tag, json_type_string) ||
+					tag[0]== '\0' || strchr(tag, ',')!= NULL)
+				continue;
+			if(route->node_tags[0]!= '\0')
+				strcat(route->node_tags, ",");
+			strcat(route->node_tags, tag);
+		}
+	}
+
+	route->active= 0;
+	if(json_object_object_get_ex(jobj_bucket, "enabled", &jobj_aux) &&
+			json_object_is_type(jobj_aux, json_type_boolean) &&
+			!json_object_get_boolean(jobj_aux))
+		return 1;
+	start= ref_uint_param(jobj_bucket, "startdate",
+			TCDN_ROUTING_TIMESTAMP_MAX);
+	end= ref_uint_param(jobj_bucket, "enddate", TCDN_ROUTING_TIMESTAMP_MAX);
+	route->active= start<= now && (end== 0 || now< end);
+	return 1;
+}
+
+/**
+ * Reference next activation window transition: earliest start or end date,
+ * later than the given time, of the enabled routable buckets of the
+ * requested platform (duplicated host-names included).
+ * @return The transition time, zero if none.
+ */
+static unsigned int ref_next_transition(struct json_object *jobj_buckets,
+		unsigned int now)
+{
+	register size_t i;
+	unsigned int next= 0;
+
+	for(i= 0; i< json_object_array_length(jobj_buckets); i++) {
+		struct json_object *jobj_bucket= json_object_array_get_idx(
+				jobj_buckets, i);
+		struct json_object *jobj_aux;
+		const char *dates[]= {"startdate", "enddate"};
+		ref_route_t route;
+		int j;
+
+		if(!json_object_object_get_ex(jobj_bucket, "platform", &jobj_aux) ||
+				!json_object_is_type(jobj_aux, json_type_int) ||
+				json_object_get_int(jobj_aux)!= PLATFORM)
+			continue;
+		if(!json_object_object_get_ex(jobj_bucket, "host", &jobj_aux) ||
+				!json_object_is_type(jobj_aux, json_type_string) ||
+				json_object_get_string(jobj_aux)[0]== '\0' ||
+				strchr(json_object_get_string(jobj_aux), ':')!= NULL)
+			continue;
+		if(!ref_bucket_route(jobj_bucket, now, &route))
+			continue;
+		if(json_object_object_get_ex(jobj_bucket, "enabled", &jobj_aux) &&
+				json_object_is_type(jobj_aux, json_type_boolean) &&
+				!json_object_get_boolean(jobj_aux))
+			continue;
+		for(j= 0; j< 2; j++) {
+			unsigned int date= ref_uint_param(jobj_bucket, dates[j],
+					TCDN_ROUTING_TIMESTAMP_MAX);
+
+			if(date> now && (next== 0 || date< next))
+				next= date;
+		}
+	}
+	return next;
+}
+
+/**
+ * Reference server (origin-server or shield) parsing.
+ * @return 1 if the server is valid, 0 otherwise.
+ */
+static int ref_server(struct json_object *jobj_server, const char **ref_host,
+		unsigned int *ref_port, unsigned int default_port)
+{
+	struct json_object *jobj_aux;
+
+	if(!json_object_object_get_ex(jobj_server, "host", &jobj_aux) ||
+			!json_object_is_type(jobj_aux, json_type_string) ||
+			strlen(json_object_get_string(jobj_aux))== 0)
+		return 0;
+	*ref_host= json_object_get_string(jobj_aux);
+
+	*ref_port= default_port;
+	if(json_object_object_get_ex(jobj_server, "port", &jobj_aux)) {
+		long port;
+		char *endptr= NULL;
+		const char *str= json_object_get_string(jobj_aux);
+
+		if(json_object_is_type(jobj_aux, json_type_int))
+			port= (long)json_object_get_int64(jobj_aux);
+		else if(json_object_is_type(jobj_aux, json_type_string) &&
+				str[0]>= '0' && str[0]<= '9' && strlen(str)<= 5)
+			port= strtol(str, &endptr, 10);
+		else
+			return 0;
+		if((endptr!= NULL && *endptr!= '\0') || port<= 0 || port> 65535)
+			return 0;
+		*ref_port= (unsigned int)port;
+	}
+	return 1;
+}
+
+/**
+ * Reference unsigned integer parameter (e.g. stale window) parsing.
+ * @return The parameter value, zero if not valid.
+ */
+static unsigned int ref_uint_param(struct json_object *jobj_awa,
+		const char *key, unsigned int max)
+{
+	struct json_object *jobj_aux;
+	int64_t value;
+
+	if(!json_object_object_get_ex(jobj_awa, key, &jobj_aux) ||
+			!json_object_is_type(jobj_aux, json_type_int))
+		return 0;
+	value= json_object_get_int64(jobj_aux);
+	return (value>= 0 && value<= max)? (unsigned int)value: 0;
+}
+
+/**
+ * Random case version of a host-name, optionally with a ":port" suffix.
+ */
+static void host_random_case(const char *host, char *out, size_t out_size,
+		int flag_port)
+{
+	register size_t i;
+
+	for(i= 0; host[i]!= '\0' && i< out_size- 8; i++) {
+		char c= host[i];
+		if(rnd(2) && c>= 'a' && c<= 'z')
+			c= c- 'a'+ 'A';
+		else if(rnd(2) && c>= 'A' && c<= 'Z')
+			c= c- 'A'+ 'a';
+		out[i]= c;
+	}
+	snprintf(&out[i], out_size- i, "%s", flag_port? ":8080": "");
+}
+
+/**
+ * Random access list: elements of the given pool (valid and invalid ones),
+ * with some non-string elements; some lists are not arrays (then ignored).
+ */
+static struct json_object* access_list_random(const char *const *pool,
+		size_t pool_size)
+{
+	struct json_object *jobj_list;
+	unsigned int r;
+
+	if(rnd(10)== 0)
+		return json_object_new_string(pool[0]); // Not an array
+	jobj_list= json_object_new_array();
+	for(r= rnd(5); r> 0; r--) {
+		if(rnd(10)== 0)
+			json_object_array_add(jobj_list, json_object_new_int(rnd(9)));
+		else
+			json_object_array_add(jobj_list,
+					json_object_new_string(pool[rnd(pool_size)]));
+	}
+	return jobj_list;
+}
+
+/**
+ * Random access check request: client address (IPv4, IPv6 or invalid
+ * length), referer (or none) and country (or unknown).
+ */
+static void access_probe_random(unsigned char *addr, size_t *ref_addr_len,
+		const char **ref_referer, const char **ref_country)
+{
+	static const char *const referers[]= {
+			"http://example.com/a", "https://www.example.com:8443/",
+			"http://a.b.EXAMPLE.com?x", "https://user@www.example.org/",
+			"www.example.org/no-scheme", "http://cdn.example.org",
+			"http://x.cdn.example.org#f", "http://example.org/",
+			"http://notexample.com/", "", "http://"
+	};
+	static const char *const countries[]= {
+			"ES", "es", "PT", "FR", "DE", "US", "--", "ESP"
+	};
+
+	switch(rnd(3)) {
+	case 0:
+		*ref_addr_len= 16;
+		memset(addr, 0, 16);
+		addr[0]= 0x20;
+		addr[1]= 0x01;
+		addr[2]= 0x0d;
+		addr[3]= 0xb8;
+		addr[5]= (unsigned char)rnd(3);
+		addr[15]= (unsigned char)rnd(3);
+		break;
+	case 1:
+		*ref_addr_len= rnd(4)== 0? 0: 4;
+		addr[0]= 10;
+		addr[1]= (unsigned char)rnd(4);
+		addr[2]= (unsigned char)rnd(4);
+		addr[3]= (unsigned char)rnd(4);
+		break;
+	default:
+		*ref_addr_len= 4;
+		addr[0]= 10;
+		addr[1]= 1;
+		addr[2]= 2;
+		addr[3]= (unsigned char)rnd(5);
+		break;
+	}
+	*ref_referer= rnd(5)== 0? NULL:
+			referers[rnd(sizeof(referers)/ sizeof(referers[0]))];
+	*ref_country= rnd(4)== 0? NULL:
+			countries[rnd(sizeof(countries)/ sizeof(countries[0]))];
+}
+
+/**
+ * Reference access check: linear scan of the bucket's lists.
+ * @return Access check result (see 'tcdn_routing_access_check()').
+ */
+static int ref_access_check(struct json_object *jobj_bucket,
+		const unsigned char *addr, size_t addr_len, const char *referer,
+		const char *country)
+{
+	struct json_object *jobj_list;
+	int valid= 0, listed;
+
+	if(json_object_object_get_ex(jobj_bucket, "blacklist", &jobj_list) &&
+			ref_address_listed(jobj_list, addr, addr_len, &valid))
+		return TCDN_ROUTING_ACCESS_DENIED_ADDRESS;
+	valid= 0;
+	if(json_object_object_get_ex(jobj_bucket, "whitelist", &jobj_list) &&
+			!ref_address_listed(jobj_list, addr, addr_len, &valid) && valid)
+		return TCDN_ROUTING_ACCESS_DENIED_ADDRESS;
+
+	valid= 0;
+	if(json_object_object_get_ex(jobj_bucket, "referer", &jobj_list) &&
+			!ref_referer_listed(jobj_list, referer, &valid) && valid)
+		return TCDN_ROUTING_ACCESS_DENIED_REFERER;
+
+	if(country== NULL || strlen(country)!= 2 || country[0]== '-')
+		return TCDN_ROUTING_ACCESS_ALLOWED; // Unknown country
+	if(json_object_object_get_ex(jobj_bucket, "geoloc-deny", &jobj_list) &&
+			ref_country_listed(jobj_list, country, &valid))
+		return TCDN_ROUTING_ACCESS_DENIED_GEOLOC;
+	valid= 0;
+	if(json_object_object_get_ex(jobj_bucket, "geoloc-allow", &jobj_list)) {
+		listed= ref_country_listed(jobj_list, country, &valid);
+		if(!listed && valid)
+			return TCDN_ROUTING_ACCESS_DENIED_GEOLOC;
+	}
+	return TCDN_ROUTING_ACCESS_ALLOWED;
+}
+
+/**
+ * Reference address list scan (prefixes compared under their mask).
+ * @param ref_valid Set if the list has a valid element.
+ * @return 1 if the address matches an element of the list, 0 otherwise.
+ */
+static int ref_address_listed(struct json_object *jobj_list,
+		const unsigned char *addr, size_t addr_len, int *ref_valid)
+{
+	register size_t i;
+	int listed= 0;
+
+	if(!json_object_is_type(jobj_list, json_type_array))
+		return 0;
+	for(i= 0; i< json_object_array_length(jobj_list); i++) {
+		struct json_object *jobj_addr= json_object_array_get_idx(jobj_list,
+				i);
+		char str[64], *slash;
+		unsigned char prefix[16];
+		size_t prefix_len;
+		long bits;
+		unsigned int b;
+
+		if(!json_object_is_type(jobj_addr, json_type_string))
+			continue;
+		snprintf(str, sizeof(str), "%s", json_object_get_string(jobj_addr));
+		if((slash= strchr(str, '/'))!= NULL)
+			*slash= '\0';
+		prefix_len= strchr(str, ':')!= NULL? 16: 4;
+		if(inet_pton(prefix_len== 16? AF_INET6: AF_INET, str, prefix)!= 1)
+			continue;
+		bits= prefix_len* 8;
+		if(slash!= NULL) {
+			char *endptr= NULL;
+			if(slash[1]< '0' || slash[1]> '9')
+				continue;
+			bits= strtol(slash+ 1, &endptr, 10);
+			if(*endptr!= '\0' || bits> (long)prefix_len* 8)
+				continue;
+		}
+		if(prefix_len== 16 && bits>= 96 && memcmp(prefix,
+				"\0\0\0\0\0\0\0\0\0\0\xff\xff", 12)== 0) {
+			memmove(prefix, &prefix[12], 4);
+			prefix_len= 4;
+			bits-= 96;
+		}
+		*ref_valid= 1;
+		if(addr_len!= prefix_len)
+			continue;
+		for(b= 0; b< (unsigned int)bits; b++) {
+			if(((addr[b/ 8]^ prefix[b/ 8])>> (7- b% 8))& 1)
+				break;
+		}
+		if(b== (unsigned int)bits)
+			listed= 1;
+	}
+	return listed;
+}
+
+/**
+ * Reference referer list scan.
+ * @param ref_valid Set if the list has a valid element.
+ * @return 1 if the referer matches an element of the list, 0 otherwise.
+ */
+static int ref_referer_listed(struct json_object *jobj_list,
+		const char *referer, int *ref_valid)
+{
+	register size_t i;
+	char host[256];
+	const char *p;
+	size_t host_len;
+	int listed= 0;
+
+	if(!json_object_is_type(jobj_list, json_type_array))
+		return 0;
+
+	host[0]= '\0';
+	if(referer!= NULL) {
+		p= strstr(referer, "://");
+		p= p!= NULL? p+ 3: referer;
+		if(strchr(p, '@')!= NULL)
+			p= strchr(p, '@')+ 1;
+		snprintf(host, sizeof(host), "%.*s", (int)strcspn(p, ":/?#"), p);
+	}
+	host_len= strlen(host);
+
+	for(i= 0; i< json_object_array_length(jobj_list); i++) {
+		struct json_object *jobj_referer= json_object_array_get_idx(
+				jobj_list, i);
+		const char *pattern;
+		size_t pattern_len;
+
+		if(!json_object_is_type(jobj_referer, json_type_string))
+			continue;
+		pattern= json_object_get_string(jobj_referer);
+		pattern_len= strlen(pattern);
+		if(strcasecmp(pattern, "none")== 0) {
+			*ref_valid= 1;
+			listed|= referer== NULL;
+			continue;
+		}
+		if(pattern_len== 0 || strspn(strncmp(pattern, "*.", 2)== 0 &&
+				pattern_len> 2? pattern+ 1: pattern,
+				"abcdefghijklmnopqrstuvwxyz"
+				"ABCDEFGHIJKLMNOPQRSTUVWXYZ0123456789-_.")!= pattern_len-
+				(strncmp(pattern, "*.", 2)== 0 && pattern_len> 2? 1: 0))
+			continue;
+		*ref_valid= 1;
+		if(referer== NULL || host_len== 0)
+			continue;
+		if(pattern[0]== '*')
+			listed|= host_len> pattern_len- 1 && strcasecmp(
+					&host[host_len- (pattern_len- 1)], pattern+ 1)== 0;
+		else
+			listed|= strcasecmp(host, pattern)== 0;
+	}
+	return listed;
+}
+
+/**
+ * Reference countries list scan.
+ * @param ref_valid Set if the list has a valid element.
+ * @return 1 if the country is in the list, 0 otherwise.
+ */
+static int ref_country_listed(struct json_object *jobj_list,
+		const char *country, int *ref_valid)
+{
+	register size_t i;
+	int listed= 0;
+
+	if(!json_object_is_type(jobj_list, json_type_array))
+		return 0;
+	for(i= 0; i< json_object_array_length(jobj_list); i++) {
+		struct json_object *jobj_country= json_object_array_get_idx(
+				jobj_list, i);
+		const char *str= json_object_get_string(jobj_country);
+
+		if(!json_object_is_type(jobj_country, json_type_string) ||
+				strlen(str)!= 2 || strspn(str, "abcdefghijklmnopqrstuvwxyz"
+				"ABCDEFGHIJKLMNOPQRSTUVWXYZ")!= 2)
+			continue;
+		*ref_valid= 1;
+		listed|= strcasecmp(str, country)== 0;
+	}
+	return listed;
+}